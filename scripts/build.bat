@@ -1,3 +1,3 @@
 @echo off
 
-gcc src/*.c src/lib/wren/wren.c assets/icon.res -std=c99 -O3 -s -IC:\SDL2\include -LC:\SDL2\lib -lmingw32 -lSDL2main -lSDL2 -o basil.exe
+gcc src/*.c src/lib/wren/wren.c assets/icon.res -std=c99 -O3 -s -IC:\SDL2\include -LC:\SDL2\lib -lmingw32 -lSDL2main -lSDL2 -Wl,--export-all-symbols,--out-implib,libbasil.a -o basil.exe
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-gcc src/*.c src/lib/wren/wren.c -std=c99 -O3 -s -lSDL2 -lm -o basil
+gcc src/*.c src/lib/wren/wren.c -std=c99 -O3 -s -rdynamic -lSDL2 -lm -o basil
@@ -0,0 +1,219 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+import argparse
+import collections
+
+# Reads a heap snapshot written by GC.snapshot() and reports which objects keep
+# the most memory alive.
+#
+# An object's retained size is its own size plus the size of every object that
+# is only reachable through it, so it's what would be freed if it went away.
+# Those are computed from the dominator tree of the heap graph, rooted at a
+# virtual node that points at all the GC roots.
+
+class Node:
+  def __init__(self, address, type, class_name, size, references, label):
+    self.address = address
+    self.type = type
+    self.class_name = class_name
+    self.size = size
+    self.references = references
+    self.label = label
+    self.retained = 0
+
+
+def read_snapshot(path):
+  nodes = {}
+  roots = []
+  method_tables = []
+
+  with open(path, "r", errors="replace") as f:
+    for line in f:
+      fields = line.rstrip("\n").split("\t")
+
+      if fields[0] == "o" and len(fields) >= 7:
+        references = [r for r in fields[5].split(",") if r]
+        nodes[fields[1]] = Node(fields[1], fields[2], fields[3],
+                                int(fields[4]), references, fields[6])
+      elif fields[0] == "m" and len(fields) >= 4:
+        method_tables.append((fields[1], int(fields[2]), int(fields[3])))
+      elif fields[0] == "r" and len(fields) >= 3:
+        roots.append((fields[1], fields[2]))
+
+  return nodes, roots, method_tables
+
+
+def postorder(successors, start):
+  order = []
+  visited = {start}
+  stack = [(start, iter(successors[start]))]
+
+  while stack:
+    node, children = stack[-1]
+    child = next(children, None)
+
+    if child is None:
+      stack.pop()
+      order.append(node)
+    elif child not in visited:
+      visited.add(child)
+      stack.append((child, iter(successors[child])))
+
+  return order
+
+
+def dominators(successors, start):
+  # Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+  order = postorder(successors, start)
+  index = {node: i for i, node in enumerate(order)}
+
+  predecessors = collections.defaultdict(list)
+  for node in order:
+    for child in successors[node]:
+      predecessors[child].append(node)
+
+  idom = {start: start}
+
+  def intersect(a, b):
+    while a != b:
+      while index[a] < index[b]:
+        a = idom[a]
+      while index[b] < index[a]:
+        b = idom[b]
+    return a
+
+  changed = True
+  while changed:
+    changed = False
+
+    for node in reversed(order):
+      if node == start:
+        continue
+
+      new_idom = None
+      for predecessor in predecessors[node]:
+        if predecessor not in idom:
+          continue
+        new_idom = predecessor if new_idom is None else intersect(predecessor,
+                                                                  new_idom)
+
+      if idom.get(node) != new_idom:
+        idom[node] = new_idom
+        changed = True
+
+  return order, idom
+
+
+def root_paths(successors, start):
+  parents = {start: None}
+  queue = collections.deque([start])
+
+  while queue:
+    node = queue.popleft()
+    for child in successors[node]:
+      if child not in parents:
+        parents[child] = node
+        queue.append(child)
+
+  return parents
+
+
+def describe(node):
+  text = node.type
+  if node.class_name != "-":
+    text += " " + node.class_name
+  if node.label:
+    text += " \"" + node.label + "\""
+  return text
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description="Report retained sizes in a basil heap snapshot.")
+  parser.add_argument("snapshot", help="The snapshot written by GC.snapshot()")
+  parser.add_argument("--top", type=int, default=20,
+                      help="How many objects and classes to list")
+  parser.add_argument("--paths", action="store_true",
+                      help="Show how each listed object is reached from a root")
+  parser.add_argument("--class", dest="class_name",
+                      help="Only list objects of this class")
+
+  args = parser.parse_args()
+
+  nodes, roots, method_tables = read_snapshot(args.snapshot)
+
+  # The virtual root is "", real roots hang off it by kind.
+  successors = {"": []}
+  root_kinds = {}
+  for kind, address in roots:
+    if address in nodes and address not in root_kinds:
+      successors[""].append(address)
+      root_kinds[address] = kind
+
+  for address, node in nodes.items():
+    successors[address] = [r for r in node.references if r in nodes]
+
+  order, idom = dominators(successors, "")
+
+  # Postorder visits every node before its dominator.
+  for address in order:
+    if address == "":
+      continue
+
+    node = nodes[address]
+    node.retained += node.size
+    if idom[address] != "":
+      nodes[idom[address]].retained += node.retained
+
+  reachable = [nodes[a] for a in order if a != ""]
+  total = sum(node.size for node in reachable)
+  unreachable = len(nodes) - len(reachable)
+
+  print("%d objects, %d bytes reachable from %d roots (%d unreachable)" %
+        (len(reachable), total, len(successors[""]), unreachable))
+
+  classes = collections.defaultdict(lambda: [0, 0])
+  for node in reachable:
+    key = node.class_name if node.class_name != "-" else node.type
+    classes[key][0] += 1
+    classes[key][1] += node.size
+
+  print("\nBy class:%32s %14s" % ("count", "bytes"))
+  ranked = sorted(classes.items(), key=lambda item: item[1][1], reverse=True)
+  for name, (count, size) in ranked[:args.top]:
+    print("  %-36s %10d %14d" % (name, count, size))
+
+  listed = reachable
+  if args.class_name:
+    listed = [node for node in listed if node.class_name == args.class_name]
+
+  parents = root_paths(successors, "") if args.paths else None
+
+  print("\nLargest retained:%24s %14s" % ("shallow", "retained"))
+  listed = sorted(listed, key=lambda node: node.retained, reverse=True)
+  for node in listed[:args.top]:
+    print("  %-36s %10d %14d" % (describe(node)[:36], node.size, node.retained))
+
+    if parents is not None:
+      path = []
+      address = node.address
+      while parents[address] != "":
+        address = parents[address]
+        path.append(describe(nodes[address]))
+      path.append("(" + root_kinds[address] + ")")
+      print("    from " + " <- ".join(path))
+
+  # Older snapshots don't have method tables.
+  if method_tables:
+    total = sum(size for _, _, size in method_tables)
+    print("\nMethod tables: %d bytes in %d classes" % (total, len(method_tables)))
+    print("  %-36s %10s %14s" % ("", "methods", "bytes"))
+
+    ranked = sorted(method_tables, key=lambda table: table[2], reverse=True)
+    for address, count, size in ranked[:args.top]:
+      name = describe(nodes[address]) if address in nodes else address
+      print("  %-36s %10d %14d" % (name[:36], count, size))
+
+
+main()
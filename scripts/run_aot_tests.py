@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+import argparse
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+# Checks that modules compiled ahead of time behave like the interpreter.
+#
+# Writes C code for the tests with `basil aot`, builds basil with it, and runs
+# the tests against that build with run_tests.py. The tests expect what the
+# interpreter prints, so any failure here that run_tests.py doesn't also show
+# is a difference in the native code.
+
+SOURCES = glob.glob(os.path.join("src", "*.c")) + ["src/lib/wren/wren.c"]
+FLAGS = ["-std=c99", "-O2", "-rdynamic"]
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description="Run the basil test scripts compiled ahead of time.")
+  parser.add_argument("--basil", default="./basil",
+                      help="The basil executable to write the C code with")
+  parser.add_argument("--cc", default="gcc",
+                      help="The C compiler to build with")
+  parser.add_argument("--libs", default="-lSDL2 -lm",
+                      help="The libraries to link with")
+  parser.add_argument("--cflags", default="",
+                      help="Extra arguments for the C compiler")
+  parser.add_argument("tests", nargs="?", default=os.path.join("tests", "aot"),
+                      help="The directory of tests to run")
+
+  args = parser.parse_args()
+
+  paths = sorted(glob.glob(os.path.join(args.tests, "**", "*.wren"),
+                           recursive=True))
+  if not paths:
+    print("No tests in {0}".format(args.tests))
+    sys.exit(1)
+
+  directory = tempfile.mkdtemp(prefix="basil-aot-")
+  native = os.path.abspath(os.path.join(directory, "native.inc"))
+  executable = os.path.join(directory, "basil")
+
+  if subprocess.call([args.basil, "aot", native] + paths) != 0:
+    print("Could not write native code for {0}".format(args.tests))
+    sys.exit(1)
+
+  # Every test should have something worth running natively, or it isn't
+  # testing the native code.
+  with open(native, "r") as f:
+    modules = f.read().count("NATIVE_MODULE(")
+  if modules != len(paths):
+    print("Native code was written for {0} of {1} tests".format(
+        modules, len(paths)))
+    sys.exit(1)
+
+  command = ([args.cc] + SOURCES + FLAGS + args.cflags.split() +
+             ['-DWREN_NATIVE_MODULES="{0}"'.format(native)] +
+             args.libs.split() + ["-o", executable])
+  if subprocess.call(command) != 0:
+    print("Could not build basil with the native code")
+    sys.exit(1)
+
+  runner = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "run_tests.py")
+  sys.exit(subprocess.call([sys.executable, runner, "--basil", executable,
+                            args.tests]))
+
+
+main()
@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+# Runs the scripts in tests/ and checks what they print.
+#
+# Every line a test prints must match the next `// expect: ` comment in it, in
+# order, and a test must not print more than it expects. A test that needs
+# something else from the runner says so with `// options: ` comments, read as
+# basil options to run it with. A `// expect prefix: ` comment only has to
+# match the start of its line, for output that differs between platforms.
+#
+# Every C file in tests/ is a plugin, built into a shared library next to it
+# before the tests run. A script with the same name as a plugin is its module
+# source, not a test.
+#
+# Each test runs once for every collector configuration below, with a small
+# heap so collections happen often. Results must not depend on any of them.
+
+CONFIGURATIONS = [
+  ("full", []),
+  ("incremental", ["--gc", "incremental"]),
+  ("generational", ["--gc", "generational", "--heap-nursery", "16K"]),
+  ("parallel", ["--gc-threads", "4"]),
+]
+
+HEAP_OPTIONS = ["--heap-initial", "64K", "--heap-min", "64K"]
+
+SOURCE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                          "src")
+
+EXPECT_PATTERN = re.compile(r"// expect: ?(.*)")
+EXPECT_PREFIX_PATTERN = re.compile(r"// expect prefix: ?(.*)")
+OPTIONS_PATTERN = re.compile(r"// options: (.*)")
+
+
+def read_test(path):
+  expected = []
+  options = []
+
+  with open(path, "r") as f:
+    for line in f:
+      match = EXPECT_PATTERN.search(line)
+      if match:
+        expected.append((match.group(1), False))
+
+      match = EXPECT_PREFIX_PATTERN.search(line)
+      if match:
+        expected.append((match.group(1), True))
+
+      match = OPTIONS_PATTERN.search(line)
+      if match:
+        options += match.group(1).split()
+
+  return expected, options
+
+
+def run_test(basil, path, configuration, expected, options):
+  command = [basil] + HEAP_OPTIONS + configuration + options + [path]
+  result = subprocess.run(command, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, universal_newlines=True)
+
+  actual = result.stdout.splitlines()
+
+  for i, (line, prefix) in enumerate(expected):
+    if i >= len(actual):
+      return "expected '{0}' but the output ended".format(line)
+    if actual[i] != line and not (prefix and actual[i].startswith(line)):
+      return "expected '{0}' but got '{1}'".format(line, actual[i])
+
+  if len(actual) > len(expected):
+    return "unexpected output '{0}'".format(actual[len(expected)])
+
+  if result.returncode != 0:
+    return "exited with {0}".format(result.returncode)
+
+  return None
+
+
+def plugin_path(source):
+  if sys.platform == "win32":
+    extension = ".dll"
+  elif sys.platform == "darwin":
+    extension = ".dylib"
+  else:
+    extension = ".so"
+
+  return os.path.splitext(source)[0] + extension
+
+
+def build_plugin(cc, source):
+  # Plugins call back into the Wren API exported by basil, so those symbols
+  # are left for the loader to resolve.
+  command = [cc, "-shared", "-fPIC", "-std=c99", "-I" + SOURCE_DIR]
+  if sys.platform == "darwin":
+    command += ["-undefined", "dynamic_lookup"]
+  command += [source, "-o", plugin_path(source)]
+
+  result = subprocess.run(command, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, universal_newlines=True)
+  if result.returncode != 0:
+    print(result.stdout)
+    return False
+
+  return True
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Run the basil test scripts.")
+  parser.add_argument("--basil", default="./basil",
+                      help="The basil executable to test")
+  parser.add_argument("--cc", default="cc",
+                      help="The C compiler to build plugins with")
+  parser.add_argument("--filter", default="",
+                      help="Only run tests whose path contains this")
+  parser.add_argument("tests", nargs="?", default="tests",
+                      help="The directory of tests to run")
+
+  args = parser.parse_args()
+
+  plugins = sorted(glob.glob(os.path.join(args.tests, "**", "*.c"),
+                             recursive=True))
+  for plugin in plugins:
+    if not build_plugin(args.cc, plugin):
+      print("FAIL could not build plugin {0}".format(plugin))
+      sys.exit(1)
+
+  paths = sorted(glob.glob(os.path.join(args.tests, "**", "*.wren"),
+                           recursive=True))
+  paths = [path for path in paths
+           if os.path.splitext(path)[0] + ".c" not in plugins]
+  paths = [path for path in paths if args.filter in path]
+
+  failed = 0
+  count = 0
+
+  for path in paths:
+    expected, options = read_test(path)
+
+    for name, configuration in CONFIGURATIONS:
+      count += 1
+      error = run_test(args.basil, path, configuration, expected, options)
+      if error is not None:
+        failed += 1
+        print("FAIL {0} ({1}): {2}".format(path, name, error))
+
+  print("{0} of {1} test runs passed".format(count - failed, count))
+  sys.exit(1 if failed > 0 else 0)
+
+
+main()
@@ -0,0 +1,261 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+import argparse
+import re
+import sys
+
+# Generates the foreign bindings for a Wren module from its source.
+#
+# Every foreign method and foreign class is preceded by a `#bind` attribute
+# naming the C functions that implement it. Wren ignores attributes without a
+# `!`, so they cost nothing at runtime:
+#
+#     #bind(allocate = "imageAllocate", finalize = "imageFinalize")
+#     foreign class Image {
+#         #bind(fn = "imageClear", types = "F F")
+#         foreign clear(color)
+#     }
+#
+# Methods with `types` are typed foreign methods, see WrenTypedForeignMethod.
+#
+# This writes two files. The prototypes of the functions, for the header, and
+# the tables the host binds them from. Both tables are perfect hashes: a key's
+# hash with seed 0 picks a seed, and its hash with that seed is its index. So
+# every lookup is two hashes and one comparison, however many methods there
+# are.
+
+PREAMBLE = "// Generated automatically from {0}. Do not edit.\n"
+
+CLASS_PATTERN = re.compile(r"^(foreign\s+)?class\s+(\w+)")
+METHOD_PATTERN = re.compile(r"^foreign\s+(static\s+)?(construct\s+)?(.+?)\s*$")
+BIND_PATTERN = re.compile(r"^#bind\((.*)\)\s*$")
+ATTRIBUTE_PATTERN = re.compile(r"(\w+)\s*=\s*\"([^\"]*)\"")
+PARAMETERS_PATTERN = re.compile(r"([(\[])([^)\]]*)([)\]])")
+
+TYPES = "NIBSF_"
+
+
+class Method:
+  def __init__(self, class_name, is_static, signature, arity, fn, types):
+    self.class_name = class_name
+    self.is_static = is_static
+    self.signature = signature
+    self.arity = arity
+    self.fn = fn
+    self.types = types
+
+
+class ForeignClass:
+  def __init__(self, name, allocate, finalize):
+    self.name = name
+    self.allocate = allocate
+    self.finalize = finalize
+
+
+def fail(path, line_number, message):
+  sys.exit("{0}:{1}: {2}".format(path, line_number, message))
+
+
+def signature_of(declaration, is_constructor):
+  arity = 0
+
+  def underscores(match):
+    nonlocal arity
+    parameters = [p for p in match.group(2).split(",") if p.strip()]
+    arity += len(parameters)
+    return match.group(1) + ",".join("_" * len(parameters)) + match.group(3)
+
+  signature = PARAMETERS_PATTERN.sub(underscores, declaration.replace(" ", ""))
+  if is_constructor:
+    signature = "init " + signature
+
+  return signature, arity
+
+
+def read_bindings(path):
+  methods = []
+  classes = []
+  class_name = None
+  bind = None
+
+  with open(path, "r") as f:
+    for line_number, line in enumerate(f, 1):
+      line = line.strip()
+      if not line or line.startswith("//"):
+        continue
+
+      match = BIND_PATTERN.match(line)
+      if match:
+        bind = dict(ATTRIBUTE_PATTERN.findall(match.group(1)))
+        continue
+
+      match = CLASS_PATTERN.match(line)
+      if match:
+        class_name = match.group(2)
+        if match.group(1):
+          if bind is None or "allocate" not in bind:
+            fail(path, line_number, "Foreign class needs an allocate binding.")
+          classes.append(ForeignClass(class_name, bind["allocate"],
+                                      bind.get("finalize")))
+        bind = None
+        continue
+
+      match = METHOD_PATTERN.match(line)
+      if match:
+        if bind is None or "fn" not in bind:
+          fail(path, line_number, "Foreign method needs an fn binding.")
+
+        signature, arity = signature_of(match.group(3), match.group(2))
+        types = bind.get("types")
+        if types is not None:
+          types = types.replace(" ", "")
+          if any(t not in TYPES for t in types):
+            fail(path, line_number, "Unknown type in '{0}'.".format(types))
+          if len(types) != arity + 1:
+            fail(path, line_number,
+                 "Expected {0} types, one for the receiver and one for each "
+                 "argument.".format(arity + 1))
+
+        methods.append(Method(class_name, match.group(1) is not None,
+                              signature, arity, bind["fn"], bind.get("types")))
+
+      bind = None
+
+  return methods, classes
+
+
+# 32-bit FNV-1a over each part in turn, the same as hashBinding() in basil.c.
+def hash_parts(seed, parts):
+  hash = (2166136261 ^ seed) & 0xffffffff
+  for part in parts:
+    for byte in part.encode("utf-8"):
+      hash = ((hash ^ byte) * 16777619) & 0xffffffff
+  return hash
+
+
+def perfect_hash(keys):
+  count = len(keys)
+  buckets = [[] for _ in range(count)]
+  for i, key in enumerate(keys):
+    buckets[hash_parts(0, key) % count].append(i)
+
+  seeds = [0] * count
+  slots = [None] * count
+
+  # The fullest buckets are the hardest to place, so they go first.
+  for bucket in sorted(range(count), key=lambda b: -len(buckets[b])):
+    if not buckets[bucket]:
+      break
+
+    seed = 1
+    while True:
+      positions = [hash_parts(seed, keys[i]) % count for i in buckets[bucket]]
+      if (len(set(positions)) == len(positions) and
+          all(slots[p] is None for p in positions)):
+        break
+      seed += 1
+
+    seeds[bucket] = seed
+    for i, position in zip(buckets[bucket], positions):
+      slots[position] = i
+
+  return seeds, slots
+
+
+def c_string(text):
+  return "NULL" if text is None else '"' + text + '"'
+
+
+def write_seeds(lines, name, seeds):
+  lines.append("static const uint32_t {0}[] = {{".format(name))
+  for i in range(0, len(seeds), 8):
+    lines.append("    " + ", ".join(str(s) for s in seeds[i:i + 8]) + ",")
+  lines.append("};")
+  lines.append("")
+
+
+def write_prototypes(input_path, methods, classes):
+  lines = [PREAMBLE.format(input_path)]
+
+  for foreign_class in classes:
+    lines.append("void {0}(WrenVM* vm);".format(foreign_class.allocate))
+    if foreign_class.finalize:
+      lines.append("void {0}(void* data);".format(foreign_class.finalize))
+
+  seen = set()
+  for method in methods:
+    if method.fn in seen:
+      continue
+    seen.add(method.fn)
+
+    if method.types is None:
+      lines.append("void {0}(WrenVM* vm);".format(method.fn))
+    else:
+      lines.append(
+          "void {0}(WrenVM* vm, const WrenForeignArg* args);".format(method.fn))
+
+  return "\n".join(lines) + "\n"
+
+
+def write_tables(input_path, methods, classes):
+  lines = [PREAMBLE.format(input_path)]
+
+  keys = [(m.class_name, "." if m.is_static else "#", m.signature)
+          for m in methods]
+  seeds, slots = perfect_hash(keys)
+
+  lines.append("#define FOREIGN_METHOD_COUNT {0}".format(len(methods)))
+  lines.append("")
+  write_seeds(lines, "foreignMethodSeeds", seeds)
+
+  lines.append("static const ForeignMethodBinding foreignMethods[] = {")
+  for i in slots:
+    method = methods[i]
+    if method.types is None:
+      fns = "{0}, NULL".format(method.fn)
+    else:
+      fns = "NULL, {0}".format(method.fn)
+
+    lines.append("    {{ \"{0}\", {1}, \"{2}\", {3}, {4}, {5} }},".format(
+        method.class_name, "true" if method.is_static else "false",
+        method.signature, method.arity, c_string(method.types), fns))
+  lines.append("};")
+  lines.append("")
+
+  seeds, slots = perfect_hash([(c.name,) for c in classes])
+
+  lines.append("#define FOREIGN_CLASS_COUNT {0}".format(len(classes)))
+  lines.append("")
+  write_seeds(lines, "foreignClassSeeds", seeds)
+
+  lines.append("static const ForeignClassBinding foreignClasses[] = {")
+  for i in slots:
+    foreign_class = classes[i]
+    lines.append("    {{ \"{0}\", {1}, {2} }},".format(
+        foreign_class.name, foreign_class.allocate,
+        foreign_class.finalize or "NULL"))
+  lines.append("};")
+
+  return "\n".join(lines) + "\n"
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description="Generate foreign binding tables for a Wren module.")
+  parser.add_argument("prototypes", help="The prototypes file to write")
+  parser.add_argument("tables", help="The binding tables file to write")
+  parser.add_argument("input", help="The source .wren file")
+
+  args = parser.parse_args()
+
+  methods, classes = read_bindings(args.input)
+
+  with open(args.prototypes, "w") as f:
+    f.write(write_prototypes(args.input, methods, classes))
+
+  with open(args.tables, "w") as f:
+    f.write(write_tables(args.input, methods, classes))
+
+
+main()
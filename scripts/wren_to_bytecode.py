@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+import argparse
+import os
+import os.path
+import subprocess
+import tempfile
+
+# The basil module is embedded already compiled, so that a script starts
+# without compiling it. This runs `basil compile` on a ".wren" module and turns
+# the bytecode into a C array in a ".wrenc.inc" file, next to the source one
+# generated by wren_to_c_string.py.
+#
+# The bytecode is tied to the source and the VM it was compiled by. When
+# either changes without regenerating it, basil compiles the source instead.
+
+PREAMBLE = """// Generated automatically from {0}. Do not edit.
+static const unsigned char {1}ModuleBytecode[] = {{
+{2}
+}};
+"""
+
+def bytecode_to_c_array(input_path, bytecode, module):
+  lines = []
+  for i in range(0, len(bytecode), 16):
+    lines.append("    " + ", ".join("0x%02x" % b for b in bytecode[i:i + 16]) + ",")
+
+  return PREAMBLE.format(input_path, module, "\n".join(lines))
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description="Compile a Wren library to a C array of bytecode.")
+  parser.add_argument("output", help="The output file to write")
+  parser.add_argument("input", help="The source .wren file")
+  parser.add_argument("--basil", default="./basil",
+                      help="The basil executable to compile with")
+
+  args = parser.parse_args()
+
+  handle, bytecode_path = tempfile.mkstemp(suffix=".wrenc")
+  os.close(handle)
+
+  try:
+    subprocess.check_call([args.basil, "compile", args.input, bytecode_path])
+    with open(bytecode_path, "rb") as f:
+      bytecode = bytearray(f.read())
+  finally:
+    os.remove(bytecode_path)
+
+  module = os.path.splitext(os.path.basename(args.input))[0]
+
+  c_source = bytecode_to_c_array(args.input, bytecode, module)
+
+  with open(args.output, "w") as f:
+    f.write(c_source)
+
+
+main()
@@ -8,6 +8,9 @@
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "lib/stb/stb_truetype.h"
 
+#include "pool.h"
+#include "scene.h"
+#include "trace.h"
 #include "util.h"
 
 #define VM_ABORT(vm, error)              \
@@ -48,20 +51,52 @@
     if (width <= 0 || height <= 0)        \
     return
 
-static int argCount = 0;
-static char** args = NULL;
-static const char* basePath = NULL;
+// Runs a raster kernel, adding its time to the current scene frame when a
+// scene benchmark is running.
+#define RASTER(vm, call)                                                  \
+    do {                                                                  \
+        Scene* scene = ((Context*)wrenGetUserData(vm))->scene;            \
+        if (scene == NULL) {                                              \
+            call;                                                         \
+            break;                                                        \
+        }                                                                 \
+        uint64_t rasterStart = SDL_GetPerformanceCounter();               \
+        call;                                                             \
+        scene->rasterTime += SDL_GetPerformanceCounter() - rasterStart;   \
+    } while (false)
 
 static Window* window = NULL;
 static Image defaultFont[128];
-static int exitCode = 0;
 
-void setArgs(int argc, char** argv)
+// Threads kept around for marking, woken up for each collection. Starting
+// threads costs more than marking a small heap does.
+typedef struct
 {
-    argCount = argc;
-    args = argv;
+    SDL_mutex* lock;
+    SDL_cond* start;
+    SDL_cond* done;
 
-    basePath = getDirectoryPath(argv[1]);
+    SDL_Thread* threads[MAX_GC_THREADS];
+    int threadCount;
+
+    // Bumped for every run, each thread waits for it to change.
+    int run;
+    bool busy;
+
+    WrenVM* vm;
+    WrenWorkerFn worker;
+    void* data;
+    int count;
+    int pending;
+} WorkerPool;
+
+static WorkerPool pool;
+
+void initApi()
+{
+    pool.lock = SDL_CreateMutex();
+    pool.start = SDL_CreateCond();
+    pool.done = SDL_CreateCond();
 
     for (int c = 0; c < 128; c++) {
         char* bitmap = font8x8_basic[c];
@@ -81,9 +116,19 @@ void setArgs(int argc, char** argv)
     }
 }
 
-int getExitCode()
+void initContext(Context* context, int argc, char** argv)
 {
-    return exitCode;
+    context->argCount = argc;
+    context->args = argv;
+    context->exitCode = 0;
+    context->headless = false;
+    context->output = NULL;
+    context->scene = NULL;
+
+    memset(&context->gc, 0, sizeof(GCPauses));
+    context->gcFrameBudget = 0;
+
+    snprintf(context->basePath, MAX_PATH_LENGTH, "%s", getDirectoryPath(argv[1]));
 }
 
 void colorAllocate(WrenVM* vm)
@@ -92,42 +137,31 @@ void colorAllocate(WrenVM* vm)
     wrenSetSlotNewForeign(vm, 0, 0, sizeof(Color));
 }
 
-void colorNew(WrenVM* vm)
+void colorNew(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "r");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "g");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "b");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "a");
+    Color* color = (Color*)args[0].foreign;
 
-    color->r = (uint8_t)wrenGetSlotDouble(vm, 1);
-    color->g = (uint8_t)wrenGetSlotDouble(vm, 2);
-    color->b = (uint8_t)wrenGetSlotDouble(vm, 3);
-    color->a = (uint8_t)wrenGetSlotDouble(vm, 4);
+    color->r = (uint8_t)args[1].num;
+    color->g = (uint8_t)args[2].num;
+    color->b = (uint8_t)args[3].num;
+    color->a = (uint8_t)args[4].num;
 }
 
-void colorNew2(WrenVM* vm)
+void colorNew2(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "r");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "g");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "b");
+    Color* color = (Color*)args[0].foreign;
 
-    color->r = (uint8_t)wrenGetSlotDouble(vm, 1);
-    color->g = (uint8_t)wrenGetSlotDouble(vm, 2);
-    color->b = (uint8_t)wrenGetSlotDouble(vm, 3);
+    color->r = (uint8_t)args[1].num;
+    color->g = (uint8_t)args[2].num;
+    color->b = (uint8_t)args[3].num;
     color->a = 255;
 }
 
-void colorNew3(WrenVM* vm)
+void colorNew3(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
+    Color* color = (Color*)args[0].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "num");
-
-    uint32_t num = (uint32_t)wrenGetSlotDouble(vm, 1);
+    uint32_t num = (uint32_t)args[1].num;
 
     color->r = (uint8_t)(num >> 16);
     color->g = (uint8_t)(num >> 8);
@@ -135,52 +169,52 @@ void colorNew3(WrenVM* vm)
     color->a = (uint8_t)(num >> 24);
 }
 
-void colorGetR(WrenVM* vm)
+void colorGetR(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
+    Color* color = (Color*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, color->r);
 }
 
-void colorGetG(WrenVM* vm)
+void colorGetG(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
+    Color* color = (Color*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, color->g);
 }
 
-void colorGetB(WrenVM* vm)
+void colorGetB(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
+    Color* color = (Color*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, color->b);
 }
 
-void colorGetA(WrenVM* vm)
+void colorGetA(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
+    Color* color = (Color*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, color->a);
 }
 
-void colorSetR(WrenVM* vm)
+void colorSetR(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-    color->r = (uint8_t)wrenGetSlotDouble(vm, 1);
+    Color* color = (Color*)args[0].foreign;
+    color->r = (uint8_t)args[1].num;
 }
 
-void colorSetG(WrenVM* vm)
+void colorSetG(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-    color->g = (uint8_t)wrenGetSlotDouble(vm, 1);
+    Color* color = (Color*)args[0].foreign;
+    color->g = (uint8_t)args[1].num;
 }
 
-void colorSetB(WrenVM* vm)
+void colorSetB(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-    color->b = (uint8_t)wrenGetSlotDouble(vm, 1);
+    Color* color = (Color*)args[0].foreign;
+    color->b = (uint8_t)args[1].num;
 }
 
-void colorSetA(WrenVM* vm)
+void colorSetA(WrenVM* vm, const WrenForeignArg* args)
 {
-    Color* color = (Color*)wrenGetSlotForeign(vm, 0);
-    color->a = (uint8_t)wrenGetSlotDouble(vm, 1);
+    Color* color = (Color*)args[0].foreign;
+    color->a = (uint8_t)args[1].num;
 }
 
 void fontAllocate(WrenVM* vm)
@@ -210,11 +244,19 @@ void fontNew(WrenVM* vm)
     const char* path = wrenGetSlotString(vm, 1);
     int size = (int)wrenGetSlotDouble(vm, 2);
 
+    Context* context = (Context*)wrenGetUserData(vm);
+
     char fullPath[MAX_PATH_LENGTH];
-    snprintf(fullPath, MAX_PATH_LENGTH, "%s/%s", basePath, path);
+    if (!joinPath(fullPath, context->basePath, path, "")) {
+        VM_ABORT(vm, "Font path is too long.");
+        return;
+    }
+
+    TRACE_BEGIN("load font");
 
     FILE* file = fopen(fullPath, "rb");
     if (file == NULL) {
+        TRACE_END();
         VM_ABORT(vm, "Failed to open font file.");
         return;
     }
@@ -226,6 +268,7 @@ void fontNew(WrenVM* vm)
     font->data = (uint8_t*)malloc(fileSize);
     if (font->data == NULL) {
         fclose(file);
+        TRACE_END();
         VM_ABORT(vm, "Failed to allocate font data.");
         return;
     }
@@ -234,13 +277,29 @@ void fontNew(WrenVM* vm)
     if (bytesRead < fileSize) {
         fclose(file);
         free(font->data);
+        TRACE_END();
         VM_ABORT(vm, "Failed to read font data.");
         return;
     }
 
     fclose(file);
 
+    TRACE_END();
+
     font->size = size;
+    font->dataSize = fileSize;
+
+    wrenSetSlotExternalSize(vm, 0, fileSize);
+}
+
+void fontDispose(WrenVM* vm)
+{
+    Font* font = (Font*)wrenGetSlotForeign(vm, 0);
+
+    fontFinalize(font);
+    font->dataSize = 0;
+
+    wrenSetSlotExternalSize(vm, 0, 0);
 }
 
 void imageAllocate(WrenVM* vm)
@@ -282,6 +341,8 @@ void imageNew(WrenVM* vm)
         image->width = width;
         image->height = height;
 
+        wrenSetSlotExternalSize(vm, 0, width * height * sizeof(Color));
+
         image->clipX = 0;
         image->clipY = 0;
         image->clipWidth = -1;
@@ -290,6 +351,11 @@ void imageNew(WrenVM* vm)
         Font* font = (Font*)wrenGetSlotForeign(vm, 1);
         const char* text = wrenGetSlotString(vm, 2);
 
+        if (font->data == NULL) {
+            VM_ABORT(vm, "Font has been disposed.");
+            return;
+        }
+
         stbtt_fontinfo info;
         if (!stbtt_InitFont(&info, font->data, 0)) {
             VM_ABORT(vm, "Failed to initialize font.");
@@ -359,6 +425,8 @@ void imageNew(WrenVM* vm)
         image->width = bitmapW;
         image->height = bitmapH;
 
+        wrenSetSlotExternalSize(vm, 0, bitmapW * bitmapH * sizeof(Color));
+
         image->clipX = 0;
         image->clipY = 0;
         image->clipWidth = -1;
@@ -376,11 +444,19 @@ void imageNew2(WrenVM* vm)
     if (wrenGetSlotType(vm, 1) == WREN_TYPE_STRING) {
         const char* path = wrenGetSlotString(vm, 1);
 
+        Context* context = (Context*)wrenGetUserData(vm);
+
         char fullPath[MAX_PATH_LENGTH];
-        snprintf(fullPath, MAX_PATH_LENGTH, "%s/%s", basePath, path);
+        if (!joinPath(fullPath, context->basePath, path, "")) {
+            VM_ABORT(vm, "Image path is too long.");
+            return;
+        }
+
+        TRACE_BEGIN("decode image");
 
         image->data = (Color*)stbi_load(fullPath, &image->width, &image->height, NULL, STBI_rgb_alpha);
         if (image->data == NULL) {
+            TRACE_END();
             VM_ABORT(vm, "Failed to load image data.");
             return;
         }
@@ -393,6 +469,10 @@ void imageNew2(WrenVM* vm)
             bytes[i + 2] = b;
         }
 
+        TRACE_END();
+
+        wrenSetSlotExternalSize(vm, 0, image->width * image->height * sizeof(Color));
+
         image->clipX = 0;
         image->clipY = 0;
         image->clipWidth = -1;
@@ -400,6 +480,11 @@ void imageNew2(WrenVM* vm)
     } else if (wrenGetSlotType(vm, 1) == WREN_TYPE_FOREIGN) {
         Image* toCopy = (Image*)wrenGetSlotForeign(vm, 1);
 
+        if (toCopy->data == NULL) {
+            VM_ABORT(vm, "Image has been disposed.");
+            return;
+        }
+
         image->data = (Color*)calloc(toCopy->width * toCopy->height, sizeof(Color));
         if (image->data == NULL) {
             VM_ABORT(vm, "Failed to allocate image data.");
@@ -411,6 +496,8 @@ void imageNew2(WrenVM* vm)
         image->width = toCopy->width;
         image->height = toCopy->height;
 
+        wrenSetSlotExternalSize(vm, 0, image->width * image->height * sizeof(Color));
+
         image->clipX = 0;
         image->clipY = 0;
         image->clipWidth = -1;
@@ -421,47 +508,62 @@ void imageNew2(WrenVM* vm)
     }
 }
 
-void imageGetWidth(WrenVM* vm)
+void imageDispose(WrenVM* vm)
 {
     Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+
+    imageFinalize(image);
+
+    // A disposed image is empty, drawing to it does nothing.
+    image->width = 0;
+    image->height = 0;
+    image->clipX = 0;
+    image->clipY = 0;
+    image->clipWidth = 0;
+    image->clipHeight = 0;
+
+    wrenSetSlotExternalSize(vm, 0, 0);
+}
+
+void imageGetWidth(WrenVM* vm, const WrenForeignArg* args)
+{
+    Image* image = (Image*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, image->width);
 }
 
-void imageGetHeight(WrenVM* vm)
+void imageGetHeight(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
     wrenSetSlotDouble(vm, 0, image->height);
 }
 
-void imageClip(WrenVM* vm)
+void imageClip(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "height");
+    int x = args[1].integer;
+    int y = args[2].integer;
+    int x2 = args[3].integer >= 0 ? x + args[3].integer : image->width;
+    int y2 = args[4].integer >= 0 ? y + args[4].integer : image->height;
 
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
-    int width = (int)wrenGetSlotDouble(vm, 3);
-    int height = (int)wrenGetSlotDouble(vm, 4);
+    // The drawing code trusts the clip rectangle, so it's kept inside the
+    // image. A disposed image gets an empty one.
+    x = x < 0 ? 0 : x;
+    y = y < 0 ? 0 : y;
+    x2 = x2 > image->width ? image->width : x2;
+    y2 = y2 > image->height ? image->height : y2;
 
     image->clipX = x;
     image->clipY = y;
-    image->clipWidth = width;
-    image->clipHeight = height;
+    image->clipWidth = x2 > x ? x2 - x : 0;
+    image->clipHeight = y2 > y ? y2 - y : 0;
 }
 
-void imageGet(WrenVM* vm)
+void imageGet(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
+    Image* image = (Image*)args[0].foreign;
+    int x = args[1].integer;
+    int y = args[2].integer;
 
     Color color = { 0, 0, 0, 0 };
 
@@ -471,7 +573,7 @@ void imageGet(WrenVM* vm)
     wrenSetSlotDouble(vm, 0, (color.a << 24) | (color.r << 16) | (color.g << 8) | color.b);
 }
 
-static void setColor(Image* image, int x, int y, Color color)
+void rasterSet(Image* image, int x, int y, Color color)
 {
     int xa, i, a;
 
@@ -492,52 +594,47 @@ static void setColor(Image* image, int x, int y, Color color)
     }
 }
 
-void imageSet(WrenVM* vm)
+void imageSet(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
+    int x = args[1].integer;
+    int y = args[2].integer;
+    Color* color = (Color*)args[3].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, FOREIGN, "color");
-
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 3);
-
-    setColor(image, x, y, *color);
+    RASTER(vm, rasterSet(image, x, y, *color));
 }
 
-void imageClear(WrenVM* vm)
+void imageClear(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
+    Color* color = (Color*)args[1].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "color");
-
-    Color* color = (Color*)wrenGetSlotForeign(vm, 1);
+    RASTER(vm, rasterClear(image, *color));
+}
 
+void rasterClear(Image* image, Color color)
+{
     int count = image->width * image->height;
 
     int n;
     for (n = 0; n < count; n++)
-        image->data[n] = *color;
+        image->data[n] = color;
 }
 
-void imageFill(WrenVM* vm)
+void imageFill(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "height");
-    ASSERT_SLOT_TYPE(vm, 5, FOREIGN, "color");
-
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
-    int width = (int)wrenGetSlotDouble(vm, 3);
-    int height = (int)wrenGetSlotDouble(vm, 4);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 5);
+    Image* image = (Image*)args[0].foreign;
+    int x = args[1].integer;
+    int y = args[2].integer;
+    int width = args[3].integer;
+    int height = args[4].integer;
+    Color* color = (Color*)args[5].foreign;
+
+    RASTER(vm, rasterFill(image, x, y, width, height, *color));
+}
 
+void rasterFill(Image* image, int x, int y, int width, int height, Color color)
+{
     Color* td;
     int dt, i;
 
@@ -567,13 +664,13 @@ void imageFill(WrenVM* vm)
 
     do {
         for (i = 0; i < width; i++)
-            td[i] = *color;
+            td[i] = color;
 
         td += dt;
     } while (--height);
 }
 
-static void line(Image* image, int x0, int y0, int x1, int y1, Color color)
+void rasterLine(Image* image, int x0, int y0, int x1, int y1, Color color)
 {
     int sx, sy, dx, dy, err, e2;
 
@@ -593,7 +690,7 @@ static void line(Image* image, int x0, int y0, int x1, int y1, Color color)
     err = dx - dy;
 
     do {
-        setColor(image, x0, y0, color);
+        rasterSet(image, x0, y0, color);
 
         e2 = 2 * err;
 
@@ -609,41 +706,32 @@ static void line(Image* image, int x0, int y0, int x1, int y1, Color color)
     } while (x0 != x1 || y0 != y1);
 }
 
-void imageLine(WrenVM* vm)
+void imageLine(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x0");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y0");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "x1");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "y1");
-    ASSERT_SLOT_TYPE(vm, 5, FOREIGN, "color");
-
-    int x0 = (int)wrenGetSlotDouble(vm, 1);
-    int y0 = (int)wrenGetSlotDouble(vm, 2);
-    int x1 = (int)wrenGetSlotDouble(vm, 3);
-    int y1 = (int)wrenGetSlotDouble(vm, 4);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 5);
-
-    line(image, x0, y0, x1, y1, *color);
+    Image* image = (Image*)args[0].foreign;
+    int x0 = args[1].integer;
+    int y0 = args[2].integer;
+    int x1 = args[3].integer;
+    int y1 = args[4].integer;
+    Color* color = (Color*)args[5].foreign;
+
+    RASTER(vm, rasterLine(image, x0, y0, x1, y1, *color));
 }
 
-void imageRect(WrenVM* vm)
+void imageRect(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "height");
-    ASSERT_SLOT_TYPE(vm, 5, FOREIGN, "color");
-
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
-    int width = (int)wrenGetSlotDouble(vm, 3);
-    int height = (int)wrenGetSlotDouble(vm, 4);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 5);
+    Image* image = (Image*)args[0].foreign;
+    int x = args[1].integer;
+    int y = args[2].integer;
+    int width = args[3].integer;
+    int height = args[4].integer;
+    Color* color = (Color*)args[5].foreign;
+
+    RASTER(vm, rasterRect(image, x, y, width, height, *color));
+}
 
+void rasterRect(Image* image, int x, int y, int width, int height, Color color)
+{
     int x1, y1;
 
     if (width <= 0 || height <= 0) {
@@ -651,36 +739,34 @@ void imageRect(WrenVM* vm)
     }
 
     if (width == 1) {
-        line(image, x, y, x, y + height, *color);
+        rasterLine(image, x, y, x, y + height, color);
     } else if (height == 1) {
-        line(image, x, y, x + width, y, *color);
+        rasterLine(image, x, y, x + width, y, color);
     } else {
         x1 = x + width - 1;
         y1 = y + height - 1;
 
-        line(image, x, y, x1, y, *color);
-        line(image, x1, y, x1, y1, *color);
-        line(image, x1, y1, x, y1, *color);
-        line(image, x, y1, x, y, *color);
+        rasterLine(image, x, y, x1, y, color);
+        rasterLine(image, x1, y, x1, y1, color);
+        rasterLine(image, x1, y1, x, y1, color);
+        rasterLine(image, x, y1, x, y, color);
     }
 }
 
-void imageFillRect(WrenVM* vm)
+void imageFillRect(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "height");
-    ASSERT_SLOT_TYPE(vm, 5, FOREIGN, "color");
-
-    int x = (int)wrenGetSlotDouble(vm, 1);
-    int y = (int)wrenGetSlotDouble(vm, 2);
-    int width = (int)wrenGetSlotDouble(vm, 3);
-    int height = (int)wrenGetSlotDouble(vm, 4);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 5);
+    Image* image = (Image*)args[0].foreign;
+    int x = args[1].integer;
+    int y = args[2].integer;
+    int width = args[3].integer;
+    int height = args[4].integer;
+    Color* color = (Color*)args[5].foreign;
+
+    RASTER(vm, rasterFillRect(image, x, y, width, height, *color));
+}
 
+void rasterFillRect(Image* image, int x, int y, int width, int height, Color color)
+{
     x += 1;
     y += 1;
     width -= 2;
@@ -714,45 +800,44 @@ void imageFillRect(WrenVM* vm)
 
     Color* td = &image->data[y * image->width + x];
     int dt = image->width;
-    int xa = EXPAND(color->a);
+    int xa = EXPAND(color.a);
     int a = xa * xa;
 
     do {
         for (int i = 0; i < width; i++) {
-            td[i].r += (uint8_t)((color->r - td[i].r) * a >> 16);
-            td[i].g += (uint8_t)((color->g - td[i].g) * a >> 16);
-            td[i].b += (uint8_t)((color->b - td[i].b) * a >> 16);
-            td[i].a += (uint8_t)((color->a - td[i].a) * a >> 16);
+            td[i].r += (uint8_t)((color.r - td[i].r) * a >> 16);
+            td[i].g += (uint8_t)((color.g - td[i].g) * a >> 16);
+            td[i].b += (uint8_t)((color.b - td[i].b) * a >> 16);
+            td[i].a += (uint8_t)((color.a - td[i].a) * a >> 16);
         }
 
         td += dt;
     } while (--height);
 }
 
-void imageCircle(WrenVM* vm)
+void imageCircle(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "radius");
-    ASSERT_SLOT_TYPE(vm, 4, FOREIGN, "color");
+    Image* image = (Image*)args[0].foreign;
+    int x0 = args[1].integer;
+    int y0 = args[2].integer;
+    int radius = args[3].integer;
+    Color* color = (Color*)args[4].foreign;
 
-    int x0 = (int)wrenGetSlotDouble(vm, 1);
-    int y0 = (int)wrenGetSlotDouble(vm, 2);
-    int radius = (int)wrenGetSlotDouble(vm, 3);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 4);
+    RASTER(vm, rasterCircle(image, x0, y0, radius, *color));
+}
 
+void rasterCircle(Image* image, int x0, int y0, int radius, Color color)
+{
     int E = 1 - radius;
     int dx = 0;
     int dy = -2 * radius;
     int x = 0;
     int y = radius;
 
-    setColor(image, x0, y0 + radius, *color);
-    setColor(image, x0, y0 - radius, *color);
-    setColor(image, x0 + radius, y0, *color);
-    setColor(image, x0 - radius, y0, *color);
+    rasterSet(image, x0, y0 + radius, color);
+    rasterSet(image, x0, y0 - radius, color);
+    rasterSet(image, x0 + radius, y0, color);
+    rasterSet(image, x0 - radius, y0, color);
 
     while (x < y - 1) {
         x++;
@@ -766,34 +851,33 @@ void imageCircle(WrenVM* vm)
         dx += 2;
         E += dx + 1;
 
-        setColor(image, x0 + x, y0 + y, *color);
-        setColor(image, x0 - x, y0 + y, *color);
-        setColor(image, x0 + x, y0 - y, *color);
-        setColor(image, x0 - x, y0 - y, *color);
+        rasterSet(image, x0 + x, y0 + y, color);
+        rasterSet(image, x0 - x, y0 + y, color);
+        rasterSet(image, x0 + x, y0 - y, color);
+        rasterSet(image, x0 - x, y0 - y, color);
 
         if (x != y) {
-            setColor(image, x0 + y, y0 + x, *color);
-            setColor(image, x0 - y, y0 + x, *color);
-            setColor(image, x0 + y, y0 - x, *color);
-            setColor(image, x0 - y, y0 - x, *color);
+            rasterSet(image, x0 + y, y0 + x, color);
+            rasterSet(image, x0 - y, y0 + x, color);
+            rasterSet(image, x0 + y, y0 - x, color);
+            rasterSet(image, x0 - y, y0 - x, color);
         }
     }
 }
 
-void imageFillCircle(WrenVM* vm)
+void imageFillCircle(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
+    int x0 = args[1].integer;
+    int y0 = args[2].integer;
+    int radius = args[3].integer;
+    Color* color = (Color*)args[4].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "radius");
-    ASSERT_SLOT_TYPE(vm, 4, FOREIGN, "color");
-
-    int x0 = (int)wrenGetSlotDouble(vm, 1);
-    int y0 = (int)wrenGetSlotDouble(vm, 2);
-    int radius = (int)wrenGetSlotDouble(vm, 3);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 4);
+    RASTER(vm, rasterFillCircle(image, x0, y0, radius, *color));
+}
 
+void rasterFillCircle(Image* image, int x0, int y0, int radius, Color color)
+{
     if (radius <= 0) {
         return;
     }
@@ -804,7 +888,7 @@ void imageFillCircle(WrenVM* vm)
     int x = 0;
     int y = radius;
 
-    line(image, x0 - radius + 1, y0, x0 + radius, y0, *color);
+    rasterLine(image, x0 - radius + 1, y0, x0 + radius, y0, color);
 
     while (x < y - 1) {
         x++;
@@ -813,21 +897,21 @@ void imageFillCircle(WrenVM* vm)
             y--;
             dy += 2;
             E += dy;
-            line(image, x0 - x + 1, y0 + y, x0 + x, y0 + y, *color);
-            line(image, x0 - x + 1, y0 - y, x0 + x, y0 - y, *color);
+            rasterLine(image, x0 - x + 1, y0 + y, x0 + x, y0 + y, color);
+            rasterLine(image, x0 - x + 1, y0 - y, x0 + x, y0 - y, color);
         }
 
         dx += 2;
         E += dx + 1;
 
         if (x != y) {
-            line(image, x0 - y + 1, y0 + x, x0 + y, y0 + x, *color);
-            line(image, x0 - y + 1, y0 - x, x0 + y, y0 - x, *color);
+            rasterLine(image, x0 - y + 1, y0 + x, x0 + y, y0 + x, color);
+            rasterLine(image, x0 - y + 1, y0 - x, x0 + y, y0 - x, color);
         }
     }
 }
 
-static void blitTint(Image* image, Image* src, int dx, int dy, int sx, int sy, int width, int height, Color tint)
+void rasterBlitTint(Image* image, Image* src, int dx, int dy, int sx, int sy, int width, int height, Color tint)
 {
     int cw = image->clipWidth >= 0 ? image->clipWidth : image->width;
     int ch = image->clipHeight >= 0 ? image->clipHeight : image->height;
@@ -863,44 +947,39 @@ static void blitTint(Image* image, Image* src, int dx, int dy, int sx, int sy, i
     } while (--height);
 }
 
-void imagePrint(WrenVM* vm)
+void rasterPrint(Image* image, const char* text, int x, int y, Color color)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, STRING, "text");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "x");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "y");
-    ASSERT_SLOT_TYPE(vm, 4, FOREIGN, "color");
-
-    const char* text = wrenGetSlotString(vm, 1);
-    int x = (int)wrenGetSlotDouble(vm, 2);
-    int y = (int)wrenGetSlotDouble(vm, 3);
-    Color* color = (Color*)wrenGetSlotForeign(vm, 4);
-
     for (int i = 0; i < strlen(text); i++)
-        blitTint(image, &defaultFont[text[i]], x + i * 8, y, 0, 0, 8, 8, *color);
+        rasterBlitTint(image, &defaultFont[text[i]], x + i * 8, y, 0, 0, 8, 8, color);
 }
 
-void imageBlit(WrenVM* vm)
+void imagePrint(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
+    Image* image = (Image*)args[0].foreign;
+    const char* text = args[1].string;
+    int x = args[2].integer;
+    int y = args[3].integer;
+    Color* color = (Color*)args[4].foreign;
 
-    ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "image");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "dx");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "dy");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "sx");
-    ASSERT_SLOT_TYPE(vm, 5, NUM, "sy");
-    ASSERT_SLOT_TYPE(vm, 6, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 7, NUM, "height");
-
-    Image* src = (Image*)wrenGetSlotForeign(vm, 1);
-    int dx = (int)wrenGetSlotDouble(vm, 2);
-    int dy = (int)wrenGetSlotDouble(vm, 3);
-    int sx = (int)wrenGetSlotDouble(vm, 4);
-    int sy = (int)wrenGetSlotDouble(vm, 5);
-    int width = (int)wrenGetSlotDouble(vm, 6);
-    int height = (int)wrenGetSlotDouble(vm, 7);
+    RASTER(vm, rasterPrint(image, text, x, y, *color));
+}
+
+void imageBlit(WrenVM* vm, const WrenForeignArg* args)
+{
+    Image* image = (Image*)args[0].foreign;
+    Image* src = (Image*)args[1].foreign;
+    int dx = args[2].integer;
+    int dy = args[3].integer;
+    int sx = args[4].integer;
+    int sy = args[5].integer;
+    int width = args[6].integer;
+    int height = args[7].integer;
+
+    RASTER(vm, rasterBlit(image, src, dx, dy, sx, sy, width, height));
+}
 
+void rasterBlit(Image* image, Image* src, int dx, int dy, int sx, int sy, int width, int height)
+{
     int cw = image->clipWidth >= 0 ? image->clipWidth : image->width;
     int ch = image->clipHeight >= 0 ? image->clipHeight : image->height;
 
@@ -919,55 +998,36 @@ void imageBlit(WrenVM* vm)
     } while (--height);
 }
 
-void imageBlitAlpha(WrenVM* vm)
+void imageBlitAlpha(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "image");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "dx");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "dy");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "sx");
-    ASSERT_SLOT_TYPE(vm, 5, NUM, "sy");
-    ASSERT_SLOT_TYPE(vm, 6, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 7, NUM, "height");
-    ASSERT_SLOT_TYPE(vm, 8, NUM, "alpha");
-
-    Image* src = (Image*)wrenGetSlotForeign(vm, 1);
-    int dx = (int)wrenGetSlotDouble(vm, 2);
-    int dy = (int)wrenGetSlotDouble(vm, 3);
-    int sx = (int)wrenGetSlotDouble(vm, 4);
-    int sy = (int)wrenGetSlotDouble(vm, 5);
-    int width = (int)wrenGetSlotDouble(vm, 6);
-    int height = (int)wrenGetSlotDouble(vm, 7);
-    float alpha = (float)wrenGetSlotDouble(vm, 8);
+    Image* image = (Image*)args[0].foreign;
+    Image* src = (Image*)args[1].foreign;
+    int dx = args[2].integer;
+    int dy = args[3].integer;
+    int sx = args[4].integer;
+    int sy = args[5].integer;
+    int width = args[6].integer;
+    int height = args[7].integer;
+    float alpha = (float)args[8].num;
 
     alpha = (alpha < 0) ? 0 : (alpha > 1 ? 1 : alpha);
-    blitTint(image, src, dx, dy, sx, sy, width, height, (Color) { 255, 255, 255, (uint8_t)(255 * alpha) });
+    Color tint = { 255, 255, 255, (uint8_t)(255 * alpha) };
+    RASTER(vm, rasterBlitTint(image, src, dx, dy, sx, sy, width, height, tint));
 }
 
-void imageBlitTint(WrenVM* vm)
+void imageBlitTint(WrenVM* vm, const WrenForeignArg* args)
 {
-    Image* image = (Image*)wrenGetSlotForeign(vm, 0);
-
-    ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "image");
-    ASSERT_SLOT_TYPE(vm, 2, NUM, "dx");
-    ASSERT_SLOT_TYPE(vm, 3, NUM, "dy");
-    ASSERT_SLOT_TYPE(vm, 4, NUM, "sx");
-    ASSERT_SLOT_TYPE(vm, 5, NUM, "sy");
-    ASSERT_SLOT_TYPE(vm, 6, NUM, "width");
-    ASSERT_SLOT_TYPE(vm, 7, NUM, "height");
-    ASSERT_SLOT_TYPE(vm, 8, FOREIGN, "tint");
-
-    Image* src = (Image*)wrenGetSlotForeign(vm, 1);
-    int dx = (int)wrenGetSlotDouble(vm, 2);
-    int dy = (int)wrenGetSlotDouble(vm, 3);
-    int sx = (int)wrenGetSlotDouble(vm, 4);
-    int sy = (int)wrenGetSlotDouble(vm, 5);
-    int width = (int)wrenGetSlotDouble(vm, 6);
-    int height = (int)wrenGetSlotDouble(vm, 7);
-    Color* tint = (Color*)wrenGetSlotForeign(vm, 8);
-
-    blitTint(image, src, dx, dy, sx, sy, width, height, *tint);
+    Image* image = (Image*)args[0].foreign;
+    Image* src = (Image*)args[1].foreign;
+    int dx = args[2].integer;
+    int dy = args[3].integer;
+    int sx = args[4].integer;
+    int sy = args[5].integer;
+    int width = args[6].integer;
+    int height = args[7].integer;
+    Color* tint = (Color*)args[8].foreign;
+
+    RASTER(vm, rasterBlitTint(image, src, dx, dy, sx, sy, width, height, *tint));
 }
 
 void osName(WrenVM* vm)
@@ -984,11 +1044,13 @@ void osBasilVersion(WrenVM* vm)
 
 void osArgs(WrenVM* vm)
 {
+    Context* context = (Context*)wrenGetUserData(vm);
+
     wrenEnsureSlots(vm, 2);
     wrenSetSlotNewList(vm, 0);
 
-    for (int i = 0; i < argCount; i++) {
-        wrenSetSlotString(vm, 1, args[i]);
+    for (int i = 0; i < context->argCount; i++) {
+        wrenSetSlotString(vm, 1, context->args[i]);
         wrenInsertInList(vm, 0, i, 1);
     }
 }
@@ -996,11 +1058,19 @@ void osArgs(WrenVM* vm)
 void osExit(WrenVM* vm)
 {
     ASSERT_SLOT_TYPE(vm, 1, NUM, "code");
-    exitCode = (int)wrenGetSlotDouble(vm, 1);
+
+    Context* context = (Context*)wrenGetUserData(vm);
+    context->exitCode = (int)wrenGetSlotDouble(vm, 1);
 }
 
 void windowInit(WrenVM* vm)
 {
+    Context* context = (Context*)wrenGetUserData(vm);
+    if (context->headless && context->scene == NULL) {
+        VM_ABORT(vm, "Window not available in headless mode");
+        return;
+    }
+
     if (window != NULL) {
         VM_ABORT(vm, "Window already initialized");
         return;
@@ -1019,7 +1089,17 @@ void windowInit(WrenVM* vm)
         return;
     }
 
-    window = (Window*)malloc(sizeof(Window));
+    window = (Window*)calloc(1, sizeof(Window));
+
+    window->screenWidth = width;
+    window->screenHeight = height;
+    window->targetFps = -1;
+
+    // Headless scenes only need the input state, frames go to the scene.
+    if (context->headless) {
+        beginScene(context->scene, window);
+        return;
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         VM_ABORT(vm, "Error initializing SDL");
@@ -1044,15 +1124,13 @@ void windowInit(WrenVM* vm)
         return;
     }
 
-    window->screenWidth = width;
-    window->screenHeight = height;
-    window->closed = false;
-
     SDL_SetWindowMinimumSize(window->window, width, height);
     SDL_RenderSetLogicalSize(window->renderer, width, height);
 
     window->prevTime = SDL_GetPerformanceCounter();
-    window->targetFps = -1;
+
+    if (context->scene != NULL)
+        beginScene(context->scene, window);
 
 #ifndef _WIN32
 #include "icon.h"
@@ -1089,6 +1167,7 @@ void windowQuit(WrenVM* vm)
     }
 
     free(window);
+    window = NULL;
 
     SDL_Quit();
 }
@@ -1104,26 +1183,49 @@ void windowUpdate(WrenVM* vm)
 
     Image* image = (Image*)wrenGetSlotForeign(vm, 1);
 
-    if (image->width != window->screenWidth || image->height != window->screenHeight) {
-        SDL_DestroyTexture(window->screen);
+    if (image->data == NULL) {
+        VM_ABORT(vm, "Image has been disposed.");
+        return;
+    }
+    Scene* scene = ((Context*)wrenGetUserData(vm))->scene;
 
-        window->screen = SDL_CreateTexture(window->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, image->width, image->height);
-        if (window->screen == NULL) {
-            VM_ABORT(vm, "Error creating screen texture");
-            return;
+    uint64_t presentStart = SDL_GetPerformanceCounter();
+
+    if (scene != NULL)
+        presentScene(scene, image);
+
+    if (window->window != NULL) {
+        TRACE_BEGIN("upload");
+
+        if (image->width != window->screenWidth || image->height != window->screenHeight) {
+            SDL_DestroyTexture(window->screen);
+
+            window->screen = SDL_CreateTexture(window->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, image->width, image->height);
+            if (window->screen == NULL) {
+                TRACE_END();
+                VM_ABORT(vm, "Error creating screen texture");
+                return;
+            }
+
+            window->screenWidth = image->width;
+            window->screenHeight = image->height;
+
+            SDL_RenderSetLogicalSize(window->renderer, image->width, image->height);
         }
 
-        window->screenWidth = image->width;
-        window->screenHeight = image->height;
+        SDL_UpdateTexture(window->screen, NULL, image->data, image->width * 4);
 
-        SDL_RenderSetLogicalSize(window->renderer, image->width, image->height);
-    }
+        TRACE_END();
+        TRACE_BEGIN("present");
 
-    SDL_UpdateTexture(window->screen, NULL, image->data, image->width * 4);
+        SDL_RenderClear(window->renderer);
+        SDL_RenderCopy(window->renderer, window->screen, NULL, NULL);
+        SDL_RenderPresent(window->renderer);
 
-    SDL_RenderClear(window->renderer);
-    SDL_RenderCopy(window->renderer, window->screen, NULL, NULL);
-    SDL_RenderPresent(window->renderer);
+        TRACE_END();
+    }
+
+    uint64_t presentTime = SDL_GetPerformanceCounter() - presentStart;
 
     for (int i = 0; i < SDL_NUM_SCANCODES; i++)
         window->keysPressed[i] = false;
@@ -1131,10 +1233,15 @@ void windowUpdate(WrenVM* vm)
     for (int i = 0; i < 5; i++)
         window->mousePressed[i] = false;
 
+    TRACE_BEGIN("events");
+
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
+    while (window->window != NULL && SDL_PollEvent(&event)) {
         if (event.type == SDL_QUIT) {
             window->closed = true;
+        } else if (scene != NULL) {
+            // Scenes only see their scripted input.
+            continue;
         } else if (event.type == SDL_KEYDOWN && event.key.repeat == 0) {
             window->keysHeld[event.key.keysym.scancode] = true;
             window->keysPressed[event.key.keysym.scancode] = true;
@@ -1150,6 +1257,17 @@ void windowUpdate(WrenVM* vm)
             window->mouseY = event.motion.y;
         }
     }
+
+    TRACE_END();
+
+    double gcBudget = ((Context*)wrenGetUserData(vm))->gcFrameBudget;
+    if (gcBudget > 0)
+        collectFor(vm, gcBudget);
+
+    if (scene != NULL)
+        endSceneFrame(scene, window, presentTime);
+
+    TRACE_FRAME();
 }
 
 void windowKeyHeld(WrenVM* vm)
@@ -1219,8 +1337,9 @@ void windowWidth(WrenVM* vm)
 
     wrenEnsureSlots(vm, 1);
 
-    int width;
-    SDL_GetWindowSize(window->window, &width, NULL);
+    int width = window->screenWidth;
+    if (window->window != NULL)
+        SDL_GetWindowSize(window->window, &width, NULL);
 
     wrenSetSlotDouble(vm, 0, width);
 }
@@ -1234,8 +1353,9 @@ void windowHeight(WrenVM* vm)
 
     wrenEnsureSlots(vm, 1);
 
-    int height;
-    SDL_GetWindowSize(window->window, NULL, &height);
+    int height = window->screenHeight;
+    if (window->window != NULL)
+        SDL_GetWindowSize(window->window, NULL, &height);
 
     wrenSetSlotDouble(vm, 0, height);
 }
@@ -1248,7 +1368,7 @@ void windowTitle(WrenVM* vm)
     }
 
     wrenEnsureSlots(vm, 1);
-    wrenSetSlotString(vm, 0, SDL_GetWindowTitle(window->window));
+    wrenSetSlotString(vm, 0, window->window != NULL ? SDL_GetWindowTitle(window->window) : "");
 }
 
 void windowClosed(WrenVM* vm)
@@ -1292,7 +1412,7 @@ void windowGetIntegerScaling(WrenVM* vm)
     }
 
     wrenEnsureSlots(vm, 1);
-    wrenSetSlotBool(vm, 0, SDL_RenderGetIntegerScale(window->renderer));
+    wrenSetSlotBool(vm, 0, window->renderer != NULL && SDL_RenderGetIntegerScale(window->renderer));
 }
 
 void windowSetIntegerScaling(WrenVM* vm)
@@ -1305,7 +1425,8 @@ void windowSetIntegerScaling(WrenVM* vm)
     ASSERT_SLOT_TYPE(vm, 1, BOOL, "integerScaling");
 
     bool integerScaling = wrenGetSlotBool(vm, 1);
-    SDL_RenderSetIntegerScale(window->renderer, integerScaling);
+    if (window->renderer != NULL)
+        SDL_RenderSetIntegerScale(window->renderer, integerScaling);
 }
 
 void windowTargetFps(WrenVM* vm)
@@ -1326,6 +1447,12 @@ void windowTime(WrenVM* vm)
         return;
     }
 
+    // Scenes run on a virtual clock, every frame takes exactly one tick.
+    if (((Context*)wrenGetUserData(vm))->scene != NULL) {
+        wrenSetSlotDouble(vm, 0, 1.0 / (window->targetFps > 0 ? window->targetFps : 60));
+        return;
+    }
+
     if (window->targetFps > 0) {
         double targetTime = 1.0 / window->targetFps;
 
@@ -1347,3 +1474,422 @@ void windowTime(WrenVM* vm)
         window->prevTime = now;
     }
 }
+
+void profilerBegin(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, STRING, "name");
+
+    TRACE_BEGIN(traceName(wrenGetSlotString(vm, 1)));
+}
+
+void profilerEnd(WrenVM* vm)
+{
+    TRACE_END();
+}
+
+void profilerSetOpcodeCounting(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, BOOL, "opcodeCounting");
+
+    wrenSetOpcodeCounting(vm, wrenGetSlotBool(vm, 1));
+}
+
+void profilerDumpOpcodeStats(WrenVM* vm)
+{
+    wrenDumpOpcodeStats(vm, NULL);
+}
+
+void profilerSetAllocationTracking(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, BOOL, "allocationTracking");
+
+    wrenSetAllocationTracking(vm, wrenGetSlotBool(vm, 1));
+}
+
+void profilerDumpAllocations(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, NUM, "sites");
+
+    wrenDumpAllocationStats(vm, NULL, (int)wrenGetSlotDouble(vm, 1));
+}
+
+// Upper bounds in milliseconds, the last bucket takes everything longer.
+const double gcPauseBounds[GC_PAUSE_BUCKETS - 1] = { 0.1, 0.25, 0.5, 1, 2, 4, 8, 16 };
+
+void recordCollection(WrenVM* vm, bool finished)
+{
+    Context* context = (Context*)wrenGetUserData(vm);
+    if (context == NULL)
+        return;
+
+    GCPauses* gc = &context->gc;
+
+    if (!finished) {
+        TRACE_BEGIN("GC");
+        gc->start = SDL_GetPerformanceCounter();
+        return;
+    }
+
+    double pause = (SDL_GetPerformanceCounter() - gc->start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause > gcPauseBounds[bucket])
+        bucket++;
+
+    gc->pauses++;
+    gc->lastPause = pause;
+    gc->totalPause += pause;
+    gc->histogram[bucket]++;
+
+    if (pause > gc->maxPause)
+        gc->maxPause = pause;
+
+    TRACE_END();
+}
+
+// Takes incremental collection steps, or a minor collection, until [budget]
+// milliseconds have passed or there's nothing left to collect, returns whether
+// any step was taken.
+bool collectFor(WrenVM* vm, double budget)
+{
+    GCPauses* gc = &((Context*)wrenGetUserData(vm))->gc;
+    int pauses = gc->pauses;
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint64_t limit = (uint64_t)(budget * SDL_GetPerformanceFrequency() / 1000.0);
+
+    while (SDL_GetPerformanceCounter() - start < limit) {
+        if (!wrenCollectGarbageStep(vm, GC_BUDGET_STEP))
+            break;
+    }
+
+    return gc->pauses != pauses;
+}
+
+static int runPoolThread(void* data)
+{
+    int index = (int)(intptr_t)data;
+    int run = 0;
+
+    SDL_LockMutex(pool.lock);
+
+    for (;;) {
+        while (pool.run == run)
+            SDL_CondWait(pool.start, pool.lock);
+
+        run = pool.run;
+        if (index >= pool.count)
+            continue;
+
+        WrenVM* vm = pool.vm;
+        WrenWorkerFn worker = pool.worker;
+        void* workerData = pool.data;
+
+        SDL_UnlockMutex(pool.lock);
+        worker(vm, index, workerData);
+        SDL_LockMutex(pool.lock);
+
+        if (--pool.pending == 0)
+            SDL_CondSignal(pool.done);
+    }
+
+    return 0;
+}
+
+// Runs [worker] on [count] threads, this one being the first. If threads
+// can't be started, or another VM is using them, the others do their share.
+void runOnThreads(WrenVM* vm, int count, WrenWorkerFn worker, void* data)
+{
+    if (count > MAX_GC_THREADS)
+        count = MAX_GC_THREADS;
+
+    SDL_LockMutex(pool.lock);
+
+    if (pool.busy) {
+        SDL_UnlockMutex(pool.lock);
+        worker(vm, 0, data);
+        return;
+    }
+
+    while (pool.threadCount + 1 < count) {
+        SDL_Thread* thread = SDL_CreateThread(runPoolThread, "basil gc", (void*)(intptr_t)(pool.threadCount + 1));
+        if (thread == NULL)
+            break;
+
+        pool.threads[pool.threadCount++] = thread;
+    }
+
+    if (count > pool.threadCount + 1)
+        count = pool.threadCount + 1;
+
+    pool.busy = true;
+    pool.vm = vm;
+    pool.worker = worker;
+    pool.data = data;
+    pool.count = count;
+    pool.pending = count - 1;
+    pool.run++;
+
+    SDL_CondBroadcast(pool.start);
+    SDL_UnlockMutex(pool.lock);
+
+    worker(vm, 0, data);
+
+    SDL_LockMutex(pool.lock);
+
+    while (pool.pending > 0)
+        SDL_CondWait(pool.done, pool.lock);
+
+    pool.busy = false;
+    SDL_UnlockMutex(pool.lock);
+}
+
+void gcCollect(WrenVM* vm)
+{
+    wrenCollectGarbage(vm);
+}
+
+void gcBudget(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, NUM, "budget");
+
+    GCPauses* gc = &((Context*)wrenGetUserData(vm))->gc;
+
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    if (stats.incremental || stats.nurserySize > 0) {
+        wrenSetSlotBool(vm, 0, collectFor(vm, wrenGetSlotDouble(vm, 1)));
+        return;
+    }
+
+    // Only collect once the heap is halfway to the next automatic collection
+    // and the last pause suggests this one fits in the time left.
+    bool collect = stats.bytesAllocated >= stats.nextGC / 2 && gc->lastPause <= wrenGetSlotDouble(vm, 1);
+
+    if (collect)
+        wrenCollectGarbage(vm);
+
+    wrenSetSlotBool(vm, 0, collect);
+}
+
+void gcExternalBytes(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.externalBytes);
+}
+
+void gcMethodTableBytes(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.methodTableBytes);
+}
+
+void gcClassIds(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.classIds);
+}
+
+void gcCollections(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.collections);
+}
+
+void gcMinorCollections(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.minorCollections);
+}
+
+void gcIncremental(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotBool(vm, 0, stats.incremental);
+}
+
+void gcNurserySize(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.nurserySize);
+}
+
+void gcMarkThreads(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, stats.markThreads);
+}
+
+void gcFrameBudget(WrenVM* vm)
+{
+    wrenSetSlotDouble(vm, 0, ((Context*)wrenGetUserData(vm))->gcFrameBudget);
+}
+
+void gcSetFrameBudget(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, NUM, "budget");
+
+    ((Context*)wrenGetUserData(vm))->gcFrameBudget = wrenGetSlotDouble(vm, 1);
+}
+
+void gcBytesAllocated(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.bytesAllocated);
+}
+
+void gcNextCollection(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.nextGC);
+}
+
+void gcLastFreed(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.lastFreed);
+}
+
+void gcTotalFreed(WrenVM* vm)
+{
+    WrenGCStats stats;
+    wrenGetGCStats(vm, &stats);
+
+    wrenSetSlotDouble(vm, 0, (double)stats.totalFreed);
+}
+
+void gcLastPause(WrenVM* vm)
+{
+    wrenSetSlotDouble(vm, 0, ((Context*)wrenGetUserData(vm))->gc.lastPause);
+}
+
+void gcMaxPause(WrenVM* vm)
+{
+    wrenSetSlotDouble(vm, 0, ((Context*)wrenGetUserData(vm))->gc.maxPause);
+}
+
+void gcTotalPause(WrenVM* vm)
+{
+    wrenSetSlotDouble(vm, 0, ((Context*)wrenGetUserData(vm))->gc.totalPause);
+}
+
+void gcPauseHistogram(WrenVM* vm)
+{
+    GCPauses* gc = &((Context*)wrenGetUserData(vm))->gc;
+
+    wrenEnsureSlots(vm, 2);
+    wrenSetSlotNewList(vm, 0);
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        wrenSetSlotDouble(vm, 1, gc->histogram[i]);
+        wrenInsertInList(vm, 0, i, 1);
+    }
+}
+
+void gcPauseBuckets(WrenVM* vm)
+{
+    wrenEnsureSlots(vm, 2);
+    wrenSetSlotNewList(vm, 0);
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS - 1; i++) {
+        wrenSetSlotDouble(vm, 1, gcPauseBounds[i]);
+        wrenInsertInList(vm, 0, i, 1);
+    }
+}
+
+size_t foreignSize(WrenVM* vm, WrenForeignMethodFn allocate, void* data)
+{
+    if (allocate == imageAllocate) {
+        Image* image = (Image*)data;
+        return sizeof(Image) + (image->data != NULL ? image->width * image->height * sizeof(Color) : 0);
+    }
+
+    if (allocate == fontAllocate)
+        return sizeof(Font) + ((Font*)data)->dataSize;
+
+    if (allocate == colorAllocate)
+        return sizeof(Color);
+
+    return 0;
+}
+
+static void writeSnapshot(void* userData, const char* text, size_t length)
+{
+    fwrite(text, 1, length, (FILE*)userData);
+}
+
+static void setMapNumber(WrenVM* vm, const char* key, double value)
+{
+    wrenSetSlotString(vm, 1, key);
+    wrenSetSlotDouble(vm, 2, value);
+    wrenSetMapValue(vm, 0, 1, 2);
+}
+
+void gcPoolStats(WrenVM* vm)
+{
+    PoolStats stats;
+
+    if (!getPoolStats(&stats)) {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewMap(vm, 0);
+
+    setMapNumber(vm, "slabBytes", (double)stats.slabBytes);
+    setMapNumber(vm, "usedBytes", (double)stats.usedBytes);
+    setMapNumber(vm, "requestedBytes", (double)stats.requestedBytes);
+    setMapNumber(vm, "largeBytes", (double)stats.largeBytes);
+    setMapNumber(vm, "largeBlocks", stats.largeBlocks);
+}
+
+void gcSnapshot(WrenVM* vm)
+{
+    ASSERT_SLOT_TYPE(vm, 1, STRING, "path");
+
+    const char* path = wrenGetSlotString(vm, 1);
+
+    Context* context = (Context*)wrenGetUserData(vm);
+
+    char fullPath[MAX_PATH_LENGTH];
+    if (!joinPath(fullPath, context->basePath, path, "")) {
+        VM_ABORT(vm, "Snapshot path is too long.");
+        return;
+    }
+
+    FILE* file = fopen(fullPath, "w");
+    if (file == NULL) {
+        VM_ABORT(vm, "Failed to open snapshot file.");
+        return;
+    }
+
+    TRACE_BEGIN("heap snapshot");
+    wrenWriteHeapSnapshot(vm, writeSnapshot, file, foreignSize);
+    TRACE_END();
+
+    fclose(file);
+}
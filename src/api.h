@@ -8,37 +8,22 @@
 
 #include "lib/wren/wren.h"
 
-void setArgs(int argc, char** argv);
-int getExitCode();
+#include "util.h"
 
 typedef struct
 {
     uint8_t b, g, r, a;
 } Color;
 
-void colorAllocate(WrenVM* vm);
-void colorNew(WrenVM* vm);
-void colorNew2(WrenVM* vm);
-void colorNew3(WrenVM* vm);
-void colorGetR(WrenVM* vm);
-void colorGetG(WrenVM* vm);
-void colorGetB(WrenVM* vm);
-void colorGetA(WrenVM* vm);
-void colorSetR(WrenVM* vm);
-void colorSetG(WrenVM* vm);
-void colorSetB(WrenVM* vm);
-void colorSetA(WrenVM* vm);
+#include "api.prototypes.inc"
 
 typedef struct
 {
     int size;
     uint8_t* data;
+    size_t dataSize;
 } Font;
 
-void fontAllocate(WrenVM* vm);
-void fontFinalize(void* data);
-void fontNew(WrenVM* vm);
-
 typedef struct
 {
     int width, height;
@@ -46,31 +31,17 @@ typedef struct
     Color* data;
 } Image;
 
-void imageAllocate(WrenVM* vm);
-void imageFinalize(void* data);
-void imageNew(WrenVM* vm);
-void imageNew2(WrenVM* vm);
-void imageGetWidth(WrenVM* vm);
-void imageGetHeight(WrenVM* vm);
-void imageClip(WrenVM* vm);
-void imageGet(WrenVM* vm);
-void imageSet(WrenVM* vm);
-void imageClear(WrenVM* vm);
-void imageFill(WrenVM* vm);
-void imageLine(WrenVM* vm);
-void imageRect(WrenVM* vm);
-void imageFillRect(WrenVM* vm);
-void imageCircle(WrenVM* vm);
-void imageFillCircle(WrenVM* vm);
-void imagePrint(WrenVM* vm);
-void imageBlit(WrenVM* vm);
-void imageBlitAlpha(WrenVM* vm);
-void imageBlitTint(WrenVM* vm);
-
-void osName(WrenVM* vm);
-void osBasilVersion(WrenVM* vm);
-void osArgs(WrenVM* vm);
-void osExit(WrenVM* vm);
+void rasterSet(Image* image, int x, int y, Color color);
+void rasterClear(Image* image, Color color);
+void rasterFill(Image* image, int x, int y, int width, int height, Color color);
+void rasterLine(Image* image, int x0, int y0, int x1, int y1, Color color);
+void rasterRect(Image* image, int x, int y, int width, int height, Color color);
+void rasterFillRect(Image* image, int x, int y, int width, int height, Color color);
+void rasterCircle(Image* image, int x0, int y0, int radius, Color color);
+void rasterFillCircle(Image* image, int x0, int y0, int radius, Color color);
+void rasterPrint(Image* image, const char* text, int x, int y, Color color);
+void rasterBlit(Image* image, Image* src, int dx, int dy, int sx, int sy, int width, int height);
+void rasterBlitTint(Image* image, Image* src, int dx, int dy, int sx, int sy, int width, int height, Color tint);
 
 typedef struct
 {
@@ -88,22 +59,87 @@ typedef struct
     int targetFps;
 } Window;
 
-void windowInit(WrenVM* vm);
-void windowQuit(WrenVM* vm);
-void windowUpdate(WrenVM* vm);
-void windowKeyHeld(WrenVM* vm);
-void windowKeyPressed(WrenVM* vm);
-void windowMouseHeld(WrenVM* vm);
-void windowMousePressed(WrenVM* vm);
-void windowWidth(WrenVM* vm);
-void windowHeight(WrenVM* vm);
-void windowTitle(WrenVM* vm);
-void windowClosed(WrenVM* vm);
-void windowMouseX(WrenVM* vm);
-void windowMouseY(WrenVM* vm);
-void windowGetIntegerScaling(WrenVM* vm);
-void windowSetIntegerScaling(WrenVM* vm);
-void windowTime(WrenVM* vm);
-void windowTargetFps(WrenVM* vm);
+size_t foreignSize(WrenVM* vm, WrenForeignMethodFn allocate, void* data);
+
+typedef enum
+{
+    SCENE_MOUSE_MOVE,
+    SCENE_MOUSE_DOWN,
+    SCENE_MOUSE_UP,
+    SCENE_KEY_DOWN,
+    SCENE_KEY_UP,
+    SCENE_QUIT
+} SceneEventType;
+
+typedef struct
+{
+    int frame;
+    SceneEventType type;
+    int x, y;
+    int button;
+    SDL_Scancode key;
+} SceneEvent;
+
+typedef struct
+{
+    double script, raster, present, total;
+} SceneFrame;
+
+typedef struct
+{
+    int frameCount;
+    uint32_t seed;
+    uint32_t seedCount;
+
+    SceneEvent* events;
+    int eventCount;
+    int nextEvent;
+
+    SceneFrame* frames;
+    int frame;
+    uint64_t frameStart;
+    uint64_t rasterTime;
+
+    Color* screen;
+    int screenWidth, screenHeight;
+} Scene;
+
+#define GC_PAUSE_BUCKETS 9
+
+extern const double gcPauseBounds[GC_PAUSE_BUCKETS - 1];
+
+// The objects marked or swept between two looks at the clock when collecting
+// within a time budget.
+#define GC_BUDGET_STEP 256
+
+// The most threads a collection marks the heap on.
+#define MAX_GC_THREADS 64
+
+typedef struct
+{
+    uint64_t start;
+    int pauses;
+    double lastPause, maxPause, totalPause;
+    int histogram[GC_PAUSE_BUCKETS];
+} GCPauses;
+
+typedef struct
+{
+    int argCount;
+    char** args;
+    char basePath[MAX_PATH_LENGTH];
+    int exitCode;
+    bool headless;
+    TextBuffer* output;
+    Scene* scene;
+    GCPauses gc;
+    double gcFrameBudget;
+} Context;
+
+void initApi();
+void initContext(Context* context, int argc, char** argv);
+void recordCollection(WrenVM* vm, bool finished);
+bool collectFor(WrenVM* vm, double budget);
+void runOnThreads(WrenVM* vm, int count, WrenWorkerFn worker, void* data);
 
 #endif
@@ -8,13 +8,22 @@
 #include "api.h"
 #include "api.wren.inc"
 
+#include "batch.h"
+#include "bench.h"
+#include "cache.h"
+#include "plugin.h"
+#include "pool.h"
+#include "profile.h"
+#include "scene.h"
+#include "trace.h"
 #include "util.h"
 
-static const char* basePath = NULL;
-
 static void onComplete(WrenVM* vm, const char* name, WrenLoadModuleResult result)
 {
-    if (result.source)
+    TRACE_END();
+
+    // Embedded sources are marked with userData.
+    if (result.source != apiModuleSource && result.userData == NULL)
         free((void*)result.source);
 }
 
@@ -25,146 +34,141 @@ static WrenLoadModuleResult wrenLoadModule(WrenVM* vm, const char* name)
     if (strcmp(name, "meta") == 0 || strcmp(name, "random") == 0)
         return result;
 
+#ifdef BASIL_TRACE
+    // The zone covers reading and compiling the module, it ends in onComplete.
+    char zone[MAX_PATH_LENGTH];
+    snprintf(zone, MAX_PATH_LENGTH, "import %s", name);
+    TRACE_BEGIN(traceName(zone));
+#endif
+
+    result.onComplete = onComplete;
+
     if (strcmp(name, "basil") == 0) {
         result.source = apiModuleSource;
         return result;
     }
 
+    Context* context = (Context*)wrenGetUserData(vm);
+
+    if (isPluginModule(name)) {
+        const Plugin* plugin = loadPlugin(context->basePath, name, context->output);
+        if (plugin == NULL) {
+            TRACE_END();
+            return (WrenLoadModuleResult) { 0 };
+        }
+
+        if (plugin->source != NULL) {
+            result.source = plugin->source;
+            result.userData = (void*)plugin;
+            return result;
+        }
+
+        // The module is read from the Wren file next to the plugin.
+        name += strlen(PLUGIN_PREFIX);
+    }
+
     char fullPath[MAX_PATH_LENGTH];
-    snprintf(fullPath, MAX_PATH_LENGTH, "%s/%s.wren", basePath, name);
+    if (joinPath(fullPath, context->basePath, name, ".wren"))
+        result.source = readFile(fullPath, context->output);
+    else
+        printText(context->output, "Module path is too long: %s.\n", name);
 
-    result.source = readFile(fullPath);
-    result.onComplete = onComplete;
+    // Wren doesn't call onComplete for modules that weren't found.
+    if (result.source == NULL)
+        TRACE_END();
 
     return result;
 }
 
+// Bindings for every foreign method and class in api.wren, generated from its
+// #bind attributes by scripts/wren_to_bindings.py.
+#include "api.bindings.inc"
+
+// FNV-1a, continued from hash. Must match hash_parts() in the generator.
+static uint32_t hashBinding(uint32_t hash, const char* text)
+{
+    for (; *text != '\0'; text++)
+        hash = (hash ^ (uint8_t)*text) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t hashMethod(uint32_t seed, const char* className, bool isStatic, const char* signature)
+{
+    uint32_t hash = hashBinding(2166136261u ^ seed, className);
+    hash = hashBinding(hash, isStatic ? "." : "#");
+    return hashBinding(hash, signature);
+}
+
+// Plugins are told apart by the directory of the script importing them.
+static const Plugin* findModulePlugin(WrenVM* vm, const char* module)
+{
+    Context* context = (Context*)wrenGetUserData(vm);
+    return context != NULL ? findPlugin(context->basePath, module) : NULL;
+}
+
+static const ForeignMethodBinding* findMethodBinding(WrenVM* vm, const char* module, const char* className, bool isStatic, const char* signature)
+{
+    const Plugin* plugin = findModulePlugin(vm, module);
+    if (plugin != NULL)
+        return findPluginMethod(plugin, className, isStatic, signature);
+
+    uint32_t seed = foreignMethodSeeds[hashMethod(0, className, isStatic, signature) % FOREIGN_METHOD_COUNT];
+    const ForeignMethodBinding* binding = &foreignMethods[hashMethod(seed, className, isStatic, signature) % FOREIGN_METHOD_COUNT];
+
+    if (binding->isStatic != isStatic || strcmp(binding->signature, signature) != 0 || strcmp(binding->className, className) != 0)
+        return NULL;
+
+    return binding;
+}
+
 static WrenForeignMethodFn wrenBindForeignMethod(WrenVM* vm, const char* module, const char* className, bool isStatic, const char* signature)
 {
-    if (strcmp(className, "Color") == 0) {
-        if (strcmp(signature, "init new(_,_,_,_)") == 0)
-            return colorNew;
-        if (strcmp(signature, "init new(_,_,_)") == 0)
-            return colorNew2;
-        if (strcmp(signature, "init new(_)") == 0)
-            return colorNew3;
-        if (strcmp(signature, "r") == 0)
-            return colorGetR;
-        if (strcmp(signature, "g") == 0)
-            return colorGetG;
-        if (strcmp(signature, "b") == 0)
-            return colorGetB;
-        if (strcmp(signature, "a") == 0)
-            return colorGetA;
-        if (strcmp(signature, "r=(_)") == 0)
-            return colorSetR;
-        if (strcmp(signature, "g=(_)") == 0)
-            return colorSetG;
-        if (strcmp(signature, "b=(_)") == 0)
-            return colorSetB;
-        if (strcmp(signature, "a=(_)") == 0)
-            return colorSetA;
-    } else if (strcmp(className, "Font") == 0) {
-        if (strcmp(signature, "init new(_,_)") == 0)
-            return fontNew;
-    } else if (strcmp(className, "Image") == 0) {
-        if (strcmp(signature, "init new(_,_)") == 0)
-            return imageNew;
-        if (strcmp(signature, "init new(_)") == 0)
-            return imageNew2;
-        if (strcmp(signature, "width") == 0)
-            return imageGetWidth;
-        if (strcmp(signature, "height") == 0)
-            return imageGetHeight;
-        if (strcmp(signature, "clip(_,_,_,_)") == 0)
-            return imageClip;
-        if (strcmp(signature, "f_get(_,_)") == 0)
-            return imageGet;
-        if (strcmp(signature, "set(_,_,_)") == 0)
-            return imageSet;
-        if (strcmp(signature, "clear(_)") == 0)
-            return imageClear;
-        if (strcmp(signature, "fill(_,_,_,_,_)") == 0)
-            return imageFill;
-        if (strcmp(signature, "line(_,_,_,_,_)") == 0)
-            return imageLine;
-        if (strcmp(signature, "rect(_,_,_,_,_)") == 0)
-            return imageRect;
-        if (strcmp(signature, "fillRect(_,_,_,_,_)") == 0)
-            return imageFillRect;
-        if (strcmp(signature, "circle(_,_,_,_)") == 0)
-            return imageCircle;
-        if (strcmp(signature, "fillCircle(_,_,_,_)") == 0)
-            return imageFillCircle;
-        if (strcmp(signature, "print(_,_,_,_)") == 0)
-            return imagePrint;
-        if (strcmp(signature, "blit(_,_,_,_,_,_,_)") == 0)
-            return imageBlit;
-        if (strcmp(signature, "blitAlpha(_,_,_,_,_,_,_,_)") == 0)
-            return imageBlitAlpha;
-        if (strcmp(signature, "blitTint(_,_,_,_,_,_,_,_)") == 0)
-            return imageBlitTint;
-    } else if (strcmp(className, "OS") == 0) {
-        if (strcmp(signature, "name") == 0)
-            return osName;
-        if (strcmp(signature, "basilVersion") == 0)
-            return osBasilVersion;
-        if (strcmp(signature, "args") == 0)
-            return osArgs;
-        if (strcmp(signature, "f_exit(_)") == 0)
-            return osExit;
-    } else if (strcmp(className, "Window") == 0) {
-        if (strcmp(signature, "init(_,_,_)") == 0)
-            return windowInit;
-        if (strcmp(signature, "quit()") == 0)
-            return windowQuit;
-        if (strcmp(signature, "update(_)") == 0)
-            return windowUpdate;
-        if (strcmp(signature, "keyHeld(_)") == 0)
-            return windowKeyHeld;
-        if (strcmp(signature, "keyPressed(_)") == 0)
-            return windowKeyPressed;
-        if (strcmp(signature, "mouseHeld(_)") == 0)
-            return windowMouseHeld;
-        if (strcmp(signature, "mousePressed(_)") == 0)
-            return windowMousePressed;
-        if (strcmp(signature, "width") == 0)
-            return windowWidth;
-        if (strcmp(signature, "height") == 0)
-            return windowHeight;
-        if (strcmp(signature, "title") == 0)
-            return windowTitle;
-        if (strcmp(signature, "closed") == 0)
-            return windowClosed;
-        if (strcmp(signature, "mouseX") == 0)
-            return windowMouseX;
-        if (strcmp(signature, "mouseY") == 0)
-            return windowMouseY;
-        if (strcmp(signature, "integerScaling") == 0)
-            return windowGetIntegerScaling;
-        if (strcmp(signature, "integerScaling=(_)") == 0)
-            return windowSetIntegerScaling;
-        if (strcmp(signature, "time()") == 0)
-            return windowTime;
-        if (strcmp(signature, "targetFps=(_)") == 0)
-            return windowTargetFps;
-    }
-
-    return NULL;
+    const ForeignMethodBinding* binding = findMethodBinding(vm, module, className, isStatic, signature);
+    WrenForeignMethodFn fn = binding != NULL ? binding->fn : NULL;
+
+#ifdef BASIL_TRACE
+    // Profiler zones are already explicit, everything else gets one for free.
+    if (fn != NULL && traceActive && strcmp(className, "Profiler") != 0)
+        fn = traceForeignMethod(fn, className, isStatic, signature);
+#endif
+
+    return fn;
+}
+
+static WrenTypedForeignMethod wrenBindTypedForeignMethod(WrenVM* vm, const char* module, const char* className, bool isStatic, const char* signature)
+{
+    const ForeignMethodBinding* binding = findMethodBinding(vm, module, className, isStatic, signature);
+    if (binding == NULL || binding->typedFn == NULL)
+        return (WrenTypedForeignMethod) { NULL, NULL };
+
+    WrenTypedForeignMethod method = { binding->typedFn, binding->types };
+
+#ifdef BASIL_TRACE
+    if (method.fn != NULL && traceActive)
+        method.fn = traceTypedForeignMethod(method.fn, className, isStatic, signature);
+#endif
+
+    return method;
 }
 
 static WrenForeignClassMethods wrenBindForeignClass(WrenVM* vm, const char* module, const char* className)
 {
     WrenForeignClassMethods methods = { 0 };
 
-    if (strcmp(className, "Color") == 0) {
-        methods.allocate = colorAllocate;
-    } else if (strcmp(className, "Font") == 0) {
-        methods.allocate = fontAllocate;
-        methods.finalize = fontFinalize;
-    } else if (strcmp(className, "Image") == 0) {
-        methods.allocate = imageAllocate;
-        methods.finalize = imageFinalize;
+    const Plugin* plugin = findModulePlugin(vm, module);
+    const ForeignClassBinding* binding;
+
+    if (plugin != NULL) {
+        binding = findPluginClass(plugin, className);
+    } else {
+        uint32_t seed = foreignClassSeeds[hashBinding(2166136261u, className) % FOREIGN_CLASS_COUNT];
+        binding = &foreignClasses[hashBinding(2166136261u ^ seed, className) % FOREIGN_CLASS_COUNT];
+    }
+
+    if (binding != NULL && strcmp(binding->className, className) == 0) {
+        methods.allocate = binding->allocate;
+        methods.finalize = binding->finalize;
     }
 
     return methods;
@@ -172,30 +176,269 @@ static WrenForeignClassMethods wrenBindForeignClass(WrenVM* vm, const char* modu
 
 static void wrenWrite(WrenVM* vm, const char* text)
 {
-    printf("%s", text);
+    Context* context = (Context*)wrenGetUserData(vm);
+
+    if (context != NULL && context->output != NULL)
+        appendText(context->output, text);
+    else
+        printf("%s", text);
 }
 
 static void wrenError(WrenVM* vm, WrenErrorType type, const char* module, int line, const char* message)
 {
+    char text[1024];
+
     switch (type) {
     case WREN_ERROR_COMPILE:
-        printf("[%s line %d] %s\n", module, line, message);
+        snprintf(text, sizeof(text), "[%s line %d] %s\n", module, line, message);
         break;
     case WREN_ERROR_RUNTIME:
-        printf("%s\n", message);
+        snprintf(text, sizeof(text), "%s\n", message);
         break;
     case WREN_ERROR_STACK_TRACE:
-        printf("[%s line %d] in %s\n", module, line, message);
+        snprintf(text, sizeof(text), "[%s line %d] in %s\n", module, line, message);
         break;
     }
+
+    wrenWrite(vm, text);
+}
+
+static void printUsage()
+{
+    printf("Usage:\n");
+    printf("\tbasil [options] [file] [arguments...]\n");
+    printf("\tbasil [options] scene [scene options] [file] [arguments...]\n");
+    printf("\tbasil [options] batch [-j workers] [jobs]\n");
+    printf("\tbasil compile [file] [output]\n");
+    printf("\tbasil aot [output] [files...]\n");
+    printf("\tbasil bench [options]\n");
+    printf("\tbasil version\n");
+    printf("Options:\n");
+    printf("\t--trace file           write a Chrome trace (builds with BASIL_TRACE)\n");
+    printf("\t--trace-frames a[-b]   only trace frames a to b\n");
+    printf("\t--profile file         write sampled script stacks in collapsed format\n");
+    printf("\t--profile-interval ms  time between samples, 1 by default\n");
+    printf("\t--opstats file         write opcode, opcode pair and function instruction counts\n");
+    printf("\t--allocs file          write allocation counts by source line and class\n");
+    printf("\t--heap-initial size    bytes allocated before the first collection (BASIL_HEAP_INITIAL)\n");
+    printf("\t--heap-min size        smallest heap that triggers a collection (BASIL_HEAP_MIN)\n");
+    printf("\t--heap-growth percent  heap growth after a collection (BASIL_HEAP_GROWTH)\n");
+    printf("\t--heap-nursery size    bytes allocated between minor collections, 1M by default (BASIL_HEAP_NURSERY)\n");
+    printf("\t--allocator name       system (default) or pool, size classed slabs per thread\n");
+    printf("\t--gc mode              full (default), incremental or generational collections (BASIL_GC)\n");
+    printf("\t--gc-threads count     threads full collections mark on, 0 for one per core (BASIL_GC_THREADS)\n");
+    printf("\t--cache directory      keep compiled modules in directory to skip compiling them again (BASIL_CACHE)\n");
+    printf("Sizes take an optional K, M or G suffix.\n");
+}
+
+static size_t parseSize(const char* text)
+{
+    char* end;
+    double size = strtod(text, &end);
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        size *= 1024;
+        break;
+    case 'm':
+    case 'M':
+        size *= 1024 * 1024;
+        break;
+    case 'g':
+    case 'G':
+        size *= 1024 * 1024 * 1024;
+        break;
+    }
+
+    return size > 0 ? (size_t)size : 0;
+}
+
+static const char* compilePath = NULL;
+static bool compileWritten = false;
+
+static void saveCompiledModule(WrenVM* vm, const char* module, const char* source, const void* bytecode, size_t length)
+{
+    // The core module is compiled by every new VM.
+    if (module == NULL)
+        return;
+
+    compileWritten = writeBytecode(compilePath, bytecode, length);
+    if (!compileWritten)
+        printf("Error writing file: %s.\n", compilePath);
+}
+
+static int runCompile(WrenConfiguration* config, int argc, char** argv)
+{
+    if (argc != 4) {
+        printUsage();
+        return 1;
+    }
+
+    const char* sourcePath = argv[2];
+
+    char* source = readFile(sourcePath, NULL);
+    if (source == NULL)
+        return 1;
+
+    compilePath = argv[3];
+
+    config->loadBytecodeFn = NULL;
+    config->saveBytecodeFn = saveCompiledModule;
+
+    WrenVM* vm = wrenNewVM(config);
+    WrenInterpretResult result = wrenCompileModule(vm, sourcePath, source);
+
+    free(source);
+    wrenFreeVM(vm);
+
+    return result == WREN_RESULT_SUCCESS && compileWritten ? 0 : 1;
+}
+
+static FILE* aotFile = NULL;
+
+static void writeAot(WrenVM* vm, const char* text)
+{
+    fputs(text, aotFile);
+}
+
+// Writes C code for the modules in files, for a build with
+// -DWREN_NATIVE_MODULES='"output"' to run them natively.
+static int runAot(WrenConfiguration* config, int argc, char** argv)
+{
+    if (argc < 4) {
+        printUsage();
+        return 1;
+    }
+
+    const char* outputPath = argv[2];
+
+    aotFile = fopen(outputPath, "w");
+    if (aotFile == NULL) {
+        printf("Error writing file: %s.\n", outputPath);
+        return 1;
+    }
+
+    config->loadBytecodeFn = NULL;
+    config->saveBytecodeFn = NULL;
+
+    WrenVM* vm = wrenNewVM(config);
+    int exitCode = 0;
+
+    for (int i = 3; i < argc && exitCode == 0; i++) {
+        char* source = readFile(argv[i], NULL);
+        if (source == NULL || wrenWriteNativeCode(vm, argv[i], source, writeAot) != WREN_RESULT_SUCCESS)
+            exitCode = 1;
+
+        free(source);
+    }
+
+    wrenFreeVM(vm);
+
+    if (fclose(aotFile) != 0)
+        exitCode = 1;
+
+    return exitCode;
+}
+
+static int runScript(WrenConfiguration* config, int argc, char** argv)
+{
+    const char* sourcePath = argv[1];
+
+    char* source = readFile(sourcePath, NULL);
+    if (source == NULL)
+        return 1;
+
+    Context context;
+    initContext(&context, argc, argv);
+
+    config->userData = &context;
+
+    TRACE_BEGIN("VM init");
+    WrenVM* vm = wrenNewVM(config);
+    TRACE_END();
+
+    startProfile(vm);
+
+    TRACE_BEGIN("interpret");
+    wrenInterpret(vm, sourcePath, source);
+    TRACE_END();
+
+    stopProfile(vm);
+
+    free(source);
+    wrenFreeVM(vm);
+    freeThreadPool();
+
+    return context.exitCode;
 }
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2) {
-        printf("Usage:\n");
-        printf("\tbasil [file] [arguments...]\n");
-        printf("\tbasil version\n");
+    const char* tracePath = NULL;
+    int firstFrame = 0;
+    int lastFrame = -1;
+    const char* profilePath = NULL;
+    int profileInterval = 1;
+    const char* opcodePath = NULL;
+    const char* allocationPath = NULL;
+
+    const char* heapInitial = getenv("BASIL_HEAP_INITIAL");
+    const char* heapMin = getenv("BASIL_HEAP_MIN");
+    const char* heapGrowth = getenv("BASIL_HEAP_GROWTH");
+    const char* heapNursery = getenv("BASIL_HEAP_NURSERY");
+    const char* allocator = "system";
+    const char* gcMode = getenv("BASIL_GC");
+    const char* gcThreads = getenv("BASIL_GC_THREADS");
+    const char* cacheDirectory = getenv("BASIL_CACHE");
+
+    int first = 1;
+    while (first + 1 < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--trace") == 0) {
+            tracePath = argv[first + 1];
+        } else if (strcmp(argv[first], "--trace-frames") == 0) {
+            if (sscanf(argv[first + 1], "%d-%d", &firstFrame, &lastFrame) == 1)
+                lastFrame = firstFrame;
+        } else if (strcmp(argv[first], "--profile") == 0) {
+            profilePath = argv[first + 1];
+        } else if (strcmp(argv[first], "--profile-interval") == 0) {
+            profileInterval = atoi(argv[first + 1]);
+        } else if (strcmp(argv[first], "--opstats") == 0) {
+            opcodePath = argv[first + 1];
+        } else if (strcmp(argv[first], "--allocs") == 0) {
+            allocationPath = argv[first + 1];
+        } else if (strcmp(argv[first], "--heap-initial") == 0) {
+            heapInitial = argv[first + 1];
+        } else if (strcmp(argv[first], "--heap-min") == 0) {
+            heapMin = argv[first + 1];
+        } else if (strcmp(argv[first], "--heap-growth") == 0) {
+            heapGrowth = argv[first + 1];
+        } else if (strcmp(argv[first], "--heap-nursery") == 0) {
+            heapNursery = argv[first + 1];
+        } else if (strcmp(argv[first], "--allocator") == 0) {
+            allocator = argv[first + 1];
+        } else if (strcmp(argv[first], "--gc") == 0) {
+            gcMode = argv[first + 1];
+        } else if (strcmp(argv[first], "--gc-threads") == 0) {
+            gcThreads = argv[first + 1];
+        } else if (strcmp(argv[first], "--cache") == 0) {
+            cacheDirectory = argv[first + 1];
+        } else {
+            break;
+        }
+
+        first += 2;
+    }
+
+    // Drop the options so every mode finds its file or command in argv[1].
+    if (first > 1) {
+        argv[first - 1] = argv[0];
+        argv += first - 1;
+        argc -= first - 1;
+    }
+
+    if (argc < 2 || strncmp(argv[1], "--", 2) == 0) {
+        printUsage();
         return 1;
     }
 
@@ -204,31 +447,118 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    const char* sourcePath = argv[1];
+    if ((tracePath != NULL || profilePath != NULL || opcodePath != NULL || allocationPath != NULL) && (strcmp(argv[1], "batch") == 0 || strcmp(argv[1], "bench") == 0)) {
+        printf("Tracing and profiling are only available for scripts and scenes.\n");
+        return 1;
+    }
 
-    char* source = readFile(sourcePath);
-    if (source == NULL)
+    if (profilePath != NULL)
+        initProfile(profilePath, profileInterval);
+
+    if (opcodePath != NULL)
+        initOpcodeProfile(opcodePath);
+
+    if (allocationPath != NULL)
+        initAllocationProfile(allocationPath);
+
+    if (tracePath != NULL) {
+#ifdef BASIL_TRACE
+        initTrace(tracePath, firstFrame, lastFrame);
+#else
+        printf("Tracing is not available, build with -DBASIL_TRACE.\n");
+        return 1;
+#endif
+    }
+
+    if (strcmp(allocator, "pool") == 0) {
+        initPool();
+    } else if (strcmp(allocator, "system") != 0) {
+        printf("Unknown allocator: %s.\n", allocator);
+        return 1;
+    }
+
+    if (gcMode != NULL && strcmp(gcMode, "full") != 0 && strcmp(gcMode, "incremental") != 0
+        && strcmp(gcMode, "generational") != 0) {
+        printf("Unknown collector: %s.\n", gcMode);
         return 1;
+    }
+
+    TRACE_BEGIN("init api");
+    initApi();
+    TRACE_END();
 
-    basePath = getDirectoryPath(sourcePath);
+    initPlugins();
 
-    setArgs(argc, argv);
+    if (strcmp(argv[1], "bench") == 0)
+        return runBench(argc, argv);
 
     WrenConfiguration config;
     wrenInitConfiguration(&config);
 
     config.loadModuleFn = wrenLoadModule;
+    config.loadBytecodeFn = loadCachedModule;
     config.bindForeignMethodFn = wrenBindForeignMethod;
+    config.bindTypedForeignMethodFn = wrenBindTypedForeignMethod;
     config.bindForeignClassFn = wrenBindForeignClass;
     config.writeFn = wrenWrite;
     config.errorFn = wrenError;
+    config.gcFn = recordCollection;
 
-    WrenVM* vm = wrenNewVM(&config);
+    if (poolActive())
+        config.reallocateFn = poolReallocate;
 
-    wrenInterpret(vm, sourcePath, source);
+    config.incrementalGC = gcMode != NULL && strcmp(gcMode, "incremental") == 0;
 
-    free(source);
-    wrenFreeVM(vm);
+    // Anything missing or invalid keeps Wren's default.
+    if (heapInitial != NULL && parseSize(heapInitial) > 0)
+        config.initialHeapSize = parseSize(heapInitial);
+    if (heapMin != NULL && parseSize(heapMin) > 0)
+        config.minHeapSize = parseSize(heapMin);
+    if (heapGrowth != NULL && atoi(heapGrowth) > 0)
+        config.heapGrowthPercent = atoi(heapGrowth);
+
+    if (gcMode != NULL && strcmp(gcMode, "generational") == 0) {
+        config.nurserySize = 1024 * 1024;
+        if (heapNursery != NULL && parseSize(heapNursery) > 0)
+            config.nurserySize = parseSize(heapNursery);
+    }
+
+    if (gcThreads != NULL) {
+        config.parallelFn = runOnThreads;
+        config.markThreads = SDL_GetCPUCount();
+        if (atoi(gcThreads) > 0 && atoi(gcThreads) < config.markThreads)
+            config.markThreads = atoi(gcThreads);
+    }
+
+    if (profilePath != NULL)
+        config.sampleFn = profileSample;
+
+    if (cacheDirectory != NULL && cacheDirectory[0] != '\0' && initModuleCache(cacheDirectory))
+        config.saveBytecodeFn = saveCachedModule;
+
+    if (strcmp(argv[1], "compile") == 0)
+        return runCompile(&config, argc, argv);
+
+    if (strcmp(argv[1], "aot") == 0)
+        return runAot(&config, argc, argv);
+
+    if (strcmp(argv[1], "batch") == 0)
+        return runBatch(&config, argc, argv);
+
+    int exitCode;
+
+    if (strcmp(argv[1], "scene") == 0)
+        exitCode = runScene(&config, argc, argv);
+    else
+        exitCode = runScript(&config, argc, argv);
+
+    if (!closeProfile())
+        exitCode = 1;
+
+#ifdef BASIL_TRACE
+    if (!closeTrace())
+        exitCode = 1;
+#endif
 
-    return getExitCode();
+    return exitCode;
 }
@@ -0,0 +1,270 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "api.h"
+#include "pool.h"
+#include "util.h"
+
+#define MAX_JOB_ARGS 64
+
+typedef struct
+{
+    // Must be the first member, the VM's user data points at it.
+    Context context;
+
+    int index;
+    char* args[MAX_JOB_ARGS];
+    int argCount;
+
+    char** modules;
+    int moduleCount;
+
+    TextBuffer output;
+    WrenInterpretResult result;
+    double time;
+} Job;
+
+typedef struct
+{
+    Job* jobs;
+    int jobCount;
+    SDL_atomic_t nextJob;
+    SDL_mutex* lock;
+    WrenConfiguration config;
+    int failed;
+} Batch;
+
+static WrenLoadModuleFn loadModule = NULL;
+
+static WrenLoadModuleResult batchLoadModule(WrenVM* vm, const char* name)
+{
+    WrenLoadModuleResult result = loadModule(vm, name);
+
+    // Remember the user modules a job brings in so they can be unloaded once it
+    // is done, leaving only the core and basil modules compiled in the VM.
+    if (result.source != NULL && strcmp(name, "basil") != 0) {
+        Job* job = (Job*)wrenGetUserData(vm);
+
+        job->modules = (char**)realloc(job->modules, (job->moduleCount + 1) * sizeof(char*));
+        job->modules[job->moduleCount] = (char*)malloc(strlen(name) + 1);
+        strcpy(job->modules[job->moduleCount], name);
+        job->moduleCount++;
+    }
+
+    return result;
+}
+
+static void runJob(WrenVM* vm, Job* job)
+{
+    const char* path = job->context.args[1];
+
+    wrenSetUserData(vm, job);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+
+    char* source = readFile(path, &job->output);
+    if (source == NULL) {
+        job->result = WREN_RESULT_COMPILE_ERROR;
+    } else {
+        job->result = wrenInterpret(vm, path, source);
+        free(source);
+    }
+
+    job->time = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    wrenUnloadModule(vm, path);
+
+    for (int i = 0; i < job->moduleCount; i++) {
+        wrenUnloadModule(vm, job->modules[i]);
+        free(job->modules[i]);
+    }
+
+    free(job->modules);
+    job->modules = NULL;
+    job->moduleCount = 0;
+
+    wrenCollectGarbage(vm);
+    wrenSetUserData(vm, NULL);
+}
+
+static void reportJob(Batch* batch, Job* job)
+{
+    const char* status = "ok";
+    if (job->result == WREN_RESULT_COMPILE_ERROR)
+        status = "compile error";
+    else if (job->result == WREN_RESULT_RUNTIME_ERROR)
+        status = "runtime error";
+    else if (job->context.exitCode != 0)
+        status = "exit";
+
+    SDL_LockMutex(batch->lock);
+
+    if (job->output.length > 0)
+        printf("%s", job->output.data);
+
+    if (job->context.exitCode != 0)
+        printf("[job %d] %s: %s %d in %.3f ms\n", job->index, job->context.args[1], status, job->context.exitCode, job->time);
+    else
+        printf("[job %d] %s: %s in %.3f ms\n", job->index, job->context.args[1], status, job->time);
+
+    if (job->result != WREN_RESULT_SUCCESS || job->context.exitCode != 0)
+        batch->failed++;
+
+    fflush(stdout);
+    SDL_UnlockMutex(batch->lock);
+
+    freeText(&job->output);
+}
+
+static int runWorker(void* data)
+{
+    Batch* batch = (Batch*)data;
+
+    WrenVM* vm = wrenNewVM(&batch->config);
+
+    for (;;) {
+        int index = SDL_AtomicAdd(&batch->nextJob, 1);
+        if (index >= batch->jobCount)
+            break;
+
+        Job* job = &batch->jobs[index];
+        runJob(vm, job);
+        reportJob(batch, job);
+    }
+
+    wrenFreeVM(vm);
+    freeThreadPool();
+
+    return 0;
+}
+
+static int parseJobs(Batch* batch, char* list, char* programName)
+{
+    int capacity = 0;
+
+    for (char* line = strtok(list, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+        while (*line == ' ' || *line == '\t')
+            line++;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        if (batch->jobCount == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            batch->jobs = (Job*)realloc(batch->jobs, capacity * sizeof(Job));
+        }
+
+        Job* job = &batch->jobs[batch->jobCount];
+        memset(job, 0, sizeof(Job));
+
+        job->index = batch->jobCount;
+        job->args[0] = programName;
+
+        job->argCount = 1;
+        char* arg = line;
+
+        while (*arg != '\0') {
+            if (job->argCount == MAX_JOB_ARGS) {
+                printf("Too many arguments for job %d.\n", job->index);
+                return 0;
+            }
+
+            job->args[job->argCount++] = arg;
+
+            while (*arg != '\0' && *arg != ' ' && *arg != '\t')
+                arg++;
+
+            if (*arg != '\0')
+                *arg++ = '\0';
+
+            while (*arg == ' ' || *arg == '\t')
+                arg++;
+        }
+
+        batch->jobCount++;
+    }
+
+    for (int i = 0; i < batch->jobCount; i++) {
+        Job* job = &batch->jobs[i];
+
+        initContext(&job->context, job->argCount, job->args);
+        job->context.headless = true;
+        job->context.output = &job->output;
+    }
+
+    return 1;
+}
+
+int runBatch(WrenConfiguration* config, int argc, char** argv)
+{
+    int workerCount = SDL_GetCPUCount();
+    const char* listPath = NULL;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            workerCount = atoi(argv[++i]);
+        else
+            listPath = argv[i];
+    }
+
+    if (listPath == NULL || workerCount <= 0) {
+        printf("Usage:\n");
+        printf("\tbasil batch [-j workers] [jobs]\n");
+        return 1;
+    }
+
+    char* list = readFile(listPath, NULL);
+    if (list == NULL)
+        return 1;
+
+    Batch batch;
+    memset(&batch, 0, sizeof(Batch));
+
+    if (!parseJobs(&batch, list, argv[0])) {
+        free(batch.jobs);
+        free(list);
+        return 1;
+    }
+
+    if (workerCount > batch.jobCount)
+        workerCount = batch.jobCount;
+
+    loadModule = config->loadModuleFn;
+
+    batch.config = *config;
+    batch.config.loadModuleFn = batchLoadModule;
+    batch.config.userData = NULL;
+    batch.lock = SDL_CreateMutex();
+
+    uint64_t start = SDL_GetPerformanceCounter();
+
+    SDL_Thread** workers = (SDL_Thread**)malloc(workerCount * sizeof(SDL_Thread*));
+
+    for (int i = 0; i < workerCount; i++)
+        workers[i] = SDL_CreateThread(runWorker, "basil batch", &batch);
+
+    for (int i = 0; i < workerCount; i++)
+        SDL_WaitThread(workers[i], NULL);
+
+    double elapsed = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    double jobTime = 0;
+    for (int i = 0; i < batch.jobCount; i++)
+        jobTime += batch.jobs[i].time;
+
+    printf("%d jobs on %d workers in %.3f ms (%.3f ms of job time, %.1f jobs/s), %d failed\n",
+        batch.jobCount, workerCount, elapsed, jobTime,
+        elapsed > 0 ? batch.jobCount * 1000.0 / elapsed : 0.0, batch.failed);
+
+    SDL_DestroyMutex(batch.lock);
+    free(workers);
+    free(batch.jobs);
+    free(list);
+
+    return batch.failed > 0 ? 1 : 0;
+}
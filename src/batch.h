@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "lib/wren/wren.h"
+
+int runBatch(WrenConfiguration* config, int argc, char** argv);
+
+#endif
@@ -0,0 +1,615 @@
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "api.h"
+#include "util.h"
+
+#define TARGET_SIZE 512
+#define WARMUP_TIME 0.02
+#define SAMPLE_TIME 0.002
+#define DEFAULT_SAMPLES 20
+#define DEFAULT_THRESHOLD 5.0
+#define MAX_NAME_LENGTH 96
+#define PI 3.14159265358979323846
+
+typedef enum
+{
+    PRIMITIVE_SET,
+    PRIMITIVE_CLEAR,
+    PRIMITIVE_FILL,
+    PRIMITIVE_LINE,
+    PRIMITIVE_RECT,
+    PRIMITIVE_FILL_RECT,
+    PRIMITIVE_CIRCLE,
+    PRIMITIVE_FILL_CIRCLE,
+    PRIMITIVE_PRINT,
+    PRIMITIVE_BLIT,
+    PRIMITIVE_BLIT_TINT,
+    PRIMITIVE_COUNT
+} Primitive;
+
+typedef enum
+{
+    CLIP_INSIDE,
+    CLIP_EDGE,
+    CLIP_CLIPPED,
+    CLIP_OUTSIDE,
+    CLIP_COUNT
+} ClipMode;
+
+typedef enum
+{
+    ALPHA_OPAQUE,
+    ALPHA_TRANSLUCENT,
+    ALPHA_TRANSPARENT,
+    ALPHA_COUNT
+} AlphaClass;
+
+typedef enum
+{
+    TINT_WHITE,
+    TINT_COLOR,
+    TINT_ALPHA,
+    TINT_COUNT
+} TintMode;
+
+static const char* primitiveNames[PRIMITIVE_COUNT] = {
+    "set", "clear", "fill", "line", "rect", "fillRect",
+    "circle", "fillCircle", "print", "blit", "blitTint"
+};
+
+static const char* clipNames[CLIP_COUNT] = { "inside", "edge", "clipped", "outside" };
+static const char* alphaNames[ALPHA_COUNT] = { "opaque", "translucent", "transparent" };
+static const char* tintNames[TINT_COUNT] = { "white", "color", "alpha" };
+
+static const int sizes[] = { 8, 32, 128 };
+
+typedef struct
+{
+    char name[MAX_NAME_LENGTH];
+    Primitive primitive;
+    int size;
+    ClipMode clip;
+    AlphaClass alpha;
+    TintMode tint;
+    bool hasTint;
+    double pixels;
+
+    long calls;
+    double mean;
+    double ci;
+    double min;
+} Case;
+
+typedef struct
+{
+    char name[MAX_NAME_LENGTH];
+    double mean;
+    double ci;
+} Baseline;
+
+static Image target;
+static Image sources[sizeof(sizes) / sizeof(sizes[0])][ALPHA_COUNT];
+static char text[TARGET_SIZE / 8 + 1];
+
+static double now()
+{
+    return SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+}
+
+// Two-sided 95% critical values of Student's t distribution for 1 to 30
+// degrees of freedom. Larger samples use the normal approximation.
+static double studentT(int degrees)
+{
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+
+    if (degrees < 1)
+        return 0;
+
+    return degrees <= 30 ? table[degrees - 1] : 1.96;
+}
+
+static void initImage(Image* image, int width, int height)
+{
+    image->width = width;
+    image->height = height;
+    image->clipX = 0;
+    image->clipY = 0;
+    image->clipWidth = -1;
+    image->clipHeight = -1;
+    image->data = (Color*)calloc(width * height, sizeof(Color));
+}
+
+static void initSources()
+{
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+
+        for (int alpha = 0; alpha < ALPHA_COUNT; alpha++) {
+            Image* image = &sources[i][alpha];
+            initImage(image, size, size);
+
+            float radius = size / 2.0f;
+
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    Color* color = &image->data[y * size + x];
+                    color->r = (uint8_t)(x * 255 / size);
+                    color->g = (uint8_t)(y * 255 / size);
+                    color->b = 128;
+
+                    if (alpha == ALPHA_OPAQUE) {
+                        color->a = 255;
+                    } else if (alpha == ALPHA_TRANSPARENT) {
+                        color->a = 0;
+                    } else {
+                        // A sprite-like mask: opaque in the middle, fading out
+                        // towards the corners.
+                        float dx = x + 0.5f - radius;
+                        float dy = y + 0.5f - radius;
+                        float d = sqrtf(dx * dx + dy * dy) / radius;
+                        color->a = d >= 1 ? 0 : (uint8_t)(255 * (1 - d * d));
+                    }
+                }
+            }
+        }
+    }
+
+    initImage(&target, TARGET_SIZE, TARGET_SIZE);
+
+    memset(text, 'A', sizeof(text) - 1);
+}
+
+static void freeSources()
+{
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        for (int alpha = 0; alpha < ALPHA_COUNT; alpha++)
+            free(sources[i][alpha].data);
+
+    free(target.data);
+}
+
+static Image* findSource(int size, AlphaClass alpha)
+{
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        if (sizes[i] == size)
+            return &sources[i][alpha];
+
+    return NULL;
+}
+
+static Color caseColor(Case* c)
+{
+    Color color = { 80, 160, 240, 255 };
+
+    if (c->alpha == ALPHA_TRANSLUCENT)
+        color.a = 128;
+    else if (c->alpha == ALPHA_TRANSPARENT)
+        color.a = 0;
+
+    return color;
+}
+
+static Color caseTint(Case* c)
+{
+    Color tint = { 255, 255, 255, 255 };
+
+    if (c->tint == TINT_COLOR) {
+        tint.r = 255;
+        tint.g = 128;
+        tint.b = 64;
+    } else if (c->tint == TINT_ALPHA) {
+        tint.a = 128;
+    }
+
+    return tint;
+}
+
+static void runCase(Case* c, long calls)
+{
+    int s = c->size;
+    int x = (TARGET_SIZE - s) / 2;
+    int y = x;
+
+    target.clipX = 0;
+    target.clipY = 0;
+    target.clipWidth = -1;
+    target.clipHeight = -1;
+
+    switch (c->clip) {
+    case CLIP_INSIDE:
+        break;
+    case CLIP_EDGE:
+        x = y = TARGET_SIZE - s / 2;
+        break;
+    case CLIP_CLIPPED:
+        target.clipX = target.clipY = TARGET_SIZE / 4;
+        target.clipWidth = target.clipHeight = TARGET_SIZE / 2;
+        x = y = TARGET_SIZE / 4 - s / 2;
+        break;
+    case CLIP_OUTSIDE:
+        x = y = TARGET_SIZE + s;
+        break;
+    default:
+        break;
+    }
+
+    Color color = caseColor(c);
+    Color tint = caseTint(c);
+    Image* src = findSource(s, c->alpha);
+
+    int chars = s / 8 > 0 ? s / 8 : 1;
+    text[chars] = '\0';
+
+    switch (c->primitive) {
+    case PRIMITIVE_SET:
+        for (long i = 0; i < calls; i++)
+            rasterSet(&target, x + s / 2, y + s / 2, color);
+        break;
+    case PRIMITIVE_CLEAR:
+        for (long i = 0; i < calls; i++)
+            rasterClear(&target, color);
+        break;
+    case PRIMITIVE_FILL:
+        for (long i = 0; i < calls; i++)
+            rasterFill(&target, x, y, s, s, color);
+        break;
+    case PRIMITIVE_LINE:
+        for (long i = 0; i < calls; i++)
+            rasterLine(&target, x, y, x + s - 1, y + s / 2, color);
+        break;
+    case PRIMITIVE_RECT:
+        for (long i = 0; i < calls; i++)
+            rasterRect(&target, x, y, s, s, color);
+        break;
+    case PRIMITIVE_FILL_RECT:
+        for (long i = 0; i < calls; i++)
+            rasterFillRect(&target, x, y, s, s, color);
+        break;
+    case PRIMITIVE_CIRCLE:
+        for (long i = 0; i < calls; i++)
+            rasterCircle(&target, x + s / 2, y + s / 2, s / 2, color);
+        break;
+    case PRIMITIVE_FILL_CIRCLE:
+        for (long i = 0; i < calls; i++)
+            rasterFillCircle(&target, x + s / 2, y + s / 2, s / 2, color);
+        break;
+    case PRIMITIVE_PRINT:
+        for (long i = 0; i < calls; i++)
+            rasterPrint(&target, text, x, y, color);
+        break;
+    case PRIMITIVE_BLIT:
+        for (long i = 0; i < calls; i++)
+            rasterBlit(&target, src, x, y, 0, 0, s, s);
+        break;
+    case PRIMITIVE_BLIT_TINT:
+        for (long i = 0; i < calls; i++)
+            rasterBlitTint(&target, src, x, y, 0, 0, s, s, tint);
+        break;
+    default:
+        break;
+    }
+
+    text[chars] = 'A';
+}
+
+static double nominalPixels(Primitive primitive, int s)
+{
+    double r = s / 2.0;
+    int chars = s / 8 > 0 ? s / 8 : 1;
+
+    switch (primitive) {
+    case PRIMITIVE_SET:
+        return 1;
+    case PRIMITIVE_CLEAR:
+        return TARGET_SIZE * TARGET_SIZE;
+    case PRIMITIVE_LINE:
+        return s;
+    case PRIMITIVE_RECT:
+        return 4.0 * s;
+    case PRIMITIVE_CIRCLE:
+        return 2 * PI * r;
+    case PRIMITIVE_FILL_CIRCLE:
+        return PI * r * r;
+    case PRIMITIVE_PRINT:
+        return 64.0 * chars;
+    default:
+        return (double)s * s;
+    }
+}
+
+static int addCase(Case** cases, int count, Primitive primitive, int size, ClipMode clip, AlphaClass alpha, int tint)
+{
+    *cases = (Case*)realloc(*cases, (count + 1) * sizeof(Case));
+
+    Case* c = &(*cases)[count];
+    memset(c, 0, sizeof(Case));
+
+    c->primitive = primitive;
+    c->size = size;
+    c->clip = clip;
+    c->alpha = alpha;
+    c->hasTint = tint >= 0;
+    c->tint = tint >= 0 ? (TintMode)tint : TINT_WHITE;
+    c->pixels = nominalPixels(primitive, size);
+
+    if (c->hasTint)
+        snprintf(c->name, MAX_NAME_LENGTH, "%s/%d/%s/%s/%s", primitiveNames[primitive], size, clipNames[clip], alphaNames[alpha], tintNames[c->tint]);
+    else
+        snprintf(c->name, MAX_NAME_LENGTH, "%s/%d/%s/%s", primitiveNames[primitive], size, clipNames[clip], alphaNames[alpha]);
+
+    return count + 1;
+}
+
+// Builds the matrix of cases. Dimensions a primitive ignores are collapsed so
+// every case measures something different: clear and set have no size, clear
+// and fill ignore alpha and blit copies pixels verbatim.
+static int buildCases(Case** cases)
+{
+    int count = 0;
+
+    for (int p = 0; p < PRIMITIVE_COUNT; p++) {
+        if (p == PRIMITIVE_CLEAR) {
+            count = addCase(cases, count, PRIMITIVE_CLEAR, TARGET_SIZE, CLIP_INSIDE, ALPHA_OPAQUE, -1);
+            continue;
+        }
+
+        for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            if (p == PRIMITIVE_SET && i > 0)
+                break;
+
+            int size = p == PRIMITIVE_SET ? 1 : sizes[i];
+
+            for (int clip = 0; clip < CLIP_COUNT; clip++) {
+                for (int alpha = 0; alpha < ALPHA_COUNT; alpha++) {
+                    if ((p == PRIMITIVE_FILL || p == PRIMITIVE_BLIT) && alpha != ALPHA_OPAQUE)
+                        continue;
+
+                    if (p == PRIMITIVE_BLIT_TINT) {
+                        for (int tint = 0; tint < TINT_COUNT; tint++)
+                            count = addCase(cases, count, (Primitive)p, size, (ClipMode)clip, (AlphaClass)alpha, tint);
+                    } else {
+                        count = addCase(cases, count, (Primitive)p, size, (ClipMode)clip, (AlphaClass)alpha, -1);
+                    }
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+static void measureCase(Case* c, int samples)
+{
+    // Warm up caches and branch predictors, and find out how many calls fill
+    // one sample.
+    long calls = 1;
+    long warmupCalls = 0;
+    double start = now();
+    double elapsed = 0;
+
+    while (elapsed < WARMUP_TIME) {
+        runCase(c, calls);
+        warmupCalls += calls;
+        calls *= 2;
+        elapsed = now() - start;
+    }
+
+    calls = (long)(SAMPLE_TIME / (elapsed / warmupCalls));
+    if (calls < 1)
+        calls = 1;
+
+    double* times = (double*)malloc(samples * sizeof(double));
+    double sum = 0;
+
+    c->min = INFINITY;
+
+    for (int i = 0; i < samples; i++) {
+        double sampleStart = now();
+        runCase(c, calls);
+        times[i] = (now() - sampleStart) * 1e9 / calls;
+
+        sum += times[i];
+        if (times[i] < c->min)
+            c->min = times[i];
+    }
+
+    c->calls = calls;
+    c->mean = sum / samples;
+
+    double variance = 0;
+    for (int i = 0; i < samples; i++)
+        variance += (times[i] - c->mean) * (times[i] - c->mean);
+
+    variance = samples > 1 ? variance / (samples - 1) : 0;
+    c->ci = studentT(samples - 1) * sqrt(variance / samples);
+
+    free(times);
+}
+
+static bool writeJson(const char* path, Case* cases, int count, int samples)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Error opening file: %s.\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"basil\": \"%s\",\n", BASIL_VERSION);
+    fprintf(file, "  \"samples\": %d,\n", samples);
+    fprintf(file, "  \"results\": [\n");
+
+    for (int i = 0; i < count; i++) {
+        Case* c = &cases[i];
+
+        // One result per line keeps the file easy to diff and to read back.
+        fprintf(file, "    {\"name\": \"%s\", \"primitive\": \"%s\", \"size\": %d, \"clip\": \"%s\", \"alpha\": \"%s\", ",
+            c->name, primitiveNames[c->primitive], c->size, clipNames[c->clip], alphaNames[c->alpha]);
+
+        if (c->hasTint)
+            fprintf(file, "\"tint\": \"%s\", ", tintNames[c->tint]);
+
+        fprintf(file, "\"pixels\": %.0f, \"calls\": %ld, \"nsPerCall\": %.3f, \"ci95\": %.3f, \"minNsPerCall\": %.3f, \"mpixelsPerSecond\": %.3f}%s\n",
+            c->pixels, c->calls, c->mean, c->ci, c->min, c->pixels * 1000.0 / c->mean, i + 1 < count ? "," : "");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    bool written = !ferror(file);
+    if (fclose(file) != 0 || !written) {
+        printf("Error writing file: %s.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static double readNumber(const char* line, const char* key)
+{
+    const char* found = strstr(line, key);
+    return found != NULL ? strtod(found + strlen(key), NULL) : -1;
+}
+
+static int readBaseline(const char* path, Baseline** baseline)
+{
+    char* json = readFile(path, NULL);
+    if (json == NULL)
+        return -1;
+
+    int count = 0;
+
+    for (char* line = strtok(json, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        const char* name = strstr(line, "\"name\": \"");
+        if (name == NULL)
+            continue;
+
+        name += strlen("\"name\": \"");
+        const char* end = strchr(name, '"');
+        if (end == NULL || end - name >= MAX_NAME_LENGTH)
+            continue;
+
+        *baseline = (Baseline*)realloc(*baseline, (count + 1) * sizeof(Baseline));
+
+        Baseline* b = &(*baseline)[count++];
+        memcpy(b->name, name, end - name);
+        b->name[end - name] = '\0';
+        b->mean = readNumber(line, "\"nsPerCall\": ");
+        b->ci = readNumber(line, "\"ci95\": ");
+    }
+
+    free(json);
+
+    return count;
+}
+
+static Baseline* findBaseline(Baseline* baseline, int count, const char* name)
+{
+    for (int i = 0; i < count; i++)
+        if (strcmp(baseline[i].name, name) == 0)
+            return &baseline[i];
+
+    return NULL;
+}
+
+int runBench(int argc, char** argv)
+{
+    const char* filter = NULL;
+    const char* jsonPath = NULL;
+    const char* comparePath = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int samples = DEFAULT_SAMPLES;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            comparePath = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else {
+            printf("Usage:\n");
+            printf("\tbasil bench [--filter text] [--samples n] [--json file] [--compare file] [--threshold percent]\n");
+            return 1;
+        }
+    }
+
+    if (samples < 2)
+        samples = 2;
+
+    Baseline* baseline = NULL;
+    int baselineCount = 0;
+
+    if (comparePath != NULL) {
+        baselineCount = readBaseline(comparePath, &baseline);
+        if (baselineCount < 0)
+            return 1;
+    }
+
+    initSources();
+
+    Case* cases = NULL;
+    int count = buildCases(&cases);
+    int measured = 0;
+    int regressions = 0;
+
+    for (int i = 0; i < count; i++) {
+        Case* c = &cases[i];
+
+        if (filter != NULL && strstr(c->name, filter) == NULL)
+            continue;
+
+        measureCase(c, samples);
+        cases[measured++] = *c;
+
+        printf("%-40s %12.1f ns/call +- %5.1f%% %10.1f Mpx/s",
+            c->name, c->mean, c->mean > 0 ? c->ci * 100 / c->mean : 0.0, c->pixels * 1000.0 / c->mean);
+
+        Baseline* b = findBaseline(baseline, baselineCount, c->name);
+        if (b != NULL && b->mean > 0) {
+            double change = (c->mean - b->mean) * 100 / b->mean;
+
+            // Only flag changes that are both over the threshold and larger than
+            // the combined noise of the two runs.
+            bool significant = fabs(c->mean - b->mean) > c->ci + b->ci;
+
+            printf(" %+7.1f%%", change);
+
+            if (significant && change > threshold) {
+                printf(" REGRESSION");
+                regressions++;
+            } else if (significant && change < -threshold) {
+                printf(" improved");
+            }
+        }
+
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (comparePath != NULL)
+        printf("%d regressions over %.1f%% against %s\n", regressions, threshold, comparePath);
+
+    bool written = jsonPath == NULL || writeJson(jsonPath, cases, measured, samples);
+
+    free(cases);
+    free(baseline);
+    freeSources();
+
+    return regressions > 0 || !written ? 1 : 0;
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int runBench(int argc, char** argv);
+
+#endif
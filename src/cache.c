@@ -0,0 +1,108 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#define makeDirectory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define makeDirectory(path) mkdir(path, 0777)
+#endif
+
+#include "api.wrenc.inc"
+#include "util.h"
+
+static const char* cacheDirectory = NULL;
+
+bool initModuleCache(const char* directory)
+{
+    if (makeDirectory(directory) != 0 && errno != EEXIST) {
+        printf("Could not create cache directory %s, modules will not be cached.\n", directory);
+        return false;
+    }
+
+    cacheDirectory = directory;
+    return true;
+}
+
+// Wren checks that the bytecode matches the source, the hash only has to
+// tell modules apart.
+static void getCachePath(const char* source, char path[MAX_PATH_LENGTH])
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    snprintf(path, MAX_PATH_LENGTH, "%s/%016llx.wrenc", cacheDirectory, (unsigned long long)hash);
+}
+
+static void onComplete(WrenVM* vm, const char* module, WrenLoadBytecodeResult result)
+{
+    free((void*)result.bytecode);
+}
+
+WrenLoadBytecodeResult loadCachedModule(WrenVM* vm, const char* module, const char* source)
+{
+    WrenLoadBytecodeResult result = { 0 };
+
+    // The embedded module is regenerated with api.wren, so it's only stale
+    // while working on it.
+    if (module != NULL && strcmp(module, "basil") == 0) {
+        result.bytecode = apiModuleBytecode;
+        result.length = sizeof(apiModuleBytecode);
+        return result;
+    }
+
+    if (cacheDirectory == NULL)
+        return result;
+
+    char path[MAX_PATH_LENGTH];
+    getCachePath(source, path);
+
+    // Modules that aren't cached yet are the common case, not an error.
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return result;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+
+    uint8_t* bytecode = length > 0 ? (uint8_t*)malloc(length) : NULL;
+    if (bytecode != NULL && fread(bytecode, 1, length, file) == (size_t)length) {
+        result.bytecode = bytecode;
+        result.length = length;
+        result.onComplete = onComplete;
+    } else {
+        free(bytecode);
+    }
+
+    fclose(file);
+    return result;
+}
+
+void saveCachedModule(WrenVM* vm, const char* module, const char* source, const void* bytecode, size_t length)
+{
+    char path[MAX_PATH_LENGTH];
+    getCachePath(source, path);
+
+    // A file that can't be written only costs a compile next time.
+    writeBytecode(path, bytecode, length);
+}
+
+bool writeBytecode(const char* path, const void* bytecode, size_t length)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+
+    bool written = fwrite(bytecode, 1, length, file) == length;
+    return fclose(file) == 0 && written;
+}
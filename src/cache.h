@@ -0,0 +1,19 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/wren/wren.h"
+
+// Compiled modules are kept in [directory], named after a hash of their
+// source, which is created if needed. Without a directory only the embedded
+// basil module is used. Returns false if the directory can't be created.
+bool initModuleCache(const char* directory);
+
+WrenLoadBytecodeResult loadCachedModule(WrenVM* vm, const char* module, const char* source);
+void saveCachedModule(WrenVM* vm, const char* module, const char* source, const void* bytecode, size_t length);
+
+bool writeBytecode(const char* path, const void* bytecode, size_t length);
+
+#endif
@@ -27,6 +27,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // The Wren semantic version number components.
 #define WREN_VERSION_MAJOR 0
@@ -83,6 +84,42 @@ typedef void* (*WrenReallocateFn)(void* memory, size_t newSize, void* userData);
 // A function callable from Wren code, but implemented in C.
 typedef void (*WrenForeignMethodFn)(WrenVM* vm);
 
+// The receiver or an argument of a typed foreign method, unpacked according to
+// the type it was declared with.
+typedef union
+{
+  double num;
+  int integer;
+  bool boolean;
+  const char* string;
+  void* foreign;
+} WrenForeignArg;
+
+// A foreign method whose receiver and arguments Wren checks against its
+// declared types and unpacks into [args] before calling it, [args][0] being
+// the receiver. The slots are set up as for a [WrenForeignMethodFn], for
+// returning a result and reading arguments declared as any value.
+typedef void (*WrenTypedForeignMethodFn)(WrenVM* vm,
+                                         const WrenForeignArg* args);
+
+// A typed foreign method and the types of its receiver and arguments, one
+// letter each, optionally separated by spaces:
+//
+// - `N` a number, unpacked as [num].
+// - `I` a number, truncated to [integer].
+// - `B` a boolean, unpacked as [boolean].
+// - `S` a string, unpacked as [string].
+// - `F` a foreign object, its data unpacked as [foreign].
+// - `_` any value, left in its slot.
+//
+// A call with an argument of the wrong type is a runtime error, and never
+// reaches [fn].
+typedef struct
+{
+  WrenTypedForeignMethodFn fn;
+  const char* types;
+} WrenTypedForeignMethod;
+
 // A finalizer function for freeing resources owned by an instance of a foreign
 // class. Unlike most foreign methods, finalizers do not have access to the VM
 // and should not interact with it since it's in the middle of a garbage
@@ -116,12 +153,48 @@ typedef struct WrenLoadModuleResult
 // Loads and returns the source code for the module [name].
 typedef WrenLoadModuleResult (*WrenLoadModuleFn)(WrenVM* vm, const char* name);
 
+// Forward declare
+struct WrenLoadBytecodeResult;
+
+// Called once Wren is done with the result of a loadBytecodeFn call, so that
+// you can free memory if appropriate.
+typedef void (*WrenLoadBytecodeCompleteFn)(WrenVM* vm, const char* module,
+    struct WrenLoadBytecodeResult result);
+
+// The result of a loadBytecodeFn call.
+// [bytecode] is the module as it was handed to saveBytecodeFn, [length] bytes
+// long, or NULL to compile the source.
+// [onComplete] an optional callback that will be called once Wren is done with the result.
+typedef struct WrenLoadBytecodeResult
+{
+  const void* bytecode;
+  size_t length;
+  WrenLoadBytecodeCompleteFn onComplete;
+  void* userData;
+} WrenLoadBytecodeResult;
+
+// Returns the compiled form of [module], whose source is [source]. [module] is
+// `NULL` for the core module.
+typedef WrenLoadBytecodeResult (*WrenLoadBytecodeFn)(WrenVM* vm,
+    const char* module, const char* source);
+
+// Receives [module], just compiled from [source], serialized to [length] bytes
+// of [bytecode]. The bytes are only valid during the call.
+typedef void (*WrenSaveBytecodeFn)(WrenVM* vm, const char* module,
+    const char* source, const void* bytecode, size_t length);
+
 // Returns a pointer to a foreign method on [className] in [module] with
 // [signature].
 typedef WrenForeignMethodFn (*WrenBindForeignMethodFn)(WrenVM* vm,
     const char* module, const char* className, bool isStatic,
     const char* signature);
 
+// Returns a typed foreign method on [className] in [module] with [signature],
+// or one whose [fn] is `NULL` to bind it with [WrenBindForeignMethodFn].
+typedef WrenTypedForeignMethod (*WrenBindTypedForeignMethodFn)(WrenVM* vm,
+    const char* module, const char* className, bool isStatic,
+    const char* signature);
+
 // Displays a string of text to the user.
 typedef void (*WrenWriteFn)(WrenVM* vm, const char* text);
 
@@ -153,6 +226,87 @@ typedef void (*WrenErrorFn)(
     WrenVM* vm, WrenErrorType type, const char* module, int line,
     const char* message);
 
+// Returns a seed for a `Random` instance created without an explicit seed.
+typedef uint32_t (*WrenRandomSeedFn)(WrenVM* vm);
+
+// Called at a safe point after [wrenRequestSample] was called. When the sample
+// was taken right after a foreign method returned, [className] and [signature]
+// name that method, otherwise they are `NULL`.
+typedef void (*WrenSampleFn)(WrenVM* vm, const char* className,
+                             const char* signature);
+
+// A frame of the running fiber's call stack, as seen by [wrenGetStackFrames].
+typedef struct
+{
+  const char* module;
+  const char* function;
+  int line;
+} WrenStackFrame;
+
+// Receives a heap snapshot written by [wrenWriteHeapSnapshot], a piece of
+// [length] bytes at a time.
+typedef void (*WrenSnapshotFn)(void* userData, const char* text, size_t length);
+
+// Returns the bytes owned by the foreign object [data], including its own data
+// and any memory it points to. Its class is identified by the [allocate]
+// function it was bound with, since class names aren't unique across modules.
+typedef size_t (*WrenForeignSizeFn)(WrenVM* vm, WrenForeignMethodFn allocate,
+                                    void* data);
+
+// Called right before a garbage collection or an incremental step of one
+// starts, with [finished] set to false, and again when it's done, with
+// [finished] set to true.
+typedef void (*WrenGCFn)(WrenVM* vm, bool finished);
+
+// A function run on several threads at once by a [WrenParallelFn], each
+// passing a different [index] starting from 0.
+typedef void (*WrenWorkerFn)(WrenVM* vm, int index, void* data);
+
+// Runs [worker] on [count] threads at once, the calling one included, and
+// returns once all of them have finished.
+typedef void (*WrenParallelFn)(WrenVM* vm, int count, WrenWorkerFn worker,
+                               void* data);
+
+// The state of the garbage collector, as reported by [wrenGetGCStats].
+typedef struct
+{
+  // The number of collections so far.
+  unsigned long collections;
+
+  // The bytes known to be in use, live after the last collection plus
+  // whatever was allocated since.
+  size_t bytesAllocated;
+
+  // The value of [bytesAllocated] that triggers the next collection.
+  size_t nextGC;
+
+  // The bytes freed by the last collection and by all of them.
+  size_t lastFreed;
+  size_t totalFreed;
+
+  // The part of [bytesAllocated] owned by foreign objects outside the VM, as
+  // recorded by [wrenSetSlotExternalSize].
+  size_t externalBytes;
+
+  // The part of [bytesAllocated] taken by the method tables of classes.
+  size_t methodTableBytes;
+
+  // The class ids handed out so far. Ids of freed classes are reused, so this
+  // follows the most classes alive at once.
+  size_t classIds;
+
+  // Whether collections triggered by allocation run incrementally.
+  bool incremental;
+
+  // The number of minor collections, and the bytes allocated between them, or
+  // zero if collection isn't generational.
+  unsigned long minorCollections;
+  size_t nurserySize;
+
+  // The number of threads full collections mark on.
+  int markThreads;
+} WrenGCStats;
+
 typedef struct
 {
   // The callback invoked when the foreign object is created.
@@ -223,6 +377,23 @@ typedef struct
   // should return NULL and Wren will report that as a runtime error.
   WrenLoadModuleFn loadModuleFn;
 
+  // The callback Wren uses to skip compiling a module it has compiled before.
+  //
+  // Before the source of a module is compiled, whether it comes from
+  // [loadModuleFn] or [wrenInterpret], this is called with the module's name
+  // and source. If it returns bytecode that [saveBytecodeFn] was given for the
+  // same source by the same version of Wren, the module is loaded from it.
+  // Anything else is ignored and the source is compiled as usual.
+  //
+  // If this is `NULL`, modules are always compiled from source.
+  WrenLoadBytecodeFn loadBytecodeFn;
+
+  // The callback that receives every module compiled from source, serialized
+  // so that [loadBytecodeFn] can hand it back to a later VM.
+  //
+  // If this is `NULL`, compiled modules aren't serialized.
+  WrenSaveBytecodeFn saveBytecodeFn;
+
   // The callback Wren uses to find a foreign method and bind it to a class.
   //
   // When a foreign method is declared in a class, this will be called with the
@@ -234,6 +405,13 @@ typedef struct
   // Wren will report it as runtime error.
   WrenBindForeignMethodFn bindForeignMethodFn;
 
+  // The callback Wren tries before [bindForeignMethodFn], for foreign methods
+  // that take their arguments already checked and unpacked. That saves a slot
+  // API call per argument, for methods called often enough for it to matter.
+  //
+  // If this is `NULL`, every foreign method is bound by [bindForeignMethodFn].
+  WrenBindTypedForeignMethodFn bindTypedForeignMethodFn;
+
   // The callback Wren uses to find a foreign class and get its foreign methods.
   //
   // When a foreign class is declared, this will be called with the class's
@@ -255,6 +433,56 @@ typedef struct
   // errors.
   WrenErrorFn errorFn;
 
+  // The callback the optional random module uses to seed generators created
+  // with `Random.new()`.
+  //
+  // If this is `NULL`, generators are seeded from the current time. Hosts that
+  // need reproducible runs can return a fixed sequence of seeds instead.
+  WrenRandomSeedFn randomSeedFn;
+
+  // The callback used to record a profiler sample.
+  //
+  // Samples are only taken when requested through [wrenRequestSample], if
+  // this is `NULL` requests are ignored.
+  WrenSampleFn sampleFn;
+
+  // The callback invoked around every garbage collection.
+  //
+  // If this is `NULL`, collections aren't reported.
+  WrenGCFn gcFn;
+
+  // Whether collections triggered by allocation run incrementally.
+  //
+  // If true, a collection marks and sweeps a bounded part of the heap every
+  // time another slice of memory is allocated, instead of pausing the program
+  // for the whole heap at once. Steps can also be taken explicitly with
+  // [wrenCollectGarbageStep] in either mode.
+  //
+  // Defaults to false.
+  bool incrementalGC;
+
+  // The number of bytes allocated between minor collections.
+  //
+  // If non-zero, collection is generational. Objects that survive a collection
+  // are old and only looked at again by a full one, while a minor collection
+  // runs every time this many bytes have been allocated and only visits the
+  // objects allocated since the last one and the old objects changed to point
+  // at them. Ignored if [incrementalGC] is set.
+  //
+  // Defaults to 0.
+  size_t nurserySize;
+
+  // The callback used to run work on several threads.
+  //
+  // If this is `NULL`, the VM only ever uses the thread it's called on.
+  WrenParallelFn parallelFn;
+
+  // The number of threads full collections mark the heap on, through
+  // [parallelFn]. The result is the same as marking on one.
+  //
+  // Defaults to 1.
+  int markThreads;
+
   // The number of bytes Wren will allocate before triggering the first garbage
   // collection.
   //
@@ -342,11 +570,98 @@ WREN_API void wrenFreeVM(WrenVM* vm);
 // Immediately run the garbage collector to free unused memory.
 WREN_API void wrenCollectGarbage(WrenVM* vm);
 
+// Does up to [work] units of incremental garbage collection, a unit being one
+// object marked or swept. A new collection is only started once the heap is
+// at least halfway to the next automatic one.
+//
+// If collection is generational, runs a minor collection instead once the
+// nursery is at least half full.
+//
+// Returns whether a collection is still in progress.
+WREN_API bool wrenCollectGarbageStep(WrenVM* vm, int work);
+
+// Stores the current state of the garbage collector in [stats].
+WREN_API void wrenGetGCStats(WrenVM* vm, WrenGCStats* stats);
+
+// Collects garbage, then writes every object on the heap with its size and
+// the objects it references, followed by the roots, using [write].
+//
+// The snapshot is text, one record per line with tab separated fields:
+//
+//     o <address> <type> <class> <size> <references> <label>
+//     m <address> <methods> <bytes>
+//     r <kind> <address>
+//
+// where <references> is a comma separated list of addresses and <label> is a
+// name or the start of a string's contents, if the object has one. The sizes
+// of foreign objects come from [foreignSize] if it isn't `NULL`. Every class
+// has an "m" record with the number of methods it has and the bytes its method
+// table takes, which are also part of the class's size.
+WREN_API void wrenWriteHeapSnapshot(WrenVM* vm, WrenSnapshotFn write,
+                                    void* userData,
+                                    WrenForeignSizeFn foreignSize);
+
+// Asks [vm] to call its sampleFn at the next call, return or loop back edge.
+//
+// Unlike the rest of the API this may be called from any thread, typically
+// from a profiler's timer.
+WREN_API void wrenRequestSample(WrenVM* vm);
+
+// Stores up to [maxFrames] frames of the running fiber's call stack in
+// [frames], innermost first, and returns how many were stored. Frames of the
+// core module are skipped. The strings are owned by the VM and only valid
+// until it resumes running.
+WREN_API int wrenGetStackFrames(WrenVM* vm, WrenStackFrame* frames,
+                                int maxFrames);
+
+// Turns counting of executed instructions on or off. While on, the
+// interpreter counts every opcode, every pair of consecutive opcodes and the
+// instructions executed by each function. Counts are kept when counting is
+// turned off again.
+WREN_API void wrenSetOpcodeCounting(WrenVM* vm, bool enabled);
+
+// Writes a report of the instruction counts gathered so far using [write], or
+// the VM's writeFn if [write] is `NULL`.
+WREN_API void wrenDumpOpcodeStats(WrenVM* vm, WrenWriteFn write);
+
+// Turns allocation tracking on or off. While on, every allocation is counted
+// against the line of Wren code that caused it, skipping the core module, and
+// every new object against its class. Counts are kept when tracking is turned
+// off again.
+WREN_API void wrenSetAllocationTracking(WrenVM* vm, bool enabled);
+
+// Writes the [maxSites] allocation sites that allocated the most bytes, and
+// the allocations by class, using [write] or the VM's writeFn if [write] is
+// `NULL`.
+WREN_API void wrenDumpAllocationStats(WrenVM* vm, WrenWriteFn write,
+                                      int maxSites);
+
 // Runs [source], a string of Wren source code in a new fiber in [vm] in the
 // context of resolved [module].
 WREN_API WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
                                   const char* source);
 
+// Compiles [source] as the module [module] without running it, and hands the
+// result to the VM's saveBytecodeFn.
+//
+// Returns [WREN_RESULT_COMPILE_ERROR] if the source has errors.
+WREN_API WrenInterpretResult wrenCompileModule(WrenVM* vm, const char* module,
+                                               const char* source);
+
+// Compiles [source] as the module [module] without running it, and writes C
+// code that runs its functions natively using [write], or the VM's writeFn if
+// [write] is `NULL`. Code written for several modules can go in one file.
+//
+// Building Wren with `WREN_NATIVE_MODULES` defined as the name of that file
+// makes those modules run the native code when their source is unchanged.
+// Anything the code doesn't handle, such as most calls, falls back to the
+// interpreter.
+//
+// Returns [WREN_RESULT_COMPILE_ERROR] if the source has errors.
+WREN_API WrenInterpretResult wrenWriteNativeCode(WrenVM* vm, const char* module,
+                                                 const char* source,
+                                                 WrenWriteFn write);
+
 // Creates a handle that can be used to invoke a method with [signature] on
 // using a receiver and arguments that are set up on the stack.
 //
@@ -453,6 +768,14 @@ WREN_API double wrenGetSlotDouble(WrenVM* vm, int slot);
 // foreign class.
 WREN_API void* wrenGetSlotForeign(WrenVM* vm, int slot);
 
+// Records that the foreign object in [slot] owns [size] bytes of memory
+// allocated outside of the VM, replacing whatever was recorded before.
+//
+// The bytes count towards the heap size like the VM's own allocations, so
+// objects holding on to large buffers cause collections sooner. Set it back
+// to zero when the object releases its memory early.
+WREN_API void wrenSetSlotExternalSize(WrenVM* vm, int slot, size_t size);
+
 // Reads a string from [slot].
 //
 // The memory for the returned string is owned by Wren. You can inspect it
@@ -564,6 +887,11 @@ WREN_API bool wrenHasVariable(WrenVM* vm, const char* module, const char* name);
 // Returns true if [module] has been imported/resolved before, false if not.
 WREN_API bool wrenHasModule(WrenVM* vm, const char* module);
 
+// Removes [module] from the set of loaded modules, if it has been loaded, so
+// that importing it again will load and run it from scratch. Anything that
+// was only reachable through the module is garbage after this.
+WREN_API void wrenUnloadModule(WrenVM* vm, const char* module);
+
 // Sets the current fiber to be aborted, and uses the value in [slot] as the
 // runtime error object.
 WREN_API void wrenAbortFiber(WrenVM* vm, int slot);
@@ -634,6 +962,19 @@ WREN_API void wrenSetUserData(WrenVM* vm, void* userData);
   #endif
 #endif
 
+// If true, full collections can mark the heap on several threads, see
+// [markThreads] in the configuration. This uses the atomic and thread-local
+// storage extensions of GCC and Clang.
+//
+// Defaults to true on supported compilers.
+#ifndef WREN_PARALLEL_MARK
+  #if defined(__GNUC__)
+    #define WREN_PARALLEL_MARK 1
+  #else
+    #define WREN_PARALLEL_MARK 0
+  #endif
+#endif
+
 // The VM includes a number of optional modules. You can choose to include
 // these or not. By default, they are all available. To disable one, set the
 // corresponding `WREN_OPT_<name>` define to `0`.
@@ -1052,11 +1393,16 @@ typedef struct sObjClass ObjClass;
 typedef struct sObj Obj;
 struct sObj
 {
-  ObjType type;
+  // The object's [ObjType], in a byte so that the header stays 16 bytes.
+  uint8_t type;
   bool isDark;
 
-  // The object's class.
-  ObjClass* classObj;
+  // Whether the object is in the remembered set, see [wrenRemember].
+  bool isRemembered;
+
+  // The object's class, as its [ObjClass.id]. Use [wrenGetObjClass] to get
+  // the class itself.
+  uint32_t classId;
 
   // The next object in the linked list of all currently allocated objects.
   struct sObj* next;
@@ -1159,8 +1505,19 @@ typedef struct
   // bytecode in the function's bytecode array. The value of that element is
   // the line in the source code that generated that instruction.
   IntBuffer sourceLines;
+
+  // The number of instructions of this function executed while opcode
+  // counting was on.
+  uint64_t executed;
 } FnDebug;
 
+struct sObjFiber;
+
+// Runs a function natively from [ip] in [fiber]'s current frame until it gets
+// to an instruction it doesn't handle, and returns that instruction for the
+// interpreter to carry on from. Generated by [wrenWriteNativeModule].
+typedef uint8_t* (*NativeFn)(WrenVM* vm, struct sObjFiber* fiber, uint8_t* ip);
+
 // A loaded module and the top-level variables it defines.
 //
 // While this is an Obj and is managed by the GC, it never appears as a
@@ -1209,6 +1566,9 @@ typedef struct
   // only be set for fns, and not ObjFns that represent methods or scripts.
   int arity;
   FnDebug* debug;
+
+  // The function's native code, if Wren was built with some for its module.
+  NativeFn native;
 } ObjFn;
 
 // An instance of a first-class function and the environment it has closed over.
@@ -1296,6 +1656,9 @@ typedef struct sObjFiber
   Value error;
   
   FiberState state;
+
+  // The collection that last scanned this fiber's stack, see [wrenScanFiber].
+  unsigned long scanned;
 } ObjFiber;
 
 typedef enum
@@ -1310,8 +1673,18 @@ typedef enum
   // A externally-defined C method.
   METHOD_FOREIGN,
 
+  // A foreign method that gets its arguments checked and unpacked, see
+  // [WrenTypedForeignMethodFn].
+  METHOD_FOREIGN_TYPED,
+
   // A normal user-defined method.
   METHOD_BLOCK,
+
+  // A user-defined method that only returns one of the receiver's fields, or
+  // only stores its argument in one and returns it. These run inline without
+  // a call frame. Since they can't fail, stack traces don't miss them.
+  METHOD_FIELD_GETTER,
+  METHOD_FIELD_SETTER,
   
   // No method for the given symbol.
   METHOD_NONE
@@ -1321,36 +1694,73 @@ typedef struct
 {
   MethodType type;
 
+  // The field a METHOD_FIELD_GETTER or METHOD_FIELD_SETTER accesses, or where
+  // the types of a METHOD_FOREIGN_TYPED's arguments start in the VM's
+  // [foreignTypes].
+  int field;
+
   // The method function itself. The [type] determines which field of the union
   // is used.
   union
   {
     Primitive primitive;
     WrenForeignMethodFn foreign;
+    WrenTypedForeignMethodFn typedForeign;
     ObjClosure* closure;
   } as;
 } Method;
 
-DECLARE_BUFFER(Method, Method);
+// Whether [method] is implemented by a closure, which is always the case for
+// user-defined methods.
+static inline bool wrenIsClosureMethod(const Method* method)
+{
+  return method->type == METHOD_BLOCK ||
+         method->type == METHOD_FIELD_GETTER ||
+         method->type == METHOD_FIELD_SETTER;
+}
+
+typedef struct
+{
+  // The method's symbol, or -1 if the entry is empty.
+  int symbol;
+
+  Method method;
+} MethodEntry;
+
+// The methods of a class, keyed by method symbol.
+//
+// Symbols are shared by every class, so a table indexed directly by symbol
+// would be as long as the highest symbol the class supports, and in a large
+// program most of its cells would be empty. This is an open addressed hash
+// table instead, which only takes room for the methods the class actually has.
+// It's kept at most half full so most lookups find the method in the first
+// entry they look at.
+typedef struct
+{
+  MethodEntry* entries;
+
+  // The number of methods in the table.
+  int count;
+
+  // The number of entries, always zero or a power of two.
+  int capacity;
+} MethodTable;
 
 struct sObjClass
 {
   Obj obj;
   ObjClass* superclass;
 
+  // The index of this class in the VM's class table, which is how objects
+  // refer to it. Ids of freed classes are reused.
+  uint32_t id;
+
   // The number of fields needed for an instance of this class, including all
   // of its superclass fields.
   int numFields;
 
-  // The table of methods that are defined in or inherited by this class.
-  // Methods are called by symbol, and the symbol directly maps to an index in
-  // this table. This makes method calls fast at the expense of empty cells in
-  // the list for methods the class doesn't support.
-  //
-  // You can think of it as a hash table that never has collisions but has a
-  // really low load factor. Since methods are pretty small (just a type and a
-  // pointer), this should be a worthwhile trade-off.
-  MethodBuffer methods;
+  // The methods that are defined in or inherited by this class.
+  MethodTable methods;
 
   // The name of the class.
   ObjString* name;
@@ -1362,6 +1772,11 @@ struct sObjClass
 typedef struct
 {
   Obj obj;
+
+  // The memory the object owns outside the VM's heap, as reported by the
+  // host.
+  size_t externalSize;
+
   uint8_t data[FLEXIBLE_ARRAY];
 } ObjForeign;
 
@@ -1571,12 +1986,41 @@ ObjClass* wrenNewSingleClass(WrenVM* vm, int numFields, ObjString* name);
 // on subclass.
 void wrenBindSuperclass(WrenVM* vm, ObjClass* subclass, ObjClass* superclass);
 
+// Sets the class of [obj]. [classObj] may be NULL while the core classes are
+// being created.
+static inline void wrenSetObjClass(Obj* obj, ObjClass* classObj)
+{
+  obj->classId = classObj == NULL ? 0 : classObj->id;
+}
+
 // Creates a new class object as well as its associated metaclass.
 ObjClass* wrenNewClass(WrenVM* vm, ObjClass* superclass, int numFields,
                        ObjString* name);
 
 void wrenBindMethod(WrenVM* vm, ObjClass* classObj, int symbol, Method method);
 
+// Returns the method [classObj] has for [symbol], or NULL if it has none.
+static inline Method* wrenFindMethod(ObjClass* classObj, int symbol)
+{
+  if (classObj->methods.capacity == 0) return NULL;
+
+  // Spread out the symbols, methods defined together have consecutive ones.
+  uint32_t hash = (uint32_t)symbol * 0x9e3779b1u;
+  uint32_t mask = (uint32_t)classObj->methods.capacity - 1;
+  uint32_t index = (hash ^ (hash >> 16)) & mask;
+
+  // The table is never full, so this always finds the method or an empty
+  // entry.
+  for (;;)
+  {
+    MethodEntry* entry = &classObj->methods.entries[index];
+    if (entry->symbol == symbol) return &entry->method;
+    if (entry->symbol == -1) return NULL;
+
+    index = (index + 1) & mask;
+  }
+}
+
 // Creates a new closure object that invokes [fn]. Allocates room for its
 // upvalues, but assumes outside code will populate it.
 ObjClosure* wrenNewClosure(WrenVM* vm, ObjFn* fn);
@@ -1731,6 +2175,11 @@ void wrenGrayBuffer(WrenVM* vm, ValueBuffer* buffer);
 // (in use and fully traversed).
 void wrenBlackenObjects(WrenVM* vm);
 
+// Does the same as [wrenBlackenObjects] on the configured mark threads.
+// Returns false, without doing anything, if the heap should be marked on this
+// thread alone.
+bool wrenBlackenObjectsInParallel(WrenVM* vm);
+
 // Releases all memory owned by [obj], including [obj] itself.
 void wrenFreeObj(WrenVM* vm, Obj* obj);
 
@@ -1821,6 +2270,37 @@ static inline Value wrenNumToValue(double num)
 #endif
 }
 
+// Returns the iterator after [iterator] when stepping from [from] towards
+// [to], starting at [from] if [iterator] is null, or false once the range is
+// done. [iterator] must be null or a number.
+static inline Value wrenIterateRange(double from, double to, bool isInclusive,
+                                     Value iterator)
+{
+  // Special case: empty range.
+  if (from == to && !isInclusive) return FALSE_VAL;
+
+  // Start the iteration.
+  if (IS_NULL(iterator)) return NUM_VAL(from);
+
+  double next = AS_NUM(iterator);
+
+  // Iterate towards [to] from [from].
+  if (from < to)
+  {
+    next++;
+    if (next > to) return FALSE_VAL;
+  }
+  else
+  {
+    next--;
+    if (next < to) return FALSE_VAL;
+  }
+
+  if (!isInclusive && next == to) return FALSE_VAL;
+
+  return NUM_VAL(next);
+}
+
 static inline bool wrenMapIsValidKey(Value arg)
 {
   return IS_BOOL(arg)
@@ -1888,6 +2368,28 @@ ObjFn* wrenCompile(WrenVM* vm, ObjModule* module, const char* source,
 // method is bound, we walk the bytecode for the function and patch it up.
 void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn);
 
+// Serializes [fn], the function [wrenCompile] returned for [source], and the
+// functions it creates into [bytes]. Method and module variable names are
+// stored instead of their indexes, which change from one VM to another.
+//
+// Must be called before any of the methods are bound. Returns `false` if a
+// constant can't be serialized.
+bool wrenSerializeModule(WrenVM* vm, ObjFn* fn, const char* source,
+                         ByteBuffer* bytes);
+
+// Loads a module serialized by [wrenSerializeModule] into [module], defining
+// the module variables it uses. Returns `NULL` if [bytecode] is malformed or
+// wasn't serialized from [source] by this version of Wren.
+ObjFn* wrenDeserializeModule(WrenVM* vm, ObjModule* module,
+                             const char* source, const uint8_t* bytecode,
+                             size_t length);
+
+// Writes C code that runs [fn], the function [wrenCompile] returned for
+// [source], and the functions it creates natively where it can, using
+// [write]. See [wrenWriteNativeCode].
+void wrenWriteNativeModule(WrenVM* vm, ObjFn* fn, const char* source,
+                           WrenWriteFn write);
+
 // Reaches all of the heap-allocated objects in use by [compiler] (and all of
 // its parents) so that they are not collected by the GC.
 void wrenMarkCompiler(WrenVM* vm, Compiler* compiler);
@@ -2031,6 +2533,19 @@ OPCODE(LOOP, 0)
 // Pop and if not truthy then jump the instruction pointer [arg] forward.
 OPCODE(JUMP_IF, -1)
 
+// Jump [arg] forward if the top two values on the stack are both numbers.
+// Leaves the stack unchanged.
+OPCODE(JUMP_IF_NUMS, 0)
+
+// Advances a for loop over a List or Range without going through the
+// iteration protocol. Reads the slots of the sequence and iterator, an
+// [IterateKind], and then two forward jump offsets, both relative to the end
+// of the instruction. When the loop is done, pushes false and jumps by the
+// first one to the exit test. Otherwise, stores the new iterator, pushes its
+// value and jumps by the second one to the loop body. For any other sequence
+// it does nothing, and the protocol calls that follow run instead.
+OPCODE(ITERATE, 0)
+
 // If the top of the stack is false, jump [arg] forward. Otherwise, pop and
 // continue.
 OPCODE(AND, -1)
@@ -2117,6 +2632,31 @@ OPCODE(IMPORT_MODULE, 1)
 // variable's value.
 OPCODE(IMPORT_VARIABLE, 1)
 
+// Superinstructions, which each run a pair of instructions that often follow
+// one another with a single dispatch. The compiler never emits them directly,
+// it rewrites pairs into them once a function is finished. Each one takes up
+// the same bytes as its pair. The second opcode byte holds the slot of a
+// LOAD_LOCAL_<n> and is unused otherwise.
+
+// LOAD_LOCAL_<n> followed by CALL_0 or CALL_1. Byte [arg] is the local slot
+// and the next two are the method symbol.
+OPCODE(LOAD_LOCAL_CALL_0, 1)
+OPCODE(LOAD_LOCAL_CALL_1, 0)
+
+// LOAD_MODULE_VAR followed by CALL_0.
+OPCODE(LOAD_MODULE_VAR_CALL_0, 1)
+
+// CONSTANT followed by CALL_1.
+OPCODE(CONSTANT_CALL_1, 0)
+
+// STORE_LOCAL, STORE_MODULE_VAR or STORE_FIELD_THIS followed by POP.
+OPCODE(STORE_LOCAL_POP, -1)
+OPCODE(STORE_MODULE_VAR_POP, -1)
+OPCODE(STORE_FIELD_THIS_POP, -1)
+
+// POP followed by LOOP.
+OPCODE(POP_LOOP, -1)
+
 // This pseudo-instruction indicates the end of the bytecode. It should
 // always be preceded by a `CODE_RETURN`, so is never actually executed.
 OPCODE(END, 0)
@@ -2124,6 +2664,74 @@ OPCODE(END, 0)
   #undef OPCODE
 } Code;
 
+// The sequences a [CODE_ITERATE] loop can step through directly.
+typedef enum
+{
+  // A List or Range value.
+  ITERATE_SEQUENCE,
+
+  // The bounds of a `..` or `...` range literal, when both are numbers. The
+  // range itself is never created.
+  ITERATE_INCLUSIVE_RANGE,
+  ITERATE_EXCLUSIVE_RANGE
+} IterateKind;
+
+// Execution counts gathered while opcode counting is on.
+typedef struct
+{
+  uint64_t opcodes[CODE_END + 1];
+
+  // Indexed by the previous and the current opcode.
+  uint64_t pairs[CODE_END + 1][CODE_END + 1];
+
+  // The opcode executed last, carried over between interpreter runs.
+  Code previous;
+} OpcodeStats;
+
+// Allocations counted against one key, a line of a function for sites or a
+// class for types. The key is only used to tell entries apart, [name] is a
+// copy so it outlives whatever the key pointed to.
+typedef struct
+{
+  const void* key;
+  int line;
+  char* name;
+  uint64_t allocations;
+  uint64_t bytes;
+  uint64_t objects;
+} AllocationCount;
+
+typedef struct
+{
+  AllocationCount* entries;
+  int count;
+  int capacity;
+} AllocationTable;
+
+typedef struct
+{
+  AllocationTable sites;
+  AllocationTable types;
+
+  // The site and size of the last allocation. Objects are initialized right
+  // after their memory is allocated, so this is where a new object came from.
+  int lastSite;
+  size_t lastSize;
+} AllocationStats;
+
+typedef enum
+{
+  // No collection is in progress.
+  GC_IDLE,
+
+  // Objects are being marked from the gray stack. New objects start out
+  // marked and overwritten references are grayed by [wrenWriteBarrier].
+  GC_MARK,
+
+  // The object list is being swept, a slice at a time.
+  GC_SWEEP
+} GCPhase;
+
 // A handle to a value, basically just a linked list of extra GC roots.
 //
 // Note that even non-heap-allocated values can be stored here.
@@ -2174,9 +2782,62 @@ struct WrenVM
   // The number of total allocated bytes that will trigger the next GC.
   size_t nextGC;
 
+  // The external memory of all foreign objects.
+  size_t externalBytes;
+
+  // Totals reported by [wrenGetGCStats].
+  unsigned long gcCount;
+  size_t lastFreed;
+  size_t totalFreed;
+
   // The first object in the linked list of all currently allocated objects.
   Obj* first;
 
+  // How many objects there are in that list.
+  size_t objectCount;
+
+  // Every class by its [ObjClass.id]. Slot 0 is NULL, for objects that don't
+  // have a class yet. Not a GC root, a class clears its slot when freed.
+  ObjClass** classes;
+  uint32_t classCount;
+  uint32_t classCapacity;
+
+  // The ids of freed classes. Has room for [classCapacity] of them so freeing
+  // a class never allocates.
+  uint32_t* freeClassIds;
+  uint32_t freeClassCount;
+
+  // The shared state of the mark threads while there are any.
+  struct sParallelMark* parallelMark;
+
+  // Where an incremental collection is, see [wrenCollectGarbageStep].
+  GCPhase gcPhase;
+
+  // The bytes proven live so far by the collection being marked.
+  size_t markedBytes;
+
+  // The bytes allocated since the last incremental step.
+  size_t gcDebt;
+
+  // While sweeping, the link to the next object to look at.
+  Obj** sweepLink;
+
+  // When collection is generational, the objects from [first] up to this one
+  // were allocated since the last collection. Every object after it survived
+  // one and stays marked.
+  Obj* firstOld;
+
+  // Old objects that may point at young ones, scanned by minor collections.
+  Obj** remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+
+  unsigned long minorCount;
+
+  // A list or map too long to mark in one step, and how far marking it got.
+  Obj* markingObj;
+  uint32_t markingIndex;
+
   // The "gray" set for the garbage collector. This is the stack of unprocessed
   // objects while a garbage collection pass is in process.
   Obj** gray;
@@ -2218,6 +2879,22 @@ struct WrenVM
   // There is a single global symbol table for all method names on all classes.
   // Method calls are dispatched directly by index in this table.
   SymbolTable methodNames;
+
+  // The argument types of every typed foreign method bound so far, one letter
+  // per argument as in [WrenTypedForeignMethod].
+  ByteBuffer foreignTypes;
+
+  // Set from any thread by wrenRequestSample() and cleared by the interpreter
+  // once the sample is taken. Only accessed atomically.
+  bool sampleRequested;
+
+  // Instruction counts, allocated the first time counting is turned on.
+  OpcodeStats* opcodeStats;
+  bool countOpcodes;
+
+  // Allocation counts, allocated the first time tracking is turned on.
+  AllocationStats* allocationStats;
+  bool trackAllocations;
 };
 
 // A generic allocation function that handles all explicit memory management.
@@ -2238,6 +2915,9 @@ struct WrenVM
 //   [oldSize] will be zero. It should return NULL.
 void* wrenReallocate(WrenVM* vm, void* memory, size_t oldSize, size_t newSize);
 
+// Counts the new object [obj] while allocation tracking is on.
+void wrenTrackObject(WrenVM* vm, Obj* obj);
+
 // Invoke the finalizer for the foreign object referenced by [foreign].
 void wrenFinalizeForeign(WrenVM* vm, ObjForeign* foreign);
 
@@ -2245,12 +2925,13 @@ void wrenFinalizeForeign(WrenVM* vm, ObjForeign* foreign);
 WrenHandle* wrenMakeHandle(WrenVM* vm, Value value);
 
 // Compile [source] in the context of [module] and wrap in a fiber that can
-// execute it.
+// execute it. If [useBytecode] is true, the host's loadBytecodeFn and
+// saveBytecodeFn are used.
 //
 // Returns NULL if a compile error occurred.
 ObjClosure* wrenCompileSource(WrenVM* vm, const char* module,
                               const char* source, bool isExpression,
-                              bool printErrors);
+                              bool printErrors, bool useBytecode);
 
 // Looks up a variable from a previously-loaded module.
 //
@@ -2305,9 +2986,52 @@ static inline void wrenCallFunction(WrenVM* vm, ObjFiber* fiber,
 // Marks [obj] as a GC root so that it doesn't get collected.
 void wrenPushRoot(WrenVM* vm, Obj* obj);
 
+// Must be called before a reference to [value] stored in a heap object is
+// overwritten or removed.
+//
+// An incremental collection marks what was reachable when it started, so an
+// object can't be allowed to drop out of the heap before it has been marked.
+static inline void wrenWriteBarrier(WrenVM* vm, Value value)
+{
+  if (vm->gcPhase == GC_MARK) wrenGrayValue(vm, value);
+}
+
+// Adds [obj] to the remembered set if collection is generational and it's
+// old, so the next minor collection marks what it points at.
+void wrenRemember(WrenVM* vm, Obj* obj);
+
+// Must be called when [value] is stored in [obj], unless [obj] was allocated
+// since the last possible collection.
+//
+// A minor collection only marks from the roots and the remembered set, so an
+// old object pointing at a young one has to be in it.
+static inline void wrenRememberStore(WrenVM* vm, Obj* obj, Value value)
+{
+  if (obj->isDark && IS_OBJ(value) && !AS_OBJ(value)->isDark)
+  {
+    wrenRemember(vm, obj);
+  }
+}
+
+// Marks the rest of [obj] if it's a long list or map being marked a slice at
+// a time. Must be called before its elements are moved around.
+void wrenFinishMarkingObj(WrenVM* vm, Obj* obj);
+
+// Scans [fiber]'s stack if an incremental collection is marking and hasn't
+// done so yet, or remembers it for the next minor one. Stack slots are written
+// without a barrier, so this has to happen before the fiber runs or has its
+// stack changed.
+void wrenScanFiber(WrenVM* vm, ObjFiber* fiber);
+
 // Removes the most recently pushed temporary root.
 void wrenPopRoot(WrenVM* vm);
 
+// Returns the class of [obj].
+static inline ObjClass* wrenGetObjClass(WrenVM* vm, Obj* obj)
+{
+  return vm->classes[obj->classId];
+}
+
 // Returns the class of [value].
 //
 // Defined here instead of in wren_value.h because it's critical that this be
@@ -2316,7 +3040,7 @@ void wrenPopRoot(WrenVM* vm);
 static inline ObjClass* wrenGetClassInline(WrenVM* vm, Value value)
 {
   if (IS_NUM(value)) return vm->numClass;
-  if (IS_OBJ(value)) return AS_OBJ(value)->classObj;
+  if (IS_OBJ(value)) return wrenGetObjClass(vm, AS_OBJ(value));
 
 #if WREN_NAN_TAGGING
   switch (GET_TAG(value))
@@ -2334,7 +3058,7 @@ static inline ObjClass* wrenGetClassInline(WrenVM* vm, Value value)
     case VAL_NULL:      return vm->nullClass;
     case VAL_NUM:       return vm->numClass;
     case VAL_TRUE:      return vm->boolClass;
-    case VAL_OBJ:       return AS_OBJ(value)->classObj;
+    case VAL_OBJ:       return wrenGetObjClass(vm, AS_OBJ(value));
     case VAL_UNDEFINED: UNREACHABLE();
   }
 #endif
@@ -2734,6 +3458,15 @@ struct sCompiler
   // The current innermost loop being compiled, or NULL if not in a loop.
   Loop* loop;
 
+  // The operator token of the last infix expression parsed, or TOKEN_EOF if
+  // the last expression was only a prefix one. Lets a for loop see that its
+  // sequence is a range literal.
+  TokenType lastOperator;
+
+  // Where the bytecode for the left operand of the infix expression about to
+  // be parsed starts, so operators can tell if both operands are constants.
+  int infixStart;
+
   // If this is a compiler for a method, keeps track of the class enclosing it.
   ClassInfo* enclosingClass;
 
@@ -2921,6 +3654,19 @@ OPCODE(LOOP, 0)
 // Pop and if not truthy then jump the instruction pointer [arg] forward.
 OPCODE(JUMP_IF, -1)
 
+// Jump [arg] forward if the top two values on the stack are both numbers.
+// Leaves the stack unchanged.
+OPCODE(JUMP_IF_NUMS, 0)
+
+// Advances a for loop over a List or Range without going through the
+// iteration protocol. Reads the slots of the sequence and iterator, an
+// [IterateKind], and then two forward jump offsets, both relative to the end
+// of the instruction. When the loop is done, pushes false and jumps by the
+// first one to the exit test. Otherwise, stores the new iterator, pushes its
+// value and jumps by the second one to the loop body. For any other sequence
+// it does nothing, and the protocol calls that follow run instead.
+OPCODE(ITERATE, 0)
+
 // If the top of the stack is false, jump [arg] forward. Otherwise, pop and
 // continue.
 OPCODE(AND, -1)
@@ -3007,6 +3753,31 @@ OPCODE(IMPORT_MODULE, 1)
 // variable's value.
 OPCODE(IMPORT_VARIABLE, 1)
 
+// Superinstructions, which each run a pair of instructions that often follow
+// one another with a single dispatch. The compiler never emits them directly,
+// it rewrites pairs into them once a function is finished. Each one takes up
+// the same bytes as its pair. The second opcode byte holds the slot of a
+// LOAD_LOCAL_<n> and is unused otherwise.
+
+// LOAD_LOCAL_<n> followed by CALL_0 or CALL_1. Byte [arg] is the local slot
+// and the next two are the method symbol.
+OPCODE(LOAD_LOCAL_CALL_0, 1)
+OPCODE(LOAD_LOCAL_CALL_1, 0)
+
+// LOAD_MODULE_VAR followed by CALL_0.
+OPCODE(LOAD_MODULE_VAR_CALL_0, 1)
+
+// CONSTANT followed by CALL_1.
+OPCODE(CONSTANT_CALL_1, 0)
+
+// STORE_LOCAL, STORE_MODULE_VAR or STORE_FIELD_THIS followed by POP.
+OPCODE(STORE_LOCAL_POP, -1)
+OPCODE(STORE_MODULE_VAR_POP, -1)
+OPCODE(STORE_FIELD_THIS_POP, -1)
+
+// POP followed by LOOP.
+OPCODE(POP_LOOP, -1)
+
 // This pseudo-instruction indicates the end of the bytecode. It should
 // always be preceded by a `CODE_RETURN`, so is never actually executed.
 OPCODE(END, 0)
@@ -3107,6 +3878,7 @@ static int addConstant(Compiler* compiler, Value constant)
     if (IS_OBJ(constant)) wrenPushRoot(compiler->parser->vm, AS_OBJ(constant));
     wrenValueBufferWrite(compiler->parser->vm, &compiler->fn->constants,
                          constant);
+    wrenRememberStore(compiler->parser->vm, &compiler->fn->obj, constant);
     if (IS_OBJ(constant)) wrenPopRoot(compiler->parser->vm);
     
     if (compiler->constants == NULL)
@@ -3973,29 +4745,229 @@ static void emitConstant(Compiler* compiler, Value value)
   emitShortArg(compiler, CODE_CONSTANT, constant);
 }
 
-// Create a new local variable with [name]. Assumes the current scope is local
-// and the name is unique.
-static int addLocal(Compiler* compiler, const char* name, int length)
+// Emits the code to push [value], which is null, a bool, a number or a string.
+static void emitValue(Compiler* compiler, Value value)
 {
-  Local* local = &compiler->locals[compiler->numLocals];
-  local->name = name;
-  local->length = length;
-  local->depth = compiler->scopeDepth;
-  local->isUpvalue = false;
-  return compiler->numLocals++;
+  if (IS_NULL(value))
+  {
+    emitOp(compiler, CODE_NULL);
+  }
+  else if (IS_BOOL(value))
+  {
+    emitOp(compiler, AS_BOOL(value) ? CODE_TRUE : CODE_FALSE);
+  }
+  else
+  {
+    emitConstant(compiler, value);
+  }
 }
 
-// Declares a variable in the current scope whose name is the given token.
-//
-// If [token] is `NULL`, uses the previously consumed token. Returns its symbol.
-static int declareVariable(Compiler* compiler, Token* token)
+// Returns true if the bytecode emitted since [start] is a single instruction
+// that pushes a literal value, and stores the value in [value].
+static bool isConstantCode(Compiler* compiler, int start, Value* value)
 {
-  if (token == NULL) token = &compiler->parser->previous;
+  // Constants aren't added once there's an error, so don't trust the code.
+  if (compiler->parser->hasError) return false;
 
-  if (token->length > MAX_VARIABLE_NAME)
+  uint8_t* code = compiler->fn->code.data + start;
+  int length = compiler->fn->code.count - start;
+
+  if (length == 1)
   {
-    error(compiler, "Variable name cannot be longer than %d characters.",
-          MAX_VARIABLE_NAME);
+    switch (code[0])
+    {
+      case CODE_NULL:  *value = NULL_VAL; return true;
+      case CODE_FALSE: *value = FALSE_VAL; return true;
+      case CODE_TRUE:  *value = TRUE_VAL; return true;
+      default: return false;
+    }
+  }
+
+  if (length == 3 && code[0] == CODE_CONSTANT)
+  {
+    *value = compiler->fn->constants.data[(code[1] << 8) | code[2]];
+    return true;
+  }
+
+  return false;
+}
+
+// Returns true if the bytecode emitted since [start] is a single instruction
+// that pushes a value without any other effect, so it can be dropped if the
+// value is never used.
+static bool isPureCode(Compiler* compiler, int start)
+{
+  Value value;
+  if (isConstantCode(compiler, start, &value)) return true;
+  if (compiler->parser->hasError) return false;
+
+  Code instruction = (Code)compiler->fn->code.data[start];
+  int length = compiler->fn->code.count - start;
+
+  switch (instruction)
+  {
+    case CODE_LOAD_LOCAL_0:
+    case CODE_LOAD_LOCAL_1:
+    case CODE_LOAD_LOCAL_2:
+    case CODE_LOAD_LOCAL_3:
+    case CODE_LOAD_LOCAL_4:
+    case CODE_LOAD_LOCAL_5:
+    case CODE_LOAD_LOCAL_6:
+    case CODE_LOAD_LOCAL_7:
+    case CODE_LOAD_LOCAL_8:
+      return length == 1;
+
+    case CODE_LOAD_LOCAL:
+    case CODE_LOAD_UPVALUE:
+    case CODE_LOAD_FIELD_THIS:
+      return length == 2;
+
+    case CODE_LOAD_MODULE_VAR:
+      return length == 3;
+
+    default:
+      return false;
+  }
+}
+
+// Removes the bytecode emitted since [start], which left [numPushed] more
+// values on the stack.
+static void discardCode(Compiler* compiler, int start, int numPushed)
+{
+  compiler->fn->code.count = start;
+  compiler->fn->debug->sourceLines.count = start;
+  compiler->numSlots -= numPushed;
+}
+
+// Bitwise operators convert their operands to 32-bit unsigned ints, which C
+// leaves undefined for values outside that range. Those are left to runtime
+// so the result is always the one the core methods give.
+static bool isBitwiseOperand(double value)
+{
+  return value >= 0 && value <= UINT32_MAX;
+}
+
+// Evaluates the prefix operator [operatorType] on the literal [operand] at
+// compile time, the same way the core classes would at runtime. Returns false
+// if it can't be folded, and the operator method is called as usual.
+static bool foldPrefix(TokenType operatorType, Value operand, Value* result)
+{
+  // Every object is truthy apart from false and null, and only Bool and Null
+  // override "!".
+  if (operatorType == TOKEN_BANG)
+  {
+    *result = BOOL_VAL(wrenIsFalsyValue(operand));
+    return true;
+  }
+
+  if (!IS_NUM(operand)) return false;
+
+  double value = AS_NUM(operand);
+  switch (operatorType)
+  {
+    case TOKEN_MINUS:
+      *result = NUM_VAL(-value);
+      return true;
+    case TOKEN_TILDE:
+      if (!isBitwiseOperand(value)) return false;
+      *result = NUM_VAL(~(uint32_t)value);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Evaluates the infix operator [operatorType] on the literals [left] and
+// [right] at compile time, the same way the core Num and String classes would
+// at runtime. Returns false if it can't be folded, including when the call
+// would be a runtime error, and the operator method is called as usual.
+static bool foldInfix(WrenVM* vm, TokenType operatorType, Value left,
+                      Value right, Value* result)
+{
+  if (IS_STRING(left) && IS_STRING(right))
+  {
+    switch (operatorType)
+    {
+      case TOKEN_PLUS:
+        *result = wrenStringFormat(vm, "@@", left, right);
+        return true;
+      case TOKEN_EQEQ:
+        *result = BOOL_VAL(wrenValuesEqual(left, right));
+        return true;
+      case TOKEN_BANGEQ:
+        *result = BOOL_VAL(!wrenValuesEqual(left, right));
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  if (!IS_NUM(left) || !IS_NUM(right)) return false;
+
+  double a = AS_NUM(left);
+  double b = AS_NUM(right);
+  bool isBitwise = isBitwiseOperand(a) && isBitwiseOperand(b);
+  switch (operatorType)
+  {
+    case TOKEN_PLUS:    *result = NUM_VAL(a + b); return true;
+    case TOKEN_MINUS:   *result = NUM_VAL(a - b); return true;
+    case TOKEN_STAR:    *result = NUM_VAL(a * b); return true;
+    case TOKEN_SLASH:   *result = NUM_VAL(a / b); return true;
+    case TOKEN_PERCENT: *result = NUM_VAL(fmod(a, b)); return true;
+    case TOKEN_LT:      *result = BOOL_VAL(a < b); return true;
+    case TOKEN_GT:      *result = BOOL_VAL(a > b); return true;
+    case TOKEN_LTEQ:    *result = BOOL_VAL(a <= b); return true;
+    case TOKEN_GTEQ:    *result = BOOL_VAL(a >= b); return true;
+    case TOKEN_EQEQ:    *result = BOOL_VAL(a == b); return true;
+    case TOKEN_BANGEQ:  *result = BOOL_VAL(a != b); return true;
+    case TOKEN_AMP:
+      if (!isBitwise) return false;
+      *result = NUM_VAL((uint32_t)a & (uint32_t)b);
+      return true;
+    case TOKEN_PIPE:
+      if (!isBitwise) return false;
+      *result = NUM_VAL((uint32_t)a | (uint32_t)b);
+      return true;
+    case TOKEN_CARET:
+      if (!isBitwise) return false;
+      *result = NUM_VAL((uint32_t)a ^ (uint32_t)b);
+      return true;
+    case TOKEN_LTLT:
+      if (!isBitwise || b >= 32) return false;
+      *result = NUM_VAL((uint32_t)a << (uint32_t)b);
+      return true;
+    case TOKEN_GTGT:
+      if (!isBitwise || b >= 32) return false;
+      *result = NUM_VAL((uint32_t)a >> (uint32_t)b);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Create a new local variable with [name]. Assumes the current scope is local
+// and the name is unique.
+static int addLocal(Compiler* compiler, const char* name, int length)
+{
+  Local* local = &compiler->locals[compiler->numLocals];
+  local->name = name;
+  local->length = length;
+  local->depth = compiler->scopeDepth;
+  local->isUpvalue = false;
+  return compiler->numLocals++;
+}
+
+// Declares a variable in the current scope whose name is the given token.
+//
+// If [token] is `NULL`, uses the previously consumed token. Returns its symbol.
+static int declareVariable(Compiler* compiler, Token* token)
+{
+  if (token == NULL) token = &compiler->parser->previous;
+
+  if (token->length > MAX_VARIABLE_NAME)
+  {
+    error(compiler, "Variable name cannot be longer than %d characters.",
+          MAX_VARIABLE_NAME);
   }
 
   // Top-level module scope.
@@ -4252,6 +5224,8 @@ static void loadLocal(Compiler* compiler, int slot)
   emitByteArg(compiler, CODE_LOAD_LOCAL, slot);
 }
 
+static void fuseInstructions(Compiler* compiler);
+
 // Finishes [compiler], which is compiling a function, method, or chunk of top
 // level code. If there is a parent compiler, then this emits code in the
 // parent compiler to load the resulting function.
@@ -4269,6 +5243,8 @@ static ObjFn* endCompiler(Compiler* compiler,
   // we can't rely on CODE_RETURN to tell us we're at the end.
   emitOp(compiler, CODE_END);
 
+  fuseInstructions(compiler);
+
   wrenFunctionBindName(compiler->parser->vm, compiler->fn,
                        debugName, debugNameLength);
   
@@ -4360,6 +5336,17 @@ static void patchJump(Compiler* compiler, int offset)
   compiler->fn->code.data[offset + 1] = jump & 0xff;
 }
 
+// Replaces the placeholder at [offset] for one of the jumps of a CODE_ITERATE
+// instruction ending at [end] with an offset to the current end of bytecode.
+static void patchIterateJump(Compiler* compiler, int offset, int end)
+{
+  int jump = compiler->fn->code.count - end;
+  if (jump > MAX_JUMP) error(compiler, "Too much code to jump over.");
+
+  compiler->fn->code.data[offset] = (jump >> 8) & 0xff;
+  compiler->fn->code.data[offset + 1] = jump & 0xff;
+}
+
 // Parses a block body, after the initial "{" has been consumed.
 //
 // Returns true if it was a expression body, false if it was a statement body.
@@ -4798,13 +5785,27 @@ static void map(Compiler* compiler, bool canAssign)
 // Unary operators like `-foo`.
 static void unaryOp(Compiler* compiler, bool canAssign)
 {
-  GrammarRule* rule = getRule(compiler->parser->previous.type);
+  TokenType operatorType = compiler->parser->previous.type;
+  GrammarRule* rule = getRule(operatorType);
 
   ignoreNewlines(compiler);
 
   // Compile the argument.
+  int start = compiler->fn->code.count;
   parsePrecedence(compiler, (Precedence)(PREC_UNARY + 1));
 
+  // The core classes' operators can't be changed, so an operator on a literal
+  // can be evaluated now.
+  Value operand;
+  Value result;
+  if (isConstantCode(compiler, start, &operand) &&
+      foldPrefix(operatorType, operand, &result))
+  {
+    discardCode(compiler, start, 1);
+    emitValue(compiler, result);
+    return;
+  }
+
   // Call the operator method on the left-hand side.
   callMethod(compiler, 0, rule->name, 1);
 }
@@ -5152,9 +6153,33 @@ static void or_(Compiler* compiler, bool canAssign)
 
 static void conditional(Compiler* compiler, bool canAssign)
 {
+  Value condition;
+  int start = compiler->infixStart;
+  bool isConstant = isConstantCode(compiler, start, &condition);
+
   // Ignore newline after '?'.
   ignoreNewlines(compiler);
 
+  // With a literal condition, only the branch that's taken is kept.
+  if (isConstant)
+  {
+    discardCode(compiler, start, 1);
+    bool isTruthy = !wrenIsFalsyValue(condition);
+
+    int thenStart = compiler->fn->code.count;
+    parsePrecedence(compiler, PREC_CONDITIONAL);
+    if (!isTruthy) discardCode(compiler, thenStart, 1);
+
+    consume(compiler, TOKEN_COLON,
+            "Expect ':' after then branch of conditional operator.");
+    ignoreNewlines(compiler);
+
+    int elseStart = compiler->fn->code.count;
+    parsePrecedence(compiler, PREC_ASSIGNMENT);
+    if (isTruthy) discardCode(compiler, elseStart, 1);
+    return;
+  }
+
   // Jump to the else branch if the condition is false.
   int ifJump = emitJump(compiler, CODE_JUMP_IF);
 
@@ -5179,14 +6204,35 @@ static void conditional(Compiler* compiler, bool canAssign)
 
 void infixOp(Compiler* compiler, bool canAssign)
 {
-  GrammarRule* rule = getRule(compiler->parser->previous.type);
+  TokenType operatorType = compiler->parser->previous.type;
+  GrammarRule* rule = getRule(operatorType);
+
+  Value left;
+  int start = compiler->infixStart;
+  bool isConstant = isConstantCode(compiler, start, &left);
 
   // An infix operator cannot end an expression.
   ignoreNewlines(compiler);
 
   // Compile the right-hand side.
+  int rightStart = compiler->fn->code.count;
   parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
+  // The core classes' operators can't be changed, so an operator on two
+  // literals can be evaluated now.
+  WrenVM* vm = compiler->parser->vm;
+  Value right;
+  Value result;
+  if (isConstant && isConstantCode(compiler, rightStart, &right) &&
+      foldInfix(vm, operatorType, left, right, &result))
+  {
+    if (IS_OBJ(result)) wrenPushRoot(vm, AS_OBJ(result));
+    discardCode(compiler, start, 2);
+    emitValue(compiler, result);
+    if (IS_OBJ(result)) wrenPopRoot(vm);
+    return;
+  }
+
   // Call the operator method on the left-hand side.
   Signature signature = { rule->name, (int)strlen(rule->name), SIG_METHOD, 1 };
   callSignature(compiler, CODE_CALL_0, &signature);
@@ -5437,13 +6483,18 @@ void parsePrecedence(Compiler* compiler, Precedence precedence)
   // we pass in whether or not it appears in a context loose enough to allow
   // "=". If so, it will parse the "=" itself and handle it appropriately.
   bool canAssign = precedence <= PREC_CONDITIONAL;
+  int start = compiler->fn->code.count;
   prefix(compiler, canAssign);
+  compiler->lastOperator = TOKEN_EOF;
 
   while (precedence <= rules[compiler->parser->current.type].precedence)
   {
     nextToken(compiler->parser);
-    GrammarFn infix = rules[compiler->parser->previous.type].infix;
+    TokenType operatorType = compiler->parser->previous.type;
+    GrammarFn infix = rules[operatorType].infix;
+    compiler->infixStart = start;
     infix(compiler, canAssign);
+    compiler->lastOperator = operatorType;
   }
 }
 
@@ -5519,6 +6570,7 @@ static int getByteCountForArguments(const uint8_t* bytecode,
     case CODE_JUMP:
     case CODE_LOOP:
     case CODE_JUMP_IF:
+    case CODE_JUMP_IF_NUMS:
     case CODE_AND:
     case CODE_OR:
     case CODE_METHOD_INSTANCE:
@@ -5527,6 +6579,23 @@ static int getByteCountForArguments(const uint8_t* bytecode,
     case CODE_IMPORT_VARIABLE:
       return 2;
 
+    case CODE_ITERATE:
+      return 7;
+
+    case CODE_STORE_LOCAL_POP:
+    case CODE_STORE_FIELD_THIS_POP:
+      return 2;
+
+    case CODE_LOAD_LOCAL_CALL_0:
+    case CODE_LOAD_LOCAL_CALL_1:
+    case CODE_STORE_MODULE_VAR_POP:
+    case CODE_POP_LOOP:
+      return 3;
+
+    case CODE_LOAD_MODULE_VAR_CALL_0:
+    case CODE_CONSTANT_CALL_1:
+      return 5;
+
     case CODE_SUPER_0:
     case CODE_SUPER_1:
     case CODE_SUPER_2:
@@ -5560,6 +6629,113 @@ static int getByteCountForArguments(const uint8_t* bytecode,
   return 0;
 }
 
+// Returns the superinstruction that runs [first] and then [second], or
+// CODE_END if there is none for that pair.
+static Code superinstruction(Code first, Code second)
+{
+  if (first >= CODE_LOAD_LOCAL_0 && first <= CODE_LOAD_LOCAL_8)
+  {
+    if (second == CODE_CALL_0) return CODE_LOAD_LOCAL_CALL_0;
+    if (second == CODE_CALL_1) return CODE_LOAD_LOCAL_CALL_1;
+    return CODE_END;
+  }
+
+  switch (first)
+  {
+    case CODE_LOAD_MODULE_VAR:
+      return second == CODE_CALL_0 ? CODE_LOAD_MODULE_VAR_CALL_0 : CODE_END;
+    case CODE_CONSTANT:
+      return second == CODE_CALL_1 ? CODE_CONSTANT_CALL_1 : CODE_END;
+    case CODE_STORE_LOCAL:
+      return second == CODE_POP ? CODE_STORE_LOCAL_POP : CODE_END;
+    case CODE_STORE_MODULE_VAR:
+      return second == CODE_POP ? CODE_STORE_MODULE_VAR_POP : CODE_END;
+    case CODE_STORE_FIELD_THIS:
+      return second == CODE_POP ? CODE_STORE_FIELD_THIS_POP : CODE_END;
+    case CODE_POP:
+      return second == CODE_LOOP ? CODE_POP_LOOP : CODE_END;
+    default:
+      return CODE_END;
+  }
+}
+
+// Rewrites pairs of instructions in the finished bytecode of [compiler] into
+// superinstructions. The pairs are the most frequent ones in the opcode pair
+// counts written by `--opstats` for the examples.
+//
+// A superinstruction fills the same bytes as its pair, so jump offsets and the
+// line of every byte stay as they are. Pairs whose second instruction is the
+// target of a jump are left alone, since the second opcode byte is reused.
+static void fuseInstructions(Compiler* compiler)
+{
+  WrenVM* vm = compiler->parser->vm;
+  ObjFn* fn = compiler->fn;
+  uint8_t* code = fn->code.data;
+
+  ByteBuffer isTarget;
+  wrenByteBufferInit(&isTarget);
+  wrenByteBufferFill(vm, &isTarget, false, fn->code.count + 1);
+
+  int ip = 0;
+  while (ip < fn->code.count)
+  {
+    int next = ip + 1 + getByteCountForArguments(code, fn->constants.data, ip);
+    switch (code[ip])
+    {
+      case CODE_JUMP:
+      case CODE_JUMP_IF:
+      case CODE_JUMP_IF_NUMS:
+      case CODE_AND:
+      case CODE_OR:
+        isTarget.data[next + ((code[ip + 1] << 8) | code[ip + 2])] = true;
+        break;
+
+      case CODE_LOOP:
+        isTarget.data[next - ((code[ip + 1] << 8) | code[ip + 2])] = true;
+        break;
+
+      case CODE_ITERATE:
+        isTarget.data[next + ((code[ip + 4] << 8) | code[ip + 5])] = true;
+        isTarget.data[next + ((code[ip + 6] << 8) | code[ip + 7])] = true;
+        break;
+    }
+
+    ip = next;
+  }
+
+  ip = 0;
+  while (ip < fn->code.count)
+  {
+    int next = ip + 1 + getByteCountForArguments(code, fn->constants.data, ip);
+    if (next >= fn->code.count || isTarget.data[next])
+    {
+      ip = next;
+      continue;
+    }
+
+    Code fused = superinstruction((Code)code[ip], (Code)code[next]);
+    if (fused == CODE_END)
+    {
+      ip = next;
+      continue;
+    }
+
+    int after = next + 1 +
+        getByteCountForArguments(code, fn->constants.data, next);
+
+    // The local's slot goes where the second opcode was.
+    if (code[ip] >= CODE_LOAD_LOCAL_0 && code[ip] <= CODE_LOAD_LOCAL_8)
+    {
+      code[next] = code[ip] - CODE_LOAD_LOCAL_0;
+    }
+
+    code[ip] = fused;
+    ip = after;
+  }
+
+  wrenByteBufferClear(vm, &isTarget);
+}
+
 // Marks the beginning of a loop. Keeps track of the current instruction so we
 // know what to loop back to at the end of the body.
 static void startLoop(Compiler* compiler, Loop* loop)
@@ -5595,7 +6771,11 @@ static void endLoop(Compiler* compiler)
   int loopOffset = compiler->fn->code.count - compiler->loop->start + 2;
   emitShortArg(compiler, CODE_LOOP, loopOffset);
 
-  patchJump(compiler, compiler->loop->exitJump);
+  // Loops on a literal condition have no exit test.
+  if (compiler->loop->exitJump != -1)
+  {
+    patchJump(compiler, compiler->loop->exitJump);
+  }
 
   // Find any break placeholder instructions (which will be CODE_END in the
   // bytecode) and replace them with real jumps.
@@ -5648,6 +6828,11 @@ static void forStatement(Compiler* compiler)
   //   it should exit the loop.
   // - The .iteratorValue() method is used to get the value at the current
   //   iterator position.
+  //
+  // Each iteration starts with a CODE_ITERATE, which steps through lists and
+  // ranges itself and skips the two calls. When the sequence is a range
+  // literal like `a..b`, the bounds are kept in two hidden variables instead,
+  // and the range is only created if they aren't both numbers.
 
   // Create a scope for the hidden local variables used for the iterator.
   pushScope(compiler);
@@ -5667,16 +6852,46 @@ static void forStatement(Compiler* compiler)
   // variable.
   expression(compiler);
 
+  // If the whole expression is a range literal, take back the call to `..` or
+  // `...` that ends it. The bounds stay on the stack when they are numbers,
+  // otherwise the call is made and null fills the second slot.
+  IterateKind kind = ITERATE_SEQUENCE;
+  if ((compiler->lastOperator == TOKEN_DOTDOT ||
+       compiler->lastOperator == TOKEN_DOTDOTDOT) &&
+      compiler->fn->code.data[compiler->fn->code.count - 3] == CODE_CALL_1)
+  {
+    bool isInclusive = compiler->lastOperator == TOKEN_DOTDOT;
+    kind = isInclusive ? ITERATE_INCLUSIVE_RANGE : ITERATE_EXCLUSIVE_RANGE;
+
+    compiler->fn->code.count -= 3;
+    compiler->fn->debug->sourceLines.count -= 3;
+    compiler->numSlots++;
+
+    int numbers = emitJump(compiler, CODE_JUMP_IF_NUMS);
+    if (isInclusive)
+    {
+      callMethod(compiler, 1, "..(_)", 5);
+    }
+    else
+    {
+      callMethod(compiler, 1, "...(_)", 6);
+    }
+    null(compiler, false);
+    patchJump(compiler, numbers);
+  }
+
   // Verify that there is space to hidden local variables.
-  // Note that we expect only two addLocal calls next to each other in the
-  // following code.
-  if (compiler->numLocals + 2 > MAX_LOCALS)
+  // Note that we expect only two or three addLocal calls next to each other in
+  // the following code.
+  int numHidden = kind == ITERATE_SEQUENCE ? 2 : 3;
+  if (compiler->numLocals + numHidden > MAX_LOCALS)
   {
     error(compiler, "Cannot declare more than %d variables in one scope. (Not enough space for for-loops internal variables)",
           MAX_LOCALS);
     return;
   }
   int seqSlot = addLocal(compiler, "seq ", 4);
+  if (kind != ITERATE_SEQUENCE) addLocal(compiler, "to ", 3);
 
   // Create another hidden local for the iterator object.
   null(compiler, false);
@@ -5687,6 +6902,15 @@ static void forStatement(Compiler* compiler)
   Loop loop;
   startLoop(compiler, &loop);
 
+  emitByteArg(compiler, CODE_ITERATE, seqSlot);
+  emitByte(compiler, iterSlot);
+  emitByte(compiler, kind);
+  int exitJump = emitByte(compiler, 0xff);
+  emitByte(compiler, 0xff);
+  int bodyJump = emitByte(compiler, 0xff);
+  emitByte(compiler, 0xff);
+  int iterateEnd = compiler->fn->code.count;
+
   // Advance the iterator by calling the ".iterate" method on the sequence.
   loadLocal(compiler, seqSlot);
   loadLocal(compiler, iterSlot);
@@ -5694,12 +6918,14 @@ static void forStatement(Compiler* compiler)
   // Update and test the iterator.
   callMethod(compiler, 1, "iterate(_)", 10);
   emitByteArg(compiler, CODE_STORE_LOCAL, iterSlot);
+  patchIterateJump(compiler, exitJump, iterateEnd);
   testExitLoop(compiler);
 
   // Get the current value in the sequence by calling ".iteratorValue".
   loadLocal(compiler, seqSlot);
   loadLocal(compiler, iterSlot);
   callMethod(compiler, 1, "iteratorValue(_)", 16);
+  patchIterateJump(compiler, bodyJump, iterateEnd);
 
   // Bind the loop variable in its own scope. This ensures we get a fresh
   // variable each iteration so that closures for it don't all see the same one.
@@ -5721,8 +6947,30 @@ static void ifStatement(Compiler* compiler)
 {
   // Compile the condition.
   consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  int start = compiler->fn->code.count;
   expression(compiler);
   consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
+
+  // With a literal condition, only the branch that's taken is kept. The other
+  // one is still compiled so it gets checked for errors.
+  Value condition;
+  if (isConstantCode(compiler, start, &condition))
+  {
+    discardCode(compiler, start, 1);
+    bool isTruthy = !wrenIsFalsyValue(condition);
+
+    int thenStart = compiler->fn->code.count;
+    statement(compiler);
+    if (!isTruthy) discardCode(compiler, thenStart, 0);
+
+    if (match(compiler, TOKEN_ELSE))
+    {
+      int elseStart = compiler->fn->code.count;
+      statement(compiler);
+      if (isTruthy) discardCode(compiler, elseStart, 0);
+    }
+    return;
+  }
   
   // Jump to the else branch if the condition is false.
   int ifJump = emitJump(compiler, CODE_JUMP_IF);
@@ -5754,13 +7002,29 @@ static void whileStatement(Compiler* compiler)
   startLoop(compiler, &loop);
 
   // Compile the condition.
+  int start = compiler->fn->code.count;
   consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression(compiler);
   consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
 
-  testExitLoop(compiler);
+  // A literal condition is never tested. If it's false, the whole loop is
+  // dropped once it has been compiled.
+  Value condition;
+  bool isConstant = isConstantCode(compiler, start, &condition);
+  if (isConstant)
+  {
+    discardCode(compiler, start, 1);
+    loop.exitJump = -1;
+  }
+  else
+  {
+    testExitLoop(compiler);
+  }
+
   loopBody(compiler);
   endLoop(compiler);
+
+  if (isConstant && wrenIsFalsyValue(condition)) discardCode(compiler, start, 0);
 }
 
 // Compiles a simple statement. These can only appear at the top-level or
@@ -5854,8 +7118,18 @@ void statement(Compiler* compiler)
   else
   {
     // Expression statement.
+    int start = compiler->fn->code.count;
     expression(compiler);
-    emitOp(compiler, CODE_POP);
+
+    // Don't push a value only to pop it again.
+    if (isPureCode(compiler, start))
+    {
+      discardCode(compiler, start, 1);
+    }
+    else
+    {
+      emitOp(compiler, CODE_POP);
+    }
   }
 }
 
@@ -5878,6 +7152,7 @@ static void createConstructor(Compiler* compiler, Signature* signature,
 {
   Compiler methodCompiler;
   initCompiler(&methodCompiler, compiler->parser, compiler, true);
+  methodCompiler.fn->arity = signature->arity;
   
   // Allocate the instance.
   emitOp(&methodCompiler, compiler->enclosingClass->isForeign
@@ -6084,6 +7359,10 @@ static bool method(Compiler* compiler, Variable classVariable)
   }
   else
   {
+    // Methods aren't called through an arity check, but the bytecode loader
+    // needs to know how many slots the caller fills.
+    methodCompiler.fn->arity = signature.arity;
+
     consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' to begin method body.");
     finishBody(&methodCompiler);
     endCompiler(&methodCompiler, fullSignature, length);
@@ -6437,691 +7716,2043 @@ ObjFn* wrenCompile(WrenVM* vm, ObjModule* module, const char* source,
   return endCompiler(&compiler, "(script)", 8);
 }
 
-void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
+// Serialized modules start with these bytes.
+#define BYTECODE_MAGIC "WRNB"
+
+// Bump this when the serialized layout changes. Changes to the instruction set
+// are caught by storing the number of opcodes too.
+#define BYTECODE_VERSION 2
+
+typedef enum
 {
-  int ip = 0;
-  for (;;)
-  {
-    Code instruction = (Code)fn->code.data[ip];
-    switch (instruction)
-    {
-      case CODE_LOAD_FIELD:
-      case CODE_STORE_FIELD:
-      case CODE_LOAD_FIELD_THIS:
-      case CODE_STORE_FIELD_THIS:
-        // Shift this class's fields down past the inherited ones. We don't
-        // check for overflow here because we'll see if the number of fields
-        // overflows when the subclass is created.
-        fn->code.data[ip + 1] += classObj->superclass->numFields;
-        break;
+  BYTECODE_NULL,
+  BYTECODE_FALSE,
+  BYTECODE_TRUE,
+  BYTECODE_NUM,
+  BYTECODE_STRING,
+  BYTECODE_FN
+} BytecodeConstant;
 
-      case CODE_SUPER_0:
-      case CODE_SUPER_1:
-      case CODE_SUPER_2:
-      case CODE_SUPER_3:
-      case CODE_SUPER_4:
-      case CODE_SUPER_5:
-      case CODE_SUPER_6:
-      case CODE_SUPER_7:
-      case CODE_SUPER_8:
-      case CODE_SUPER_9:
-      case CODE_SUPER_10:
-      case CODE_SUPER_11:
-      case CODE_SUPER_12:
-      case CODE_SUPER_13:
-      case CODE_SUPER_14:
-      case CODE_SUPER_15:
-      case CODE_SUPER_16:
-      {
-        // Fill in the constant slot with a reference to the superclass.
-        int constant = (fn->code.data[ip + 3] << 8) | fn->code.data[ip + 4];
-        fn->constants.data[constant] = OBJ_VAL(classObj->superclass);
-        break;
-      }
+typedef struct
+{
+  WrenVM* vm;
+  ByteBuffer bytes;
 
-      case CODE_CLOSURE:
-      {
-        // Bind the nested closure too.
-        int constant = (fn->code.data[ip + 1] << 8) | fn->code.data[ip + 2];
-        wrenBindMethodCode(classObj, AS_FN(fn->constants.data[constant]));
-        break;
-      }
+  // Method symbols and module variables are stored as indexes into tables of
+  // the names the module uses, since the VM's own indexes depend on what was
+  // compiled before. These map the VM's indexes to the tables, or -1.
+  IntBuffer methodIndexes;
+  IntBuffer variableIndexes;
 
-      case CODE_END:
-        return;
+  // The VM's indexes in table order.
+  IntBuffer methods;
+  IntBuffer variables;
+} BytecodeWriter;
 
-      default:
-        // Other instructions are unaffected, so just skip over them.
-        break;
-    }
-    ip += 1 + getByteCountForArguments(fn->code.data, fn->constants.data, ip);
+typedef struct
+{
+  WrenVM* vm;
+  ObjModule* module;
+
+  const uint8_t* data;
+  size_t length;
+  size_t position;
+  bool hasError;
+
+  // The VM's method symbols and module variables for the serialized tables.
+  IntBuffer methods;
+  IntBuffer variables;
+} BytecodeReader;
+
+// FNV-1a, only used to tell whether serialized code is out of date or
+// damaged.
+static uint64_t hashBytes(const uint8_t* bytes, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
   }
+
+  return hash;
 }
 
-void wrenMarkCompiler(WrenVM* vm, Compiler* compiler)
+static uint64_t hashSource(const char* source)
 {
-  wrenGrayValue(vm, compiler->parser->current.value);
-  wrenGrayValue(vm, compiler->parser->previous.value);
-  wrenGrayValue(vm, compiler->parser->next.value);
+  return hashBytes((const uint8_t*)source, strlen(source));
+}
 
-  // Walk up the parent chain to mark the outer compilers too. The VM only
-  // tracks the innermost one.
-  do
+static void writeBytes(BytecodeWriter* writer, const void* data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
   {
-    wrenGrayObj(vm, (Obj*)compiler->fn);
-    wrenGrayObj(vm, (Obj*)compiler->constants);
-    wrenGrayObj(vm, (Obj*)compiler->attributes);
-    
-    if (compiler->enclosingClass != NULL)
-    {
-      wrenBlackenSymbolTable(vm, &compiler->enclosingClass->fields);
-
-      if(compiler->enclosingClass->methodAttributes != NULL) 
-      {
-        wrenGrayObj(vm, (Obj*)compiler->enclosingClass->methodAttributes);
-      }
-      if(compiler->enclosingClass->classAttributes != NULL) 
-      {
-        wrenGrayObj(vm, (Obj*)compiler->enclosingClass->classAttributes);
-      }
-    }
-    
-    compiler = compiler->parent;
+    wrenByteBufferWrite(writer->vm, &writer->bytes, ((const uint8_t*)data)[i]);
   }
-  while (compiler != NULL);
 }
 
-// Helpers for Attributes
-
-// Throw an error if any attributes were found preceding, 
-// and clear the attributes so the error doesn't keep happening.
-static void disallowAttributes(Compiler* compiler)
+// Writes a little endian base 128 number, most are one byte.
+static void writeInt(BytecodeWriter* writer, uint64_t value)
 {
-  if (compiler->numAttributes > 0)
+  while (value >= 0x80)
   {
-    error(compiler, "Attributes can only specified before a class or a method");
-    wrenMapClear(compiler->parser->vm, compiler->attributes);
-    compiler->numAttributes = 0;
+    wrenByteBufferWrite(writer->vm, &writer->bytes, (uint8_t)(value | 0x80));
+    value >>= 7;
   }
+
+  wrenByteBufferWrite(writer->vm, &writer->bytes, (uint8_t)value);
 }
 
-// Add an attribute to a given group in the compiler attribues map
-static void addToAttributeGroup(Compiler* compiler, 
-                                Value group, Value key, Value value) 
+static void writeString(BytecodeWriter* writer, const char* text, int length)
 {
-  WrenVM* vm = compiler->parser->vm;
-
-  if(IS_OBJ(group)) wrenPushRoot(vm, AS_OBJ(group));
-  if(IS_OBJ(key))   wrenPushRoot(vm, AS_OBJ(key));
-  if(IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
+  writeInt(writer, length);
+  writeBytes(writer, text, length);
+}
 
-  Value groupMapValue = wrenMapGet(compiler->attributes, group);
-  if(IS_UNDEFINED(groupMapValue)) 
+static uint64_t readInt(BytecodeReader* reader)
+{
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7)
   {
-    groupMapValue = OBJ_VAL(wrenNewMap(vm));
-    wrenMapSet(vm, compiler->attributes, group, groupMapValue);
+    if (reader->position >= reader->length) break;
+
+    uint8_t byte = reader->data[reader->position++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return value;
   }
 
-  //we store them as a map per so we can maintain duplicate keys 
-  //group = { key:[value, ...], }
-  ObjMap* groupMap = AS_MAP(groupMapValue);
+  reader->hasError = true;
+  return 0;
+}
 
-  //var keyItems = group[key]
-  //if(!keyItems) keyItems = group[key] = [] 
-  Value keyItemsValue = wrenMapGet(groupMap, key);
-  if(IS_UNDEFINED(keyItemsValue)) 
+// Returns the next [length] bytes, or NULL if there aren't that many left.
+static const uint8_t* readBytes(BytecodeReader* reader, uint64_t length)
+{
+  if (length > reader->length - reader->position)
   {
-    keyItemsValue = OBJ_VAL(wrenNewList(vm, 0));
-    wrenMapSet(vm, groupMap, key, keyItemsValue);
+    reader->hasError = true;
+    return NULL;
   }
 
-  //keyItems.add(value)
-  ObjList* keyItems = AS_LIST(keyItemsValue);
-  wrenValueBufferWrite(vm, &keyItems->elements, value);
-
-  if(IS_OBJ(group)) wrenPopRoot(vm);
-  if(IS_OBJ(key))   wrenPopRoot(vm);
-  if(IS_OBJ(value)) wrenPopRoot(vm);
+  const uint8_t* bytes = reader->data + reader->position;
+  reader->position += length;
+  return bytes;
 }
 
+// Reads the two byte operand at [ip] in [code].
+static int readOperand(const uint8_t* code, int ip)
+{
+  return (code[ip] << 8) | code[ip + 1];
+}
 
-// Emit the attributes in the give map onto the stack
-static void emitAttributes(Compiler* compiler, ObjMap* attributes) 
+// Returns false if the instruction at [ip] in [fn], [size] bytes long, refers
+// to a constant, local slot or upvalue [fn] doesn't have, or jumps outside of
+// its code. Jump targets are added to [targets], to be checked against the
+// starts of instructions once they're all known.
+static bool checkOperands(WrenVM* vm, ObjFn* fn, int ip, int size,
+                          IntBuffer* targets)
 {
-  // Instantiate a new map for the attributes
-  loadCoreVariable(compiler, "Map");
-  callMethod(compiler, 0, "new()", 5);
+  const uint8_t* code = fn->code.data;
+  int next = ip + size;
 
-  // The attributes are stored as group = { key:[value, value, ...] }
-  // so our first level is the group map
-  for(uint32_t groupIdx = 0; groupIdx < attributes->capacity; groupIdx++)
+  // The receiver and arguments come before the slots [maxSlots] counts.
+  int numSlots = fn->arity + 1 + fn->maxSlots;
+
+  // The offsets in the instruction of each kind of operand, or -1.
+  int constant = -1;
+  int slot = -1;
+  int upvalue = -1;
+  int jump = -1;
+  int loop = -1;
+
+  switch ((Code)code[ip])
   {
-    const MapEntry* groupEntry = &attributes->entries[groupIdx];
-    if(IS_UNDEFINED(groupEntry->key)) continue;
-    //group key
-    emitConstant(compiler, groupEntry->key);
+    case CODE_CONSTANT:
+    case CODE_CONSTANT_CALL_1:
+    case CODE_IMPORT_MODULE:
+    case CODE_IMPORT_VARIABLE:
+      constant = 1;
+      break;
 
-    //group value is gonna be a map
-    loadCoreVariable(compiler, "Map");
-    callMethod(compiler, 0, "new()", 5);
+    case CODE_SUPER_0:
+    case CODE_SUPER_1:
+    case CODE_SUPER_2:
+    case CODE_SUPER_3:
+    case CODE_SUPER_4:
+    case CODE_SUPER_5:
+    case CODE_SUPER_6:
+    case CODE_SUPER_7:
+    case CODE_SUPER_8:
+    case CODE_SUPER_9:
+    case CODE_SUPER_10:
+    case CODE_SUPER_11:
+    case CODE_SUPER_12:
+    case CODE_SUPER_13:
+    case CODE_SUPER_14:
+    case CODE_SUPER_15:
+    case CODE_SUPER_16:
+      constant = 3;
+      break;
 
-    ObjMap* groupItems = AS_MAP(groupEntry->value);
-    for(uint32_t itemIdx = 0; itemIdx < groupItems->capacity; itemIdx++)
-    {
-      const MapEntry* itemEntry = &groupItems->entries[itemIdx];
-      if(IS_UNDEFINED(itemEntry->key)) continue;
+    case CODE_LOAD_LOCAL_0:
+    case CODE_LOAD_LOCAL_1:
+    case CODE_LOAD_LOCAL_2:
+    case CODE_LOAD_LOCAL_3:
+    case CODE_LOAD_LOCAL_4:
+    case CODE_LOAD_LOCAL_5:
+    case CODE_LOAD_LOCAL_6:
+    case CODE_LOAD_LOCAL_7:
+    case CODE_LOAD_LOCAL_8:
+      if (code[ip] - CODE_LOAD_LOCAL_0 >= numSlots) return false;
+      break;
 
-      emitConstant(compiler, itemEntry->key);
-      // Attribute key value, key = []
-      loadCoreVariable(compiler, "List");
-      callMethod(compiler, 0, "new()", 5);
-      // Add the items to the key list
-      ObjList* items = AS_LIST(itemEntry->value);
-      for(int itemIdx = 0; itemIdx < items->elements.count; ++itemIdx)
+    case CODE_LOAD_LOCAL:
+    case CODE_STORE_LOCAL:
+    case CODE_STORE_LOCAL_POP:
+    case CODE_LOAD_LOCAL_CALL_0:
+    case CODE_LOAD_LOCAL_CALL_1:
+      slot = 1;
+      break;
+
+    case CODE_LOAD_UPVALUE:
+    case CODE_STORE_UPVALUE:
+      upvalue = 1;
+      break;
+
+    case CODE_JUMP:
+    case CODE_JUMP_IF:
+    case CODE_JUMP_IF_NUMS:
+    case CODE_AND:
+    case CODE_OR:
+      jump = 1;
+      break;
+
+    case CODE_LOOP:
+      loop = 1;
+      break;
+
+    case CODE_POP_LOOP:
+      loop = 2;
+      break;
+
+    case CODE_ITERATE:
+    {
+      if (code[ip + 1] >= numSlots || code[ip + 2] >= numSlots ||
+          code[ip + 3] > ITERATE_EXCLUSIVE_RANGE)
       {
-        emitConstant(compiler, items->elements.data[itemIdx]);
-        callMethod(compiler, 1, "addCore_(_)", 11);
+        return false;
       }
-      // Add the list to the map
-      callMethod(compiler, 2, "addCore_(_,_)", 13);
+
+      // The exit offset is checked here, the body offset below.
+      int exit = next + readOperand(code, ip + 4);
+      if (exit >= fn->code.count - 1) return false;
+      wrenIntBufferWrite(vm, targets, exit);
+
+      jump = 6;
+      break;
     }
 
-    // Add the key/value to the map
-    callMethod(compiler, 2, "addCore_(_,_)", 13);
+    case CODE_CLOSURE:
+      // The function's constant was checked before finding [size]. Each
+      // upvalue captures either a local of [fn] or one of its upvalues.
+      for (int i = ip + 3; i < next; i += 2)
+      {
+        int limit = code[i] ? numSlots : fn->numUpvalues;
+        if (code[i + 1] >= limit) return false;
+      }
+      break;
+
+    default:
+      break;
   }
 
-}
+  if (constant != -1 &&
+      readOperand(code, ip + constant) >= fn->constants.count)
+  {
+    return false;
+  }
 
-// Methods are stored as method <-> attributes, so we have to have 
-// an indirection to resolve for methods
-static void emitAttributeMethods(Compiler* compiler, ObjMap* attributes)
-{
-    // Instantiate a new map for the attributes
-  loadCoreVariable(compiler, "Map");
-  callMethod(compiler, 0, "new()", 5);
+  if (slot != -1 && code[ip + slot] >= numSlots) return false;
+  if (upvalue != -1 && code[ip + upvalue] >= fn->numUpvalues) return false;
 
-  for(uint32_t methodIdx = 0; methodIdx < attributes->capacity; methodIdx++)
+  // Nothing jumps to the CODE_END at the end, it's never run.
+  if (jump != -1)
   {
-    const MapEntry* methodEntry = &attributes->entries[methodIdx];
-    if(IS_UNDEFINED(methodEntry->key)) continue;
-    emitConstant(compiler, methodEntry->key);
-    ObjMap* attributeMap = AS_MAP(methodEntry->value);
-    emitAttributes(compiler, attributeMap);
-    callMethod(compiler, 2, "addCore_(_,_)", 13);
+    int target = next + readOperand(code, ip + jump);
+    if (target >= fn->code.count - 1) return false;
+    wrenIntBufferWrite(vm, targets, target);
   }
-}
 
+  if (loop != -1)
+  {
+    int target = next - readOperand(code, ip + loop);
+    if (target < 0) return false;
+    wrenIntBufferWrite(vm, targets, target);
+  }
 
-// Emit the final ClassAttributes that exists at runtime
-static void emitClassAttributes(Compiler* compiler, ClassInfo* classInfo)
+  return true;
+}
+
+// Maps the method symbol or module variable index at [operand] through
+// [indexes]. When writing, indexes not in the table yet are added to [table].
+// Returns false if an index is out of range.
+static bool remapOperand(WrenVM* vm, uint8_t* operand, IntBuffer* indexes,
+                         IntBuffer* table)
 {
-  loadCoreVariable(compiler, "ClassAttributes");
+  int index = readOperand(operand, 0);
+  if (index >= indexes->count) return false;
 
-  classInfo->classAttributes 
-    ? emitAttributes(compiler, classInfo->classAttributes) 
-    : null(compiler, false);
+  if (indexes->data[index] == -1)
+  {
+    if (table == NULL) return false;
 
-  classInfo->methodAttributes 
-    ? emitAttributeMethods(compiler, classInfo->methodAttributes) 
-    : null(compiler, false);
+    indexes->data[index] = table->count;
+    wrenIntBufferWrite(vm, table, index);
+  }
 
-  callMethod(compiler, 2, "new(_,_)", 8);
+  operand[0] = (indexes->data[index] >> 8) & 0xff;
+  operand[1] = indexes->data[index] & 0xff;
+  return true;
 }
 
-// Copy the current attributes stored in the compiler into a destination map
-// This also resets the counter, since the intent is to consume the attributes
-static void copyAttributes(Compiler* compiler, ObjMap* into)
+// Rewrites the method symbols and module variables in the instructions of
+// [fn] through [methods] and [variables], see [remapOperand], marking where
+// each one starts in [starts]. Returns false if the code doesn't end where it
+// should or an instruction fails [checkOperands].
+static bool remapInstructions(WrenVM* vm, ObjFn* fn, ByteBuffer* starts,
+                              IntBuffer* targets, IntBuffer* methods,
+                              IntBuffer* methodTable, IntBuffer* variables,
+                              IntBuffer* variableTable)
 {
-  compiler->numAttributes = 0;
+  uint8_t* code = fn->code.data;
+  int ip = 0;
 
-  if(compiler->attributes->count == 0) return;
-  if(into == NULL) return;
+  while (ip < fn->code.count)
+  {
+    Code instruction = (Code)code[ip];
+    if (instruction == CODE_END) return ip == fn->code.count - 1;
+    if (instruction > CODE_END) return false;
 
-  WrenVM* vm = compiler->parser->vm;
-  
-  // Note we copy the actual values as is since we'll take ownership 
-  // and clear the original map
-  for(uint32_t attrIdx = 0; attrIdx < compiler->attributes->capacity; attrIdx++)
+    starts->data[ip] = true;
+
+    // Closures are the only instruction whose size depends on a constant.
+    if (instruction == CODE_CLOSURE)
+    {
+      if (ip + 2 >= fn->code.count) return false;
+
+      int constant = readOperand(code, ip + 1);
+      if (constant >= fn->constants.count ||
+          !IS_FN(fn->constants.data[constant]))
+      {
+        return false;
+      }
+    }
+
+    int size = 1 + getByteCountForArguments(code, fn->constants.data, ip);
+    if (ip + size >= fn->code.count) return false;
+    if (!checkOperands(vm, fn, ip, size, targets)) return false;
+
+    int method = -1;
+    int variable = -1;
+
+    switch (instruction)
+    {
+      case CODE_CALL_0:
+      case CODE_CALL_1:
+      case CODE_CALL_2:
+      case CODE_CALL_3:
+      case CODE_CALL_4:
+      case CODE_CALL_5:
+      case CODE_CALL_6:
+      case CODE_CALL_7:
+      case CODE_CALL_8:
+      case CODE_CALL_9:
+      case CODE_CALL_10:
+      case CODE_CALL_11:
+      case CODE_CALL_12:
+      case CODE_CALL_13:
+      case CODE_CALL_14:
+      case CODE_CALL_15:
+      case CODE_CALL_16:
+      case CODE_SUPER_0:
+      case CODE_SUPER_1:
+      case CODE_SUPER_2:
+      case CODE_SUPER_3:
+      case CODE_SUPER_4:
+      case CODE_SUPER_5:
+      case CODE_SUPER_6:
+      case CODE_SUPER_7:
+      case CODE_SUPER_8:
+      case CODE_SUPER_9:
+      case CODE_SUPER_10:
+      case CODE_SUPER_11:
+      case CODE_SUPER_12:
+      case CODE_SUPER_13:
+      case CODE_SUPER_14:
+      case CODE_SUPER_15:
+      case CODE_SUPER_16:
+      case CODE_METHOD_INSTANCE:
+      case CODE_METHOD_STATIC:
+        method = 1;
+        break;
+
+      case CODE_LOAD_LOCAL_CALL_0:
+      case CODE_LOAD_LOCAL_CALL_1:
+        method = 2;
+        break;
+
+      case CODE_CONSTANT_CALL_1:
+        method = 4;
+        break;
+
+      case CODE_LOAD_MODULE_VAR_CALL_0:
+        variable = 1;
+        method = 4;
+        break;
+
+      case CODE_LOAD_MODULE_VAR:
+      case CODE_STORE_MODULE_VAR:
+      case CODE_STORE_MODULE_VAR_POP:
+        variable = 1;
+        break;
+
+      default:
+        break;
+    }
+
+    if (method != -1 &&
+        !remapOperand(vm, code + ip + method, methods, methodTable))
+    {
+      return false;
+    }
+
+    if (variable != -1 &&
+        !remapOperand(vm, code + ip + variable, variables, variableTable))
+    {
+      return false;
+    }
+
+    ip += size;
+  }
+
+  return false;
+}
+
+// Rewrites [fn]'s code with [remapInstructions], and checks that its jumps
+// land on the start of an instruction. Returns false if anything about the
+// code is wrong.
+static bool remapCode(WrenVM* vm, ObjFn* fn, IntBuffer* methods,
+                      IntBuffer* methodTable, IntBuffer* variables,
+                      IntBuffer* variableTable)
+{
+  ByteBuffer starts;
+  wrenByteBufferInit(&starts);
+  wrenByteBufferFill(vm, &starts, false, fn->code.count);
+
+  IntBuffer targets;
+  wrenIntBufferInit(&targets);
+
+  bool isValid = remapInstructions(vm, fn, &starts, &targets, methods,
+                                   methodTable, variables, variableTable);
+  for (int i = 0; isValid && i < targets.count; i++)
   {
-    const MapEntry* attrEntry = &compiler->attributes->entries[attrIdx];
-    if(IS_UNDEFINED(attrEntry->key)) continue;
-    wrenMapSet(vm, into, attrEntry->key, attrEntry->value);
+    isValid = starts.data[targets.data[i]];
   }
-  
-  wrenMapClear(vm, compiler->attributes);
+
+  wrenByteBufferClear(vm, &starts);
+  wrenIntBufferClear(vm, &targets);
+  return isValid;
 }
 
-// Copy the current attributes stored in the compiler into the method specific
-// attributes for the current enclosingClass.
-// This also resets the counter, since the intent is to consume the attributes
-static void copyMethodAttributes(Compiler* compiler, bool isForeign,
-            bool isStatic, const char* fullSignature, int32_t length) 
+// Writes [fn] and the functions it creates, depth first.
+static bool writeFn(BytecodeWriter* writer, ObjFn* fn)
 {
-  compiler->numAttributes = 0;
+  writeInt(writer, fn->arity);
+  writeInt(writer, fn->maxSlots);
+  writeInt(writer, fn->numUpvalues);
+  writeString(writer, fn->debug->name, (int)strlen(fn->debug->name));
 
-  if(compiler->attributes->count == 0) return;
+  writeInt(writer, fn->constants.count);
+  for (int i = 0; i < fn->constants.count; i++)
+  {
+    Value constant = fn->constants.data[i];
 
-  WrenVM* vm = compiler->parser->vm;
-  
-  // Make a map for this method to copy into
-  ObjMap* methodAttr = wrenNewMap(vm);
-  wrenPushRoot(vm, (Obj*)methodAttr);
-  copyAttributes(compiler, methodAttr);
+    if (IS_NULL(constant))
+    {
+      wrenByteBufferWrite(writer->vm, &writer->bytes, BYTECODE_NULL);
+    }
+    else if (IS_BOOL(constant))
+    {
+      wrenByteBufferWrite(writer->vm, &writer->bytes,
+                          AS_BOOL(constant) ? BYTECODE_TRUE : BYTECODE_FALSE);
+    }
+    else if (IS_NUM(constant))
+    {
+      wrenByteBufferWrite(writer->vm, &writer->bytes, BYTECODE_NUM);
 
-  // Include 'foreign static ' in front as needed
-  int32_t fullLength = length;
-  if(isForeign) fullLength += 8;
-  if(isStatic) fullLength += 7;
-  char fullSignatureWithPrefix[MAX_METHOD_SIGNATURE + 8 + 7];
-  const char* foreignPrefix = isForeign ? "foreign " : "";
-  const char* staticPrefix = isStatic ? "static " : "";
-  sprintf(fullSignatureWithPrefix, "%s%s%.*s", foreignPrefix, staticPrefix, 
-                                               length, fullSignature);
-  fullSignatureWithPrefix[fullLength] = '\0';
+      uint64_t bits = wrenDoubleToBits(AS_NUM(constant));
+      for (int shift = 0; shift < 64; shift += 8)
+      {
+        wrenByteBufferWrite(writer->vm, &writer->bytes,
+                            (uint8_t)(bits >> shift));
+      }
+    }
+    else if (IS_STRING(constant))
+    {
+      wrenByteBufferWrite(writer->vm, &writer->bytes, BYTECODE_STRING);
+      writeString(writer, AS_CSTRING(constant), AS_STRING(constant)->length);
+    }
+    else if (IS_FN(constant))
+    {
+      wrenByteBufferWrite(writer->vm, &writer->bytes, BYTECODE_FN);
+      if (!writeFn(writer, AS_FN(constant))) return false;
+    }
+    else
+    {
+      return false;
+    }
+  }
 
-  if(compiler->enclosingClass->methodAttributes == NULL) {
-    compiler->enclosingClass->methodAttributes = wrenNewMap(vm);
+  // The code is written with the table indexes in place of the VM's.
+  writeInt(writer, fn->code.count);
+  int codeStart = writer->bytes.count;
+  writeBytes(writer, fn->code.data, fn->code.count);
+
+  ObjFn copy = *fn;
+  copy.code.data = writer->bytes.data + codeStart;
+  if (!remapCode(writer->vm, &copy, &writer->methodIndexes, &writer->methods,
+                 &writer->variableIndexes, &writer->variables))
+  {
+    return false;
   }
-  
-  // Store the method attributes in the class map
-  Value key = wrenNewStringLength(vm, fullSignatureWithPrefix, fullLength);
-  wrenMapSet(vm, compiler->enclosingClass->methodAttributes, key, OBJ_VAL(methodAttr));
 
-  wrenPopRoot(vm);
+  for (int i = 0; i < fn->code.count; i++)
+  {
+    writeInt(writer, fn->debug->sourceLines.data[i]);
+  }
+
+  return true;
 }
-// End file "wren_compiler.c"
-// Begin file "wren_core.c"
-#include <ctype.h>
-#include <errno.h>
-#include <float.h>
-#include <math.h>
-#include <string.h>
-#include <time.h>
 
-// Begin file "wren_core.h"
-#ifndef wren_core_h
-#define wren_core_h
+bool wrenSerializeModule(WrenVM* vm, ObjFn* fn, const char* source,
+                         ByteBuffer* bytes)
+{
+  BytecodeWriter writer;
+  writer.vm = vm;
+  wrenByteBufferInit(&writer.bytes);
+  wrenIntBufferInit(&writer.methodIndexes);
+  wrenIntBufferInit(&writer.variableIndexes);
+  wrenIntBufferInit(&writer.methods);
+  wrenIntBufferInit(&writer.variables);
 
+  wrenIntBufferFill(vm, &writer.methodIndexes, -1, vm->methodNames.count);
+  wrenIntBufferFill(vm, &writer.variableIndexes, -1,
+                    fn->module->variableNames.count);
 
-// This module defines the built-in classes and their primitives methods that
-// are implemented directly in C code. Some languages try to implement as much
-// of the core module itself in the primary language instead of in the host
-// language.
-//
-// With Wren, we try to do as much of it in C as possible. Primitive methods
-// are always faster than code written in Wren, and it minimizes startup time
-// since we don't have to parse, compile, and execute Wren code.
-//
-// There is one limitation, though. Methods written in C cannot call Wren ones.
-// They can only be the top of the callstack, and immediately return. This
-// makes it difficult to have primitive methods that rely on polymorphic
-// behavior. For example, `System.print` should call `toString` on its argument,
-// including user-defined `toString` methods on user-defined classes.
+  bool success = writeFn(&writer, fn);
 
-void wrenInitializeCore(WrenVM* vm);
+  if (success)
+  {
+    // The name tables go before the functions that filled them.
+    BytecodeWriter payload = writer;
+    wrenByteBufferInit(&payload.bytes);
 
-#endif
-// End file "wren_core.h"
-// Begin file "wren_primitive.h"
-#ifndef wren_primitive_h
-#define wren_primitive_h
+    writeInt(&payload, writer.methods.count);
+    for (int i = 0; i < writer.methods.count; i++)
+    {
+      ObjString* name = vm->methodNames.data[writer.methods.data[i]];
+      writeString(&payload, name->value, name->length);
+    }
 
+    writeInt(&payload, writer.variables.count);
+    for (int i = 0; i < writer.variables.count; i++)
+    {
+      ObjString* name = fn->module->variableNames.data[writer.variables.data[i]];
+      writeString(&payload, name->value, name->length);
+    }
 
-// Binds a primitive method named [name] (in Wren) implemented using C function
-// [fn] to `ObjClass` [cls].
-#define PRIMITIVE(cls, name, function)                                         \
-    do                                                                         \
-    {                                                                          \
-      int symbol = wrenSymbolTableEnsure(vm,                                   \
-          &vm->methodNames, name, strlen(name));                               \
-      Method method;                                                           \
-      method.type = METHOD_PRIMITIVE;                                          \
-      method.as.primitive = prim_##function;                                   \
-      wrenBindMethod(vm, cls, symbol, method);                                 \
-    } while (false)
+    writeBytes(&payload, writer.bytes.data, writer.bytes.count);
 
-// Binds a primitive method named [name] (in Wren) implemented using C function
-// [fn] to `ObjClass` [cls], but as a FN call.
-#define FUNCTION_CALL(cls, name, function)                                     \
-    do                                                                         \
-    {                                                                          \
-      int symbol = wrenSymbolTableEnsure(vm,                                   \
-          &vm->methodNames, name, strlen(name));                               \
-      Method method;                                                           \
-      method.type = METHOD_FUNCTION_CALL;                                      \
-      method.as.primitive = prim_##function;                                   \
-      wrenBindMethod(vm, cls, symbol, method);                                 \
-    } while (false)
+    // And the header before both, with a checksum of them so that a damaged
+    // file is caught before any of it is read.
+    BytecodeWriter header = writer;
+    wrenByteBufferInit(&header.bytes);
 
-// Defines a primitive method whose C function name is [name]. This abstracts
-// the actual type signature of a primitive function and makes it clear which C
-// functions are invoked as primitives.
-#define DEF_PRIMITIVE(name)                                                    \
-    static bool prim_##name(WrenVM* vm, Value* args)
+    writeBytes(&header, BYTECODE_MAGIC, 4);
+    writeInt(&header, BYTECODE_VERSION);
+    writeInt(&header, CODE_END);
+    writeInt(&header, hashSource(source));
+    writeInt(&header, hashBytes(payload.bytes.data, payload.bytes.count));
 
-#define RETURN_VAL(value)                                                      \
-    do                                                                         \
-    {                                                                          \
-      args[0] = value;                                                         \
-      return true;                                                             \
-    } while (false)
+    writeBytes(&header, payload.bytes.data, payload.bytes.count);
+    wrenByteBufferClear(vm, &payload.bytes);
+    *bytes = header.bytes;
+  }
 
-#define RETURN_OBJ(obj)     RETURN_VAL(OBJ_VAL(obj))
-#define RETURN_BOOL(value)  RETURN_VAL(BOOL_VAL(value))
-#define RETURN_FALSE        RETURN_VAL(FALSE_VAL)
-#define RETURN_NULL         RETURN_VAL(NULL_VAL)
-#define RETURN_NUM(value)   RETURN_VAL(NUM_VAL(value))
-#define RETURN_TRUE         RETURN_VAL(TRUE_VAL)
+  wrenByteBufferClear(vm, &writer.bytes);
+  wrenIntBufferClear(vm, &writer.methodIndexes);
+  wrenIntBufferClear(vm, &writer.variableIndexes);
+  wrenIntBufferClear(vm, &writer.methods);
+  wrenIntBufferClear(vm, &writer.variables);
 
-#define RETURN_ERROR(msg)                                                      \
-    do                                                                         \
-    {                                                                          \
-      vm->fiber->error = wrenNewStringLength(vm, msg, sizeof(msg) - 1);        \
-      return false;                                                            \
-    } while (false)
+  return success;
+}
 
-#define RETURN_ERROR_FMT(...)                                                  \
-    do                                                                         \
-    {                                                                          \
-      vm->fiber->error = wrenStringFormat(vm, __VA_ARGS__);                    \
-      return false;                                                            \
-    } while (false)
+// Reads a function written by [writeFn] into [fn], which the caller keeps
+// reachable.
+static bool readFn(BytecodeReader* reader, ObjFn* fn)
+{
+  WrenVM* vm = reader->vm;
 
-// Validates that the given [arg] is a function. Returns true if it is. If not,
-// reports an error and returns false.
-bool validateFn(WrenVM* vm, Value arg, const char* argName);
+  uint64_t arity = readInt(reader);
+  uint64_t maxSlots = readInt(reader);
+  uint64_t numUpvalues = readInt(reader);
 
-// Validates that the given [arg] is a Num. Returns true if it is. If not,
-// reports an error and returns false.
-bool validateNum(WrenVM* vm, Value arg, const char* argName);
+  // The cap on slots is far more than the compiler ever uses, it only keeps a
+  // corrupted count from growing the stack without bound.
+  if (arity > MAX_PARAMETERS || maxSlots > MAX_CONSTANTS ||
+      numUpvalues > MAX_UPVALUES)
+  {
+    return false;
+  }
 
-// Validates that [value] is an integer. Returns true if it is. If not, reports
-// an error and returns false.
-bool validateIntValue(WrenVM* vm, double value, const char* argName);
+  fn->arity = (int)arity;
+  fn->maxSlots = (int)maxSlots;
+  fn->numUpvalues = (int)numUpvalues;
 
-// Validates that the given [arg] is an integer. Returns true if it is. If not,
-// reports an error and returns false.
-bool validateInt(WrenVM* vm, Value arg, const char* argName);
+  uint64_t nameLength = readInt(reader);
+  const uint8_t* name = readBytes(reader, nameLength);
+  if (reader->hasError) return false;
+  wrenFunctionBindName(vm, fn, (const char*)name, (int)nameLength);
 
-// Validates that [arg] is a valid object for use as a map key. Returns true if
-// it is. If not, reports an error and returns false.
-bool validateKey(WrenVM* vm, Value arg);
+  uint64_t numConstants = readInt(reader);
+  if (numConstants > MAX_CONSTANTS) return false;
 
-// Validates that the argument at [argIndex] is an integer within `[0, count)`.
-// Also allows negative indices which map backwards from the end. Returns the
-// valid positive index value. If invalid, reports an error and returns
-// `UINT32_MAX`.
-uint32_t validateIndex(WrenVM* vm, Value arg, uint32_t count,
-                       const char* argName);
+  for (uint64_t i = 0; i < numConstants && !reader->hasError; i++)
+  {
+    const uint8_t* tag = readBytes(reader, 1);
+    if (tag == NULL) return false;
 
-// Validates that the given [arg] is a String. Returns true if it is. If not,
-// reports an error and returns false.
-bool validateString(WrenVM* vm, Value arg, const char* argName);
+    Value constant;
+    switch ((BytecodeConstant)*tag)
+    {
+      case BYTECODE_NULL: constant = NULL_VAL; break;
+      case BYTECODE_FALSE: constant = FALSE_VAL; break;
+      case BYTECODE_TRUE: constant = TRUE_VAL; break;
 
-// Given a [range] and the [length] of the object being operated on, determines
-// the series of elements that should be chosen from the underlying object.
-// Handles ranges that count backwards from the end as well as negative ranges.
-//
-// Returns the index from which the range should start or `UINT32_MAX` if the
-// range is invalid. After calling, [length] will be updated with the number of
-// elements in the resulting sequence. [step] will be direction that the range
-// is going: `1` if the range is increasing from the start index or `-1` if the
-// range is decreasing.
-uint32_t calculateRange(WrenVM* vm, ObjRange* range, uint32_t* length,
-                        int* step);
+      case BYTECODE_NUM:
+      {
+        const uint8_t* bytes = readBytes(reader, 8);
+        if (bytes == NULL) return false;
 
-#endif
-// End file "wren_primitive.h"
+        uint64_t bits = 0;
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+          bits |= (uint64_t)*bytes++ << shift;
+        }
 
-// Begin file "wren_core.wren.inc"
-// Generated automatically from src/vm/wren_core.wren. Do not edit.
-static const char* coreModuleSource =
-"class Bool {}\n"
-"class Fiber {}\n"
-"class Fn {}\n"
-"class Null {}\n"
-"class Num {}\n"
-"\n"
-"class Sequence {\n"
-"  all(f) {\n"
-"    var result = true\n"
-"    for (element in this) {\n"
-"      result = f.call(element)\n"
-"      if (!result) return result\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  any(f) {\n"
-"    var result = false\n"
-"    for (element in this) {\n"
-"      result = f.call(element)\n"
-"      if (result) return result\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  contains(element) {\n"
-"    for (item in this) {\n"
-"      if (element == item) return true\n"
-"    }\n"
-"    return false\n"
-"  }\n"
-"\n"
-"  count {\n"
-"    var result = 0\n"
-"    for (element in this) {\n"
-"      result = result + 1\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  count(f) {\n"
-"    var result = 0\n"
-"    for (element in this) {\n"
-"      if (f.call(element)) result = result + 1\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  each(f) {\n"
-"    for (element in this) {\n"
-"      f.call(element)\n"
-"    }\n"
-"  }\n"
-"\n"
-"  isEmpty { iterate(null) ? false : true }\n"
-"\n"
-"  map(transformation) { MapSequence.new(this, transformation) }\n"
-"\n"
-"  skip(count) {\n"
-"    if (!(count is Num) || !count.isInteger || count < 0) {\n"
-"      Fiber.abort(\"Count must be a non-negative integer.\")\n"
-"    }\n"
-"\n"
-"    return SkipSequence.new(this, count)\n"
-"  }\n"
-"\n"
-"  take(count) {\n"
-"    if (!(count is Num) || !count.isInteger || count < 0) {\n"
-"      Fiber.abort(\"Count must be a non-negative integer.\")\n"
-"    }\n"
-"\n"
-"    return TakeSequence.new(this, count)\n"
-"  }\n"
-"\n"
-"  where(predicate) { WhereSequence.new(this, predicate) }\n"
-"\n"
-"  reduce(acc, f) {\n"
-"    for (element in this) {\n"
-"      acc = f.call(acc, element)\n"
-"    }\n"
-"    return acc\n"
-"  }\n"
-"\n"
-"  reduce(f) {\n"
-"    var iter = iterate(null)\n"
-"    if (!iter) Fiber.abort(\"Can't reduce an empty sequence.\")\n"
-"\n"
-"    // Seed with the first element.\n"
-"    var result = iteratorValue(iter)\n"
-"    while (iter = iterate(iter)) {\n"
-"      result = f.call(result, iteratorValue(iter))\n"
-"    }\n"
-"\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  join() { join(\"\") }\n"
-"\n"
-"  join(sep) {\n"
-"    var first = true\n"
-"    var result = \"\"\n"
-"\n"
-"    for (element in this) {\n"
-"      if (!first) result = result + sep\n"
-"      first = false\n"
-"      result = result + element.toString\n"
-"    }\n"
-"\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  toList {\n"
-"    var result = List.new()\n"
-"    for (element in this) {\n"
-"      result.add(element)\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"}\n"
-"\n"
-"class MapSequence is Sequence {\n"
-"  construct new(sequence, fn) {\n"
-"    _sequence = sequence\n"
-"    _fn = fn\n"
-"  }\n"
-"\n"
-"  iterate(iterator) { _sequence.iterate(iterator) }\n"
-"  iteratorValue(iterator) { _fn.call(_sequence.iteratorValue(iterator)) }\n"
-"}\n"
-"\n"
-"class SkipSequence is Sequence {\n"
-"  construct new(sequence, count) {\n"
-"    _sequence = sequence\n"
-"    _count = count\n"
-"  }\n"
-"\n"
-"  iterate(iterator) {\n"
-"    if (iterator) {\n"
-"      return _sequence.iterate(iterator)\n"
-"    } else {\n"
-"      iterator = _sequence.iterate(iterator)\n"
-"      var count = _count\n"
-"      while (count > 0 && iterator) {\n"
-"        iterator = _sequence.iterate(iterator)\n"
-"        count = count - 1\n"
-"      }\n"
-"      return iterator\n"
-"    }\n"
-"  }\n"
-"\n"
-"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
-"}\n"
-"\n"
-"class TakeSequence is Sequence {\n"
-"  construct new(sequence, count) {\n"
-"    _sequence = sequence\n"
-"    _count = count\n"
-"  }\n"
-"\n"
-"  iterate(iterator) {\n"
-"    if (!iterator) _taken = 1 else _taken = _taken + 1\n"
-"    return _taken > _count ? null : _sequence.iterate(iterator)\n"
-"  }\n"
-"\n"
-"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
-"}\n"
-"\n"
-"class WhereSequence is Sequence {\n"
-"  construct new(sequence, fn) {\n"
-"    _sequence = sequence\n"
-"    _fn = fn\n"
-"  }\n"
-"\n"
-"  iterate(iterator) {\n"
-"    while (iterator = _sequence.iterate(iterator)) {\n"
-"      if (_fn.call(_sequence.iteratorValue(iterator))) break\n"
-"    }\n"
-"    return iterator\n"
-"  }\n"
-"\n"
-"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
-"}\n"
-"\n"
-"class String is Sequence {\n"
-"  bytes { StringByteSequence.new(this) }\n"
-"  codePoints { StringCodePointSequence.new(this) }\n"
-"\n"
-"  split(delimiter) {\n"
-"    if (!(delimiter is String) || delimiter.isEmpty) {\n"
-"      Fiber.abort(\"Delimiter must be a non-empty string.\")\n"
-"    }\n"
-"\n"
-"    var result = []\n"
-"\n"
-"    var last = 0\n"
-"    var index = 0\n"
-"\n"
-"    var delimSize = delimiter.byteCount_\n"
-"    var size = byteCount_\n"
-"\n"
-"    while (last < size && (index = indexOf(delimiter, last)) != -1) {\n"
-"      result.add(this[last...index])\n"
-"      last = index + delimSize\n"
-"    }\n"
-"\n"
-"    if (last < size) {\n"
-"      result.add(this[last..-1])\n"
-"    } else {\n"
-"      result.add(\"\")\n"
-"    }\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  replace(from, to) {\n"
-"    if (!(from is String) || from.isEmpty) {\n"
-"      Fiber.abort(\"From must be a non-empty string.\")\n"
-"    } else if (!(to is String)) {\n"
-"      Fiber.abort(\"To must be a string.\")\n"
-"    }\n"
-"\n"
-"    var result = \"\"\n"
-"\n"
-"    var last = 0\n"
-"    var index = 0\n"
-"\n"
-"    var fromSize = from.byteCount_\n"
-"    var size = byteCount_\n"
-"\n"
-"    while (last < size && (index = indexOf(from, last)) != -1) {\n"
-"      result = result + this[last...index] + to\n"
-"      last = index + fromSize\n"
-"    }\n"
-"\n"
-"    if (last < size) result = result + this[last..-1]\n"
-"\n"
-"    return result\n"
-"  }\n"
-"\n"
-"  trim() { trim_(\"\\t\\r\\n \", true, true) }\n"
-"  trim(chars) { trim_(chars, true, true) }\n"
-"  trimEnd() { trim_(\"\\t\\r\\n \", false, true) }\n"
-"  trimEnd(chars) { trim_(chars, false, true) }\n"
-"  trimStart() { trim_(\"\\t\\r\\n \", true, false) }\n"
-"  trimStart(chars) { trim_(chars, true, false) }\n"
-"\n"
-"  trim_(chars, trimStart, trimEnd) {\n"
+        constant = NUM_VAL(wrenDoubleFromBits(bits));
+        break;
+      }
+
+      case BYTECODE_STRING:
+      {
+        uint64_t length = readInt(reader);
+        const uint8_t* text = readBytes(reader, length);
+        if (text == NULL) return false;
+
+        constant = wrenNewStringLength(vm, (const char*)text, (size_t)length);
+        break;
+      }
+
+      case BYTECODE_FN:
+        constant = OBJ_VAL(wrenNewFunction(vm, reader->module, 0));
+        break;
+
+      default:
+        return false;
+    }
+
+    if (IS_OBJ(constant)) wrenPushRoot(vm, AS_OBJ(constant));
+    wrenValueBufferWrite(vm, &fn->constants, constant);
+    wrenRememberStore(vm, &fn->obj, constant);
+    if (IS_OBJ(constant)) wrenPopRoot(vm);
+
+    // Nested functions are filled in once they're reachable from [fn].
+    if (IS_FN(constant) && !readFn(reader, AS_FN(constant))) return false;
+  }
+
+  uint64_t codeLength = readInt(reader);
+  const uint8_t* code = readBytes(reader, codeLength);
+  if (reader->hasError) return false;
+
+  for (uint64_t i = 0; i < codeLength; i++)
+  {
+    wrenByteBufferWrite(vm, &fn->code, code[i]);
+  }
+
+  for (uint64_t i = 0; i < codeLength && !reader->hasError; i++)
+  {
+    wrenIntBufferWrite(vm, &fn->debug->sourceLines, (int)readInt(reader));
+  }
+
+  return !reader->hasError &&
+         remapCode(vm, fn, &reader->methods, NULL, &reader->variables, NULL);
+}
+
+ObjFn* wrenDeserializeModule(WrenVM* vm, ObjModule* module,
+                             const char* source, const uint8_t* bytecode,
+                             size_t length)
+{
+  BytecodeReader reader;
+  reader.vm = vm;
+  reader.module = module;
+  reader.data = bytecode;
+  reader.length = length;
+  reader.position = 0;
+  reader.hasError = false;
+  wrenIntBufferInit(&reader.methods);
+  wrenIntBufferInit(&reader.variables);
+
+  const uint8_t* magic = readBytes(&reader, 4);
+  if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0 ||
+      readInt(&reader) != BYTECODE_VERSION ||
+      readInt(&reader) != CODE_END ||
+      readInt(&reader) != hashSource(source))
+  {
+    return NULL;
+  }
+
+  uint64_t checksum = readInt(&reader);
+  if (reader.hasError ||
+      checksum != hashBytes(reader.data + reader.position,
+                            reader.length - reader.position))
+  {
+    return NULL;
+  }
+
+  uint64_t numMethods = readInt(&reader);
+  for (uint64_t i = 0; i < numMethods && !reader.hasError; i++)
+  {
+    uint64_t nameLength = readInt(&reader);
+    const char* name = (const char*)readBytes(&reader, nameLength);
+    if (name == NULL || nameLength > MAX_METHOD_SIGNATURE) break;
+
+    wrenIntBufferWrite(vm, &reader.methods,
+        wrenSymbolTableEnsure(vm, &vm->methodNames, name, (size_t)nameLength));
+  }
+
+  // Variables defined here are taken out again if loading fails, so that the
+  // source can still be compiled into the module.
+  int numExistingVariables = module->variables.count;
+
+  uint64_t numVariables = readInt(&reader);
+  for (uint64_t i = 0; i < numVariables && !reader.hasError; i++)
+  {
+    uint64_t nameLength = readInt(&reader);
+    const char* name = (const char*)readBytes(&reader, nameLength);
+    if (name == NULL) break;
+
+    int symbol = wrenSymbolTableFind(&module->variableNames, name,
+                                     (size_t)nameLength);
+    if (symbol == -1)
+    {
+      symbol = wrenDefineVariable(vm, module, name, (size_t)nameLength,
+                                  NULL_VAL, NULL);
+    }
+
+    if (symbol < 0) reader.hasError = true;
+    wrenIntBufferWrite(vm, &reader.variables, symbol);
+  }
+
+  ObjFn* fn = NULL;
+  if (!reader.hasError && (uint64_t)reader.methods.count == numMethods &&
+      (uint64_t)reader.variables.count == numVariables)
+  {
+    fn = wrenNewFunction(vm, module, 0);
+    wrenPushRoot(vm, (Obj*)fn);
+    if (!readFn(&reader, fn) || reader.position != reader.length) fn = NULL;
+    wrenPopRoot(vm);
+  }
+
+  if (fn == NULL)
+  {
+    module->variables.count = numExistingVariables;
+    module->variableNames.count = numExistingVariables;
+  }
+
+  wrenIntBufferClear(vm, &reader.methods);
+  wrenIntBufferClear(vm, &reader.variables);
+
+  return fn;
+}
+
+// Numeric operators and methods whose result native code computes directly
+// when the operands are what the primitive expects. Both Num and List are
+// built in classes that can't be subclassed, so that's exactly what the
+// primitive would do.
+typedef enum
+{
+  NATIVE_NUM_INFIX,
+  NATIVE_NUM_BITWISE,
+  NATIVE_NUM_SHIFT,
+  NATIVE_NUM_PREFIX,
+  NATIVE_LIST_SUBSCRIPT,
+  NATIVE_LIST_COUNT
+} NativeOpKind;
+
+typedef struct
+{
+  const char* signature;
+  NativeOpKind kind;
+
+  // The result, in terms of the doubles `a` and `b`.
+  const char* result;
+} NativeOp;
+
+static const NativeOp nativeOps[] = {
+  { "+(_)",  NATIVE_NUM_INFIX,   "NUM_VAL(a + b)" },
+  { "-(_)",  NATIVE_NUM_INFIX,   "NUM_VAL(a - b)" },
+  { "*(_)",  NATIVE_NUM_INFIX,   "NUM_VAL(a * b)" },
+  { "/(_)",  NATIVE_NUM_INFIX,   "NUM_VAL(a / b)" },
+  { "%(_)",  NATIVE_NUM_INFIX,   "NUM_VAL(fmod(a, b))" },
+  { "<(_)",  NATIVE_NUM_INFIX,   "BOOL_VAL(a < b)" },
+  { ">(_)",  NATIVE_NUM_INFIX,   "BOOL_VAL(a > b)" },
+  { "<=(_)", NATIVE_NUM_INFIX,   "BOOL_VAL(a <= b)" },
+  { ">=(_)", NATIVE_NUM_INFIX,   "BOOL_VAL(a >= b)" },
+  { "==(_)", NATIVE_NUM_INFIX,   "BOOL_VAL(a == b)" },
+  { "!=(_)", NATIVE_NUM_INFIX,   "BOOL_VAL(a != b)" },
+  { "&(_)",  NATIVE_NUM_BITWISE, "NUM_VAL((uint32_t)a & (uint32_t)b)" },
+  { "|(_)",  NATIVE_NUM_BITWISE, "NUM_VAL((uint32_t)a | (uint32_t)b)" },
+  { "^(_)",  NATIVE_NUM_BITWISE, "NUM_VAL((uint32_t)a ^ (uint32_t)b)" },
+  { "<<(_)", NATIVE_NUM_SHIFT,   "NUM_VAL((uint32_t)a << (uint32_t)b)" },
+  { ">>(_)", NATIVE_NUM_SHIFT,   "NUM_VAL((uint32_t)a >> (uint32_t)b)" },
+  { "-",     NATIVE_NUM_PREFIX,  "NUM_VAL(-a)" },
+  { "abs",   NATIVE_NUM_PREFIX,  "NUM_VAL(fabs(a))" },
+  { "ceil",  NATIVE_NUM_PREFIX,  "NUM_VAL(ceil(a))" },
+  { "floor", NATIVE_NUM_PREFIX,  "NUM_VAL(floor(a))" },
+  { "round", NATIVE_NUM_PREFIX,  "NUM_VAL(round(a))" },
+  { "sqrt",  NATIVE_NUM_PREFIX,  "NUM_VAL(sqrt(a))" },
+  { "sin",   NATIVE_NUM_PREFIX,  "NUM_VAL(sin(a))" },
+  { "cos",   NATIVE_NUM_PREFIX,  "NUM_VAL(cos(a))" },
+  { "tan",   NATIVE_NUM_PREFIX,  "NUM_VAL(tan(a))" },
+  { "atan",  NATIVE_NUM_PREFIX,  "NUM_VAL(atan(a))" },
+  { "exp",   NATIVE_NUM_PREFIX,  "NUM_VAL(exp(a))" },
+  { "log",   NATIVE_NUM_PREFIX,  "NUM_VAL(log(a))" },
+  { "[_]",   NATIVE_LIST_SUBSCRIPT, NULL },
+  { "count", NATIVE_LIST_COUNT,  NULL },
+  { NULL,    NATIVE_NUM_INFIX,   NULL }
+};
+
+typedef struct
+{
+  WrenVM* vm;
+  WrenWriteFn write;
+
+  // Names the generated functions apart from other modules'.
+  uint64_t hash;
+
+  // The functions written so far, each one's index is its place in a depth
+  // first walk of the module's functions.
+  int numFns;
+} NativeWriter;
+
+static void writeNative(NativeWriter* writer, const char* format, ...)
+{
+  char text[512];
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+
+  writer->write(writer->vm, text);
+}
+
+static const NativeOp* findNativeOp(WrenVM* vm, const uint8_t* operand,
+                                    int numArgs)
+{
+  ObjString* name = vm->methodNames.data[(operand[0] << 8) | operand[1]];
+
+  for (const NativeOp* op = nativeOps; op->signature != NULL; op++)
+  {
+    bool isBinary = op->kind != NATIVE_NUM_PREFIX &&
+                    op->kind != NATIVE_LIST_COUNT;
+    if (strcmp(op->signature, name->value) == 0 &&
+        numArgs == (isBinary ? 2 : 1))
+    {
+      return op;
+    }
+  }
+
+  return NULL;
+}
+
+// Writes the code for a call to [op] at [offset] whose receiver and argument
+// are the C expressions [receiver] and [arg]. Leaves the result in
+// [result], a C lvalue.
+static void writeNativeOp(NativeWriter* writer, const NativeOp* op, int offset,
+                          const char* receiver, const char* arg,
+                          const char* result)
+{
+  writeNative(writer, "  {\n    Value r = %s;\n", receiver);
+  if (arg != NULL) writeNative(writer, "    Value v = %s;\n", arg);
+
+  switch (op->kind)
+  {
+    case NATIVE_NUM_INFIX:
+    case NATIVE_NUM_BITWISE:
+    case NATIVE_NUM_SHIFT:
+      writeNative(writer,
+          "    if (!IS_NUM(r) || !IS_NUM(v)) NATIVE_EXIT(%d);\n"
+          "    double a = AS_NUM(r), b = AS_NUM(v);\n", offset);
+
+      // Operands out of range behave as the primitive decides.
+      if (op->kind != NATIVE_NUM_INFIX)
+      {
+        writeNative(writer,
+            "    if (!isBitwiseOperand(a) || !isBitwiseOperand(b)%s) "
+            "NATIVE_EXIT(%d);\n",
+            op->kind == NATIVE_NUM_SHIFT ? " || b >= 32" : "", offset);
+      }
+
+      writeNative(writer, "    %s = %s;\n", result, op->result);
+      break;
+
+    case NATIVE_NUM_PREFIX:
+      writeNative(writer,
+          "    if (!IS_NUM(r)) NATIVE_EXIT(%d);\n"
+          "    double a = AS_NUM(r);\n"
+          "    %s = %s;\n", offset, result, op->result);
+      break;
+
+    case NATIVE_LIST_SUBSCRIPT:
+      writeNative(writer,
+          "    if (!IS_LIST(r) || !IS_NUM(v)) NATIVE_EXIT(%d);\n"
+          "    ObjList* list = AS_LIST(r);\n"
+          "    double index = AS_NUM(v);\n"
+          "    if (trunc(index) != index) NATIVE_EXIT(%d);\n"
+          "    if (index < 0) index += list->elements.count;\n"
+          "    if (!(index >= 0 && index < list->elements.count)) "
+          "NATIVE_EXIT(%d);\n"
+          "    %s = list->elements.data[(uint32_t)index];\n",
+          offset, offset, offset, result);
+      break;
+
+    case NATIVE_LIST_COUNT:
+      writeNative(writer,
+          "    if (!IS_LIST(r)) NATIVE_EXIT(%d);\n"
+          "    %s = NUM_VAL(AS_LIST(r)->elements.count);\n", offset, result);
+      break;
+  }
+
+  writeNative(writer, "  }\n");
+}
+
+// The C expression for constant [index] of [fn].
+static void nativeConstant(ObjFn* fn, int index, char* text, size_t size)
+{
+  Value constant = fn->constants.data[index];
+  if (IS_NUM(constant))
+  {
+    snprintf(text, size, "NUM_VAL(wrenDoubleFromBits(0x%016llxULL))",
+             (unsigned long long)wrenDoubleToBits(AS_NUM(constant)));
+  }
+  else
+  {
+    snprintf(text, size, "fn->constants.data[%d]", index);
+  }
+}
+
+// Writes [fn] as a C function, or nothing if it has nothing native code would
+// speed up. Returns whether it wrote one.
+static bool writeNativeFn(NativeWriter* writer, ObjFn* fn, int index)
+{
+  WrenVM* vm = writer->vm;
+  const uint8_t* code = fn->code.data;
+
+  // Find the jump targets, which need labels, and the loop headers the
+  // interpreter enters native code at along with the start.
+  ByteBuffer targets;
+  wrenByteBufferInit(&targets);
+  wrenByteBufferFill(vm, &targets, 0, fn->code.count);
+  targets.data[0] = 2;
+
+  bool isWorthIt = false;
+  for (int ip = 0; code[ip] != CODE_END;
+       ip += 1 + getByteCountForArguments(code, fn->constants.data, ip))
+  {
+    Code instruction = (Code)code[ip];
+    int size = 1 + getByteCountForArguments(code, fn->constants.data, ip);
+
+    switch (instruction)
+    {
+      case CODE_JUMP:
+      case CODE_JUMP_IF:
+      case CODE_JUMP_IF_NUMS:
+      case CODE_AND:
+      case CODE_OR:
+        targets.data[ip + size + ((code[ip + 1] << 8) | code[ip + 2])] |= 1;
+        break;
+
+      case CODE_LOOP:
+        targets.data[ip + size - ((code[ip + 1] << 8) | code[ip + 2])] = 2;
+        break;
+
+      case CODE_POP_LOOP:
+        targets.data[ip + size - ((code[ip + 2] << 8) | code[ip + 3])] = 2;
+        break;
+
+      case CODE_ITERATE:
+        targets.data[ip + size + ((code[ip + 4] << 8) | code[ip + 5])] |= 1;
+        targets.data[ip + size + ((code[ip + 6] << 8) | code[ip + 7])] |= 1;
+        isWorthIt = true;
+        break;
+
+      case CODE_CALL_0:
+      case CODE_CALL_1:
+        if (findNativeOp(vm, code + ip + 1, instruction - CODE_CALL_0 + 1))
+        {
+          isWorthIt = true;
+        }
+        break;
+
+      case CODE_LOAD_LOCAL_CALL_0:
+      case CODE_LOAD_LOCAL_CALL_1:
+        if (findNativeOp(vm, code + ip + 2,
+                         instruction - CODE_LOAD_LOCAL_CALL_0 + 1))
+        {
+          isWorthIt = true;
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  if (!isWorthIt)
+  {
+    wrenByteBufferClear(vm, &targets);
+    return false;
+  }
+
+  writeNative(writer,
+      "\n// %s\n"
+      "static uint8_t* native_%016llx_%d(WrenVM* vm, ObjFiber* fiber, "
+      "uint8_t* ip)\n"
+      "{\n"
+      "  NATIVE_FRAME();\n"
+      "  switch (ip - code)\n"
+      "  {\n", fn->debug->name, (unsigned long long)writer->hash, index);
+
+  for (int ip = 0; ip < fn->code.count; ip++)
+  {
+    if (targets.data[ip] & 2)
+    {
+      writeNative(writer, "    case %d: goto L%d;\n", ip, ip);
+    }
+  }
+
+  writeNative(writer, "    default: return ip;\n  }\n");
+
+  char constant[64];
+  char operand[64];
+
+  for (int ip = 0; code[ip] != CODE_END;
+       ip += 1 + getByteCountForArguments(code, fn->constants.data, ip))
+  {
+    Code instruction = (Code)code[ip];
+    int size = 1 + getByteCountForArguments(code, fn->constants.data, ip);
+    int next = ip + size;
+    int arg = code[ip + 1];
+    int shortArg = (code[ip + 1] << 8) | code[ip + 2];
+
+    if (targets.data[ip] != 0) writeNative(writer, "L%d:\n", ip);
+
+    switch (instruction)
+    {
+      case CODE_LOAD_LOCAL_0:
+      case CODE_LOAD_LOCAL_1:
+      case CODE_LOAD_LOCAL_2:
+      case CODE_LOAD_LOCAL_3:
+      case CODE_LOAD_LOCAL_4:
+      case CODE_LOAD_LOCAL_5:
+      case CODE_LOAD_LOCAL_6:
+      case CODE_LOAD_LOCAL_7:
+      case CODE_LOAD_LOCAL_8:
+        writeNative(writer, "  *stackTop++ = stackStart[%d];\n",
+                    instruction - CODE_LOAD_LOCAL_0);
+        break;
+
+      case CODE_LOAD_LOCAL:
+        writeNative(writer, "  *stackTop++ = stackStart[%d];\n", arg);
+        break;
+
+      case CODE_STORE_LOCAL:
+        writeNative(writer, "  stackStart[%d] = stackTop[-1];\n", arg);
+        break;
+
+      case CODE_STORE_LOCAL_POP:
+        writeNative(writer, "  stackStart[%d] = *--stackTop;\n", arg);
+        break;
+
+      case CODE_POP:
+        writeNative(writer, "  stackTop--;\n");
+        break;
+
+      case CODE_NULL:
+        writeNative(writer, "  *stackTop++ = NULL_VAL;\n");
+        break;
+
+      case CODE_FALSE:
+        writeNative(writer, "  *stackTop++ = FALSE_VAL;\n");
+        break;
+
+      case CODE_TRUE:
+        writeNative(writer, "  *stackTop++ = TRUE_VAL;\n");
+        break;
+
+      case CODE_CONSTANT:
+        nativeConstant(fn, shortArg, constant, sizeof(constant));
+        writeNative(writer, "  *stackTop++ = %s;\n", constant);
+        break;
+
+      case CODE_LOAD_UPVALUE:
+        writeNative(writer,
+            "  *stackTop++ = *frame->closure->upvalues[%d]->value;\n", arg);
+        break;
+
+      case CODE_STORE_UPVALUE:
+        writeNative(writer,
+            "  NATIVE_STORE(&frame->closure->upvalues[%d]->obj, "
+            "*frame->closure->upvalues[%d]->value, stackTop[-1]);\n",
+            arg, arg);
+        break;
+
+      // Module variables and fields are read from the code, the indexes are
+      // only final once the module is loaded and the method is bound.
+      case CODE_LOAD_MODULE_VAR:
+        writeNative(writer, "  *stackTop++ = NATIVE_MODULE_VAR(%d);\n", ip);
+        break;
+
+      case CODE_STORE_MODULE_VAR:
+      case CODE_STORE_MODULE_VAR_POP:
+        writeNative(writer,
+            "  NATIVE_STORE(&fn->module->obj, NATIVE_MODULE_VAR(%d), "
+            "stackTop[-1]);\n", ip);
+        if (instruction == CODE_STORE_MODULE_VAR_POP)
+        {
+          writeNative(writer, "  stackTop--;\n");
+        }
+        break;
+
+      case CODE_LOAD_FIELD_THIS:
+        writeNative(writer, "  *stackTop++ = NATIVE_FIELD(%d);\n", ip);
+        break;
+
+      case CODE_STORE_FIELD_THIS:
+      case CODE_STORE_FIELD_THIS_POP:
+        writeNative(writer,
+            "  NATIVE_STORE(&AS_INSTANCE(stackStart[0])->obj, "
+            "NATIVE_FIELD(%d), stackTop[-1]);\n", ip);
+        if (instruction == CODE_STORE_FIELD_THIS_POP)
+        {
+          writeNative(writer, "  stackTop--;\n");
+        }
+        break;
+
+      case CODE_JUMP:
+        writeNative(writer, "  goto L%d;\n", next + shortArg);
+        break;
+
+      case CODE_LOOP:
+        writeNative(writer, "  NATIVE_LOOP(%d, 0, L%d);\n", ip,
+                    next - shortArg);
+        break;
+
+      case CODE_POP_LOOP:
+        writeNative(writer, "  NATIVE_LOOP(%d, 1, L%d);\n", ip,
+                    next - ((code[ip + 2] << 8) | code[ip + 3]));
+        break;
+
+      case CODE_JUMP_IF:
+        writeNative(writer,
+            "  if (wrenIsFalsyValue(*--stackTop)) goto L%d;\n",
+            next + shortArg);
+        break;
+
+      case CODE_JUMP_IF_NUMS:
+        writeNative(writer,
+            "  if (IS_NUM(stackTop[-1]) && IS_NUM(stackTop[-2])) goto L%d;\n",
+            next + shortArg);
+        break;
+
+      case CODE_AND:
+        writeNative(writer,
+            "  if (wrenIsFalsyValue(stackTop[-1])) goto L%d;\n"
+            "  stackTop--;\n", next + shortArg);
+        break;
+
+      case CODE_OR:
+        writeNative(writer,
+            "  if (!wrenIsFalsyValue(stackTop[-1])) goto L%d;\n"
+            "  stackTop--;\n", next + shortArg);
+        break;
+
+      case CODE_ITERATE:
+        writeNative(writer, "  NATIVE_ITERATE(%d, %d, %d, L%d, L%d);\n",
+                    code[ip + 1], code[ip + 2], code[ip + 3],
+                    next + ((code[ip + 4] << 8) | code[ip + 5]),
+                    next + ((code[ip + 6] << 8) | code[ip + 7]));
+        break;
+
+      case CODE_CALL_0:
+      case CODE_CALL_1:
+      {
+        int numArgs = instruction - CODE_CALL_0 + 1;
+        const NativeOp* op = findNativeOp(vm, code + ip + 1, numArgs);
+        if (op == NULL)
+        {
+          writeNative(writer, "  NATIVE_EXIT(%d);\n", ip);
+        }
+        else if (numArgs == 1)
+        {
+          writeNativeOp(writer, op, ip, "stackTop[-1]", NULL, "stackTop[-1]");
+        }
+        else
+        {
+          writeNativeOp(writer, op, ip, "stackTop[-2]", "stackTop[-1]",
+                        "stackTop[-2]");
+          writeNative(writer, "  stackTop--;\n");
+        }
+        break;
+      }
+
+      case CODE_LOAD_LOCAL_CALL_0:
+      case CODE_LOAD_LOCAL_CALL_1:
+      {
+        int numArgs = instruction - CODE_LOAD_LOCAL_CALL_0 + 1;
+        const NativeOp* op = findNativeOp(vm, code + ip + 2, numArgs);
+        snprintf(operand, sizeof(operand), "stackStart[%d]", arg);
+
+        if (op == NULL)
+        {
+          writeNative(writer, "  NATIVE_EXIT(%d);\n", ip);
+        }
+        else if (numArgs == 1)
+        {
+          writeNativeOp(writer, op, ip, operand, NULL, "*stackTop");
+          writeNative(writer, "  stackTop++;\n");
+        }
+        else
+        {
+          writeNativeOp(writer, op, ip, "stackTop[-1]", operand,
+                        "stackTop[-1]");
+        }
+        break;
+      }
+
+      case CODE_CONSTANT_CALL_1:
+      {
+        const NativeOp* op = findNativeOp(vm, code + ip + 4, 2);
+        nativeConstant(fn, shortArg, constant, sizeof(constant));
+
+        if (op == NULL)
+        {
+          writeNative(writer, "  NATIVE_EXIT(%d);\n", ip);
+        }
+        else
+        {
+          writeNativeOp(writer, op, ip, "stackTop[-1]", constant,
+                        "stackTop[-1]");
+        }
+        break;
+      }
+
+      case CODE_LOAD_MODULE_VAR_CALL_0:
+      {
+        const NativeOp* op = findNativeOp(vm, code + ip + 4, 1);
+        snprintf(operand, sizeof(operand), "NATIVE_MODULE_VAR(%d)", ip);
+
+        if (op == NULL)
+        {
+          writeNative(writer, "  NATIVE_EXIT(%d);\n", ip);
+        }
+        else
+        {
+          writeNativeOp(writer, op, ip, operand, NULL, "*stackTop");
+          writeNative(writer, "  stackTop++;\n");
+        }
+        break;
+      }
+
+      // Everything else goes back to the interpreter.
+      default:
+        writeNative(writer, "  NATIVE_EXIT(%d);\n", ip);
+        break;
+    }
+  }
+
+  writeNative(writer, "}\n");
+
+  wrenByteBufferClear(vm, &targets);
+  return true;
+}
+
+// Writes [fn] and the functions it creates, depth first. Adds the length of
+// each one's code to [lengths] and whether it was written to [written].
+static void writeNativeFns(NativeWriter* writer, ObjFn* fn, IntBuffer* lengths,
+                           ByteBuffer* written)
+{
+  int index = writer->numFns++;
+  wrenIntBufferWrite(writer->vm, lengths, fn->code.count);
+  wrenByteBufferWrite(writer->vm, written, writeNativeFn(writer, fn, index));
+
+  for (int i = 0; i < fn->constants.count; i++)
+  {
+    if (IS_FN(fn->constants.data[i]))
+    {
+      writeNativeFns(writer, AS_FN(fn->constants.data[i]), lengths, written);
+    }
+  }
+}
+
+void wrenWriteNativeModule(WrenVM* vm, ObjFn* fn, const char* source,
+                           WrenWriteFn write)
+{
+  NativeWriter writer;
+  writer.vm = vm;
+  writer.write = write;
+  writer.hash = hashSource(source);
+  writer.numFns = 0;
+
+  IntBuffer lengths;
+  wrenIntBufferInit(&lengths);
+  ByteBuffer written;
+  wrenByteBufferInit(&written);
+
+  writeNative(&writer,
+      "// Generated automatically from module %s. Do not edit.\n"
+      "#ifndef NATIVE_MODULE\n", fn->module->name->value);
+  writeNativeFns(&writer, fn, &lengths, &written);
+
+  // Functions are matched with the module's by their place and size.
+  writeNative(&writer, "\nstatic const NativeFnEntry native_%016llx[] = {\n",
+              (unsigned long long)writer.hash);
+  for (int i = 0; i < lengths.count; i++)
+  {
+    if (written.data[i])
+    {
+      writeNative(&writer, "  { native_%016llx_%d, %d },\n",
+                  (unsigned long long)writer.hash, i, lengths.data[i]);
+    }
+    else
+    {
+      writeNative(&writer, "  { NULL, %d },\n", lengths.data[i]);
+    }
+  }
+
+  writeNative(&writer,
+      "};\n"
+      "#else\n"
+      "NATIVE_MODULE(0x%016llxULL, native_%016llx)\n"
+      "#endif\n",
+      (unsigned long long)writer.hash, (unsigned long long)writer.hash);
+
+  wrenIntBufferClear(vm, &lengths);
+  wrenByteBufferClear(vm, &written);
+}
+
+void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
+{
+  int ip = 0;
+  for (;;)
+  {
+    Code instruction = (Code)fn->code.data[ip];
+    switch (instruction)
+    {
+      case CODE_LOAD_FIELD:
+      case CODE_STORE_FIELD:
+      case CODE_LOAD_FIELD_THIS:
+      case CODE_STORE_FIELD_THIS:
+      case CODE_STORE_FIELD_THIS_POP:
+        // Shift this class's fields down past the inherited ones. We don't
+        // check for overflow here because we'll see if the number of fields
+        // overflows when the subclass is created.
+        fn->code.data[ip + 1] += classObj->superclass->numFields;
+        break;
+
+      case CODE_SUPER_0:
+      case CODE_SUPER_1:
+      case CODE_SUPER_2:
+      case CODE_SUPER_3:
+      case CODE_SUPER_4:
+      case CODE_SUPER_5:
+      case CODE_SUPER_6:
+      case CODE_SUPER_7:
+      case CODE_SUPER_8:
+      case CODE_SUPER_9:
+      case CODE_SUPER_10:
+      case CODE_SUPER_11:
+      case CODE_SUPER_12:
+      case CODE_SUPER_13:
+      case CODE_SUPER_14:
+      case CODE_SUPER_15:
+      case CODE_SUPER_16:
+      {
+        // Fill in the constant slot with a reference to the superclass.
+        int constant = (fn->code.data[ip + 3] << 8) | fn->code.data[ip + 4];
+        fn->constants.data[constant] = OBJ_VAL(classObj->superclass);
+        break;
+      }
+
+      case CODE_CLOSURE:
+      {
+        // Bind the nested closure too.
+        int constant = (fn->code.data[ip + 1] << 8) | fn->code.data[ip + 2];
+        wrenBindMethodCode(classObj, AS_FN(fn->constants.data[constant]));
+        break;
+      }
+
+      case CODE_END:
+        return;
+
+      default:
+        // Other instructions are unaffected, so just skip over them.
+        break;
+    }
+    ip += 1 + getByteCountForArguments(fn->code.data, fn->constants.data, ip);
+  }
+}
+
+void wrenMarkCompiler(WrenVM* vm, Compiler* compiler)
+{
+  wrenGrayValue(vm, compiler->parser->current.value);
+  wrenGrayValue(vm, compiler->parser->previous.value);
+  wrenGrayValue(vm, compiler->parser->next.value);
+
+  // Walk up the parent chain to mark the outer compilers too. The VM only
+  // tracks the innermost one.
+  do
+  {
+    wrenGrayObj(vm, (Obj*)compiler->fn);
+    wrenGrayObj(vm, (Obj*)compiler->constants);
+    wrenGrayObj(vm, (Obj*)compiler->attributes);
+    
+    if (compiler->enclosingClass != NULL)
+    {
+      wrenBlackenSymbolTable(vm, &compiler->enclosingClass->fields);
+      vm->markedBytes += compiler->enclosingClass->fields.capacity *
+                         sizeof(*compiler->enclosingClass->fields.data);
+
+      if(compiler->enclosingClass->methodAttributes != NULL) 
+      {
+        wrenGrayObj(vm, (Obj*)compiler->enclosingClass->methodAttributes);
+      }
+      if(compiler->enclosingClass->classAttributes != NULL) 
+      {
+        wrenGrayObj(vm, (Obj*)compiler->enclosingClass->classAttributes);
+      }
+    }
+    
+    compiler = compiler->parent;
+  }
+  while (compiler != NULL);
+}
+
+// Helpers for Attributes
+
+// Throw an error if any attributes were found preceding, 
+// and clear the attributes so the error doesn't keep happening.
+static void disallowAttributes(Compiler* compiler)
+{
+  if (compiler->numAttributes > 0)
+  {
+    error(compiler, "Attributes can only specified before a class or a method");
+    wrenMapClear(compiler->parser->vm, compiler->attributes);
+    compiler->numAttributes = 0;
+  }
+}
+
+// Add an attribute to a given group in the compiler attribues map
+static void addToAttributeGroup(Compiler* compiler, 
+                                Value group, Value key, Value value) 
+{
+  WrenVM* vm = compiler->parser->vm;
+
+  if(IS_OBJ(group)) wrenPushRoot(vm, AS_OBJ(group));
+  if(IS_OBJ(key))   wrenPushRoot(vm, AS_OBJ(key));
+  if(IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
+
+  Value groupMapValue = wrenMapGet(compiler->attributes, group);
+  if(IS_UNDEFINED(groupMapValue)) 
+  {
+    groupMapValue = OBJ_VAL(wrenNewMap(vm));
+    wrenMapSet(vm, compiler->attributes, group, groupMapValue);
+  }
+
+  //we store them as a map per so we can maintain duplicate keys 
+  //group = { key:[value, ...], }
+  ObjMap* groupMap = AS_MAP(groupMapValue);
+
+  //var keyItems = group[key]
+  //if(!keyItems) keyItems = group[key] = [] 
+  Value keyItemsValue = wrenMapGet(groupMap, key);
+  if(IS_UNDEFINED(keyItemsValue)) 
+  {
+    keyItemsValue = OBJ_VAL(wrenNewList(vm, 0));
+    wrenMapSet(vm, groupMap, key, keyItemsValue);
+  }
+
+  //keyItems.add(value)
+  ObjList* keyItems = AS_LIST(keyItemsValue);
+  wrenValueBufferWrite(vm, &keyItems->elements, value);
+  wrenRememberStore(vm, &keyItems->obj, value);
+
+  if(IS_OBJ(group)) wrenPopRoot(vm);
+  if(IS_OBJ(key))   wrenPopRoot(vm);
+  if(IS_OBJ(value)) wrenPopRoot(vm);
+}
+
+
+// Emit the attributes in the give map onto the stack
+static void emitAttributes(Compiler* compiler, ObjMap* attributes) 
+{
+  // Instantiate a new map for the attributes
+  loadCoreVariable(compiler, "Map");
+  callMethod(compiler, 0, "new()", 5);
+
+  // The attributes are stored as group = { key:[value, value, ...] }
+  // so our first level is the group map
+  for(uint32_t groupIdx = 0; groupIdx < attributes->capacity; groupIdx++)
+  {
+    const MapEntry* groupEntry = &attributes->entries[groupIdx];
+    if(IS_UNDEFINED(groupEntry->key)) continue;
+    //group key
+    emitConstant(compiler, groupEntry->key);
+
+    //group value is gonna be a map
+    loadCoreVariable(compiler, "Map");
+    callMethod(compiler, 0, "new()", 5);
+
+    ObjMap* groupItems = AS_MAP(groupEntry->value);
+    for(uint32_t itemIdx = 0; itemIdx < groupItems->capacity; itemIdx++)
+    {
+      const MapEntry* itemEntry = &groupItems->entries[itemIdx];
+      if(IS_UNDEFINED(itemEntry->key)) continue;
+
+      emitConstant(compiler, itemEntry->key);
+      // Attribute key value, key = []
+      loadCoreVariable(compiler, "List");
+      callMethod(compiler, 0, "new()", 5);
+      // Add the items to the key list
+      ObjList* items = AS_LIST(itemEntry->value);
+      for(int itemIdx = 0; itemIdx < items->elements.count; ++itemIdx)
+      {
+        emitConstant(compiler, items->elements.data[itemIdx]);
+        callMethod(compiler, 1, "addCore_(_)", 11);
+      }
+      // Add the list to the map
+      callMethod(compiler, 2, "addCore_(_,_)", 13);
+    }
+
+    // Add the key/value to the map
+    callMethod(compiler, 2, "addCore_(_,_)", 13);
+  }
+
+}
+
+// Methods are stored as method <-> attributes, so we have to have 
+// an indirection to resolve for methods
+static void emitAttributeMethods(Compiler* compiler, ObjMap* attributes)
+{
+    // Instantiate a new map for the attributes
+  loadCoreVariable(compiler, "Map");
+  callMethod(compiler, 0, "new()", 5);
+
+  for(uint32_t methodIdx = 0; methodIdx < attributes->capacity; methodIdx++)
+  {
+    const MapEntry* methodEntry = &attributes->entries[methodIdx];
+    if(IS_UNDEFINED(methodEntry->key)) continue;
+    emitConstant(compiler, methodEntry->key);
+    ObjMap* attributeMap = AS_MAP(methodEntry->value);
+    emitAttributes(compiler, attributeMap);
+    callMethod(compiler, 2, "addCore_(_,_)", 13);
+  }
+}
+
+
+// Emit the final ClassAttributes that exists at runtime
+static void emitClassAttributes(Compiler* compiler, ClassInfo* classInfo)
+{
+  loadCoreVariable(compiler, "ClassAttributes");
+
+  classInfo->classAttributes 
+    ? emitAttributes(compiler, classInfo->classAttributes) 
+    : null(compiler, false);
+
+  classInfo->methodAttributes 
+    ? emitAttributeMethods(compiler, classInfo->methodAttributes) 
+    : null(compiler, false);
+
+  callMethod(compiler, 2, "new(_,_)", 8);
+}
+
+// Copy the current attributes stored in the compiler into a destination map
+// This also resets the counter, since the intent is to consume the attributes
+static void copyAttributes(Compiler* compiler, ObjMap* into)
+{
+  compiler->numAttributes = 0;
+
+  if(compiler->attributes->count == 0) return;
+  if(into == NULL) return;
+
+  WrenVM* vm = compiler->parser->vm;
+  
+  // Note we copy the actual values as is since we'll take ownership 
+  // and clear the original map
+  for(uint32_t attrIdx = 0; attrIdx < compiler->attributes->capacity; attrIdx++)
+  {
+    const MapEntry* attrEntry = &compiler->attributes->entries[attrIdx];
+    if(IS_UNDEFINED(attrEntry->key)) continue;
+    wrenMapSet(vm, into, attrEntry->key, attrEntry->value);
+  }
+  
+  wrenMapClear(vm, compiler->attributes);
+}
+
+// Copy the current attributes stored in the compiler into the method specific
+// attributes for the current enclosingClass.
+// This also resets the counter, since the intent is to consume the attributes
+static void copyMethodAttributes(Compiler* compiler, bool isForeign,
+            bool isStatic, const char* fullSignature, int32_t length) 
+{
+  compiler->numAttributes = 0;
+
+  if(compiler->attributes->count == 0) return;
+
+  WrenVM* vm = compiler->parser->vm;
+  
+  // Make a map for this method to copy into
+  ObjMap* methodAttr = wrenNewMap(vm);
+  wrenPushRoot(vm, (Obj*)methodAttr);
+  copyAttributes(compiler, methodAttr);
+
+  // Include 'foreign static ' in front as needed
+  int32_t fullLength = length;
+  if(isForeign) fullLength += 8;
+  if(isStatic) fullLength += 7;
+  char fullSignatureWithPrefix[MAX_METHOD_SIGNATURE + 8 + 7];
+  const char* foreignPrefix = isForeign ? "foreign " : "";
+  const char* staticPrefix = isStatic ? "static " : "";
+  sprintf(fullSignatureWithPrefix, "%s%s%.*s", foreignPrefix, staticPrefix, 
+                                               length, fullSignature);
+  fullSignatureWithPrefix[fullLength] = '\0';
+
+  if(compiler->enclosingClass->methodAttributes == NULL) {
+    compiler->enclosingClass->methodAttributes = wrenNewMap(vm);
+  }
+  
+  // Store the method attributes in the class map
+  Value key = wrenNewStringLength(vm, fullSignatureWithPrefix, fullLength);
+  wrenMapSet(vm, compiler->enclosingClass->methodAttributes, key, OBJ_VAL(methodAttr));
+
+  wrenPopRoot(vm);
+}
+// End file "wren_compiler.c"
+// Begin file "wren_core.c"
+#include <ctype.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// Begin file "wren_core.h"
+#ifndef wren_core_h
+#define wren_core_h
+
+
+// This module defines the built-in classes and their primitives methods that
+// are implemented directly in C code. Some languages try to implement as much
+// of the core module itself in the primary language instead of in the host
+// language.
+//
+// With Wren, we try to do as much of it in C as possible. Primitive methods
+// are always faster than code written in Wren, and it minimizes startup time
+// since we don't have to parse, compile, and execute Wren code.
+//
+// There is one limitation, though. Methods written in C cannot call Wren ones.
+// They can only be the top of the callstack, and immediately return. This
+// makes it difficult to have primitive methods that rely on polymorphic
+// behavior. For example, `System.print` should call `toString` on its argument,
+// including user-defined `toString` methods on user-defined classes.
+
+void wrenInitializeCore(WrenVM* vm);
+
+#endif
+// End file "wren_core.h"
+// Begin file "wren_primitive.h"
+#ifndef wren_primitive_h
+#define wren_primitive_h
+
+
+// Binds a primitive method named [name] (in Wren) implemented using C function
+// [fn] to `ObjClass` [cls].
+#define PRIMITIVE(cls, name, function)                                         \
+    do                                                                         \
+    {                                                                          \
+      int symbol = wrenSymbolTableEnsure(vm,                                   \
+          &vm->methodNames, name, strlen(name));                               \
+      Method method;                                                           \
+      method.type = METHOD_PRIMITIVE;                                          \
+      method.as.primitive = prim_##function;                                   \
+      wrenBindMethod(vm, cls, symbol, method);                                 \
+    } while (false)
+
+// Binds a primitive method named [name] (in Wren) implemented using C function
+// [fn] to `ObjClass` [cls], but as a FN call.
+#define FUNCTION_CALL(cls, name, function)                                     \
+    do                                                                         \
+    {                                                                          \
+      int symbol = wrenSymbolTableEnsure(vm,                                   \
+          &vm->methodNames, name, strlen(name));                               \
+      Method method;                                                           \
+      method.type = METHOD_FUNCTION_CALL;                                      \
+      method.as.primitive = prim_##function;                                   \
+      wrenBindMethod(vm, cls, symbol, method);                                 \
+    } while (false)
+
+// Defines a primitive method whose C function name is [name]. This abstracts
+// the actual type signature of a primitive function and makes it clear which C
+// functions are invoked as primitives.
+#define DEF_PRIMITIVE(name)                                                    \
+    static bool prim_##name(WrenVM* vm, Value* args)
+
+#define RETURN_VAL(value)                                                      \
+    do                                                                         \
+    {                                                                          \
+      args[0] = value;                                                         \
+      return true;                                                             \
+    } while (false)
+
+#define RETURN_OBJ(obj)     RETURN_VAL(OBJ_VAL(obj))
+#define RETURN_BOOL(value)  RETURN_VAL(BOOL_VAL(value))
+#define RETURN_FALSE        RETURN_VAL(FALSE_VAL)
+#define RETURN_NULL         RETURN_VAL(NULL_VAL)
+#define RETURN_NUM(value)   RETURN_VAL(NUM_VAL(value))
+#define RETURN_TRUE         RETURN_VAL(TRUE_VAL)
+
+#define RETURN_ERROR(msg)                                                      \
+    do                                                                         \
+    {                                                                          \
+      vm->fiber->error = wrenNewStringLength(vm, msg, sizeof(msg) - 1);        \
+      return false;                                                            \
+    } while (false)
+
+#define RETURN_ERROR_FMT(...)                                                  \
+    do                                                                         \
+    {                                                                          \
+      vm->fiber->error = wrenStringFormat(vm, __VA_ARGS__);                    \
+      return false;                                                            \
+    } while (false)
+
+// Validates that the given [arg] is a function. Returns true if it is. If not,
+// reports an error and returns false.
+bool validateFn(WrenVM* vm, Value arg, const char* argName);
+
+// Validates that the given [arg] is a Num. Returns true if it is. If not,
+// reports an error and returns false.
+bool validateNum(WrenVM* vm, Value arg, const char* argName);
+
+// Validates that [value] is an integer. Returns true if it is. If not, reports
+// an error and returns false.
+bool validateIntValue(WrenVM* vm, double value, const char* argName);
+
+// Validates that the given [arg] is an integer. Returns true if it is. If not,
+// reports an error and returns false.
+bool validateInt(WrenVM* vm, Value arg, const char* argName);
+
+// Validates that [arg] is a valid object for use as a map key. Returns true if
+// it is. If not, reports an error and returns false.
+bool validateKey(WrenVM* vm, Value arg);
+
+// Validates that the argument at [argIndex] is an integer within `[0, count)`.
+// Also allows negative indices which map backwards from the end. Returns the
+// valid positive index value. If invalid, reports an error and returns
+// `UINT32_MAX`.
+uint32_t validateIndex(WrenVM* vm, Value arg, uint32_t count,
+                       const char* argName);
+
+// Validates that the given [arg] is a String. Returns true if it is. If not,
+// reports an error and returns false.
+bool validateString(WrenVM* vm, Value arg, const char* argName);
+
+// Given a [range] and the [length] of the object being operated on, determines
+// the series of elements that should be chosen from the underlying object.
+// Handles ranges that count backwards from the end as well as negative ranges.
+//
+// Returns the index from which the range should start or `UINT32_MAX` if the
+// range is invalid. After calling, [length] will be updated with the number of
+// elements in the resulting sequence. [step] will be direction that the range
+// is going: `1` if the range is increasing from the start index or `-1` if the
+// range is decreasing.
+uint32_t calculateRange(WrenVM* vm, ObjRange* range, uint32_t* length,
+                        int* step);
+
+#endif
+// End file "wren_primitive.h"
+
+// Begin file "wren_core.wren.inc"
+// Generated automatically from src/vm/wren_core.wren. Do not edit.
+static const char* coreModuleSource =
+"class Bool {}\n"
+"class Fiber {}\n"
+"class Fn {}\n"
+"class Null {}\n"
+"class Num {}\n"
+"\n"
+"class Sequence {\n"
+"  all(f) {\n"
+"    var result = true\n"
+"    for (element in this) {\n"
+"      result = f.call(element)\n"
+"      if (!result) return result\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  any(f) {\n"
+"    var result = false\n"
+"    for (element in this) {\n"
+"      result = f.call(element)\n"
+"      if (result) return result\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  contains(element) {\n"
+"    for (item in this) {\n"
+"      if (element == item) return true\n"
+"    }\n"
+"    return false\n"
+"  }\n"
+"\n"
+"  count {\n"
+"    var result = 0\n"
+"    for (element in this) {\n"
+"      result = result + 1\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  count(f) {\n"
+"    var result = 0\n"
+"    for (element in this) {\n"
+"      if (f.call(element)) result = result + 1\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  each(f) {\n"
+"    for (element in this) {\n"
+"      f.call(element)\n"
+"    }\n"
+"  }\n"
+"\n"
+"  isEmpty { iterate(null) ? false : true }\n"
+"\n"
+"  map(transformation) { MapSequence.new(this, transformation) }\n"
+"\n"
+"  skip(count) {\n"
+"    if (!(count is Num) || !count.isInteger || count < 0) {\n"
+"      Fiber.abort(\"Count must be a non-negative integer.\")\n"
+"    }\n"
+"\n"
+"    return SkipSequence.new(this, count)\n"
+"  }\n"
+"\n"
+"  take(count) {\n"
+"    if (!(count is Num) || !count.isInteger || count < 0) {\n"
+"      Fiber.abort(\"Count must be a non-negative integer.\")\n"
+"    }\n"
+"\n"
+"    return TakeSequence.new(this, count)\n"
+"  }\n"
+"\n"
+"  where(predicate) { WhereSequence.new(this, predicate) }\n"
+"\n"
+"  reduce(acc, f) {\n"
+"    for (element in this) {\n"
+"      acc = f.call(acc, element)\n"
+"    }\n"
+"    return acc\n"
+"  }\n"
+"\n"
+"  reduce(f) {\n"
+"    var iter = iterate(null)\n"
+"    if (!iter) Fiber.abort(\"Can't reduce an empty sequence.\")\n"
+"\n"
+"    // Seed with the first element.\n"
+"    var result = iteratorValue(iter)\n"
+"    while (iter = iterate(iter)) {\n"
+"      result = f.call(result, iteratorValue(iter))\n"
+"    }\n"
+"\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  join() { join(\"\") }\n"
+"\n"
+"  join(sep) {\n"
+"    var first = true\n"
+"    var result = \"\"\n"
+"\n"
+"    for (element in this) {\n"
+"      if (!first) result = result + sep\n"
+"      first = false\n"
+"      result = result + element.toString\n"
+"    }\n"
+"\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  toList {\n"
+"    var result = List.new()\n"
+"    for (element in this) {\n"
+"      result.add(element)\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"}\n"
+"\n"
+"class MapSequence is Sequence {\n"
+"  construct new(sequence, fn) {\n"
+"    _sequence = sequence\n"
+"    _fn = fn\n"
+"  }\n"
+"\n"
+"  iterate(iterator) { _sequence.iterate(iterator) }\n"
+"  iteratorValue(iterator) { _fn.call(_sequence.iteratorValue(iterator)) }\n"
+"}\n"
+"\n"
+"class SkipSequence is Sequence {\n"
+"  construct new(sequence, count) {\n"
+"    _sequence = sequence\n"
+"    _count = count\n"
+"  }\n"
+"\n"
+"  iterate(iterator) {\n"
+"    if (iterator) {\n"
+"      return _sequence.iterate(iterator)\n"
+"    } else {\n"
+"      iterator = _sequence.iterate(iterator)\n"
+"      var count = _count\n"
+"      while (count > 0 && iterator) {\n"
+"        iterator = _sequence.iterate(iterator)\n"
+"        count = count - 1\n"
+"      }\n"
+"      return iterator\n"
+"    }\n"
+"  }\n"
+"\n"
+"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
+"}\n"
+"\n"
+"class TakeSequence is Sequence {\n"
+"  construct new(sequence, count) {\n"
+"    _sequence = sequence\n"
+"    _count = count\n"
+"  }\n"
+"\n"
+"  iterate(iterator) {\n"
+"    if (!iterator) _taken = 1 else _taken = _taken + 1\n"
+"    return _taken > _count ? null : _sequence.iterate(iterator)\n"
+"  }\n"
+"\n"
+"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
+"}\n"
+"\n"
+"class WhereSequence is Sequence {\n"
+"  construct new(sequence, fn) {\n"
+"    _sequence = sequence\n"
+"    _fn = fn\n"
+"  }\n"
+"\n"
+"  iterate(iterator) {\n"
+"    while (iterator = _sequence.iterate(iterator)) {\n"
+"      if (_fn.call(_sequence.iteratorValue(iterator))) break\n"
+"    }\n"
+"    return iterator\n"
+"  }\n"
+"\n"
+"  iteratorValue(iterator) { _sequence.iteratorValue(iterator) }\n"
+"}\n"
+"\n"
+"class String is Sequence {\n"
+"  bytes { StringByteSequence.new(this) }\n"
+"  codePoints { StringCodePointSequence.new(this) }\n"
+"\n"
+"  split(delimiter) {\n"
+"    if (!(delimiter is String) || delimiter.isEmpty) {\n"
+"      Fiber.abort(\"Delimiter must be a non-empty string.\")\n"
+"    }\n"
+"\n"
+"    var result = []\n"
+"\n"
+"    var last = 0\n"
+"    var index = 0\n"
+"\n"
+"    var delimSize = delimiter.byteCount_\n"
+"    var size = byteCount_\n"
+"\n"
+"    while (last < size && (index = indexOf(delimiter, last)) != -1) {\n"
+"      result.add(this[last...index])\n"
+"      last = index + delimSize\n"
+"    }\n"
+"\n"
+"    if (last < size) {\n"
+"      result.add(this[last..-1])\n"
+"    } else {\n"
+"      result.add(\"\")\n"
+"    }\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  replace(from, to) {\n"
+"    if (!(from is String) || from.isEmpty) {\n"
+"      Fiber.abort(\"From must be a non-empty string.\")\n"
+"    } else if (!(to is String)) {\n"
+"      Fiber.abort(\"To must be a string.\")\n"
+"    }\n"
+"\n"
+"    var result = \"\"\n"
+"\n"
+"    var last = 0\n"
+"    var index = 0\n"
+"\n"
+"    var fromSize = from.byteCount_\n"
+"    var size = byteCount_\n"
+"\n"
+"    while (last < size && (index = indexOf(from, last)) != -1) {\n"
+"      result = result + this[last...index] + to\n"
+"      last = index + fromSize\n"
+"    }\n"
+"\n"
+"    if (last < size) result = result + this[last..-1]\n"
+"\n"
+"    return result\n"
+"  }\n"
+"\n"
+"  trim() { trim_(\"\\t\\r\\n \", true, true) }\n"
+"  trim(chars) { trim_(chars, true, true) }\n"
+"  trimEnd() { trim_(\"\\t\\r\\n \", false, true) }\n"
+"  trimEnd(chars) { trim_(chars, false, true) }\n"
+"  trimStart() { trim_(\"\\t\\r\\n \", true, false) }\n"
+"  trimStart(chars) { trim_(chars, true, false) }\n"
+"\n"
+"  trim_(chars, trimStart, trimEnd) {\n"
 "    if (!(chars is String)) {\n"
 "      Fiber.abort(\"Characters must be a string.\")\n"
 "    }\n"
@@ -7361,4007 +9992,6045 @@ static const char* coreModuleSource =
 "}\n";
 // End file "wren_core.wren.inc"
 
-DEF_PRIMITIVE(bool_not)
-{
-  RETURN_BOOL(!AS_BOOL(args[0]));
+DEF_PRIMITIVE(bool_not)
+{
+  RETURN_BOOL(!AS_BOOL(args[0]));
+}
+
+DEF_PRIMITIVE(bool_toString)
+{
+  if (AS_BOOL(args[0]))
+  {
+    RETURN_VAL(CONST_STRING(vm, "true"));
+  }
+  else
+  {
+    RETURN_VAL(CONST_STRING(vm, "false"));
+  }
+}
+
+DEF_PRIMITIVE(class_name)
+{
+  RETURN_OBJ(AS_CLASS(args[0])->name);
+}
+
+DEF_PRIMITIVE(class_supertype)
+{
+  ObjClass* classObj = AS_CLASS(args[0]);
+
+  // Object has no superclass.
+  if (classObj->superclass == NULL) RETURN_NULL;
+
+  RETURN_OBJ(classObj->superclass);
+}
+
+DEF_PRIMITIVE(class_toString)
+{
+  RETURN_OBJ(AS_CLASS(args[0])->name);
+}
+
+DEF_PRIMITIVE(class_attributes)
+{
+  RETURN_VAL(AS_CLASS(args[0])->attributes);
+}
+
+DEF_PRIMITIVE(fiber_new)
+{
+  if (!validateFn(vm, args[1], "Argument")) return false;
+
+  ObjClosure* closure = AS_CLOSURE(args[1]);
+  if (closure->fn->arity > 1)
+  {
+    RETURN_ERROR("Function cannot take more than one parameter.");
+  }
+  
+  RETURN_OBJ(wrenNewFiber(vm, closure));
+}
+
+DEF_PRIMITIVE(fiber_abort)
+{
+  vm->fiber->error = args[1];
+
+  // If the error is explicitly null, it's not really an abort.
+  return IS_NULL(args[1]);
+}
+
+// Transfer execution to [fiber] coming from the current fiber whose stack has
+// [args].
+//
+// [isCall] is true if [fiber] is being called and not transferred.
+//
+// [hasValue] is true if a value in [args] is being passed to the new fiber.
+// Otherwise, `null` is implicitly being passed.
+static bool runFiber(WrenVM* vm, ObjFiber* fiber, Value* args, bool isCall,
+                     bool hasValue, const char* verb)
+{
+
+  if (wrenHasError(fiber))
+  {
+    RETURN_ERROR_FMT("Cannot $ an aborted fiber.", verb);
+  }
+
+  if (isCall)
+  {
+    // You can't call a called fiber, but you can transfer directly to it,
+    // which is why this check is gated on `isCall`. This way, after resuming a
+    // suspended fiber, it will run and then return to the fiber that called it
+    // and so on.
+    if (fiber->caller != NULL) RETURN_ERROR("Fiber has already been called.");
+
+    if (fiber->state == FIBER_ROOT) RETURN_ERROR("Cannot call root fiber.");
+    
+    // Remember who ran it.
+    fiber->caller = vm->fiber;
+  }
+
+  if (fiber->numFrames == 0)
+  {
+    RETURN_ERROR_FMT("Cannot $ a finished fiber.", verb);
+  }
+
+  wrenScanFiber(vm, fiber);
+
+  // When the calling fiber resumes, we'll store the result of the call in its
+  // stack. If the call has two arguments (the fiber and the value), we only
+  // need one slot for the result, so discard the other slot now.
+  if (hasValue) vm->fiber->stackTop--;
+
+  if (fiber->numFrames == 1 &&
+      fiber->frames[0].ip == fiber->frames[0].closure->fn->code.data)
+  {
+    // The fiber is being started for the first time. If its function takes a
+    // parameter, bind an argument to it.
+    if (fiber->frames[0].closure->fn->arity == 1)
+    {
+      fiber->stackTop[0] = hasValue ? args[1] : NULL_VAL;
+      fiber->stackTop++;
+    }
+  }
+  else
+  {
+    // The fiber is being resumed, make yield() or transfer() return the result.
+    fiber->stackTop[-1] = hasValue ? args[1] : NULL_VAL;
+  }
+
+  vm->fiber = fiber;
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_call)
+{
+  return runFiber(vm, AS_FIBER(args[0]), args, true, false, "call");
+}
+
+DEF_PRIMITIVE(fiber_call1)
+{
+  return runFiber(vm, AS_FIBER(args[0]), args, true, true, "call");
+}
+
+DEF_PRIMITIVE(fiber_current)
+{
+  RETURN_OBJ(vm->fiber);
+}
+
+DEF_PRIMITIVE(fiber_error)
+{
+  RETURN_VAL(AS_FIBER(args[0])->error);
+}
+
+DEF_PRIMITIVE(fiber_isDone)
+{
+  ObjFiber* runFiber = AS_FIBER(args[0]);
+  RETURN_BOOL(runFiber->numFrames == 0 || wrenHasError(runFiber));
+}
+
+DEF_PRIMITIVE(fiber_suspend)
+{
+  // Switching to a null fiber tells the interpreter to stop and exit.
+  vm->fiber = NULL;
+  vm->apiStack = NULL;
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_transfer)
+{
+  return runFiber(vm, AS_FIBER(args[0]), args, false, false, "transfer to");
+}
+
+DEF_PRIMITIVE(fiber_transfer1)
+{
+  return runFiber(vm, AS_FIBER(args[0]), args, false, true, "transfer to");
+}
+
+DEF_PRIMITIVE(fiber_transferError)
+{
+  runFiber(vm, AS_FIBER(args[0]), args, false, true, "transfer to");
+  vm->fiber->error = args[1];
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_try)
+{
+  runFiber(vm, AS_FIBER(args[0]), args, true, false, "try");
+  
+  // If we're switching to a valid fiber to try, remember that we're trying it.
+  if (!wrenHasError(vm->fiber)) vm->fiber->state = FIBER_TRY;
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_try1)
+{
+  runFiber(vm, AS_FIBER(args[0]), args, true, true, "try");
+  
+  // If we're switching to a valid fiber to try, remember that we're trying it.
+  if (!wrenHasError(vm->fiber)) vm->fiber->state = FIBER_TRY;
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_yield)
+{
+  ObjFiber* current = vm->fiber;
+  vm->fiber = current->caller;
+
+  // Unhook this fiber from the one that called it.
+  current->caller = NULL;
+  current->state = FIBER_OTHER;
+
+  if (vm->fiber != NULL)
+  {
+    wrenScanFiber(vm, vm->fiber);
+
+    // Make the caller's run method return null.
+    vm->fiber->stackTop[-1] = NULL_VAL;
+  }
+
+  return false;
+}
+
+DEF_PRIMITIVE(fiber_yield1)
+{
+  ObjFiber* current = vm->fiber;
+  vm->fiber = current->caller;
+
+  // Unhook this fiber from the one that called it.
+  current->caller = NULL;
+  current->state = FIBER_OTHER;
+
+  if (vm->fiber != NULL)
+  {
+    wrenScanFiber(vm, vm->fiber);
+
+    // Make the caller's run method return the argument passed to yield.
+    vm->fiber->stackTop[-1] = args[1];
+
+    // When the yielding fiber resumes, we'll store the result of the yield
+    // call in its stack. Since Fiber.yield(value) has two arguments (the Fiber
+    // class and the value) and we only need one slot for the result, discard
+    // the other slot now.
+    current->stackTop--;
+  }
+
+  return false;
+}
+
+DEF_PRIMITIVE(fn_new)
+{
+  if (!validateFn(vm, args[1], "Argument")) return false;
+
+  // The block argument is already a function, so just return it.
+  RETURN_VAL(args[1]);
+}
+
+DEF_PRIMITIVE(fn_arity)
+{
+  RETURN_NUM(AS_CLOSURE(args[0])->fn->arity);
+}
+
+static void call_fn(WrenVM* vm, Value* args, int numArgs)
+{
+  // +1 to include the function itself.
+  wrenCallFunction(vm, vm->fiber, AS_CLOSURE(args[0]), numArgs + 1);
+}
+
+#define DEF_FN_CALL(numArgs)                                                   \
+    DEF_PRIMITIVE(fn_call##numArgs)                                            \
+    {                                                                          \
+      call_fn(vm, args, numArgs);                                              \
+      return false;                                                            \
+    }
+
+DEF_FN_CALL(0)
+DEF_FN_CALL(1)
+DEF_FN_CALL(2)
+DEF_FN_CALL(3)
+DEF_FN_CALL(4)
+DEF_FN_CALL(5)
+DEF_FN_CALL(6)
+DEF_FN_CALL(7)
+DEF_FN_CALL(8)
+DEF_FN_CALL(9)
+DEF_FN_CALL(10)
+DEF_FN_CALL(11)
+DEF_FN_CALL(12)
+DEF_FN_CALL(13)
+DEF_FN_CALL(14)
+DEF_FN_CALL(15)
+DEF_FN_CALL(16)
+
+DEF_PRIMITIVE(fn_toString)
+{
+  RETURN_VAL(CONST_STRING(vm, "<fn>"));
+}
+
+// Creates a new list of size args[1], with all elements initialized to args[2].
+DEF_PRIMITIVE(list_filled)
+{
+  if (!validateInt(vm, args[1], "Size")) return false;  
+  if (AS_NUM(args[1]) < 0) RETURN_ERROR("Size cannot be negative.");
+  
+  uint32_t size = (uint32_t)AS_NUM(args[1]);
+  ObjList* list = wrenNewList(vm, size);
+  
+  for (uint32_t i = 0; i < size; i++)
+  {
+    list->elements.data[i] = args[2];
+  }
+  
+  RETURN_OBJ(list);
+}
+
+DEF_PRIMITIVE(list_new)
+{
+  RETURN_OBJ(wrenNewList(vm, 0));
+}
+
+DEF_PRIMITIVE(list_add)
+{
+  wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
+  wrenRememberStore(vm, AS_OBJ(args[0]), args[1]);
+  RETURN_VAL(args[1]);
+}
+
+// Adds an element to the list and then returns the list itself. This is called
+// by the compiler when compiling list literals instead of using add() to
+// minimize stack churn.
+DEF_PRIMITIVE(list_addCore)
+{
+  wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
+  wrenRememberStore(vm, AS_OBJ(args[0]), args[1]);
+  
+  // Return the list.
+  RETURN_VAL(args[0]);
+}
+
+DEF_PRIMITIVE(list_clear)
+{
+  ObjList* list = AS_LIST(args[0]);
+  for (int i = 0; i < list->elements.count; i++)
+  {
+    wrenWriteBarrier(vm, list->elements.data[i]);
+  }
+
+  wrenValueBufferClear(vm, &list->elements);
+  RETURN_NULL;
+}
+
+DEF_PRIMITIVE(list_count)
+{
+  RETURN_NUM(AS_LIST(args[0])->elements.count);
+}
+
+DEF_PRIMITIVE(list_insert)
+{
+  ObjList* list = AS_LIST(args[0]);
+
+  // count + 1 here so you can "insert" at the very end.
+  uint32_t index = validateIndex(vm, args[1], list->elements.count + 1,
+                                 "Index");
+  if (index == UINT32_MAX) return false;
+
+  wrenListInsert(vm, list, args[2], index);
+  RETURN_VAL(args[2]);
+}
+
+DEF_PRIMITIVE(list_iterate)
+{
+  ObjList* list = AS_LIST(args[0]);
+
+  // If we're starting the iteration, return the first index.
+  if (IS_NULL(args[1]))
+  {
+    if (list->elements.count == 0) RETURN_FALSE;
+    RETURN_NUM(0);
+  }
+
+  if (!validateInt(vm, args[1], "Iterator")) return false;
+
+  // Stop if we're out of bounds.
+  double index = AS_NUM(args[1]);
+  if (index < 0 || index >= list->elements.count - 1) RETURN_FALSE;
+
+  // Otherwise, move to the next index.
+  RETURN_NUM(index + 1);
+}
+
+DEF_PRIMITIVE(list_iteratorValue)
+{
+  ObjList* list = AS_LIST(args[0]);
+  uint32_t index = validateIndex(vm, args[1], list->elements.count, "Iterator");
+  if (index == UINT32_MAX) return false;
+
+  RETURN_VAL(list->elements.data[index]);
+}
+
+DEF_PRIMITIVE(list_removeAt)
+{
+  ObjList* list = AS_LIST(args[0]);
+  uint32_t index = validateIndex(vm, args[1], list->elements.count, "Index");
+  if (index == UINT32_MAX) return false;
+
+  RETURN_VAL(wrenListRemoveAt(vm, list, index));
+}
+
+DEF_PRIMITIVE(list_removeValue) {
+  ObjList* list = AS_LIST(args[0]);
+  int index = wrenListIndexOf(vm, list, args[1]);
+  if(index == -1) RETURN_NULL;
+  RETURN_VAL(wrenListRemoveAt(vm, list, index));
+}
+
+DEF_PRIMITIVE(list_indexOf)
+{
+  ObjList* list = AS_LIST(args[0]);
+  RETURN_NUM(wrenListIndexOf(vm, list, args[1]));
+}
+
+DEF_PRIMITIVE(list_swap)
+{
+  ObjList* list = AS_LIST(args[0]);
+  uint32_t indexA = validateIndex(vm, args[1], list->elements.count, "Index 0");
+  if (indexA == UINT32_MAX) return false;
+  uint32_t indexB = validateIndex(vm, args[2], list->elements.count, "Index 1");
+  if (indexB == UINT32_MAX) return false;
+
+  wrenFinishMarkingObj(vm, &list->obj);
+
+  Value a = list->elements.data[indexA];
+  list->elements.data[indexA] = list->elements.data[indexB];
+  list->elements.data[indexB] = a;
+
+  RETURN_NULL;
+}
+
+DEF_PRIMITIVE(list_subscript)
+{
+  ObjList* list = AS_LIST(args[0]);
+
+  if (IS_NUM(args[1]))
+  {
+    uint32_t index = validateIndex(vm, args[1], list->elements.count,
+                                   "Subscript");
+    if (index == UINT32_MAX) return false;
+
+    RETURN_VAL(list->elements.data[index]);
+  }
+
+  if (!IS_RANGE(args[1]))
+  {
+    RETURN_ERROR("Subscript must be a number or a range.");
+  }
+
+  int step;
+  uint32_t count = list->elements.count;
+  uint32_t start = calculateRange(vm, AS_RANGE(args[1]), &count, &step);
+  if (start == UINT32_MAX) return false;
+
+  ObjList* result = wrenNewList(vm, count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    result->elements.data[i] = list->elements.data[start + i * step];
+  }
+
+  RETURN_OBJ(result);
+}
+
+DEF_PRIMITIVE(list_subscriptSetter)
+{
+  ObjList* list = AS_LIST(args[0]);
+  uint32_t index = validateIndex(vm, args[1], list->elements.count,
+                                 "Subscript");
+  if (index == UINT32_MAX) return false;
+
+  wrenWriteBarrier(vm, list->elements.data[index]);
+  wrenRememberStore(vm, &list->obj, args[2]);
+  list->elements.data[index] = args[2];
+  RETURN_VAL(args[2]);
+}
+
+DEF_PRIMITIVE(map_new)
+{
+  RETURN_OBJ(wrenNewMap(vm));
+}
+
+DEF_PRIMITIVE(map_subscript)
+{
+  if (!validateKey(vm, args[1])) return false;
+
+  ObjMap* map = AS_MAP(args[0]);
+  Value value = wrenMapGet(map, args[1]);
+  if (IS_UNDEFINED(value)) RETURN_NULL;
+
+  RETURN_VAL(value);
+}
+
+DEF_PRIMITIVE(map_subscriptSetter)
+{
+  if (!validateKey(vm, args[1])) return false;
+
+  wrenMapSet(vm, AS_MAP(args[0]), args[1], args[2]);
+  RETURN_VAL(args[2]);
+}
+
+// Adds an entry to the map and then returns the map itself. This is called by
+// the compiler when compiling map literals instead of using [_]=(_) to
+// minimize stack churn.
+DEF_PRIMITIVE(map_addCore)
+{
+  if (!validateKey(vm, args[1])) return false;
+  
+  wrenMapSet(vm, AS_MAP(args[0]), args[1], args[2]);
+  
+  // Return the map itself.
+  RETURN_VAL(args[0]);
+}
+
+DEF_PRIMITIVE(map_clear)
+{
+  wrenMapClear(vm, AS_MAP(args[0]));
+  RETURN_NULL;
+}
+
+DEF_PRIMITIVE(map_containsKey)
+{
+  if (!validateKey(vm, args[1])) return false;
+
+  RETURN_BOOL(!IS_UNDEFINED(wrenMapGet(AS_MAP(args[0]), args[1])));
+}
+
+DEF_PRIMITIVE(map_count)
+{
+  RETURN_NUM(AS_MAP(args[0])->count);
+}
+
+DEF_PRIMITIVE(map_iterate)
+{
+  ObjMap* map = AS_MAP(args[0]);
+
+  if (map->count == 0) RETURN_FALSE;
+
+  // If we're starting the iteration, start at the first used entry.
+  uint32_t index = 0;
+
+  // Otherwise, start one past the last entry we stopped at.
+  if (!IS_NULL(args[1]))
+  {
+    if (!validateInt(vm, args[1], "Iterator")) return false;
+
+    if (AS_NUM(args[1]) < 0) RETURN_FALSE;
+    index = (uint32_t)AS_NUM(args[1]);
+
+    if (index >= map->capacity) RETURN_FALSE;
+
+    // Advance the iterator.
+    index++;
+  }
+
+  // Find a used entry, if any.
+  for (; index < map->capacity; index++)
+  {
+    if (!IS_UNDEFINED(map->entries[index].key)) RETURN_NUM(index);
+  }
+
+  // If we get here, walked all of the entries.
+  RETURN_FALSE;
+}
+
+DEF_PRIMITIVE(map_remove)
+{
+  if (!validateKey(vm, args[1])) return false;
+
+  RETURN_VAL(wrenMapRemoveKey(vm, AS_MAP(args[0]), args[1]));
+}
+
+DEF_PRIMITIVE(map_keyIteratorValue)
+{
+  ObjMap* map = AS_MAP(args[0]);
+  uint32_t index = validateIndex(vm, args[1], map->capacity, "Iterator");
+  if (index == UINT32_MAX) return false;
+
+  MapEntry* entry = &map->entries[index];
+  if (IS_UNDEFINED(entry->key))
+  {
+    RETURN_ERROR("Invalid map iterator.");
+  }
+
+  RETURN_VAL(entry->key);
+}
+
+DEF_PRIMITIVE(map_valueIteratorValue)
+{
+  ObjMap* map = AS_MAP(args[0]);
+  uint32_t index = validateIndex(vm, args[1], map->capacity, "Iterator");
+  if (index == UINT32_MAX) return false;
+
+  MapEntry* entry = &map->entries[index];
+  if (IS_UNDEFINED(entry->key))
+  {
+    RETURN_ERROR("Invalid map iterator.");
+  }
+
+  RETURN_VAL(entry->value);
+}
+
+DEF_PRIMITIVE(null_not)
+{
+  RETURN_VAL(TRUE_VAL);
+}
+
+DEF_PRIMITIVE(null_toString)
+{
+  RETURN_VAL(CONST_STRING(vm, "null"));
+}
+
+DEF_PRIMITIVE(num_fromString)
+{
+  if (!validateString(vm, args[1], "Argument")) return false;
+
+  ObjString* string = AS_STRING(args[1]);
+
+  // Corner case: Can't parse an empty string.
+  if (string->length == 0) RETURN_NULL;
+
+  errno = 0;
+  char* end;
+  double number = strtod(string->value, &end);
+
+  // Skip past any trailing whitespace.
+  while (*end != '\0' && isspace((unsigned char)*end)) end++;
+
+  if (errno == ERANGE) RETURN_ERROR("Number literal is too large.");
+
+  // We must have consumed the entire string. Otherwise, it contains non-number
+  // characters and we can't parse it.
+  if (end < string->value + string->length) RETURN_NULL;
+
+  RETURN_NUM(number);
+}
+
+// Defines a primitive on Num that calls infix [op] and returns [type].
+#define DEF_NUM_CONSTANT(name, value)                                          \
+    DEF_PRIMITIVE(num_##name)                                                  \
+    {                                                                          \
+      RETURN_NUM(value);                                                       \
+    }
+
+DEF_NUM_CONSTANT(infinity, INFINITY)
+DEF_NUM_CONSTANT(nan,      WREN_DOUBLE_NAN)
+DEF_NUM_CONSTANT(pi,       3.14159265358979323846264338327950288)
+DEF_NUM_CONSTANT(tau,      6.28318530717958647692528676655900577)
+
+DEF_NUM_CONSTANT(largest,  DBL_MAX)
+DEF_NUM_CONSTANT(smallest, DBL_MIN)
+
+DEF_NUM_CONSTANT(maxSafeInteger, 9007199254740991.0)
+DEF_NUM_CONSTANT(minSafeInteger, -9007199254740991.0)
+
+// Defines a primitive on Num that calls infix [op] and returns [type].
+#define DEF_NUM_INFIX(name, op, type)                                          \
+    DEF_PRIMITIVE(num_##name)                                                  \
+    {                                                                          \
+      if (!validateNum(vm, args[1], "Right operand")) return false;            \
+      RETURN_##type(AS_NUM(args[0]) op AS_NUM(args[1]));                       \
+    }
+
+DEF_NUM_INFIX(minus,    -,  NUM)
+DEF_NUM_INFIX(plus,     +,  NUM)
+DEF_NUM_INFIX(multiply, *,  NUM)
+DEF_NUM_INFIX(divide,   /,  NUM)
+DEF_NUM_INFIX(lt,       <,  BOOL)
+DEF_NUM_INFIX(gt,       >,  BOOL)
+DEF_NUM_INFIX(lte,      <=, BOOL)
+DEF_NUM_INFIX(gte,      >=, BOOL)
+
+// Defines a primitive on Num that call infix bitwise [op].
+#define DEF_NUM_BITWISE(name, op)                                              \
+    DEF_PRIMITIVE(num_bitwise##name)                                           \
+    {                                                                          \
+      if (!validateNum(vm, args[1], "Right operand")) return false;            \
+      uint32_t left = (uint32_t)AS_NUM(args[0]);                               \
+      uint32_t right = (uint32_t)AS_NUM(args[1]);                              \
+      RETURN_NUM(left op right);                                               \
+    }
+
+DEF_NUM_BITWISE(And,        &)
+DEF_NUM_BITWISE(Or,         |)
+DEF_NUM_BITWISE(Xor,        ^)
+DEF_NUM_BITWISE(LeftShift,  <<)
+DEF_NUM_BITWISE(RightShift, >>)
+
+// Defines a primitive method on Num that returns the result of [fn].
+#define DEF_NUM_FN(name, fn)                                                   \
+    DEF_PRIMITIVE(num_##name)                                                  \
+    {                                                                          \
+      RETURN_NUM(fn(AS_NUM(args[0])));                                         \
+    }
+
+DEF_NUM_FN(abs,     fabs)
+DEF_NUM_FN(acos,    acos)
+DEF_NUM_FN(asin,    asin)
+DEF_NUM_FN(atan,    atan)
+DEF_NUM_FN(cbrt,    cbrt)
+DEF_NUM_FN(ceil,    ceil)
+DEF_NUM_FN(cos,     cos)
+DEF_NUM_FN(floor,   floor)
+DEF_NUM_FN(negate,  -)
+DEF_NUM_FN(round,   round)
+DEF_NUM_FN(sin,     sin)
+DEF_NUM_FN(sqrt,    sqrt)
+DEF_NUM_FN(tan,     tan)
+DEF_NUM_FN(log,     log)
+DEF_NUM_FN(log2,    log2)
+DEF_NUM_FN(exp,     exp)
+
+DEF_PRIMITIVE(num_mod)
+{
+  if (!validateNum(vm, args[1], "Right operand")) return false;
+  RETURN_NUM(fmod(AS_NUM(args[0]), AS_NUM(args[1])));
+}
+
+DEF_PRIMITIVE(num_eqeq)
+{
+  if (!IS_NUM(args[1])) RETURN_FALSE;
+  RETURN_BOOL(AS_NUM(args[0]) == AS_NUM(args[1]));
+}
+
+DEF_PRIMITIVE(num_bangeq)
+{
+  if (!IS_NUM(args[1])) RETURN_TRUE;
+  RETURN_BOOL(AS_NUM(args[0]) != AS_NUM(args[1]));
+}
+
+DEF_PRIMITIVE(num_bitwiseNot)
+{
+  // Bitwise operators always work on 32-bit unsigned ints.
+  RETURN_NUM(~(uint32_t)AS_NUM(args[0]));
+}
+
+DEF_PRIMITIVE(num_dotDot)
+{
+  if (!validateNum(vm, args[1], "Right hand side of range")) return false;
+
+  double from = AS_NUM(args[0]);
+  double to = AS_NUM(args[1]);
+  RETURN_VAL(wrenNewRange(vm, from, to, true));
+}
+
+DEF_PRIMITIVE(num_dotDotDot)
+{
+  if (!validateNum(vm, args[1], "Right hand side of range")) return false;
+
+  double from = AS_NUM(args[0]);
+  double to = AS_NUM(args[1]);
+  RETURN_VAL(wrenNewRange(vm, from, to, false));
+}
+
+DEF_PRIMITIVE(num_atan2)
+{
+  if (!validateNum(vm, args[1], "x value")) return false;
+
+  RETURN_NUM(atan2(AS_NUM(args[0]), AS_NUM(args[1])));
+}
+
+DEF_PRIMITIVE(num_min)
+{
+  if (!validateNum(vm, args[1], "Other value")) return false;
+
+  double value = AS_NUM(args[0]);
+  double other = AS_NUM(args[1]);
+  RETURN_NUM(value <= other ? value : other);
+}
+
+DEF_PRIMITIVE(num_max)
+{
+  if (!validateNum(vm, args[1], "Other value")) return false;
+
+  double value = AS_NUM(args[0]);
+  double other = AS_NUM(args[1]);
+  RETURN_NUM(value > other ? value : other);
+}
+
+DEF_PRIMITIVE(num_clamp)
+{
+  if (!validateNum(vm, args[1], "Min value")) return false;
+  if (!validateNum(vm, args[2], "Max value")) return false;
+
+  double value = AS_NUM(args[0]);
+  double min = AS_NUM(args[1]);
+  double max = AS_NUM(args[2]);
+  double result = (value < min) ? min : ((value > max) ? max : value);
+  RETURN_NUM(result);
+}
+
+DEF_PRIMITIVE(num_pow)
+{
+  if (!validateNum(vm, args[1], "Power value")) return false;
+
+  RETURN_NUM(pow(AS_NUM(args[0]), AS_NUM(args[1])));
+}
+
+DEF_PRIMITIVE(num_fraction)
+{
+  double unused;
+  RETURN_NUM(modf(AS_NUM(args[0]) , &unused));
+}
+
+DEF_PRIMITIVE(num_isInfinity)
+{
+  RETURN_BOOL(isinf(AS_NUM(args[0])));
+}
+
+DEF_PRIMITIVE(num_isInteger)
+{
+  double value = AS_NUM(args[0]);
+  if (isnan(value) || isinf(value)) RETURN_FALSE;
+  RETURN_BOOL(trunc(value) == value);
+}
+
+DEF_PRIMITIVE(num_isNan)
+{
+  RETURN_BOOL(isnan(AS_NUM(args[0])));
+}
+
+DEF_PRIMITIVE(num_sign)
+{
+  double value = AS_NUM(args[0]);
+  if (value > 0)
+  {
+    RETURN_NUM(1);
+  }
+  else if (value < 0)
+  {
+    RETURN_NUM(-1);
+  }
+  else
+  {
+    RETURN_NUM(0);
+  }
+}
+
+DEF_PRIMITIVE(num_toString)
+{
+  RETURN_VAL(wrenNumToString(vm, AS_NUM(args[0])));
+}
+
+DEF_PRIMITIVE(num_truncate)
+{
+  double integer;
+  modf(AS_NUM(args[0]) , &integer);
+  RETURN_NUM(integer);
+}
+
+DEF_PRIMITIVE(object_same)
+{
+  RETURN_BOOL(wrenValuesEqual(args[1], args[2]));
+}
+
+DEF_PRIMITIVE(object_not)
+{
+  RETURN_VAL(FALSE_VAL);
+}
+
+DEF_PRIMITIVE(object_eqeq)
+{
+  RETURN_BOOL(wrenValuesEqual(args[0], args[1]));
+}
+
+DEF_PRIMITIVE(object_bangeq)
+{
+  RETURN_BOOL(!wrenValuesEqual(args[0], args[1]));
+}
+
+DEF_PRIMITIVE(object_is)
+{
+  if (!IS_CLASS(args[1]))
+  {
+    RETURN_ERROR("Right operand must be a class.");
+  }
+
+  ObjClass *classObj = wrenGetClass(vm, args[0]);
+  ObjClass *baseClassObj = AS_CLASS(args[1]);
+
+  // Walk the superclass chain looking for the class.
+  do
+  {
+    if (baseClassObj == classObj) RETURN_BOOL(true);
+
+    classObj = classObj->superclass;
+  }
+  while (classObj != NULL);
+
+  RETURN_BOOL(false);
+}
+
+DEF_PRIMITIVE(object_toString)
+{
+  Obj* obj = AS_OBJ(args[0]);
+  Value name = OBJ_VAL(wrenGetObjClass(vm, obj)->name);
+  RETURN_VAL(wrenStringFormat(vm, "instance of @", name));
+}
+
+DEF_PRIMITIVE(object_type)
+{
+  RETURN_OBJ(wrenGetClass(vm, args[0]));
+}
+
+DEF_PRIMITIVE(range_from)
+{
+  RETURN_NUM(AS_RANGE(args[0])->from);
+}
+
+DEF_PRIMITIVE(range_to)
+{
+  RETURN_NUM(AS_RANGE(args[0])->to);
+}
+
+DEF_PRIMITIVE(range_min)
+{
+  ObjRange* range = AS_RANGE(args[0]);
+  RETURN_NUM(fmin(range->from, range->to));
+}
+
+DEF_PRIMITIVE(range_max)
+{
+  ObjRange* range = AS_RANGE(args[0]);
+  RETURN_NUM(fmax(range->from, range->to));
+}
+
+DEF_PRIMITIVE(range_isInclusive)
+{
+  RETURN_BOOL(AS_RANGE(args[0])->isInclusive);
+}
+
+DEF_PRIMITIVE(range_iterate)
+{
+  ObjRange* range = AS_RANGE(args[0]);
+
+  // Special case: empty range.
+  if (range->from == range->to && !range->isInclusive) RETURN_FALSE;
+
+  if (!IS_NULL(args[1]) && !validateNum(vm, args[1], "Iterator")) return false;
+
+  RETURN_VAL(wrenIterateRange(range->from, range->to, range->isInclusive,
+                              args[1]));
+}
+
+DEF_PRIMITIVE(range_iteratorValue)
+{
+  // Assume the iterator is a number so that is the value of the range.
+  RETURN_VAL(args[1]);
+}
+
+DEF_PRIMITIVE(range_toString)
+{
+  ObjRange* range = AS_RANGE(args[0]);
+
+  Value from = wrenNumToString(vm, range->from);
+  wrenPushRoot(vm, AS_OBJ(from));
+
+  Value to = wrenNumToString(vm, range->to);
+  wrenPushRoot(vm, AS_OBJ(to));
+
+  Value result = wrenStringFormat(vm, "@$@", from,
+                                  range->isInclusive ? ".." : "...", to);
+
+  wrenPopRoot(vm);
+  wrenPopRoot(vm);
+  RETURN_VAL(result);
+}
+
+DEF_PRIMITIVE(string_fromCodePoint)
+{
+  if (!validateInt(vm, args[1], "Code point")) return false;
+
+  int codePoint = (int)AS_NUM(args[1]);
+  if (codePoint < 0)
+  {
+    RETURN_ERROR("Code point cannot be negative.");
+  }
+  else if (codePoint > 0x10ffff)
+  {
+    RETURN_ERROR("Code point cannot be greater than 0x10ffff.");
+  }
+
+  RETURN_VAL(wrenStringFromCodePoint(vm, codePoint));
 }
 
-DEF_PRIMITIVE(bool_toString)
+DEF_PRIMITIVE(string_fromByte)
 {
-  if (AS_BOOL(args[0]))
+  if (!validateInt(vm, args[1], "Byte")) return false;
+  int byte = (int) AS_NUM(args[1]);
+  if (byte < 0)
   {
-    RETURN_VAL(CONST_STRING(vm, "true"));
+    RETURN_ERROR("Byte cannot be negative.");
   }
-  else
+  else if (byte > 0xff)
   {
-    RETURN_VAL(CONST_STRING(vm, "false"));
+    RETURN_ERROR("Byte cannot be greater than 0xff.");
   }
+  RETURN_VAL(wrenStringFromByte(vm, (uint8_t) byte));
 }
 
-DEF_PRIMITIVE(class_name)
+DEF_PRIMITIVE(string_byteAt)
 {
-  RETURN_OBJ(AS_CLASS(args[0])->name);
+  ObjString* string = AS_STRING(args[0]);
+
+  uint32_t index = validateIndex(vm, args[1], string->length, "Index");
+  if (index == UINT32_MAX) return false;
+
+  RETURN_NUM((uint8_t)string->value[index]);
 }
 
-DEF_PRIMITIVE(class_supertype)
+DEF_PRIMITIVE(string_byteCount)
 {
-  ObjClass* classObj = AS_CLASS(args[0]);
+  RETURN_NUM(AS_STRING(args[0])->length);
+}
 
-  // Object has no superclass.
-  if (classObj->superclass == NULL) RETURN_NULL;
+DEF_PRIMITIVE(string_codePointAt)
+{
+  ObjString* string = AS_STRING(args[0]);
 
-  RETURN_OBJ(classObj->superclass);
+  uint32_t index = validateIndex(vm, args[1], string->length, "Index");
+  if (index == UINT32_MAX) return false;
+
+  // If we are in the middle of a UTF-8 sequence, indicate that.
+  const uint8_t* bytes = (uint8_t*)string->value;
+  if ((bytes[index] & 0xc0) == 0x80) RETURN_NUM(-1);
+
+  // Decode the UTF-8 sequence.
+  RETURN_NUM(wrenUtf8Decode((uint8_t*)string->value + index,
+                            string->length - index));
 }
 
-DEF_PRIMITIVE(class_toString)
+DEF_PRIMITIVE(string_contains)
 {
-  RETURN_OBJ(AS_CLASS(args[0])->name);
+  if (!validateString(vm, args[1], "Argument")) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* search = AS_STRING(args[1]);
+
+  RETURN_BOOL(wrenStringFind(string, search, 0) != UINT32_MAX);
 }
 
-DEF_PRIMITIVE(class_attributes)
+DEF_PRIMITIVE(string_endsWith)
 {
-  RETURN_VAL(AS_CLASS(args[0])->attributes);
+  if (!validateString(vm, args[1], "Argument")) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* search = AS_STRING(args[1]);
+
+  // Edge case: If the search string is longer then return false right away.
+  if (search->length > string->length) RETURN_FALSE;
+
+  RETURN_BOOL(memcmp(string->value + string->length - search->length,
+                     search->value, search->length) == 0);
 }
 
-DEF_PRIMITIVE(fiber_new)
+DEF_PRIMITIVE(string_indexOf1)
 {
-  if (!validateFn(vm, args[1], "Argument")) return false;
+  if (!validateString(vm, args[1], "Argument")) return false;
 
-  ObjClosure* closure = AS_CLOSURE(args[1]);
-  if (closure->fn->arity > 1)
-  {
-    RETURN_ERROR("Function cannot take more than one parameter.");
-  }
-  
-  RETURN_OBJ(wrenNewFiber(vm, closure));
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* search = AS_STRING(args[1]);
+
+  uint32_t index = wrenStringFind(string, search, 0);
+  RETURN_NUM(index == UINT32_MAX ? -1 : (int)index);
 }
 
-DEF_PRIMITIVE(fiber_abort)
+DEF_PRIMITIVE(string_indexOf2)
 {
-  vm->fiber->error = args[1];
+  if (!validateString(vm, args[1], "Argument")) return false;
 
-  // If the error is explicitly null, it's not really an abort.
-  return IS_NULL(args[1]);
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* search = AS_STRING(args[1]);
+  uint32_t start = validateIndex(vm, args[2], string->length, "Start");
+  if (start == UINT32_MAX) return false;
+  
+  uint32_t index = wrenStringFind(string, search, start);
+  RETURN_NUM(index == UINT32_MAX ? -1 : (int)index);
 }
 
-// Transfer execution to [fiber] coming from the current fiber whose stack has
-// [args].
-//
-// [isCall] is true if [fiber] is being called and not transferred.
-//
-// [hasValue] is true if a value in [args] is being passed to the new fiber.
-// Otherwise, `null` is implicitly being passed.
-static bool runFiber(WrenVM* vm, ObjFiber* fiber, Value* args, bool isCall,
-                     bool hasValue, const char* verb)
+DEF_PRIMITIVE(string_iterate)
 {
+  ObjString* string = AS_STRING(args[0]);
 
-  if (wrenHasError(fiber))
+  // If we're starting the iteration, return the first index.
+  if (IS_NULL(args[1]))
   {
-    RETURN_ERROR_FMT("Cannot $ an aborted fiber.", verb);
+    if (string->length == 0) RETURN_FALSE;
+    RETURN_NUM(0);
   }
 
-  if (isCall)
-  {
-    // You can't call a called fiber, but you can transfer directly to it,
-    // which is why this check is gated on `isCall`. This way, after resuming a
-    // suspended fiber, it will run and then return to the fiber that called it
-    // and so on.
-    if (fiber->caller != NULL) RETURN_ERROR("Fiber has already been called.");
+  if (!validateInt(vm, args[1], "Iterator")) return false;
 
-    if (fiber->state == FIBER_ROOT) RETURN_ERROR("Cannot call root fiber.");
-    
-    // Remember who ran it.
-    fiber->caller = vm->fiber;
-  }
+  if (AS_NUM(args[1]) < 0) RETURN_FALSE;
+  uint32_t index = (uint32_t)AS_NUM(args[1]);
 
-  if (fiber->numFrames == 0)
+  // Advance to the beginning of the next UTF-8 sequence.
+  do
   {
-    RETURN_ERROR_FMT("Cannot $ a finished fiber.", verb);
-  }
+    index++;
+    if (index >= string->length) RETURN_FALSE;
+  } while ((string->value[index] & 0xc0) == 0x80);
 
-  // When the calling fiber resumes, we'll store the result of the call in its
-  // stack. If the call has two arguments (the fiber and the value), we only
-  // need one slot for the result, so discard the other slot now.
-  if (hasValue) vm->fiber->stackTop--;
+  RETURN_NUM(index);
+}
 
-  if (fiber->numFrames == 1 &&
-      fiber->frames[0].ip == fiber->frames[0].closure->fn->code.data)
-  {
-    // The fiber is being started for the first time. If its function takes a
-    // parameter, bind an argument to it.
-    if (fiber->frames[0].closure->fn->arity == 1)
-    {
-      fiber->stackTop[0] = hasValue ? args[1] : NULL_VAL;
-      fiber->stackTop++;
-    }
-  }
-  else
+DEF_PRIMITIVE(string_iterateByte)
+{
+  ObjString* string = AS_STRING(args[0]);
+
+  // If we're starting the iteration, return the first index.
+  if (IS_NULL(args[1]))
   {
-    // The fiber is being resumed, make yield() or transfer() return the result.
-    fiber->stackTop[-1] = hasValue ? args[1] : NULL_VAL;
+    if (string->length == 0) RETURN_FALSE;
+    RETURN_NUM(0);
   }
 
-  vm->fiber = fiber;
-  return false;
-}
+  if (!validateInt(vm, args[1], "Iterator")) return false;
 
-DEF_PRIMITIVE(fiber_call)
-{
-  return runFiber(vm, AS_FIBER(args[0]), args, true, false, "call");
-}
+  if (AS_NUM(args[1]) < 0) RETURN_FALSE;
+  uint32_t index = (uint32_t)AS_NUM(args[1]);
 
-DEF_PRIMITIVE(fiber_call1)
-{
-  return runFiber(vm, AS_FIBER(args[0]), args, true, true, "call");
-}
+  // Advance to the next byte.
+  index++;
+  if (index >= string->length) RETURN_FALSE;
 
-DEF_PRIMITIVE(fiber_current)
-{
-  RETURN_OBJ(vm->fiber);
+  RETURN_NUM(index);
 }
 
-DEF_PRIMITIVE(fiber_error)
+DEF_PRIMITIVE(string_iteratorValue)
 {
-  RETURN_VAL(AS_FIBER(args[0])->error);
-}
+  ObjString* string = AS_STRING(args[0]);
+  uint32_t index = validateIndex(vm, args[1], string->length, "Iterator");
+  if (index == UINT32_MAX) return false;
 
-DEF_PRIMITIVE(fiber_isDone)
-{
-  ObjFiber* runFiber = AS_FIBER(args[0]);
-  RETURN_BOOL(runFiber->numFrames == 0 || wrenHasError(runFiber));
+  RETURN_VAL(wrenStringCodePointAt(vm, string, index));
 }
 
-DEF_PRIMITIVE(fiber_suspend)
+DEF_PRIMITIVE(string_startsWith)
 {
-  // Switching to a null fiber tells the interpreter to stop and exit.
-  vm->fiber = NULL;
-  vm->apiStack = NULL;
-  return false;
-}
+  if (!validateString(vm, args[1], "Argument")) return false;
 
-DEF_PRIMITIVE(fiber_transfer)
-{
-  return runFiber(vm, AS_FIBER(args[0]), args, false, false, "transfer to");
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* search = AS_STRING(args[1]);
+
+  // Edge case: If the search string is longer then return false right away.
+  if (search->length > string->length) RETURN_FALSE;
+
+  RETURN_BOOL(memcmp(string->value, search->value, search->length) == 0);
 }
 
-DEF_PRIMITIVE(fiber_transfer1)
+DEF_PRIMITIVE(string_plus)
 {
-  return runFiber(vm, AS_FIBER(args[0]), args, false, true, "transfer to");
+  if (!validateString(vm, args[1], "Right operand")) return false;
+  RETURN_VAL(wrenStringFormat(vm, "@@", args[0], args[1]));
 }
 
-DEF_PRIMITIVE(fiber_transferError)
+DEF_PRIMITIVE(string_subscript)
 {
-  runFiber(vm, AS_FIBER(args[0]), args, false, true, "transfer to");
-  vm->fiber->error = args[1];
-  return false;
+  ObjString* string = AS_STRING(args[0]);
+
+  if (IS_NUM(args[1]))
+  {
+    int index = validateIndex(vm, args[1], string->length, "Subscript");
+    if (index == -1) return false;
+
+    RETURN_VAL(wrenStringCodePointAt(vm, string, index));
+  }
+
+  if (!IS_RANGE(args[1]))
+  {
+    RETURN_ERROR("Subscript must be a number or a range.");
+  }
+
+  int step;
+  uint32_t count = string->length;
+  int start = calculateRange(vm, AS_RANGE(args[1]), &count, &step);
+  if (start == -1) return false;
+
+  RETURN_VAL(wrenNewStringFromRange(vm, string, start, count, step));
 }
 
-DEF_PRIMITIVE(fiber_try)
+DEF_PRIMITIVE(string_toString)
 {
-  runFiber(vm, AS_FIBER(args[0]), args, true, false, "try");
-  
-  // If we're switching to a valid fiber to try, remember that we're trying it.
-  if (!wrenHasError(vm->fiber)) vm->fiber->state = FIBER_TRY;
-  return false;
+  RETURN_VAL(args[0]);
 }
 
-DEF_PRIMITIVE(fiber_try1)
+DEF_PRIMITIVE(system_clock)
 {
-  runFiber(vm, AS_FIBER(args[0]), args, true, true, "try");
-  
-  // If we're switching to a valid fiber to try, remember that we're trying it.
-  if (!wrenHasError(vm->fiber)) vm->fiber->state = FIBER_TRY;
-  return false;
+  RETURN_NUM((double)clock() / CLOCKS_PER_SEC);
 }
 
-DEF_PRIMITIVE(fiber_yield)
+DEF_PRIMITIVE(system_gc)
 {
-  ObjFiber* current = vm->fiber;
-  vm->fiber = current->caller;
-
-  // Unhook this fiber from the one that called it.
-  current->caller = NULL;
-  current->state = FIBER_OTHER;
+  wrenCollectGarbage(vm);
+  RETURN_NULL;
+}
 
-  if (vm->fiber != NULL)
+DEF_PRIMITIVE(system_writeString)
+{
+  if (vm->config.writeFn != NULL)
   {
-    // Make the caller's run method return null.
-    vm->fiber->stackTop[-1] = NULL_VAL;
+    vm->config.writeFn(vm, AS_CSTRING(args[1]));
   }
 
-  return false;
+  RETURN_VAL(args[1]);
 }
 
-DEF_PRIMITIVE(fiber_yield1)
+// Creates either the Object or Class class in the core module with [name].
+static ObjClass* defineClass(WrenVM* vm, ObjModule* module, const char* name)
 {
-  ObjFiber* current = vm->fiber;
-  vm->fiber = current->caller;
-
-  // Unhook this fiber from the one that called it.
-  current->caller = NULL;
-  current->state = FIBER_OTHER;
+  ObjString* nameString = AS_STRING(wrenNewString(vm, name));
+  wrenPushRoot(vm, (Obj*)nameString);
 
-  if (vm->fiber != NULL)
-  {
-    // Make the caller's run method return the argument passed to yield.
-    vm->fiber->stackTop[-1] = args[1];
+  ObjClass* classObj = wrenNewSingleClass(vm, 0, nameString);
 
-    // When the yielding fiber resumes, we'll store the result of the yield
-    // call in its stack. Since Fiber.yield(value) has two arguments (the Fiber
-    // class and the value) and we only need one slot for the result, discard
-    // the other slot now.
-    current->stackTop--;
-  }
+  wrenDefineVariable(vm, module, name, nameString->length, OBJ_VAL(classObj), NULL);
 
-  return false;
+  wrenPopRoot(vm);
+  return classObj;
 }
 
-DEF_PRIMITIVE(fn_new)
+void wrenInitializeCore(WrenVM* vm)
 {
-  if (!validateFn(vm, args[1], "Argument")) return false;
+  ObjModule* coreModule = wrenNewModule(vm, NULL);
+  wrenPushRoot(vm, (Obj*)coreModule);
+  
+  // The core module's key is null in the module map.
+  wrenMapSet(vm, vm->modules, NULL_VAL, OBJ_VAL(coreModule));
+  wrenPopRoot(vm); // coreModule.
 
-  // The block argument is already a function, so just return it.
-  RETURN_VAL(args[1]);
-}
+  // Define the root Object class. This has to be done a little specially
+  // because it has no superclass.
+  vm->objectClass = defineClass(vm, coreModule, "Object");
+  PRIMITIVE(vm->objectClass, "!", object_not);
+  PRIMITIVE(vm->objectClass, "==(_)", object_eqeq);
+  PRIMITIVE(vm->objectClass, "!=(_)", object_bangeq);
+  PRIMITIVE(vm->objectClass, "is(_)", object_is);
+  PRIMITIVE(vm->objectClass, "toString", object_toString);
+  PRIMITIVE(vm->objectClass, "type", object_type);
 
-DEF_PRIMITIVE(fn_arity)
-{
-  RETURN_NUM(AS_CLOSURE(args[0])->fn->arity);
-}
+  // Now we can define Class, which is a subclass of Object.
+  vm->classClass = defineClass(vm, coreModule, "Class");
+  wrenBindSuperclass(vm, vm->classClass, vm->objectClass);
+  PRIMITIVE(vm->classClass, "name", class_name);
+  PRIMITIVE(vm->classClass, "supertype", class_supertype);
+  PRIMITIVE(vm->classClass, "toString", class_toString);
+  PRIMITIVE(vm->classClass, "attributes", class_attributes);
 
-static void call_fn(WrenVM* vm, Value* args, int numArgs)
-{
-  // +1 to include the function itself.
-  wrenCallFunction(vm, vm->fiber, AS_CLOSURE(args[0]), numArgs + 1);
-}
+  // Finally, we can define Object's metaclass which is a subclass of Class.
+  ObjClass* objectMetaclass = defineClass(vm, coreModule, "Object metaclass");
 
-#define DEF_FN_CALL(numArgs)                                                   \
-    DEF_PRIMITIVE(fn_call##numArgs)                                            \
-    {                                                                          \
-      call_fn(vm, args, numArgs);                                              \
-      return false;                                                            \
-    }
+  // Wire up the metaclass relationships now that all three classes are built.
+  wrenSetObjClass(&vm->objectClass->obj, objectMetaclass);
+  wrenSetObjClass(&objectMetaclass->obj, vm->classClass);
+  wrenSetObjClass(&vm->classClass->obj, vm->classClass);
+
+  // Do this after wiring up the metaclasses so objectMetaclass doesn't get
+  // collected.
+  wrenBindSuperclass(vm, objectMetaclass, vm->classClass);
+
+  PRIMITIVE(objectMetaclass, "same(_,_)", object_same);
+
+  // The core class diagram ends up looking like this, where single lines point
+  // to a class's superclass, and double lines point to its metaclass:
+  //
+  //        .------------------------------------. .====.
+  //        |                  .---------------. | #    #
+  //        v                  |               v | v    #
+  //   .---------.   .-------------------.   .-------.  #
+  //   | Object  |==>| Object metaclass  |==>| Class |=="
+  //   '---------'   '-------------------'   '-------'
+  //        ^                                 ^ ^ ^ ^
+  //        |                  .--------------' # | #
+  //        |                  |                # | #
+  //   .---------.   .-------------------.      # | # -.
+  //   |  Base   |==>|  Base metaclass   |======" | #  |
+  //   '---------'   '-------------------'        | #  |
+  //        ^                                     | #  |
+  //        |                  .------------------' #  | Example classes
+  //        |                  |                    #  |
+  //   .---------.   .-------------------.          #  |
+  //   | Derived |==>| Derived metaclass |=========="  |
+  //   '---------'   '-------------------'            -'
+
+  // The rest of the classes can now be defined normally.
+  wrenInterpret(vm, NULL, coreModuleSource);
+
+  vm->boolClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Bool"));
+  PRIMITIVE(vm->boolClass, "toString", bool_toString);
+  PRIMITIVE(vm->boolClass, "!", bool_not);
+
+  vm->fiberClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Fiber"));
+  ObjClass* fiberMetaclass = wrenGetObjClass(vm, &vm->fiberClass->obj);
+  PRIMITIVE(fiberMetaclass, "new(_)", fiber_new);
+  PRIMITIVE(fiberMetaclass, "abort(_)", fiber_abort);
+  PRIMITIVE(fiberMetaclass, "current", fiber_current);
+  PRIMITIVE(fiberMetaclass, "suspend()", fiber_suspend);
+  PRIMITIVE(fiberMetaclass, "yield()", fiber_yield);
+  PRIMITIVE(fiberMetaclass, "yield(_)", fiber_yield1);
+  PRIMITIVE(vm->fiberClass, "call()", fiber_call);
+  PRIMITIVE(vm->fiberClass, "call(_)", fiber_call1);
+  PRIMITIVE(vm->fiberClass, "error", fiber_error);
+  PRIMITIVE(vm->fiberClass, "isDone", fiber_isDone);
+  PRIMITIVE(vm->fiberClass, "transfer()", fiber_transfer);
+  PRIMITIVE(vm->fiberClass, "transfer(_)", fiber_transfer1);
+  PRIMITIVE(vm->fiberClass, "transferError(_)", fiber_transferError);
+  PRIMITIVE(vm->fiberClass, "try()", fiber_try);
+  PRIMITIVE(vm->fiberClass, "try(_)", fiber_try1);
+
+  vm->fnClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Fn"));
+  ObjClass* fnMetaclass = wrenGetObjClass(vm, &vm->fnClass->obj);
+  PRIMITIVE(fnMetaclass, "new(_)", fn_new);
+
+  PRIMITIVE(vm->fnClass, "arity", fn_arity);
+
+  FUNCTION_CALL(vm->fnClass, "call()", fn_call0);
+  FUNCTION_CALL(vm->fnClass, "call(_)", fn_call1);
+  FUNCTION_CALL(vm->fnClass, "call(_,_)", fn_call2);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_)", fn_call3);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_)", fn_call4);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_)", fn_call5);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_)", fn_call6);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_)", fn_call7);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_)", fn_call8);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_)", fn_call9);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_)", fn_call10);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_)", fn_call11);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_)", fn_call12);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call13);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call14);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call15);
+  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call16);
+  
+  PRIMITIVE(vm->fnClass, "toString", fn_toString);
+
+  vm->nullClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Null"));
+  PRIMITIVE(vm->nullClass, "!", null_not);
+  PRIMITIVE(vm->nullClass, "toString", null_toString);
+
+  vm->numClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Num"));
+  ObjClass* numMetaclass = wrenGetObjClass(vm, &vm->numClass->obj);
+  PRIMITIVE(numMetaclass, "fromString(_)", num_fromString);
+  PRIMITIVE(numMetaclass, "infinity", num_infinity);
+  PRIMITIVE(numMetaclass, "nan", num_nan);
+  PRIMITIVE(numMetaclass, "pi", num_pi);
+  PRIMITIVE(numMetaclass, "tau", num_tau);
+  PRIMITIVE(numMetaclass, "largest", num_largest);
+  PRIMITIVE(numMetaclass, "smallest", num_smallest);
+  PRIMITIVE(numMetaclass, "maxSafeInteger", num_maxSafeInteger);
+  PRIMITIVE(numMetaclass, "minSafeInteger", num_minSafeInteger);
+  PRIMITIVE(vm->numClass, "-(_)", num_minus);
+  PRIMITIVE(vm->numClass, "+(_)", num_plus);
+  PRIMITIVE(vm->numClass, "*(_)", num_multiply);
+  PRIMITIVE(vm->numClass, "/(_)", num_divide);
+  PRIMITIVE(vm->numClass, "<(_)", num_lt);
+  PRIMITIVE(vm->numClass, ">(_)", num_gt);
+  PRIMITIVE(vm->numClass, "<=(_)", num_lte);
+  PRIMITIVE(vm->numClass, ">=(_)", num_gte);
+  PRIMITIVE(vm->numClass, "&(_)", num_bitwiseAnd);
+  PRIMITIVE(vm->numClass, "|(_)", num_bitwiseOr);
+  PRIMITIVE(vm->numClass, "^(_)", num_bitwiseXor);
+  PRIMITIVE(vm->numClass, "<<(_)", num_bitwiseLeftShift);
+  PRIMITIVE(vm->numClass, ">>(_)", num_bitwiseRightShift);
+  PRIMITIVE(vm->numClass, "abs", num_abs);
+  PRIMITIVE(vm->numClass, "acos", num_acos);
+  PRIMITIVE(vm->numClass, "asin", num_asin);
+  PRIMITIVE(vm->numClass, "atan", num_atan);
+  PRIMITIVE(vm->numClass, "cbrt", num_cbrt);
+  PRIMITIVE(vm->numClass, "ceil", num_ceil);
+  PRIMITIVE(vm->numClass, "cos", num_cos);
+  PRIMITIVE(vm->numClass, "floor", num_floor);
+  PRIMITIVE(vm->numClass, "-", num_negate);
+  PRIMITIVE(vm->numClass, "round", num_round);
+  PRIMITIVE(vm->numClass, "min(_)", num_min);
+  PRIMITIVE(vm->numClass, "max(_)", num_max);
+  PRIMITIVE(vm->numClass, "clamp(_,_)", num_clamp);
+  PRIMITIVE(vm->numClass, "sin", num_sin);
+  PRIMITIVE(vm->numClass, "sqrt", num_sqrt);
+  PRIMITIVE(vm->numClass, "tan", num_tan);
+  PRIMITIVE(vm->numClass, "log", num_log);
+  PRIMITIVE(vm->numClass, "log2", num_log2);
+  PRIMITIVE(vm->numClass, "exp", num_exp);
+  PRIMITIVE(vm->numClass, "%(_)", num_mod);
+  PRIMITIVE(vm->numClass, "~", num_bitwiseNot);
+  PRIMITIVE(vm->numClass, "..(_)", num_dotDot);
+  PRIMITIVE(vm->numClass, "...(_)", num_dotDotDot);
+  PRIMITIVE(vm->numClass, "atan(_)", num_atan2);
+  PRIMITIVE(vm->numClass, "pow(_)", num_pow);
+  PRIMITIVE(vm->numClass, "fraction", num_fraction);
+  PRIMITIVE(vm->numClass, "isInfinity", num_isInfinity);
+  PRIMITIVE(vm->numClass, "isInteger", num_isInteger);
+  PRIMITIVE(vm->numClass, "isNan", num_isNan);
+  PRIMITIVE(vm->numClass, "sign", num_sign);
+  PRIMITIVE(vm->numClass, "toString", num_toString);
+  PRIMITIVE(vm->numClass, "truncate", num_truncate);
+
+  // These are defined just so that 0 and -0 are equal, which is specified by
+  // IEEE 754 even though they have different bit representations.
+  PRIMITIVE(vm->numClass, "==(_)", num_eqeq);
+  PRIMITIVE(vm->numClass, "!=(_)", num_bangeq);
+
+  vm->stringClass = AS_CLASS(wrenFindVariable(vm, coreModule, "String"));
+  ObjClass* stringMetaclass = wrenGetObjClass(vm, &vm->stringClass->obj);
+  PRIMITIVE(stringMetaclass, "fromCodePoint(_)", string_fromCodePoint);
+  PRIMITIVE(stringMetaclass, "fromByte(_)", string_fromByte);
+  PRIMITIVE(vm->stringClass, "+(_)", string_plus);
+  PRIMITIVE(vm->stringClass, "[_]", string_subscript);
+  PRIMITIVE(vm->stringClass, "byteAt_(_)", string_byteAt);
+  PRIMITIVE(vm->stringClass, "byteCount_", string_byteCount);
+  PRIMITIVE(vm->stringClass, "codePointAt_(_)", string_codePointAt);
+  PRIMITIVE(vm->stringClass, "contains(_)", string_contains);
+  PRIMITIVE(vm->stringClass, "endsWith(_)", string_endsWith);
+  PRIMITIVE(vm->stringClass, "indexOf(_)", string_indexOf1);
+  PRIMITIVE(vm->stringClass, "indexOf(_,_)", string_indexOf2);
+  PRIMITIVE(vm->stringClass, "iterate(_)", string_iterate);
+  PRIMITIVE(vm->stringClass, "iterateByte_(_)", string_iterateByte);
+  PRIMITIVE(vm->stringClass, "iteratorValue(_)", string_iteratorValue);
+  PRIMITIVE(vm->stringClass, "startsWith(_)", string_startsWith);
+  PRIMITIVE(vm->stringClass, "toString", string_toString);
+
+  vm->listClass = AS_CLASS(wrenFindVariable(vm, coreModule, "List"));
+  ObjClass* listMetaclass = wrenGetObjClass(vm, &vm->listClass->obj);
+  PRIMITIVE(listMetaclass, "filled(_,_)", list_filled);
+  PRIMITIVE(listMetaclass, "new()", list_new);
+  PRIMITIVE(vm->listClass, "[_]", list_subscript);
+  PRIMITIVE(vm->listClass, "[_]=(_)", list_subscriptSetter);
+  PRIMITIVE(vm->listClass, "add(_)", list_add);
+  PRIMITIVE(vm->listClass, "addCore_(_)", list_addCore);
+  PRIMITIVE(vm->listClass, "clear()", list_clear);
+  PRIMITIVE(vm->listClass, "count", list_count);
+  PRIMITIVE(vm->listClass, "insert(_,_)", list_insert);
+  PRIMITIVE(vm->listClass, "iterate(_)", list_iterate);
+  PRIMITIVE(vm->listClass, "iteratorValue(_)", list_iteratorValue);
+  PRIMITIVE(vm->listClass, "removeAt(_)", list_removeAt);
+  PRIMITIVE(vm->listClass, "remove(_)", list_removeValue);
+  PRIMITIVE(vm->listClass, "indexOf(_)", list_indexOf);
+  PRIMITIVE(vm->listClass, "swap(_,_)", list_swap);
 
-DEF_FN_CALL(0)
-DEF_FN_CALL(1)
-DEF_FN_CALL(2)
-DEF_FN_CALL(3)
-DEF_FN_CALL(4)
-DEF_FN_CALL(5)
-DEF_FN_CALL(6)
-DEF_FN_CALL(7)
-DEF_FN_CALL(8)
-DEF_FN_CALL(9)
-DEF_FN_CALL(10)
-DEF_FN_CALL(11)
-DEF_FN_CALL(12)
-DEF_FN_CALL(13)
-DEF_FN_CALL(14)
-DEF_FN_CALL(15)
-DEF_FN_CALL(16)
+  vm->mapClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Map"));
+  ObjClass* mapMetaclass = wrenGetObjClass(vm, &vm->mapClass->obj);
+  PRIMITIVE(mapMetaclass, "new()", map_new);
+  PRIMITIVE(vm->mapClass, "[_]", map_subscript);
+  PRIMITIVE(vm->mapClass, "[_]=(_)", map_subscriptSetter);
+  PRIMITIVE(vm->mapClass, "addCore_(_,_)", map_addCore);
+  PRIMITIVE(vm->mapClass, "clear()", map_clear);
+  PRIMITIVE(vm->mapClass, "containsKey(_)", map_containsKey);
+  PRIMITIVE(vm->mapClass, "count", map_count);
+  PRIMITIVE(vm->mapClass, "remove(_)", map_remove);
+  PRIMITIVE(vm->mapClass, "iterate(_)", map_iterate);
+  PRIMITIVE(vm->mapClass, "keyIteratorValue_(_)", map_keyIteratorValue);
+  PRIMITIVE(vm->mapClass, "valueIteratorValue_(_)", map_valueIteratorValue);
 
-DEF_PRIMITIVE(fn_toString)
-{
-  RETURN_VAL(CONST_STRING(vm, "<fn>"));
-}
+  vm->rangeClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Range"));
+  PRIMITIVE(vm->rangeClass, "from", range_from);
+  PRIMITIVE(vm->rangeClass, "to", range_to);
+  PRIMITIVE(vm->rangeClass, "min", range_min);
+  PRIMITIVE(vm->rangeClass, "max", range_max);
+  PRIMITIVE(vm->rangeClass, "isInclusive", range_isInclusive);
+  PRIMITIVE(vm->rangeClass, "iterate(_)", range_iterate);
+  PRIMITIVE(vm->rangeClass, "iteratorValue(_)", range_iteratorValue);
+  PRIMITIVE(vm->rangeClass, "toString", range_toString);
 
-// Creates a new list of size args[1], with all elements initialized to args[2].
-DEF_PRIMITIVE(list_filled)
-{
-  if (!validateInt(vm, args[1], "Size")) return false;  
-  if (AS_NUM(args[1]) < 0) RETURN_ERROR("Size cannot be negative.");
-  
-  uint32_t size = (uint32_t)AS_NUM(args[1]);
-  ObjList* list = wrenNewList(vm, size);
-  
-  for (uint32_t i = 0; i < size; i++)
+  ObjClass* systemClass = AS_CLASS(wrenFindVariable(vm, coreModule, "System"));
+  ObjClass* systemMetaclass = wrenGetObjClass(vm, &systemClass->obj);
+  PRIMITIVE(systemMetaclass, "clock", system_clock);
+  PRIMITIVE(systemMetaclass, "gc()", system_gc);
+  PRIMITIVE(systemMetaclass, "writeString_(_)", system_writeString);
+
+  // While bootstrapping the core types and running the core module, a number
+  // of string objects have been created, many of which were instantiated
+  // before stringClass was stored in the VM. Some of them *must* be created
+  // first -- the ObjClass for string itself has a reference to the ObjString
+  // for its name.
+  //
+  // These all currently have a NULL classObj pointer, so go back and assign
+  // them now that the string class is known.
+  for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
   {
-    list->elements.data[i] = args[2];
+    if (obj->type == OBJ_STRING) wrenSetObjClass(obj, vm->stringClass);
   }
-  
-  RETURN_OBJ(list);
-}
-
-DEF_PRIMITIVE(list_new)
-{
-  RETURN_OBJ(wrenNewList(vm, 0));
 }
+// End file "wren_core.c"
+// Begin file "wren_debug.c"
+#include <stdio.h>
 
-DEF_PRIMITIVE(list_add)
-{
-  wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
-  RETURN_VAL(args[1]);
-}
 
-// Adds an element to the list and then returns the list itself. This is called
-// by the compiler when compiling list literals instead of using add() to
-// minimize stack churn.
-DEF_PRIMITIVE(list_addCore)
+void wrenDebugPrintStackTrace(WrenVM* vm)
 {
-  wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
+  // Bail if the host doesn't enable printing errors.
+  if (vm->config.errorFn == NULL) return;
   
-  // Return the list.
-  RETURN_VAL(args[0]);
-}
+  ObjFiber* fiber = vm->fiber;
+  if (IS_STRING(fiber->error))
+  {
+    vm->config.errorFn(vm, WREN_ERROR_RUNTIME,
+                       NULL, -1, AS_CSTRING(fiber->error));
+  }
+  else
+  {
+    // TODO: Print something a little useful here. Maybe the name of the error's
+    // class?
+    vm->config.errorFn(vm, WREN_ERROR_RUNTIME,
+                       NULL, -1, "[error object]");
+  }
 
-DEF_PRIMITIVE(list_clear)
-{
-  wrenValueBufferClear(vm, &AS_LIST(args[0])->elements);
-  RETURN_NULL;
-}
+  for (int i = fiber->numFrames - 1; i >= 0; i--)
+  {
+    CallFrame* frame = &fiber->frames[i];
+    ObjFn* fn = frame->closure->fn;
 
-DEF_PRIMITIVE(list_count)
-{
-  RETURN_NUM(AS_LIST(args[0])->elements.count);
+    // Skip over stub functions for calling methods from the C API.
+    if (fn->module == NULL) continue;
+    
+    // The built-in core module has no name. We explicitly omit it from stack
+    // traces since we don't want to highlight to a user the implementation
+    // detail of what part of the core module is written in C and what is Wren.
+    if (fn->module->name == NULL) continue;
+    
+    // -1 because IP has advanced past the instruction that it just executed.
+    int line = fn->debug->sourceLines.data[frame->ip - fn->code.data - 1];
+    vm->config.errorFn(vm, WREN_ERROR_STACK_TRACE,
+                       fn->module->name->value, line,
+                       fn->debug->name);
+  }
 }
 
-DEF_PRIMITIVE(list_insert)
+static void dumpObject(Obj* obj)
 {
-  ObjList* list = AS_LIST(args[0]);
-
-  // count + 1 here so you can "insert" at the very end.
-  uint32_t index = validateIndex(vm, args[1], list->elements.count + 1,
-                                 "Index");
-  if (index == UINT32_MAX) return false;
-
-  wrenListInsert(vm, list, args[2], index);
-  RETURN_VAL(args[2]);
+  switch (obj->type)
+  {
+    case OBJ_CLASS:
+      printf("[class %s %p]", ((ObjClass*)obj)->name->value, obj);
+      break;
+    case OBJ_CLOSURE: printf("[closure %p]", obj); break;
+    case OBJ_FIBER: printf("[fiber %p]", obj); break;
+    case OBJ_FN: printf("[fn %p]", obj); break;
+    case OBJ_FOREIGN: printf("[foreign %p]", obj); break;
+    case OBJ_INSTANCE: printf("[instance %p]", obj); break;
+    case OBJ_LIST: printf("[list %p]", obj); break;
+    case OBJ_MAP: printf("[map %p]", obj); break;
+    case OBJ_MODULE: printf("[module %p]", obj); break;
+    case OBJ_RANGE: printf("[range %p]", obj); break;
+    case OBJ_STRING: printf("%s", ((ObjString*)obj)->value); break;
+    case OBJ_UPVALUE: printf("[upvalue %p]", obj); break;
+    default: printf("[unknown object %d]", obj->type); break;
+  }
 }
 
-DEF_PRIMITIVE(list_iterate)
+void wrenDumpValue(Value value)
 {
-  ObjList* list = AS_LIST(args[0]);
-
-  // If we're starting the iteration, return the first index.
-  if (IS_NULL(args[1]))
+#if WREN_NAN_TAGGING
+  if (IS_NUM(value))
   {
-    if (list->elements.count == 0) RETURN_FALSE;
-    RETURN_NUM(0);
+    printf("%.14g", AS_NUM(value));
   }
-
-  if (!validateInt(vm, args[1], "Iterator")) return false;
-
-  // Stop if we're out of bounds.
-  double index = AS_NUM(args[1]);
-  if (index < 0 || index >= list->elements.count - 1) RETURN_FALSE;
-
-  // Otherwise, move to the next index.
-  RETURN_NUM(index + 1);
+  else if (IS_OBJ(value))
+  {
+    dumpObject(AS_OBJ(value));
+  }
+  else
+  {
+    switch (GET_TAG(value))
+    {
+      case TAG_FALSE:     printf("false"); break;
+      case TAG_NAN:       printf("NaN"); break;
+      case TAG_NULL:      printf("null"); break;
+      case TAG_TRUE:      printf("true"); break;
+      case TAG_UNDEFINED: UNREACHABLE();
+    }
+  }
+#else
+  switch (value.type)
+  {
+    case VAL_FALSE:     printf("false"); break;
+    case VAL_NULL:      printf("null"); break;
+    case VAL_NUM:       printf("%.14g", AS_NUM(value)); break;
+    case VAL_TRUE:      printf("true"); break;
+    case VAL_OBJ:       dumpObject(AS_OBJ(value)); break;
+    case VAL_UNDEFINED: UNREACHABLE();
+  }
+#endif
 }
 
-DEF_PRIMITIVE(list_iteratorValue)
+static int dumpInstruction(WrenVM* vm, ObjFn* fn, int i, int* lastLine)
 {
-  ObjList* list = AS_LIST(args[0]);
-  uint32_t index = validateIndex(vm, args[1], list->elements.count, "Iterator");
-  if (index == UINT32_MAX) return false;
+  int start = i;
+  uint8_t* bytecode = fn->code.data;
+  Code code = (Code)bytecode[i];
 
-  RETURN_VAL(list->elements.data[index]);
-}
+  int line = fn->debug->sourceLines.data[i];
+  if (lastLine == NULL || *lastLine != line)
+  {
+    printf("%4d:", line);
+    if (lastLine != NULL) *lastLine = line;
+  }
+  else
+  {
+    printf("     ");
+  }
 
-DEF_PRIMITIVE(list_removeAt)
-{
-  ObjList* list = AS_LIST(args[0]);
-  uint32_t index = validateIndex(vm, args[1], list->elements.count, "Index");
-  if (index == UINT32_MAX) return false;
+  printf(" %04d  ", i++);
 
-  RETURN_VAL(wrenListRemoveAt(vm, list, index));
-}
+  #define READ_BYTE() (bytecode[i++])
+  #define READ_SHORT() (i += 2, (bytecode[i - 2] << 8) | bytecode[i - 1])
 
-DEF_PRIMITIVE(list_removeValue) {
-  ObjList* list = AS_LIST(args[0]);
-  int index = wrenListIndexOf(vm, list, args[1]);
-  if(index == -1) RETURN_NULL;
-  RETURN_VAL(wrenListRemoveAt(vm, list, index));
-}
+  #define BYTE_INSTRUCTION(name)                                               \
+      printf("%-16s %5d\n", name, READ_BYTE());                                \
+      break
 
-DEF_PRIMITIVE(list_indexOf)
-{
-  ObjList* list = AS_LIST(args[0]);
-  RETURN_NUM(wrenListIndexOf(vm, list, args[1]));
-}
+  switch (code)
+  {
+    case CODE_CONSTANT:
+    {
+      int constant = READ_SHORT();
+      printf("%-16s %5d '", "CONSTANT", constant);
+      wrenDumpValue(fn->constants.data[constant]);
+      printf("'\n");
+      break;
+    }
 
-DEF_PRIMITIVE(list_swap)
-{
-  ObjList* list = AS_LIST(args[0]);
-  uint32_t indexA = validateIndex(vm, args[1], list->elements.count, "Index 0");
-  if (indexA == UINT32_MAX) return false;
-  uint32_t indexB = validateIndex(vm, args[2], list->elements.count, "Index 1");
-  if (indexB == UINT32_MAX) return false;
+    case CODE_NULL:  printf("NULL\n"); break;
+    case CODE_FALSE: printf("FALSE\n"); break;
+    case CODE_TRUE:  printf("TRUE\n"); break;
 
-  Value a = list->elements.data[indexA];
-  list->elements.data[indexA] = list->elements.data[indexB];
-  list->elements.data[indexB] = a;
+    case CODE_LOAD_LOCAL_0: printf("LOAD_LOCAL_0\n"); break;
+    case CODE_LOAD_LOCAL_1: printf("LOAD_LOCAL_1\n"); break;
+    case CODE_LOAD_LOCAL_2: printf("LOAD_LOCAL_2\n"); break;
+    case CODE_LOAD_LOCAL_3: printf("LOAD_LOCAL_3\n"); break;
+    case CODE_LOAD_LOCAL_4: printf("LOAD_LOCAL_4\n"); break;
+    case CODE_LOAD_LOCAL_5: printf("LOAD_LOCAL_5\n"); break;
+    case CODE_LOAD_LOCAL_6: printf("LOAD_LOCAL_6\n"); break;
+    case CODE_LOAD_LOCAL_7: printf("LOAD_LOCAL_7\n"); break;
+    case CODE_LOAD_LOCAL_8: printf("LOAD_LOCAL_8\n"); break;
 
-  RETURN_NULL;
-}
+    case CODE_LOAD_LOCAL: BYTE_INSTRUCTION("LOAD_LOCAL");
+    case CODE_STORE_LOCAL: BYTE_INSTRUCTION("STORE_LOCAL");
+    case CODE_LOAD_UPVALUE: BYTE_INSTRUCTION("LOAD_UPVALUE");
+    case CODE_STORE_UPVALUE: BYTE_INSTRUCTION("STORE_UPVALUE");
 
-DEF_PRIMITIVE(list_subscript)
-{
-  ObjList* list = AS_LIST(args[0]);
+    case CODE_LOAD_MODULE_VAR:
+    {
+      int slot = READ_SHORT();
+      printf("%-16s %5d '%s'\n", "LOAD_MODULE_VAR", slot,
+             fn->module->variableNames.data[slot]->value);
+      break;
+    }
 
-  if (IS_NUM(args[1]))
-  {
-    uint32_t index = validateIndex(vm, args[1], list->elements.count,
-                                   "Subscript");
-    if (index == UINT32_MAX) return false;
+    case CODE_STORE_MODULE_VAR:
+    {
+      int slot = READ_SHORT();
+      printf("%-16s %5d '%s'\n", "STORE_MODULE_VAR", slot,
+             fn->module->variableNames.data[slot]->value);
+      break;
+    }
 
-    RETURN_VAL(list->elements.data[index]);
-  }
+    case CODE_LOAD_FIELD_THIS: BYTE_INSTRUCTION("LOAD_FIELD_THIS");
+    case CODE_STORE_FIELD_THIS: BYTE_INSTRUCTION("STORE_FIELD_THIS");
+    case CODE_LOAD_FIELD: BYTE_INSTRUCTION("LOAD_FIELD");
+    case CODE_STORE_FIELD: BYTE_INSTRUCTION("STORE_FIELD");
 
-  if (!IS_RANGE(args[1]))
-  {
-    RETURN_ERROR("Subscript must be a number or a range.");
-  }
+    case CODE_POP: printf("POP\n"); break;
 
-  int step;
-  uint32_t count = list->elements.count;
-  uint32_t start = calculateRange(vm, AS_RANGE(args[1]), &count, &step);
-  if (start == UINT32_MAX) return false;
+    case CODE_CALL_0:
+    case CODE_CALL_1:
+    case CODE_CALL_2:
+    case CODE_CALL_3:
+    case CODE_CALL_4:
+    case CODE_CALL_5:
+    case CODE_CALL_6:
+    case CODE_CALL_7:
+    case CODE_CALL_8:
+    case CODE_CALL_9:
+    case CODE_CALL_10:
+    case CODE_CALL_11:
+    case CODE_CALL_12:
+    case CODE_CALL_13:
+    case CODE_CALL_14:
+    case CODE_CALL_15:
+    case CODE_CALL_16:
+    {
+      int numArgs = bytecode[i - 1] - CODE_CALL_0;
+      int symbol = READ_SHORT();
+      printf("CALL_%-11d %5d '%s'\n", numArgs, symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
 
-  ObjList* result = wrenNewList(vm, count);
-  for (uint32_t i = 0; i < count; i++)
-  {
-    result->elements.data[i] = list->elements.data[start + i * step];
-  }
+    case CODE_SUPER_0:
+    case CODE_SUPER_1:
+    case CODE_SUPER_2:
+    case CODE_SUPER_3:
+    case CODE_SUPER_4:
+    case CODE_SUPER_5:
+    case CODE_SUPER_6:
+    case CODE_SUPER_7:
+    case CODE_SUPER_8:
+    case CODE_SUPER_9:
+    case CODE_SUPER_10:
+    case CODE_SUPER_11:
+    case CODE_SUPER_12:
+    case CODE_SUPER_13:
+    case CODE_SUPER_14:
+    case CODE_SUPER_15:
+    case CODE_SUPER_16:
+    {
+      int numArgs = bytecode[i - 1] - CODE_SUPER_0;
+      int symbol = READ_SHORT();
+      int superclass = READ_SHORT();
+      printf("SUPER_%-10d %5d '%s' %5d\n", numArgs, symbol,
+             vm->methodNames.data[symbol]->value, superclass);
+      break;
+    }
 
-  RETURN_OBJ(result);
-}
+    case CODE_JUMP:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "JUMP", offset, i + offset);
+      break;
+    }
 
-DEF_PRIMITIVE(list_subscriptSetter)
-{
-  ObjList* list = AS_LIST(args[0]);
-  uint32_t index = validateIndex(vm, args[1], list->elements.count,
-                                 "Subscript");
-  if (index == UINT32_MAX) return false;
+    case CODE_LOOP:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "LOOP", offset, i - offset);
+      break;
+    }
 
-  list->elements.data[index] = args[2];
-  RETURN_VAL(args[2]);
-}
+    case CODE_JUMP_IF:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "JUMP_IF", offset, i + offset);
+      break;
+    }
 
-DEF_PRIMITIVE(map_new)
-{
-  RETURN_OBJ(wrenNewMap(vm));
-}
+    case CODE_JUMP_IF_NUMS:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "JUMP_IF_NUMS", offset, i + offset);
+      break;
+    }
 
-DEF_PRIMITIVE(map_subscript)
-{
-  if (!validateKey(vm, args[1])) return false;
+    case CODE_ITERATE:
+    {
+      int seq = READ_BYTE();
+      int iterator = READ_BYTE();
+      int kind = READ_BYTE();
+      int exit = READ_SHORT();
+      int body = READ_SHORT();
+      printf("%-16s %5d %d %d exit %d body %d\n", "ITERATE", seq, iterator,
+             kind, i + exit, i + body);
+      break;
+    }
 
-  ObjMap* map = AS_MAP(args[0]);
-  Value value = wrenMapGet(map, args[1]);
-  if (IS_UNDEFINED(value)) RETURN_NULL;
+    case CODE_AND:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "AND", offset, i + offset);
+      break;
+    }
 
-  RETURN_VAL(value);
-}
+    case CODE_OR:
+    {
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "OR", offset, i + offset);
+      break;
+    }
 
-DEF_PRIMITIVE(map_subscriptSetter)
-{
-  if (!validateKey(vm, args[1])) return false;
+    case CODE_CLOSE_UPVALUE: printf("CLOSE_UPVALUE\n"); break;
+    case CODE_RETURN:        printf("RETURN\n"); break;
 
-  wrenMapSet(vm, AS_MAP(args[0]), args[1], args[2]);
-  RETURN_VAL(args[2]);
-}
+    case CODE_CLOSURE:
+    {
+      int constant = READ_SHORT();
+      printf("%-16s %5d ", "CLOSURE", constant);
+      wrenDumpValue(fn->constants.data[constant]);
+      printf(" ");
+      ObjFn* loadedFn = AS_FN(fn->constants.data[constant]);
+      for (int j = 0; j < loadedFn->numUpvalues; j++)
+      {
+        int isLocal = READ_BYTE();
+        int index = READ_BYTE();
+        if (j > 0) printf(", ");
+        printf("%s %d", isLocal ? "local" : "upvalue", index);
+      }
+      printf("\n");
+      break;
+    }
 
-// Adds an entry to the map and then returns the map itself. This is called by
-// the compiler when compiling map literals instead of using [_]=(_) to
-// minimize stack churn.
-DEF_PRIMITIVE(map_addCore)
-{
-  if (!validateKey(vm, args[1])) return false;
-  
-  wrenMapSet(vm, AS_MAP(args[0]), args[1], args[2]);
-  
-  // Return the map itself.
-  RETURN_VAL(args[0]);
-}
+    case CODE_CONSTRUCT:         printf("CONSTRUCT\n"); break;
+    case CODE_FOREIGN_CONSTRUCT: printf("FOREIGN_CONSTRUCT\n"); break;
+      
+    case CODE_CLASS:
+    {
+      int numFields = READ_BYTE();
+      printf("%-16s %5d fields\n", "CLASS", numFields);
+      break;
+    }
 
-DEF_PRIMITIVE(map_clear)
-{
-  wrenMapClear(vm, AS_MAP(args[0]));
-  RETURN_NULL;
-}
+    case CODE_FOREIGN_CLASS: printf("FOREIGN_CLASS\n"); break;
+    case CODE_END_CLASS: printf("END_CLASS\n"); break;
 
-DEF_PRIMITIVE(map_containsKey)
-{
-  if (!validateKey(vm, args[1])) return false;
+    case CODE_METHOD_INSTANCE:
+    {
+      int symbol = READ_SHORT();
+      printf("%-16s %5d '%s'\n", "METHOD_INSTANCE", symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
 
-  RETURN_BOOL(!IS_UNDEFINED(wrenMapGet(AS_MAP(args[0]), args[1])));
-}
+    case CODE_METHOD_STATIC:
+    {
+      int symbol = READ_SHORT();
+      printf("%-16s %5d '%s'\n", "METHOD_STATIC", symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
+      
+    case CODE_END_MODULE:
+      printf("END_MODULE\n");
+      break;
+      
+    case CODE_IMPORT_MODULE:
+    {
+      int name = READ_SHORT();
+      printf("%-16s %5d '", "IMPORT_MODULE", name);
+      wrenDumpValue(fn->constants.data[name]);
+      printf("'\n");
+      break;
+    }
+      
+    case CODE_IMPORT_VARIABLE:
+    {
+      int variable = READ_SHORT();
+      printf("%-16s %5d '", "IMPORT_VARIABLE", variable);
+      wrenDumpValue(fn->constants.data[variable]);
+      printf("'\n");
+      break;
+    }
 
-DEF_PRIMITIVE(map_count)
-{
-  RETURN_NUM(AS_MAP(args[0])->count);
-}
+    case CODE_LOAD_LOCAL_CALL_0:
+    case CODE_LOAD_LOCAL_CALL_1:
+    {
+      const char* name = code == CODE_LOAD_LOCAL_CALL_0
+          ? "LOAD_LOCAL_CALL_0" : "LOAD_LOCAL_CALL_1";
+      int slot = READ_BYTE();
+      int symbol = READ_SHORT();
+      printf("%-16s %5d %d '%s'\n", name, slot, symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
 
-DEF_PRIMITIVE(map_iterate)
-{
-  ObjMap* map = AS_MAP(args[0]);
+    case CODE_LOAD_MODULE_VAR_CALL_0:
+    {
+      int slot = READ_SHORT();
+      i++;
+      int symbol = READ_SHORT();
+      printf("%-16s %5d '%s' %d '%s'\n", "LOAD_MODULE_VAR_CALL_0", slot,
+             fn->module->variableNames.data[slot]->value, symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
 
-  if (map->count == 0) RETURN_FALSE;
+    case CODE_CONSTANT_CALL_1:
+    {
+      int constant = READ_SHORT();
+      i++;
+      int symbol = READ_SHORT();
+      printf("%-16s %5d '", "CONSTANT_CALL_1", constant);
+      wrenDumpValue(fn->constants.data[constant]);
+      printf("' %d '%s'\n", symbol, vm->methodNames.data[symbol]->value);
+      break;
+    }
 
-  // If we're starting the iteration, start at the first used entry.
-  uint32_t index = 0;
+    case CODE_STORE_LOCAL_POP:
+      printf("%-16s %5d\n", "STORE_LOCAL_POP", READ_BYTE());
+      i++;
+      break;
 
-  // Otherwise, start one past the last entry we stopped at.
-  if (!IS_NULL(args[1]))
-  {
-    if (!validateInt(vm, args[1], "Iterator")) return false;
+    case CODE_STORE_MODULE_VAR_POP:
+    {
+      int slot = READ_SHORT();
+      i++;
+      printf("%-16s %5d '%s'\n", "STORE_MODULE_VAR_POP", slot,
+             fn->module->variableNames.data[slot]->value);
+      break;
+    }
 
-    if (AS_NUM(args[1]) < 0) RETURN_FALSE;
-    index = (uint32_t)AS_NUM(args[1]);
+    case CODE_STORE_FIELD_THIS_POP:
+      printf("%-16s %5d\n", "STORE_FIELD_THIS_POP", READ_BYTE());
+      i++;
+      break;
 
-    if (index >= map->capacity) RETURN_FALSE;
+    case CODE_POP_LOOP:
+    {
+      i++;
+      int offset = READ_SHORT();
+      printf("%-16s %5d to %d\n", "POP_LOOP", offset, i - offset);
+      break;
+    }
+      
+    case CODE_END:
+      printf("END\n");
+      break;
 
-    // Advance the iterator.
-    index++;
+    default:
+      printf("UKNOWN! [%d]\n", bytecode[i - 1]);
+      break;
   }
 
-  // Find a used entry, if any.
-  for (; index < map->capacity; index++)
-  {
-    if (!IS_UNDEFINED(map->entries[index].key)) RETURN_NUM(index);
-  }
+  // Return how many bytes this instruction takes, or -1 if it's an END.
+  if (code == CODE_END) return -1;
+  return i - start;
 
-  // If we get here, walked all of the entries.
-  RETURN_FALSE;
+  #undef READ_BYTE
+  #undef READ_SHORT
 }
 
-DEF_PRIMITIVE(map_remove)
+int wrenDumpInstruction(WrenVM* vm, ObjFn* fn, int i)
 {
-  if (!validateKey(vm, args[1])) return false;
-
-  RETURN_VAL(wrenMapRemoveKey(vm, AS_MAP(args[0]), args[1]));
+  return dumpInstruction(vm, fn, i, NULL);
 }
 
-DEF_PRIMITIVE(map_keyIteratorValue)
+void wrenDumpCode(WrenVM* vm, ObjFn* fn)
 {
-  ObjMap* map = AS_MAP(args[0]);
-  uint32_t index = validateIndex(vm, args[1], map->capacity, "Iterator");
-  if (index == UINT32_MAX) return false;
+  printf("%s: %s\n",
+         fn->module->name == NULL ? "<core>" : fn->module->name->value,
+         fn->debug->name);
 
-  MapEntry* entry = &map->entries[index];
-  if (IS_UNDEFINED(entry->key))
+  int i = 0;
+  int lastLine = -1;
+  for (;;)
   {
-    RETURN_ERROR("Invalid map iterator.");
+    int offset = dumpInstruction(vm, fn, i, &lastLine);
+    if (offset == -1) break;
+    i += offset;
   }
 
-  RETURN_VAL(entry->key);
+  printf("\n");
 }
 
-DEF_PRIMITIVE(map_valueIteratorValue)
+void wrenDumpStack(ObjFiber* fiber)
 {
-  ObjMap* map = AS_MAP(args[0]);
-  uint32_t index = validateIndex(vm, args[1], map->capacity, "Iterator");
-  if (index == UINT32_MAX) return false;
-
-  MapEntry* entry = &map->entries[index];
-  if (IS_UNDEFINED(entry->key))
+  printf("(fiber %p) ", fiber);
+  for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
   {
-    RETURN_ERROR("Invalid map iterator.");
+    wrenDumpValue(*slot);
+    printf(" | ");
   }
-
-  RETURN_VAL(entry->value);
-}
-
-DEF_PRIMITIVE(null_not)
-{
-  RETURN_VAL(TRUE_VAL);
-}
-
-DEF_PRIMITIVE(null_toString)
-{
-  RETURN_VAL(CONST_STRING(vm, "null"));
-}
-
-DEF_PRIMITIVE(num_fromString)
-{
-  if (!validateString(vm, args[1], "Argument")) return false;
-
-  ObjString* string = AS_STRING(args[1]);
-
-  // Corner case: Can't parse an empty string.
-  if (string->length == 0) RETURN_NULL;
-
-  errno = 0;
-  char* end;
-  double number = strtod(string->value, &end);
-
-  // Skip past any trailing whitespace.
-  while (*end != '\0' && isspace((unsigned char)*end)) end++;
-
-  if (errno == ERANGE) RETURN_ERROR("Number literal is too large.");
-
-  // We must have consumed the entire string. Otherwise, it contains non-number
-  // characters and we can't parse it.
-  if (end < string->value + string->length) RETURN_NULL;
-
-  RETURN_NUM(number);
+  printf("\n");
 }
+// End file "wren_debug.c"
+// Begin file "wren_primitive.c"
 
-// Defines a primitive on Num that calls infix [op] and returns [type].
-#define DEF_NUM_CONSTANT(name, value)                                          \
-    DEF_PRIMITIVE(num_##name)                                                  \
-    {                                                                          \
-      RETURN_NUM(value);                                                       \
-    }
-
-DEF_NUM_CONSTANT(infinity, INFINITY)
-DEF_NUM_CONSTANT(nan,      WREN_DOUBLE_NAN)
-DEF_NUM_CONSTANT(pi,       3.14159265358979323846264338327950288)
-DEF_NUM_CONSTANT(tau,      6.28318530717958647692528676655900577)
-
-DEF_NUM_CONSTANT(largest,  DBL_MAX)
-DEF_NUM_CONSTANT(smallest, DBL_MIN)
-
-DEF_NUM_CONSTANT(maxSafeInteger, 9007199254740991.0)
-DEF_NUM_CONSTANT(minSafeInteger, -9007199254740991.0)
-
-// Defines a primitive on Num that calls infix [op] and returns [type].
-#define DEF_NUM_INFIX(name, op, type)                                          \
-    DEF_PRIMITIVE(num_##name)                                                  \
-    {                                                                          \
-      if (!validateNum(vm, args[1], "Right operand")) return false;            \
-      RETURN_##type(AS_NUM(args[0]) op AS_NUM(args[1]));                       \
-    }
-
-DEF_NUM_INFIX(minus,    -,  NUM)
-DEF_NUM_INFIX(plus,     +,  NUM)
-DEF_NUM_INFIX(multiply, *,  NUM)
-DEF_NUM_INFIX(divide,   /,  NUM)
-DEF_NUM_INFIX(lt,       <,  BOOL)
-DEF_NUM_INFIX(gt,       >,  BOOL)
-DEF_NUM_INFIX(lte,      <=, BOOL)
-DEF_NUM_INFIX(gte,      >=, BOOL)
-
-// Defines a primitive on Num that call infix bitwise [op].
-#define DEF_NUM_BITWISE(name, op)                                              \
-    DEF_PRIMITIVE(num_bitwise##name)                                           \
-    {                                                                          \
-      if (!validateNum(vm, args[1], "Right operand")) return false;            \
-      uint32_t left = (uint32_t)AS_NUM(args[0]);                               \
-      uint32_t right = (uint32_t)AS_NUM(args[1]);                              \
-      RETURN_NUM(left op right);                                               \
-    }
-
-DEF_NUM_BITWISE(And,        &)
-DEF_NUM_BITWISE(Or,         |)
-DEF_NUM_BITWISE(Xor,        ^)
-DEF_NUM_BITWISE(LeftShift,  <<)
-DEF_NUM_BITWISE(RightShift, >>)
-
-// Defines a primitive method on Num that returns the result of [fn].
-#define DEF_NUM_FN(name, fn)                                                   \
-    DEF_PRIMITIVE(num_##name)                                                  \
-    {                                                                          \
-      RETURN_NUM(fn(AS_NUM(args[0])));                                         \
-    }
-
-DEF_NUM_FN(abs,     fabs)
-DEF_NUM_FN(acos,    acos)
-DEF_NUM_FN(asin,    asin)
-DEF_NUM_FN(atan,    atan)
-DEF_NUM_FN(cbrt,    cbrt)
-DEF_NUM_FN(ceil,    ceil)
-DEF_NUM_FN(cos,     cos)
-DEF_NUM_FN(floor,   floor)
-DEF_NUM_FN(negate,  -)
-DEF_NUM_FN(round,   round)
-DEF_NUM_FN(sin,     sin)
-DEF_NUM_FN(sqrt,    sqrt)
-DEF_NUM_FN(tan,     tan)
-DEF_NUM_FN(log,     log)
-DEF_NUM_FN(log2,    log2)
-DEF_NUM_FN(exp,     exp)
+#include <math.h>
 
-DEF_PRIMITIVE(num_mod)
+// Validates that [value] is an integer within `[0, count)`. Also allows
+// negative indices which map backwards from the end. Returns the valid positive
+// index value. If invalid, reports an error and returns `UINT32_MAX`.
+static uint32_t validateIndexValue(WrenVM* vm, uint32_t count, double value,
+                                   const char* argName)
 {
-  if (!validateNum(vm, args[1], "Right operand")) return false;
-  RETURN_NUM(fmod(AS_NUM(args[0]), AS_NUM(args[1])));
+  if (!validateIntValue(vm, value, argName)) return UINT32_MAX;
+  
+  // Negative indices count from the end.
+  if (value < 0) value = count + value;
+  
+  // Check bounds.
+  if (value >= 0 && value < count) return (uint32_t)value;
+  
+  vm->fiber->error = wrenStringFormat(vm, "$ out of bounds.", argName);
+  return UINT32_MAX;
 }
 
-DEF_PRIMITIVE(num_eqeq)
+bool validateFn(WrenVM* vm, Value arg, const char* argName)
 {
-  if (!IS_NUM(args[1])) RETURN_FALSE;
-  RETURN_BOOL(AS_NUM(args[0]) == AS_NUM(args[1]));
+  if (IS_CLOSURE(arg)) return true;
+  RETURN_ERROR_FMT("$ must be a function.", argName);
 }
 
-DEF_PRIMITIVE(num_bangeq)
+bool validateNum(WrenVM* vm, Value arg, const char* argName)
 {
-  if (!IS_NUM(args[1])) RETURN_TRUE;
-  RETURN_BOOL(AS_NUM(args[0]) != AS_NUM(args[1]));
+  if (IS_NUM(arg)) return true;
+  RETURN_ERROR_FMT("$ must be a number.", argName);
 }
 
-DEF_PRIMITIVE(num_bitwiseNot)
+bool validateIntValue(WrenVM* vm, double value, const char* argName)
 {
-  // Bitwise operators always work on 32-bit unsigned ints.
-  RETURN_NUM(~(uint32_t)AS_NUM(args[0]));
+  if (trunc(value) == value) return true;
+  RETURN_ERROR_FMT("$ must be an integer.", argName);
 }
 
-DEF_PRIMITIVE(num_dotDot)
+bool validateInt(WrenVM* vm, Value arg, const char* argName)
 {
-  if (!validateNum(vm, args[1], "Right hand side of range")) return false;
-
-  double from = AS_NUM(args[0]);
-  double to = AS_NUM(args[1]);
-  RETURN_VAL(wrenNewRange(vm, from, to, true));
+  // Make sure it's a number first.
+  if (!validateNum(vm, arg, argName)) return false;
+  return validateIntValue(vm, AS_NUM(arg), argName);
 }
 
-DEF_PRIMITIVE(num_dotDotDot)
+bool validateKey(WrenVM* vm, Value arg)
 {
-  if (!validateNum(vm, args[1], "Right hand side of range")) return false;
+  if (wrenMapIsValidKey(arg)) return true;
 
-  double from = AS_NUM(args[0]);
-  double to = AS_NUM(args[1]);
-  RETURN_VAL(wrenNewRange(vm, from, to, false));
+  RETURN_ERROR("Key must be a value type.");
 }
 
-DEF_PRIMITIVE(num_atan2)
+uint32_t validateIndex(WrenVM* vm, Value arg, uint32_t count,
+                       const char* argName)
 {
-  if (!validateNum(vm, args[1], "x value")) return false;
-
-  RETURN_NUM(atan2(AS_NUM(args[0]), AS_NUM(args[1])));
+  if (!validateNum(vm, arg, argName)) return UINT32_MAX;
+  return validateIndexValue(vm, count, AS_NUM(arg), argName);
 }
 
-DEF_PRIMITIVE(num_min)
+bool validateString(WrenVM* vm, Value arg, const char* argName)
 {
-  if (!validateNum(vm, args[1], "Other value")) return false;
-
-  double value = AS_NUM(args[0]);
-  double other = AS_NUM(args[1]);
-  RETURN_NUM(value <= other ? value : other);
+  if (IS_STRING(arg)) return true;
+  RETURN_ERROR_FMT("$ must be a string.", argName);
 }
 
-DEF_PRIMITIVE(num_max)
+uint32_t calculateRange(WrenVM* vm, ObjRange* range, uint32_t* length,
+                        int* step)
 {
-  if (!validateNum(vm, args[1], "Other value")) return false;
+  *step = 0;
 
-  double value = AS_NUM(args[0]);
-  double other = AS_NUM(args[1]);
-  RETURN_NUM(value > other ? value : other);
-}
+  // Edge case: an empty range is allowed at the end of a sequence. This way,
+  // list[0..-1] and list[0...list.count] can be used to copy a list even when
+  // empty.
+  if (range->from == *length &&
+      range->to == (range->isInclusive ? -1.0 : (double)*length))
+  {
+    *length = 0;
+    return 0;
+  }
 
-DEF_PRIMITIVE(num_clamp)
-{
-  if (!validateNum(vm, args[1], "Min value")) return false;
-  if (!validateNum(vm, args[2], "Max value")) return false;
+  uint32_t from = validateIndexValue(vm, *length, range->from, "Range start");
+  if (from == UINT32_MAX) return UINT32_MAX;
 
-  double value = AS_NUM(args[0]);
-  double min = AS_NUM(args[1]);
-  double max = AS_NUM(args[2]);
-  double result = (value < min) ? min : ((value > max) ? max : value);
-  RETURN_NUM(result);
-}
+  // Bounds check the end manually to handle exclusive ranges.
+  double value = range->to;
+  if (!validateIntValue(vm, value, "Range end")) return UINT32_MAX;
 
-DEF_PRIMITIVE(num_pow)
-{
-  if (!validateNum(vm, args[1], "Power value")) return false;
+  // Negative indices count from the end.
+  if (value < 0) value = *length + value;
 
-  RETURN_NUM(pow(AS_NUM(args[0]), AS_NUM(args[1])));
+  // Convert the exclusive range to an inclusive one.
+  if (!range->isInclusive)
+  {
+    // An exclusive range with the same start and end points is empty.
+    if (value == from)
+    {
+      *length = 0;
+      return from;
+    }
+
+    // Shift the endpoint to make it inclusive, handling both increasing and
+    // decreasing ranges.
+    value += value >= from ? -1 : 1;
+  }
+
+  // Check bounds.
+  if (value < 0 || value >= *length)
+  {
+    vm->fiber->error = CONST_STRING(vm, "Range end out of bounds.");
+    return UINT32_MAX;
+  }
+
+  uint32_t to = (uint32_t)value;
+  *length = abs((int)(from - to)) + 1;
+  *step = from < to ? 1 : -1;
+  return from;
 }
+// End file "wren_primitive.c"
+// Begin file "wren_utils.c"
+#include <string.h>
 
-DEF_PRIMITIVE(num_fraction)
+
+DEFINE_BUFFER(Byte, uint8_t);
+DEFINE_BUFFER(Int, int);
+DEFINE_BUFFER(String, ObjString*);
+
+void wrenSymbolTableInit(SymbolTable* symbols)
 {
-  double unused;
-  RETURN_NUM(modf(AS_NUM(args[0]) , &unused));
+  wrenStringBufferInit(symbols);
 }
 
-DEF_PRIMITIVE(num_isInfinity)
+void wrenSymbolTableClear(WrenVM* vm, SymbolTable* symbols)
 {
-  RETURN_BOOL(isinf(AS_NUM(args[0])));
+  wrenStringBufferClear(vm, symbols);
 }
 
-DEF_PRIMITIVE(num_isInteger)
+int wrenSymbolTableAdd(WrenVM* vm, SymbolTable* symbols,
+                       const char* name, size_t length)
 {
-  double value = AS_NUM(args[0]);
-  if (isnan(value) || isinf(value)) RETURN_FALSE;
-  RETURN_BOOL(trunc(value) == value);
+  ObjString* symbol = AS_STRING(wrenNewStringLength(vm, name, length));
+  
+  wrenPushRoot(vm, &symbol->obj);
+  wrenStringBufferWrite(vm, symbols, symbol);
+  wrenPopRoot(vm);
+  
+  return symbols->count - 1;
 }
 
-DEF_PRIMITIVE(num_isNan)
+int wrenSymbolTableEnsure(WrenVM* vm, SymbolTable* symbols,
+                          const char* name, size_t length)
 {
-  RETURN_BOOL(isnan(AS_NUM(args[0])));
+  // See if the symbol is already defined.
+  int existing = wrenSymbolTableFind(symbols, name, length);
+  if (existing != -1) return existing;
+
+  // New symbol, so add it.
+  return wrenSymbolTableAdd(vm, symbols, name, length);
 }
 
-DEF_PRIMITIVE(num_sign)
+int wrenSymbolTableFind(const SymbolTable* symbols,
+                        const char* name, size_t length)
 {
-  double value = AS_NUM(args[0]);
-  if (value > 0)
-  {
-    RETURN_NUM(1);
-  }
-  else if (value < 0)
-  {
-    RETURN_NUM(-1);
-  }
-  else
+  // See if the symbol is already defined.
+  // TODO: O(n). Do something better.
+  for (int i = 0; i < symbols->count; i++)
   {
-    RETURN_NUM(0);
+    if (wrenStringEqualsCString(symbols->data[i], name, length)) return i;
   }
-}
 
-DEF_PRIMITIVE(num_toString)
-{
-  RETURN_VAL(wrenNumToString(vm, AS_NUM(args[0])));
+  return -1;
 }
 
-DEF_PRIMITIVE(num_truncate)
+void wrenBlackenSymbolTable(WrenVM* vm, SymbolTable* symbolTable)
 {
-  double integer;
-  modf(AS_NUM(args[0]) , &integer);
-  RETURN_NUM(integer);
+  for (int i = 0; i < symbolTable->count; i++)
+  {
+    wrenGrayObj(vm, &symbolTable->data[i]->obj);
+  }
 }
 
-DEF_PRIMITIVE(object_same)
+int wrenUtf8EncodeNumBytes(int value)
 {
-  RETURN_BOOL(wrenValuesEqual(args[1], args[2]));
+  ASSERT(value >= 0, "Cannot encode a negative value.");
+  
+  if (value <= 0x7f) return 1;
+  if (value <= 0x7ff) return 2;
+  if (value <= 0xffff) return 3;
+  if (value <= 0x10ffff) return 4;
+  return 0;
 }
 
-DEF_PRIMITIVE(object_not)
+int wrenUtf8Encode(int value, uint8_t* bytes)
 {
-  RETURN_VAL(FALSE_VAL);
-}
+  if (value <= 0x7f)
+  {
+    // Single byte (i.e. fits in ASCII).
+    *bytes = value & 0x7f;
+    return 1;
+  }
+  else if (value <= 0x7ff)
+  {
+    // Two byte sequence: 110xxxxx 10xxxxxx.
+    *bytes = 0xc0 | ((value & 0x7c0) >> 6);
+    bytes++;
+    *bytes = 0x80 | (value & 0x3f);
+    return 2;
+  }
+  else if (value <= 0xffff)
+  {
+    // Three byte sequence: 1110xxxx 10xxxxxx 10xxxxxx.
+    *bytes = 0xe0 | ((value & 0xf000) >> 12);
+    bytes++;
+    *bytes = 0x80 | ((value & 0xfc0) >> 6);
+    bytes++;
+    *bytes = 0x80 | (value & 0x3f);
+    return 3;
+  }
+  else if (value <= 0x10ffff)
+  {
+    // Four byte sequence: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx.
+    *bytes = 0xf0 | ((value & 0x1c0000) >> 18);
+    bytes++;
+    *bytes = 0x80 | ((value & 0x3f000) >> 12);
+    bytes++;
+    *bytes = 0x80 | ((value & 0xfc0) >> 6);
+    bytes++;
+    *bytes = 0x80 | (value & 0x3f);
+    return 4;
+  }
 
-DEF_PRIMITIVE(object_eqeq)
-{
-  RETURN_BOOL(wrenValuesEqual(args[0], args[1]));
+  // Invalid Unicode value. See: http://tools.ietf.org/html/rfc3629
+  UNREACHABLE();
+  return 0;
 }
 
-DEF_PRIMITIVE(object_bangeq)
+int wrenUtf8Decode(const uint8_t* bytes, uint32_t length)
 {
-  RETURN_BOOL(!wrenValuesEqual(args[0], args[1]));
-}
+  // Single byte (i.e. fits in ASCII).
+  if (*bytes <= 0x7f) return *bytes;
 
-DEF_PRIMITIVE(object_is)
-{
-  if (!IS_CLASS(args[1]))
+  int value;
+  uint32_t remainingBytes;
+  if ((*bytes & 0xe0) == 0xc0)
   {
-    RETURN_ERROR("Right operand must be a class.");
+    // Two byte sequence: 110xxxxx 10xxxxxx.
+    value = *bytes & 0x1f;
+    remainingBytes = 1;
+  }
+  else if ((*bytes & 0xf0) == 0xe0)
+  {
+    // Three byte sequence: 1110xxxx	 10xxxxxx 10xxxxxx.
+    value = *bytes & 0x0f;
+    remainingBytes = 2;
+  }
+  else if ((*bytes & 0xf8) == 0xf0)
+  {
+    // Four byte sequence: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx.
+    value = *bytes & 0x07;
+    remainingBytes = 3;
+  }
+  else
+  {
+    // Invalid UTF-8 sequence.
+    return -1;
   }
 
-  ObjClass *classObj = wrenGetClass(vm, args[0]);
-  ObjClass *baseClassObj = AS_CLASS(args[1]);
+  // Don't read past the end of the buffer on truncated UTF-8.
+  if (remainingBytes > length - 1) return -1;
 
-  // Walk the superclass chain looking for the class.
-  do
+  while (remainingBytes > 0)
   {
-    if (baseClassObj == classObj) RETURN_BOOL(true);
+    bytes++;
+    remainingBytes--;
 
-    classObj = classObj->superclass;
+    // Remaining bytes must be of form 10xxxxxx.
+    if ((*bytes & 0xc0) != 0x80) return -1;
+
+    value = value << 6 | (*bytes & 0x3f);
   }
-  while (classObj != NULL);
 
-  RETURN_BOOL(false);
+  return value;
 }
 
-DEF_PRIMITIVE(object_toString)
+int wrenUtf8DecodeNumBytes(uint8_t byte)
 {
-  Obj* obj = AS_OBJ(args[0]);
-  Value name = OBJ_VAL(obj->classObj->name);
-  RETURN_VAL(wrenStringFormat(vm, "instance of @", name));
+  // If the byte starts with 10xxxxx, it's the middle of a UTF-8 sequence, so
+  // don't count it at all.
+  if ((byte & 0xc0) == 0x80) return 0;
+  
+  // The first byte's high bits tell us how many bytes are in the UTF-8
+  // sequence.
+  if ((byte & 0xf8) == 0xf0) return 4;
+  if ((byte & 0xf0) == 0xe0) return 3;
+  if ((byte & 0xe0) == 0xc0) return 2;
+  return 1;
 }
 
-DEF_PRIMITIVE(object_type)
+// From: http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2Float
+int wrenPowerOf2Ceil(int n)
 {
-  RETURN_OBJ(wrenGetClass(vm, args[0]));
+  n--;
+  n |= n >> 1;
+  n |= n >> 2;
+  n |= n >> 4;
+  n |= n >> 8;
+  n |= n >> 16;
+  n++;
+  
+  return n;
 }
 
-DEF_PRIMITIVE(range_from)
+uint32_t wrenValidateIndex(uint32_t count, int64_t value)
 {
-  RETURN_NUM(AS_RANGE(args[0])->from);
-}
+  // Negative indices count from the end.
+  if (value < 0) value = count + value;
 
-DEF_PRIMITIVE(range_to)
-{
-  RETURN_NUM(AS_RANGE(args[0])->to);
-}
+  // Check bounds.
+  if (value >= 0 && value < count) return (uint32_t)value;
 
-DEF_PRIMITIVE(range_min)
-{
-  ObjRange* range = AS_RANGE(args[0]);
-  RETURN_NUM(fmin(range->from, range->to));
+  return UINT32_MAX;
 }
+// End file "wren_utils.c"
+// Begin file "wren_value.c"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 
-DEF_PRIMITIVE(range_max)
-{
-  ObjRange* range = AS_RANGE(args[0]);
-  RETURN_NUM(fmax(range->from, range->to));
-}
 
-DEF_PRIMITIVE(range_isInclusive)
-{
-  RETURN_BOOL(AS_RANGE(args[0])->isInclusive);
-}
+#if WREN_DEBUG_TRACE_MEMORY
+#endif
 
-DEF_PRIMITIVE(range_iterate)
-{
-  ObjRange* range = AS_RANGE(args[0]);
+// TODO: Tune these.
+// The initial (and minimum) capacity of a non-empty list or map object.
+#define MIN_CAPACITY 16
 
-  // Special case: empty range.
-  if (range->from == range->to && !range->isInclusive) RETURN_FALSE;
+// The rate at which a collection's capacity grows when the size exceeds the
+// current capacity. The new capacity will be determined by *multiplying* the
+// old capacity by this. Growing geometrically is necessary to ensure that
+// adding to a collection has O(1) amortized complexity.
+#define GROW_FACTOR 2
 
-  // Start the iteration.
-  if (IS_NULL(args[1])) RETURN_NUM(range->from);
+// The maximum percentage of map entries that can be filled before the map is
+// grown. A lower load takes more memory but reduces collisions which makes
+// lookup faster.
+#define MAP_LOAD_PERCENT 75
 
-  if (!validateNum(vm, args[1], "Iterator")) return false;
+// The number of call frames initially allocated when a fiber is created. Making
+// this smaller makes fibers use less memory (at first) but spends more time
+// reallocating when the call stack grows.
+#define INITIAL_CALL_FRAMES 4
 
-  double iterator = AS_NUM(args[1]);
+DEFINE_BUFFER(Value, Value);
 
-  // Iterate towards [to] from [from].
-  if (range->from < range->to)
+static void initObj(WrenVM* vm, Obj* obj, ObjType type, ObjClass* classObj)
+{
+  obj->type = type;
+  wrenSetObjClass(obj, classObj);
+  obj->next = vm->first;
+  vm->first = obj;
+  vm->objectCount++;
+
+  // New objects survive the collection in progress. While marking they start
+  // out marked, while sweeping they are kept out of the part left to sweep.
+  obj->isDark = vm->gcPhase == GC_MARK;
+  obj->isRemembered = false;
+  if (vm->sweepLink == &vm->first) vm->sweepLink = &obj->next;
+
+  if (vm->trackAllocations) wrenTrackObject(vm, obj);
+}
+
+// Gives [classObj] an id in the class table. The table uses the host allocator
+// directly, like the gray stack, so this can't trigger a collection.
+static void registerClass(WrenVM* vm, ObjClass* classObj)
+{
+  if (vm->freeClassCount > 0)
   {
-    iterator++;
-    if (iterator > range->to) RETURN_FALSE;
+    classObj->id = vm->freeClassIds[--vm->freeClassCount];
   }
   else
   {
-    iterator--;
-    if (iterator < range->to) RETURN_FALSE;
-  }
-
-  if (!range->isInclusive && iterator == range->to) RETURN_FALSE;
+    if (vm->classCount >= vm->classCapacity)
+    {
+      vm->classCapacity *= 2;
+      vm->classes = (ObjClass**)vm->config.reallocateFn(vm->classes,
+          vm->classCapacity * sizeof(ObjClass*), vm->config.userData);
+      vm->freeClassIds = (uint32_t*)vm->config.reallocateFn(vm->freeClassIds,
+          vm->classCapacity * sizeof(uint32_t), vm->config.userData);
+    }
 
-  RETURN_NUM(iterator);
-}
+    classObj->id = vm->classCount++;
+  }
 
-DEF_PRIMITIVE(range_iteratorValue)
-{
-  // Assume the iterator is a number so that is the value of the range.
-  RETURN_VAL(args[1]);
+  vm->classes[classObj->id] = classObj;
 }
 
-DEF_PRIMITIVE(range_toString)
+ObjClass* wrenNewSingleClass(WrenVM* vm, int numFields, ObjString* name)
 {
-  ObjRange* range = AS_RANGE(args[0]);
-
-  Value from = wrenNumToString(vm, range->from);
-  wrenPushRoot(vm, AS_OBJ(from));
-
-  Value to = wrenNumToString(vm, range->to);
-  wrenPushRoot(vm, AS_OBJ(to));
-
-  Value result = wrenStringFormat(vm, "@$@", from,
-                                  range->isInclusive ? ".." : "...", to);
+  ObjClass* classObj = ALLOCATE(vm, ObjClass);
+  initObj(vm, &classObj->obj, OBJ_CLASS, NULL);
+  registerClass(vm, classObj);
+  classObj->superclass = NULL;
+  classObj->numFields = numFields;
+  classObj->name = name;
+  classObj->attributes = NULL_VAL;
+  classObj->methods.entries = NULL;
+  classObj->methods.count = 0;
+  classObj->methods.capacity = 0;
 
-  wrenPopRoot(vm);
-  wrenPopRoot(vm);
-  RETURN_VAL(result);
+  return classObj;
 }
 
-DEF_PRIMITIVE(string_fromCodePoint)
+void wrenBindSuperclass(WrenVM* vm, ObjClass* subclass, ObjClass* superclass)
 {
-  if (!validateInt(vm, args[1], "Code point")) return false;
+  ASSERT(superclass != NULL, "Must have superclass.");
 
-  int codePoint = (int)AS_NUM(args[1]);
-  if (codePoint < 0)
+  subclass->superclass = superclass;
+  wrenRememberStore(vm, &subclass->obj, OBJ_VAL(superclass));
+
+  // Include the superclass in the total number of fields.
+  if (subclass->numFields != -1)
   {
-    RETURN_ERROR("Code point cannot be negative.");
+    subclass->numFields += superclass->numFields;
   }
-  else if (codePoint > 0x10ffff)
+  else
   {
-    RETURN_ERROR("Code point cannot be greater than 0x10ffff.");
+    ASSERT(superclass->numFields == 0,
+           "A foreign class cannot inherit from a class with fields.");
   }
 
-  RETURN_VAL(wrenStringFromCodePoint(vm, codePoint));
-}
-
-DEF_PRIMITIVE(string_fromByte)
-{
-  if (!validateInt(vm, args[1], "Byte")) return false;
-  int byte = (int) AS_NUM(args[1]);
-  if (byte < 0)
-  {
-    RETURN_ERROR("Byte cannot be negative.");
-  }
-  else if (byte > 0xff)
+  // Inherit methods from its superclass.
+  for (int i = 0; i < superclass->methods.capacity; i++)
   {
-    RETURN_ERROR("Byte cannot be greater than 0xff.");
+    MethodEntry* entry = &superclass->methods.entries[i];
+    if (entry->symbol != -1)
+    {
+      wrenBindMethod(vm, subclass, entry->symbol, entry->method);
+    }
   }
-  RETURN_VAL(wrenStringFromByte(vm, (uint8_t) byte));
 }
 
-DEF_PRIMITIVE(string_byteAt)
+ObjClass* wrenNewClass(WrenVM* vm, ObjClass* superclass, int numFields,
+                       ObjString* name)
 {
-  ObjString* string = AS_STRING(args[0]);
+  // Create the metaclass.
+  Value metaclassName = wrenStringFormat(vm, "@ metaclass", OBJ_VAL(name));
+  wrenPushRoot(vm, AS_OBJ(metaclassName));
 
-  uint32_t index = validateIndex(vm, args[1], string->length, "Index");
-  if (index == UINT32_MAX) return false;
+  ObjClass* metaclass = wrenNewSingleClass(vm, 0, AS_STRING(metaclassName));
+  wrenSetObjClass(&metaclass->obj, vm->classClass);
 
-  RETURN_NUM((uint8_t)string->value[index]);
-}
+  wrenPopRoot(vm);
 
-DEF_PRIMITIVE(string_byteCount)
-{
-  RETURN_NUM(AS_STRING(args[0])->length);
-}
+  // Make sure the metaclass isn't collected when we allocate the class.
+  wrenPushRoot(vm, (Obj*)metaclass);
 
-DEF_PRIMITIVE(string_codePointAt)
-{
-  ObjString* string = AS_STRING(args[0]);
+  // Metaclasses always inherit Class and do not parallel the non-metaclass
+  // hierarchy.
+  wrenBindSuperclass(vm, metaclass, vm->classClass);
 
-  uint32_t index = validateIndex(vm, args[1], string->length, "Index");
-  if (index == UINT32_MAX) return false;
+  ObjClass* classObj = wrenNewSingleClass(vm, numFields, name);
 
-  // If we are in the middle of a UTF-8 sequence, indicate that.
-  const uint8_t* bytes = (uint8_t*)string->value;
-  if ((bytes[index] & 0xc0) == 0x80) RETURN_NUM(-1);
+  // Make sure the class isn't collected while the inherited methods are being
+  // bound.
+  wrenPushRoot(vm, (Obj*)classObj);
 
-  // Decode the UTF-8 sequence.
-  RETURN_NUM(wrenUtf8Decode((uint8_t*)string->value + index,
-                            string->length - index));
+  wrenSetObjClass(&classObj->obj, metaclass);
+  wrenBindSuperclass(vm, classObj, superclass);
+
+  wrenPopRoot(vm);
+  wrenPopRoot(vm);
+
+  return classObj;
 }
 
-DEF_PRIMITIVE(string_contains)
+// Returns the empty entry where [symbol] goes in [entries].
+static MethodEntry* findEmptyMethodEntry(MethodEntry* entries, int capacity,
+                                         int symbol)
 {
-  if (!validateString(vm, args[1], "Argument")) return false;
+  uint32_t hash = (uint32_t)symbol * 0x9e3779b1u;
+  uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = (hash ^ (hash >> 16)) & mask;
 
-  ObjString* string = AS_STRING(args[0]);
-  ObjString* search = AS_STRING(args[1]);
+  while (entries[index].symbol != -1) index = (index + 1) & mask;
+  return &entries[index];
+}
+
+static void resizeMethodTable(WrenVM* vm, MethodTable* table, int capacity)
+{
+  MethodEntry* entries = ALLOCATE_ARRAY(vm, MethodEntry, capacity);
+  for (int i = 0; i < capacity; i++) entries[i].symbol = -1;
+
+  for (int i = 0; i < table->capacity; i++)
+  {
+    MethodEntry* entry = &table->entries[i];
+    if (entry->symbol == -1) continue;
+
+    *findEmptyMethodEntry(entries, capacity, entry->symbol) = *entry;
+  }
 
-  RETURN_BOOL(wrenStringFind(string, search, 0) != UINT32_MAX);
+  DEALLOCATE(vm, table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
 }
 
-DEF_PRIMITIVE(string_endsWith)
+void wrenBindMethod(WrenVM* vm, ObjClass* classObj, int symbol, Method method)
 {
-  if (!validateString(vm, args[1], "Argument")) return false;
+  Method* existing = wrenFindMethod(classObj, symbol);
+  if (existing != NULL)
+  {
+    if (wrenIsClosureMethod(existing))
+    {
+      wrenWriteBarrier(vm, OBJ_VAL(existing->as.closure));
+    }
+  }
+  else
+  {
+    MethodTable* table = &classObj->methods;
+    if ((table->count + 1) * 2 > table->capacity)
+    {
+      resizeMethodTable(vm, table, table->capacity == 0
+                                   ? 8 : table->capacity * 2);
+    }
 
-  ObjString* string = AS_STRING(args[0]);
-  ObjString* search = AS_STRING(args[1]);
+    MethodEntry* entry = findEmptyMethodEntry(table->entries, table->capacity,
+                                              symbol);
+    entry->symbol = symbol;
+    existing = &entry->method;
+    table->count++;
+  }
 
-  // Edge case: If the search string is longer then return false right away.
-  if (search->length > string->length) RETURN_FALSE;
+  if (wrenIsClosureMethod(&method))
+  {
+    wrenRememberStore(vm, &classObj->obj, OBJ_VAL(method.as.closure));
+  }
 
-  RETURN_BOOL(memcmp(string->value + string->length - search->length,
-                     search->value, search->length) == 0);
+  *existing = method;
 }
 
-DEF_PRIMITIVE(string_indexOf1)
+ObjClosure* wrenNewClosure(WrenVM* vm, ObjFn* fn)
 {
-  if (!validateString(vm, args[1], "Argument")) return false;
+  ObjClosure* closure = ALLOCATE_FLEX(vm, ObjClosure,
+                                      ObjUpvalue*, fn->numUpvalues);
+  initObj(vm, &closure->obj, OBJ_CLOSURE, vm->fnClass);
 
-  ObjString* string = AS_STRING(args[0]);
-  ObjString* search = AS_STRING(args[1]);
+  closure->fn = fn;
 
-  uint32_t index = wrenStringFind(string, search, 0);
-  RETURN_NUM(index == UINT32_MAX ? -1 : (int)index);
+  // Clear the upvalue array. We need to do this in case a GC is triggered
+  // after the closure is created but before the upvalue array is populated.
+  for (int i = 0; i < fn->numUpvalues; i++) closure->upvalues[i] = NULL;
+
+  return closure;
 }
 
-DEF_PRIMITIVE(string_indexOf2)
+ObjFiber* wrenNewFiber(WrenVM* vm, ObjClosure* closure)
 {
-  if (!validateString(vm, args[1], "Argument")) return false;
+  // Allocate the arrays before the fiber in case it triggers a GC.
+  CallFrame* frames = ALLOCATE_ARRAY(vm, CallFrame, INITIAL_CALL_FRAMES);
+  
+  // Add one slot for the unused implicit receiver slot that the compiler
+  // assumes all functions have.
+  int stackCapacity = closure == NULL
+      ? 1
+      : wrenPowerOf2Ceil(closure->fn->maxSlots + 1);
+  Value* stack = ALLOCATE_ARRAY(vm, Value, stackCapacity);
+  
+  ObjFiber* fiber = ALLOCATE(vm, ObjFiber);
+  initObj(vm, &fiber->obj, OBJ_FIBER, vm->fiberClass);
 
-  ObjString* string = AS_STRING(args[0]);
-  ObjString* search = AS_STRING(args[1]);
-  uint32_t start = validateIndex(vm, args[2], string->length, "Start");
-  if (start == UINT32_MAX) return false;
+  fiber->stack = stack;
+  fiber->stackTop = fiber->stack;
+  fiber->stackCapacity = stackCapacity;
+
+  fiber->frames = frames;
+  fiber->frameCapacity = INITIAL_CALL_FRAMES;
+  fiber->numFrames = 0;
+
+  fiber->openUpvalues = NULL;
+  fiber->caller = NULL;
+  fiber->error = NULL_VAL;
+  fiber->state = FIBER_OTHER;
+
+  // A fiber created while marking can only hold what's live already.
+  fiber->scanned = vm->gcCount + (vm->gcPhase == GC_MARK);
   
-  uint32_t index = wrenStringFind(string, search, start);
-  RETURN_NUM(index == UINT32_MAX ? -1 : (int)index);
+  if (closure != NULL)
+  {
+    // Initialize the first call frame.
+    wrenAppendCallFrame(vm, fiber, closure, fiber->stack);
+
+    // The first slot always holds the closure.
+    fiber->stackTop[0] = OBJ_VAL(closure);
+    fiber->stackTop++;
+  }
+  
+  return fiber;
 }
 
-DEF_PRIMITIVE(string_iterate)
+void wrenEnsureStack(WrenVM* vm, ObjFiber* fiber, int needed)
 {
-  ObjString* string = AS_STRING(args[0]);
-
-  // If we're starting the iteration, return the first index.
-  if (IS_NULL(args[1]))
+  if (fiber->stackCapacity >= needed) return;
+  
+  int capacity = wrenPowerOf2Ceil(needed);
+  
+  Value* oldStack = fiber->stack;
+  fiber->stack = (Value*)wrenReallocate(vm, fiber->stack,
+                                        sizeof(Value) * fiber->stackCapacity,
+                                        sizeof(Value) * capacity);
+  fiber->stackCapacity = capacity;
+  
+  // If the reallocation moves the stack, then we need to recalculate every
+  // pointer that points into the old stack to into the same relative distance
+  // in the new stack. We have to be a little careful about how these are
+  // calculated because pointer subtraction is only well-defined within a
+  // single array, hence the slightly redundant-looking arithmetic below.
+  if (fiber->stack != oldStack)
   {
-    if (string->length == 0) RETURN_FALSE;
-    RETURN_NUM(0);
+    // Top of the stack.
+    if (vm->apiStack >= oldStack && vm->apiStack <= fiber->stackTop)
+    {
+      vm->apiStack = fiber->stack + (vm->apiStack - oldStack);
+    }
+    
+    // Stack pointer for each call frame.
+    for (int i = 0; i < fiber->numFrames; i++)
+    {
+      CallFrame* frame = &fiber->frames[i];
+      frame->stackStart = fiber->stack + (frame->stackStart - oldStack);
+    }
+    
+    // Open upvalues.
+    for (ObjUpvalue* upvalue = fiber->openUpvalues;
+         upvalue != NULL;
+         upvalue = upvalue->next)
+    {
+      upvalue->value = fiber->stack + (upvalue->value - oldStack);
+    }
+    
+    fiber->stackTop = fiber->stack + (fiber->stackTop - oldStack);
   }
+}
 
-  if (!validateInt(vm, args[1], "Iterator")) return false;
+ObjForeign* wrenNewForeign(WrenVM* vm, ObjClass* classObj, size_t size)
+{
+  ObjForeign* object = ALLOCATE_FLEX(vm, ObjForeign, uint8_t, size);
+  initObj(vm, &object->obj, OBJ_FOREIGN, classObj);
+  object->externalSize = 0;
 
-  if (AS_NUM(args[1]) < 0) RETURN_FALSE;
-  uint32_t index = (uint32_t)AS_NUM(args[1]);
+  // Zero out the bytes.
+  memset(object->data, 0, size);
+  return object;
+}
 
-  // Advance to the beginning of the next UTF-8 sequence.
-  do
-  {
-    index++;
-    if (index >= string->length) RETURN_FALSE;
-  } while ((string->value[index] & 0xc0) == 0x80);
+ObjFn* wrenNewFunction(WrenVM* vm, ObjModule* module, int maxSlots)
+{
+  FnDebug* debug = ALLOCATE(vm, FnDebug);
+  debug->name = NULL;
+  wrenIntBufferInit(&debug->sourceLines);
+  debug->executed = 0;
 
-  RETURN_NUM(index);
+  ObjFn* fn = ALLOCATE(vm, ObjFn);
+  initObj(vm, &fn->obj, OBJ_FN, vm->fnClass);
+  
+  wrenValueBufferInit(&fn->constants);
+  wrenByteBufferInit(&fn->code);
+  fn->module = module;
+  fn->maxSlots = maxSlots;
+  fn->numUpvalues = 0;
+  fn->arity = 0;
+  fn->debug = debug;
+  fn->native = NULL;
+  
+  return fn;
 }
 
-DEF_PRIMITIVE(string_iterateByte)
+void wrenFunctionBindName(WrenVM* vm, ObjFn* fn, const char* name, int length)
 {
-  ObjString* string = AS_STRING(args[0]);
+  fn->debug->name = ALLOCATE_ARRAY(vm, char, length + 1);
+  memcpy(fn->debug->name, name, length);
+  fn->debug->name[length] = '\0';
+}
 
-  // If we're starting the iteration, return the first index.
-  if (IS_NULL(args[1]))
+Value wrenNewInstance(WrenVM* vm, ObjClass* classObj)
+{
+  ObjInstance* instance = ALLOCATE_FLEX(vm, ObjInstance,
+                                        Value, classObj->numFields);
+  initObj(vm, &instance->obj, OBJ_INSTANCE, classObj);
+
+  // Initialize fields to null.
+  for (int i = 0; i < classObj->numFields; i++)
   {
-    if (string->length == 0) RETURN_FALSE;
-    RETURN_NUM(0);
+    instance->fields[i] = NULL_VAL;
   }
 
-  if (!validateInt(vm, args[1], "Iterator")) return false;
-
-  if (AS_NUM(args[1]) < 0) RETURN_FALSE;
-  uint32_t index = (uint32_t)AS_NUM(args[1]);
-
-  // Advance to the next byte.
-  index++;
-  if (index >= string->length) RETURN_FALSE;
-
-  RETURN_NUM(index);
+  return OBJ_VAL(instance);
 }
 
-DEF_PRIMITIVE(string_iteratorValue)
+ObjList* wrenNewList(WrenVM* vm, uint32_t numElements)
 {
-  ObjString* string = AS_STRING(args[0]);
-  uint32_t index = validateIndex(vm, args[1], string->length, "Iterator");
-  if (index == UINT32_MAX) return false;
+  // Allocate this before the list object in case it triggers a GC which would
+  // free the list.
+  Value* elements = NULL;
+  if (numElements > 0)
+  {
+    elements = ALLOCATE_ARRAY(vm, Value, numElements);
+  }
 
-  RETURN_VAL(wrenStringCodePointAt(vm, string, index));
+  ObjList* list = ALLOCATE(vm, ObjList);
+  initObj(vm, &list->obj, OBJ_LIST, vm->listClass);
+  list->elements.capacity = numElements;
+  list->elements.count = numElements;
+  list->elements.data = elements;
+  return list;
 }
 
-DEF_PRIMITIVE(string_startsWith)
+void wrenListInsert(WrenVM* vm, ObjList* list, Value value, uint32_t index)
 {
-  if (!validateString(vm, args[1], "Argument")) return false;
+  if (IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
 
-  ObjString* string = AS_STRING(args[0]);
-  ObjString* search = AS_STRING(args[1]);
+  // Add a slot at the end of the list.
+  wrenValueBufferWrite(vm, &list->elements, NULL_VAL);
 
-  // Edge case: If the search string is longer then return false right away.
-  if (search->length > string->length) RETURN_FALSE;
+  if (IS_OBJ(value)) wrenPopRoot(vm);
 
-  RETURN_BOOL(memcmp(string->value, search->value, search->length) == 0);
+  // Shift the existing elements down.
+  for (uint32_t i = list->elements.count - 1; i > index; i--)
+  {
+    list->elements.data[i] = list->elements.data[i - 1];
+  }
+
+  // Store the new element.
+  list->elements.data[index] = value;
+  wrenRememberStore(vm, &list->obj, value);
 }
 
-DEF_PRIMITIVE(string_plus)
+int wrenListIndexOf(WrenVM* vm, ObjList* list, Value value)
 {
-  if (!validateString(vm, args[1], "Right operand")) return false;
-  RETURN_VAL(wrenStringFormat(vm, "@@", args[0], args[1]));
+  int count = list->elements.count;
+  for (int i = 0; i < count; i++)
+  {
+    Value item = list->elements.data[i];
+    if(wrenValuesEqual(item, value)) {
+      return i;
+    }
+  }
+  return -1;
 }
 
-DEF_PRIMITIVE(string_subscript)
+Value wrenListRemoveAt(WrenVM* vm, ObjList* list, uint32_t index)
 {
-  ObjString* string = AS_STRING(args[0]);
+  Value removed = list->elements.data[index];
+  wrenWriteBarrier(vm, removed);
+  wrenFinishMarkingObj(vm, &list->obj);
 
-  if (IS_NUM(args[1]))
-  {
-    int index = validateIndex(vm, args[1], string->length, "Subscript");
-    if (index == -1) return false;
+  if (IS_OBJ(removed)) wrenPushRoot(vm, AS_OBJ(removed));
 
-    RETURN_VAL(wrenStringCodePointAt(vm, string, index));
+  // Shift items up.
+  for (int i = index; i < list->elements.count - 1; i++)
+  {
+    list->elements.data[i] = list->elements.data[i + 1];
   }
 
-  if (!IS_RANGE(args[1]))
+  // If we have too much excess capacity, shrink it.
+  if (list->elements.capacity / GROW_FACTOR >= list->elements.count)
   {
-    RETURN_ERROR("Subscript must be a number or a range.");
+    list->elements.data = (Value*)wrenReallocate(vm, list->elements.data,
+        sizeof(Value) * list->elements.capacity,
+        sizeof(Value) * (list->elements.capacity / GROW_FACTOR));
+    list->elements.capacity /= GROW_FACTOR;
   }
 
-  int step;
-  uint32_t count = string->length;
-  int start = calculateRange(vm, AS_RANGE(args[1]), &count, &step);
-  if (start == -1) return false;
+  if (IS_OBJ(removed)) wrenPopRoot(vm);
 
-  RETURN_VAL(wrenNewStringFromRange(vm, string, start, count, step));
+  list->elements.count--;
+  return removed;
 }
 
-DEF_PRIMITIVE(string_toString)
+ObjMap* wrenNewMap(WrenVM* vm)
 {
-  RETURN_VAL(args[0]);
+  ObjMap* map = ALLOCATE(vm, ObjMap);
+  initObj(vm, &map->obj, OBJ_MAP, vm->mapClass);
+  map->capacity = 0;
+  map->count = 0;
+  map->entries = NULL;
+  return map;
 }
 
-DEF_PRIMITIVE(system_clock)
+static inline uint32_t hashBits(uint64_t hash)
 {
-  RETURN_NUM((double)clock() / CLOCKS_PER_SEC);
+  // From v8's ComputeLongHash() which in turn cites:
+  // Thomas Wang, Integer Hash Functions.
+  // http://www.concentric.net/~Ttwang/tech/inthash.htm
+  hash = ~hash + (hash << 18);  // hash = (hash << 18) - hash - 1;
+  hash = hash ^ (hash >> 31);
+  hash = hash * 21;  // hash = (hash + (hash << 2)) + (hash << 4);
+  hash = hash ^ (hash >> 11);
+  hash = hash + (hash << 6);
+  hash = hash ^ (hash >> 22);
+  return (uint32_t)(hash & 0x3fffffff);
 }
 
-DEF_PRIMITIVE(system_gc)
+// Generates a hash code for [num].
+static inline uint32_t hashNumber(double num)
 {
-  wrenCollectGarbage(vm);
-  RETURN_NULL;
+  // Hash the raw bits of the value.
+  return hashBits(wrenDoubleToBits(num));
 }
 
-DEF_PRIMITIVE(system_writeString)
+// Generates a hash code for [object].
+static uint32_t hashObject(Obj* object)
 {
-  if (vm->config.writeFn != NULL)
+  switch (object->type)
   {
-    vm->config.writeFn(vm, AS_CSTRING(args[1]));
-  }
-
-  RETURN_VAL(args[1]);
-}
-
-// Creates either the Object or Class class in the core module with [name].
-static ObjClass* defineClass(WrenVM* vm, ObjModule* module, const char* name)
-{
-  ObjString* nameString = AS_STRING(wrenNewString(vm, name));
-  wrenPushRoot(vm, (Obj*)nameString);
-
-  ObjClass* classObj = wrenNewSingleClass(vm, 0, nameString);
-
-  wrenDefineVariable(vm, module, name, nameString->length, OBJ_VAL(classObj), NULL);
-
-  wrenPopRoot(vm);
-  return classObj;
-}
-
-void wrenInitializeCore(WrenVM* vm)
-{
-  ObjModule* coreModule = wrenNewModule(vm, NULL);
-  wrenPushRoot(vm, (Obj*)coreModule);
-  
-  // The core module's key is null in the module map.
-  wrenMapSet(vm, vm->modules, NULL_VAL, OBJ_VAL(coreModule));
-  wrenPopRoot(vm); // coreModule.
-
-  // Define the root Object class. This has to be done a little specially
-  // because it has no superclass.
-  vm->objectClass = defineClass(vm, coreModule, "Object");
-  PRIMITIVE(vm->objectClass, "!", object_not);
-  PRIMITIVE(vm->objectClass, "==(_)", object_eqeq);
-  PRIMITIVE(vm->objectClass, "!=(_)", object_bangeq);
-  PRIMITIVE(vm->objectClass, "is(_)", object_is);
-  PRIMITIVE(vm->objectClass, "toString", object_toString);
-  PRIMITIVE(vm->objectClass, "type", object_type);
-
-  // Now we can define Class, which is a subclass of Object.
-  vm->classClass = defineClass(vm, coreModule, "Class");
-  wrenBindSuperclass(vm, vm->classClass, vm->objectClass);
-  PRIMITIVE(vm->classClass, "name", class_name);
-  PRIMITIVE(vm->classClass, "supertype", class_supertype);
-  PRIMITIVE(vm->classClass, "toString", class_toString);
-  PRIMITIVE(vm->classClass, "attributes", class_attributes);
-
-  // Finally, we can define Object's metaclass which is a subclass of Class.
-  ObjClass* objectMetaclass = defineClass(vm, coreModule, "Object metaclass");
-
-  // Wire up the metaclass relationships now that all three classes are built.
-  vm->objectClass->obj.classObj = objectMetaclass;
-  objectMetaclass->obj.classObj = vm->classClass;
-  vm->classClass->obj.classObj = vm->classClass;
-
-  // Do this after wiring up the metaclasses so objectMetaclass doesn't get
-  // collected.
-  wrenBindSuperclass(vm, objectMetaclass, vm->classClass);
-
-  PRIMITIVE(objectMetaclass, "same(_,_)", object_same);
-
-  // The core class diagram ends up looking like this, where single lines point
-  // to a class's superclass, and double lines point to its metaclass:
-  //
-  //        .------------------------------------. .====.
-  //        |                  .---------------. | #    #
-  //        v                  |               v | v    #
-  //   .---------.   .-------------------.   .-------.  #
-  //   | Object  |==>| Object metaclass  |==>| Class |=="
-  //   '---------'   '-------------------'   '-------'
-  //        ^                                 ^ ^ ^ ^
-  //        |                  .--------------' # | #
-  //        |                  |                # | #
-  //   .---------.   .-------------------.      # | # -.
-  //   |  Base   |==>|  Base metaclass   |======" | #  |
-  //   '---------'   '-------------------'        | #  |
-  //        ^                                     | #  |
-  //        |                  .------------------' #  | Example classes
-  //        |                  |                    #  |
-  //   .---------.   .-------------------.          #  |
-  //   | Derived |==>| Derived metaclass |=========="  |
-  //   '---------'   '-------------------'            -'
-
-  // The rest of the classes can now be defined normally.
-  wrenInterpret(vm, NULL, coreModuleSource);
-
-  vm->boolClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Bool"));
-  PRIMITIVE(vm->boolClass, "toString", bool_toString);
-  PRIMITIVE(vm->boolClass, "!", bool_not);
-
-  vm->fiberClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Fiber"));
-  PRIMITIVE(vm->fiberClass->obj.classObj, "new(_)", fiber_new);
-  PRIMITIVE(vm->fiberClass->obj.classObj, "abort(_)", fiber_abort);
-  PRIMITIVE(vm->fiberClass->obj.classObj, "current", fiber_current);
-  PRIMITIVE(vm->fiberClass->obj.classObj, "suspend()", fiber_suspend);
-  PRIMITIVE(vm->fiberClass->obj.classObj, "yield()", fiber_yield);
-  PRIMITIVE(vm->fiberClass->obj.classObj, "yield(_)", fiber_yield1);
-  PRIMITIVE(vm->fiberClass, "call()", fiber_call);
-  PRIMITIVE(vm->fiberClass, "call(_)", fiber_call1);
-  PRIMITIVE(vm->fiberClass, "error", fiber_error);
-  PRIMITIVE(vm->fiberClass, "isDone", fiber_isDone);
-  PRIMITIVE(vm->fiberClass, "transfer()", fiber_transfer);
-  PRIMITIVE(vm->fiberClass, "transfer(_)", fiber_transfer1);
-  PRIMITIVE(vm->fiberClass, "transferError(_)", fiber_transferError);
-  PRIMITIVE(vm->fiberClass, "try()", fiber_try);
-  PRIMITIVE(vm->fiberClass, "try(_)", fiber_try1);
-
-  vm->fnClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Fn"));
-  PRIMITIVE(vm->fnClass->obj.classObj, "new(_)", fn_new);
-
-  PRIMITIVE(vm->fnClass, "arity", fn_arity);
-
-  FUNCTION_CALL(vm->fnClass, "call()", fn_call0);
-  FUNCTION_CALL(vm->fnClass, "call(_)", fn_call1);
-  FUNCTION_CALL(vm->fnClass, "call(_,_)", fn_call2);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_)", fn_call3);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_)", fn_call4);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_)", fn_call5);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_)", fn_call6);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_)", fn_call7);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_)", fn_call8);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_)", fn_call9);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_)", fn_call10);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_)", fn_call11);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_)", fn_call12);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call13);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call14);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call15);
-  FUNCTION_CALL(vm->fnClass, "call(_,_,_,_,_,_,_,_,_,_,_,_,_,_,_,_)", fn_call16);
-  
-  PRIMITIVE(vm->fnClass, "toString", fn_toString);
-
-  vm->nullClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Null"));
-  PRIMITIVE(vm->nullClass, "!", null_not);
-  PRIMITIVE(vm->nullClass, "toString", null_toString);
-
-  vm->numClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Num"));
-  PRIMITIVE(vm->numClass->obj.classObj, "fromString(_)", num_fromString);
-  PRIMITIVE(vm->numClass->obj.classObj, "infinity", num_infinity);
-  PRIMITIVE(vm->numClass->obj.classObj, "nan", num_nan);
-  PRIMITIVE(vm->numClass->obj.classObj, "pi", num_pi);
-  PRIMITIVE(vm->numClass->obj.classObj, "tau", num_tau);
-  PRIMITIVE(vm->numClass->obj.classObj, "largest", num_largest);
-  PRIMITIVE(vm->numClass->obj.classObj, "smallest", num_smallest);
-  PRIMITIVE(vm->numClass->obj.classObj, "maxSafeInteger", num_maxSafeInteger);
-  PRIMITIVE(vm->numClass->obj.classObj, "minSafeInteger", num_minSafeInteger);
-  PRIMITIVE(vm->numClass, "-(_)", num_minus);
-  PRIMITIVE(vm->numClass, "+(_)", num_plus);
-  PRIMITIVE(vm->numClass, "*(_)", num_multiply);
-  PRIMITIVE(vm->numClass, "/(_)", num_divide);
-  PRIMITIVE(vm->numClass, "<(_)", num_lt);
-  PRIMITIVE(vm->numClass, ">(_)", num_gt);
-  PRIMITIVE(vm->numClass, "<=(_)", num_lte);
-  PRIMITIVE(vm->numClass, ">=(_)", num_gte);
-  PRIMITIVE(vm->numClass, "&(_)", num_bitwiseAnd);
-  PRIMITIVE(vm->numClass, "|(_)", num_bitwiseOr);
-  PRIMITIVE(vm->numClass, "^(_)", num_bitwiseXor);
-  PRIMITIVE(vm->numClass, "<<(_)", num_bitwiseLeftShift);
-  PRIMITIVE(vm->numClass, ">>(_)", num_bitwiseRightShift);
-  PRIMITIVE(vm->numClass, "abs", num_abs);
-  PRIMITIVE(vm->numClass, "acos", num_acos);
-  PRIMITIVE(vm->numClass, "asin", num_asin);
-  PRIMITIVE(vm->numClass, "atan", num_atan);
-  PRIMITIVE(vm->numClass, "cbrt", num_cbrt);
-  PRIMITIVE(vm->numClass, "ceil", num_ceil);
-  PRIMITIVE(vm->numClass, "cos", num_cos);
-  PRIMITIVE(vm->numClass, "floor", num_floor);
-  PRIMITIVE(vm->numClass, "-", num_negate);
-  PRIMITIVE(vm->numClass, "round", num_round);
-  PRIMITIVE(vm->numClass, "min(_)", num_min);
-  PRIMITIVE(vm->numClass, "max(_)", num_max);
-  PRIMITIVE(vm->numClass, "clamp(_,_)", num_clamp);
-  PRIMITIVE(vm->numClass, "sin", num_sin);
-  PRIMITIVE(vm->numClass, "sqrt", num_sqrt);
-  PRIMITIVE(vm->numClass, "tan", num_tan);
-  PRIMITIVE(vm->numClass, "log", num_log);
-  PRIMITIVE(vm->numClass, "log2", num_log2);
-  PRIMITIVE(vm->numClass, "exp", num_exp);
-  PRIMITIVE(vm->numClass, "%(_)", num_mod);
-  PRIMITIVE(vm->numClass, "~", num_bitwiseNot);
-  PRIMITIVE(vm->numClass, "..(_)", num_dotDot);
-  PRIMITIVE(vm->numClass, "...(_)", num_dotDotDot);
-  PRIMITIVE(vm->numClass, "atan(_)", num_atan2);
-  PRIMITIVE(vm->numClass, "pow(_)", num_pow);
-  PRIMITIVE(vm->numClass, "fraction", num_fraction);
-  PRIMITIVE(vm->numClass, "isInfinity", num_isInfinity);
-  PRIMITIVE(vm->numClass, "isInteger", num_isInteger);
-  PRIMITIVE(vm->numClass, "isNan", num_isNan);
-  PRIMITIVE(vm->numClass, "sign", num_sign);
-  PRIMITIVE(vm->numClass, "toString", num_toString);
-  PRIMITIVE(vm->numClass, "truncate", num_truncate);
-
-  // These are defined just so that 0 and -0 are equal, which is specified by
-  // IEEE 754 even though they have different bit representations.
-  PRIMITIVE(vm->numClass, "==(_)", num_eqeq);
-  PRIMITIVE(vm->numClass, "!=(_)", num_bangeq);
-
-  vm->stringClass = AS_CLASS(wrenFindVariable(vm, coreModule, "String"));
-  PRIMITIVE(vm->stringClass->obj.classObj, "fromCodePoint(_)", string_fromCodePoint);
-  PRIMITIVE(vm->stringClass->obj.classObj, "fromByte(_)", string_fromByte);
-  PRIMITIVE(vm->stringClass, "+(_)", string_plus);
-  PRIMITIVE(vm->stringClass, "[_]", string_subscript);
-  PRIMITIVE(vm->stringClass, "byteAt_(_)", string_byteAt);
-  PRIMITIVE(vm->stringClass, "byteCount_", string_byteCount);
-  PRIMITIVE(vm->stringClass, "codePointAt_(_)", string_codePointAt);
-  PRIMITIVE(vm->stringClass, "contains(_)", string_contains);
-  PRIMITIVE(vm->stringClass, "endsWith(_)", string_endsWith);
-  PRIMITIVE(vm->stringClass, "indexOf(_)", string_indexOf1);
-  PRIMITIVE(vm->stringClass, "indexOf(_,_)", string_indexOf2);
-  PRIMITIVE(vm->stringClass, "iterate(_)", string_iterate);
-  PRIMITIVE(vm->stringClass, "iterateByte_(_)", string_iterateByte);
-  PRIMITIVE(vm->stringClass, "iteratorValue(_)", string_iteratorValue);
-  PRIMITIVE(vm->stringClass, "startsWith(_)", string_startsWith);
-  PRIMITIVE(vm->stringClass, "toString", string_toString);
+    case OBJ_CLASS:
+      // Classes just use their name.
+      return hashObject((Obj*)((ObjClass*)object)->name);
+      
+      // Allow bare (non-closure) functions so that we can use a map to find
+      // existing constants in a function's constant table. This is only used
+      // internally. Since user code never sees a non-closure function, they
+      // cannot use them as map keys.
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)object;
+      return hashNumber(fn->arity) ^ hashNumber(fn->code.count);
+    }
 
-  vm->listClass = AS_CLASS(wrenFindVariable(vm, coreModule, "List"));
-  PRIMITIVE(vm->listClass->obj.classObj, "filled(_,_)", list_filled);
-  PRIMITIVE(vm->listClass->obj.classObj, "new()", list_new);
-  PRIMITIVE(vm->listClass, "[_]", list_subscript);
-  PRIMITIVE(vm->listClass, "[_]=(_)", list_subscriptSetter);
-  PRIMITIVE(vm->listClass, "add(_)", list_add);
-  PRIMITIVE(vm->listClass, "addCore_(_)", list_addCore);
-  PRIMITIVE(vm->listClass, "clear()", list_clear);
-  PRIMITIVE(vm->listClass, "count", list_count);
-  PRIMITIVE(vm->listClass, "insert(_,_)", list_insert);
-  PRIMITIVE(vm->listClass, "iterate(_)", list_iterate);
-  PRIMITIVE(vm->listClass, "iteratorValue(_)", list_iteratorValue);
-  PRIMITIVE(vm->listClass, "removeAt(_)", list_removeAt);
-  PRIMITIVE(vm->listClass, "remove(_)", list_removeValue);
-  PRIMITIVE(vm->listClass, "indexOf(_)", list_indexOf);
-  PRIMITIVE(vm->listClass, "swap(_,_)", list_swap);
+    case OBJ_RANGE:
+    {
+      ObjRange* range = (ObjRange*)object;
+      return hashNumber(range->from) ^ hashNumber(range->to);
+    }
 
-  vm->mapClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Map"));
-  PRIMITIVE(vm->mapClass->obj.classObj, "new()", map_new);
-  PRIMITIVE(vm->mapClass, "[_]", map_subscript);
-  PRIMITIVE(vm->mapClass, "[_]=(_)", map_subscriptSetter);
-  PRIMITIVE(vm->mapClass, "addCore_(_,_)", map_addCore);
-  PRIMITIVE(vm->mapClass, "clear()", map_clear);
-  PRIMITIVE(vm->mapClass, "containsKey(_)", map_containsKey);
-  PRIMITIVE(vm->mapClass, "count", map_count);
-  PRIMITIVE(vm->mapClass, "remove(_)", map_remove);
-  PRIMITIVE(vm->mapClass, "iterate(_)", map_iterate);
-  PRIMITIVE(vm->mapClass, "keyIteratorValue_(_)", map_keyIteratorValue);
-  PRIMITIVE(vm->mapClass, "valueIteratorValue_(_)", map_valueIteratorValue);
+    case OBJ_STRING:
+      return ((ObjString*)object)->hash;
 
-  vm->rangeClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Range"));
-  PRIMITIVE(vm->rangeClass, "from", range_from);
-  PRIMITIVE(vm->rangeClass, "to", range_to);
-  PRIMITIVE(vm->rangeClass, "min", range_min);
-  PRIMITIVE(vm->rangeClass, "max", range_max);
-  PRIMITIVE(vm->rangeClass, "isInclusive", range_isInclusive);
-  PRIMITIVE(vm->rangeClass, "iterate(_)", range_iterate);
-  PRIMITIVE(vm->rangeClass, "iteratorValue(_)", range_iteratorValue);
-  PRIMITIVE(vm->rangeClass, "toString", range_toString);
+    default:
+      ASSERT(false, "Only immutable objects can be hashed.");
+      return 0;
+  }
+}
 
-  ObjClass* systemClass = AS_CLASS(wrenFindVariable(vm, coreModule, "System"));
-  PRIMITIVE(systemClass->obj.classObj, "clock", system_clock);
-  PRIMITIVE(systemClass->obj.classObj, "gc()", system_gc);
-  PRIMITIVE(systemClass->obj.classObj, "writeString_(_)", system_writeString);
+// Generates a hash code for [value], which must be one of the built-in
+// immutable types: null, bool, class, num, range, or string.
+static uint32_t hashValue(Value value)
+{
+  // TODO: We'll probably want to randomize this at some point.
 
-  // While bootstrapping the core types and running the core module, a number
-  // of string objects have been created, many of which were instantiated
-  // before stringClass was stored in the VM. Some of them *must* be created
-  // first -- the ObjClass for string itself has a reference to the ObjString
-  // for its name.
-  //
-  // These all currently have a NULL classObj pointer, so go back and assign
-  // them now that the string class is known.
-  for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
+#if WREN_NAN_TAGGING
+  if (IS_OBJ(value)) return hashObject(AS_OBJ(value));
+
+  // Hash the raw bits of the unboxed value.
+  return hashBits(value);
+#else
+  switch (value.type)
   {
-    if (obj->type == OBJ_STRING) obj->classObj = vm->stringClass;
+    case VAL_FALSE: return 0;
+    case VAL_NULL:  return 1;
+    case VAL_NUM:   return hashNumber(AS_NUM(value));
+    case VAL_TRUE:  return 2;
+    case VAL_OBJ:   return hashObject(AS_OBJ(value));
+    default:        UNREACHABLE();
   }
+  
+  return 0;
+#endif
 }
-// End file "wren_core.c"
-// Begin file "wren_debug.c"
-#include <stdio.h>
 
+// Looks for an entry with [key] in an array of [capacity] [entries].
+//
+// If found, sets [result] to point to it and returns `true`. Otherwise,
+// returns `false` and points [result] to the entry where the key/value pair
+// should be inserted.
+static bool findEntry(MapEntry* entries, uint32_t capacity, Value key,
+                      MapEntry** result)
+{
+  // If there is no entry array (an empty map), we definitely won't find it.
+  if (capacity == 0) return false;
+  
+  // Figure out where to insert it in the table. Use open addressing and
+  // basic linear probing.
+  uint32_t startIndex = hashValue(key) % capacity;
+  uint32_t index = startIndex;
+  
+  // If we pass a tombstone and don't end up finding the key, its entry will
+  // be re-used for the insert.
+  MapEntry* tombstone = NULL;
+  
+  // Walk the probe sequence until we've tried every slot.
+  do
+  {
+    MapEntry* entry = &entries[index];
+    
+    if (IS_UNDEFINED(entry->key))
+    {
+      // If we found an empty slot, the key is not in the table. If we found a
+      // slot that contains a deleted key, we have to keep looking.
+      if (IS_FALSE(entry->value))
+      {
+        // We found an empty slot, so we've reached the end of the probe
+        // sequence without finding the key. If we passed a tombstone, then
+        // that's where we should insert the item, otherwise, put it here at
+        // the end of the sequence.
+        *result = tombstone != NULL ? tombstone : entry;
+        return false;
+      }
+      else
+      {
+        // We found a tombstone. We need to keep looking in case the key is
+        // after it, but we'll use this entry as the insertion point if the
+        // key ends up not being found.
+        if (tombstone == NULL) tombstone = entry;
+      }
+    }
+    else if (wrenValuesEqual(entry->key, key))
+    {
+      // We found the key.
+      *result = entry;
+      return true;
+    }
+    
+    // Try the next slot.
+    index = (index + 1) % capacity;
+  }
+  while (index != startIndex);
+  
+  // If we get here, the table is full of tombstones. Return the first one we
+  // found.
+  ASSERT(tombstone != NULL, "Map should have tombstones or empty entries.");
+  *result = tombstone;
+  return false;
+}
 
-void wrenDebugPrintStackTrace(WrenVM* vm)
+// Inserts [key] and [value] in the array of [entries] with the given
+// [capacity].
+//
+// Returns `true` if this is the first time [key] was added to the map.
+static bool insertEntry(MapEntry* entries, uint32_t capacity,
+                        Value key, Value value)
 {
-  // Bail if the host doesn't enable printing errors.
-  if (vm->config.errorFn == NULL) return;
+  ASSERT(entries != NULL, "Should ensure capacity before inserting.");
   
-  ObjFiber* fiber = vm->fiber;
-  if (IS_STRING(fiber->error))
+  MapEntry* entry;
+  if (findEntry(entries, capacity, key, &entry))
   {
-    vm->config.errorFn(vm, WREN_ERROR_RUNTIME,
-                       NULL, -1, AS_CSTRING(fiber->error));
+    // Already present, so just replace the value.
+    entry->value = value;
+    return false;
   }
   else
   {
-    // TODO: Print something a little useful here. Maybe the name of the error's
-    // class?
-    vm->config.errorFn(vm, WREN_ERROR_RUNTIME,
-                       NULL, -1, "[error object]");
+    entry->key = key;
+    entry->value = value;
+    return true;
   }
+}
 
-  for (int i = fiber->numFrames - 1; i >= 0; i--)
+// Updates [map]'s entry array to [capacity].
+static void resizeMap(WrenVM* vm, ObjMap* map, uint32_t capacity)
+{
+  wrenFinishMarkingObj(vm, &map->obj);
+
+  // Create the new empty hash table.
+  MapEntry* entries = ALLOCATE_ARRAY(vm, MapEntry, capacity);
+  for (uint32_t i = 0; i < capacity; i++)
   {
-    CallFrame* frame = &fiber->frames[i];
-    ObjFn* fn = frame->closure->fn;
+    entries[i].key = UNDEFINED_VAL;
+    entries[i].value = FALSE_VAL;
+  }
 
-    // Skip over stub functions for calling methods from the C API.
-    if (fn->module == NULL) continue;
-    
-    // The built-in core module has no name. We explicitly omit it from stack
-    // traces since we don't want to highlight to a user the implementation
-    // detail of what part of the core module is written in C and what is Wren.
-    if (fn->module->name == NULL) continue;
-    
-    // -1 because IP has advanced past the instruction that it just executed.
-    int line = fn->debug->sourceLines.data[frame->ip - fn->code.data - 1];
-    vm->config.errorFn(vm, WREN_ERROR_STACK_TRACE,
-                       fn->module->name->value, line,
-                       fn->debug->name);
+  // Re-add the existing entries.
+  if (map->capacity > 0)
+  {
+    for (uint32_t i = 0; i < map->capacity; i++)
+    {
+      MapEntry* entry = &map->entries[i];
+      
+      // Don't copy empty entries or tombstones.
+      if (IS_UNDEFINED(entry->key)) continue;
+
+      insertEntry(entries, capacity, entry->key, entry->value);
+    }
   }
+
+  // Replace the array.
+  DEALLOCATE(vm, map->entries);
+  map->entries = entries;
+  map->capacity = capacity;
 }
 
-static void dumpObject(Obj* obj)
+Value wrenMapGet(ObjMap* map, Value key)
 {
-  switch (obj->type)
+  MapEntry* entry;
+  if (findEntry(map->entries, map->capacity, key, &entry)) return entry->value;
+
+  return UNDEFINED_VAL;
+}
+
+void wrenMapSet(WrenVM* vm, ObjMap* map, Value key, Value value)
+{
+  // If the map is getting too full, make room first.
+  if (map->count + 1 > map->capacity * MAP_LOAD_PERCENT / 100)
   {
-    case OBJ_CLASS:
-      printf("[class %s %p]", ((ObjClass*)obj)->name->value, obj);
-      break;
-    case OBJ_CLOSURE: printf("[closure %p]", obj); break;
-    case OBJ_FIBER: printf("[fiber %p]", obj); break;
-    case OBJ_FN: printf("[fn %p]", obj); break;
-    case OBJ_FOREIGN: printf("[foreign %p]", obj); break;
-    case OBJ_INSTANCE: printf("[instance %p]", obj); break;
-    case OBJ_LIST: printf("[list %p]", obj); break;
-    case OBJ_MAP: printf("[map %p]", obj); break;
-    case OBJ_MODULE: printf("[module %p]", obj); break;
-    case OBJ_RANGE: printf("[range %p]", obj); break;
-    case OBJ_STRING: printf("%s", ((ObjString*)obj)->value); break;
-    case OBJ_UPVALUE: printf("[upvalue %p]", obj); break;
-    default: printf("[unknown object %d]", obj->type); break;
+    // Figure out the new hash table size.
+    uint32_t capacity = map->capacity * GROW_FACTOR;
+    if (capacity < MIN_CAPACITY) capacity = MIN_CAPACITY;
+
+    resizeMap(vm, map, capacity);
+  }
+
+  if (vm->gcPhase == GC_MARK) wrenWriteBarrier(vm, wrenMapGet(map, key));
+  wrenRememberStore(vm, &map->obj, key);
+  wrenRememberStore(vm, &map->obj, value);
+
+  if (insertEntry(map->entries, map->capacity, key, value))
+  {
+    // A new key was added.
+    map->count++;
   }
 }
 
-void wrenDumpValue(Value value)
+void wrenMapClear(WrenVM* vm, ObjMap* map)
 {
-#if WREN_NAN_TAGGING
-  if (IS_NUM(value))
-  {
-    printf("%.14g", AS_NUM(value));
-  }
-  else if (IS_OBJ(value))
-  {
-    dumpObject(AS_OBJ(value));
-  }
-  else
+  if (vm->gcPhase == GC_MARK)
   {
-    switch (GET_TAG(value))
+    for (uint32_t i = 0; i < map->capacity; i++)
     {
-      case TAG_FALSE:     printf("false"); break;
-      case TAG_NAN:       printf("NaN"); break;
-      case TAG_NULL:      printf("null"); break;
-      case TAG_TRUE:      printf("true"); break;
-      case TAG_UNDEFINED: UNREACHABLE();
+      wrenGrayValue(vm, map->entries[i].key);
+      wrenGrayValue(vm, map->entries[i].value);
     }
   }
-#else
-  switch (value.type)
-  {
-    case VAL_FALSE:     printf("false"); break;
-    case VAL_NULL:      printf("null"); break;
-    case VAL_NUM:       printf("%.14g", AS_NUM(value)); break;
-    case VAL_TRUE:      printf("true"); break;
-    case VAL_OBJ:       dumpObject(AS_OBJ(value)); break;
-    case VAL_UNDEFINED: UNREACHABLE();
-  }
-#endif
+
+  DEALLOCATE(vm, map->entries);
+  map->entries = NULL;
+  map->capacity = 0;
+  map->count = 0;
 }
 
-static int dumpInstruction(WrenVM* vm, ObjFn* fn, int i, int* lastLine)
+Value wrenMapRemoveKey(WrenVM* vm, ObjMap* map, Value key)
 {
-  int start = i;
-  uint8_t* bytecode = fn->code.data;
-  Code code = (Code)bytecode[i];
+  MapEntry* entry;
+  if (!findEntry(map->entries, map->capacity, key, &entry)) return NULL_VAL;
 
-  int line = fn->debug->sourceLines.data[i];
-  if (lastLine == NULL || *lastLine != line)
+  // Remove the entry from the map. Set this value to true, which marks it as a
+  // deleted slot. When searching for a key, we will stop on empty slots, but
+  // continue past deleted slots.
+  Value value = entry->value;
+  wrenWriteBarrier(vm, entry->key);
+  wrenWriteBarrier(vm, value);
+  entry->key = UNDEFINED_VAL;
+  entry->value = TRUE_VAL;
+
+  if (IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
+
+  map->count--;
+
+  if (map->count == 0)
   {
-    printf("%4d:", line);
-    if (lastLine != NULL) *lastLine = line;
+    // Removed the last item, so free the array.
+    wrenMapClear(vm, map);
   }
-  else
+  else if (map->capacity > MIN_CAPACITY &&
+           map->count < map->capacity / GROW_FACTOR * MAP_LOAD_PERCENT / 100)
   {
-    printf("     ");
+    uint32_t capacity = map->capacity / GROW_FACTOR;
+    if (capacity < MIN_CAPACITY) capacity = MIN_CAPACITY;
+
+    // The map is getting empty, so shrink the entry array back down.
+    // TODO: Should we do this less aggressively than we grow?
+    resizeMap(vm, map, capacity);
   }
 
-  printf(" %04d  ", i++);
+  if (IS_OBJ(value)) wrenPopRoot(vm);
+  return value;
+}
 
-  #define READ_BYTE() (bytecode[i++])
-  #define READ_SHORT() (i += 2, (bytecode[i - 2] << 8) | bytecode[i - 1])
+ObjModule* wrenNewModule(WrenVM* vm, ObjString* name)
+{
+  ObjModule* module = ALLOCATE(vm, ObjModule);
 
-  #define BYTE_INSTRUCTION(name)                                               \
-      printf("%-16s %5d\n", name, READ_BYTE());                                \
-      break
+  // Modules are never used as first-class objects, so don't need a class.
+  initObj(vm, (Obj*)module, OBJ_MODULE, NULL);
 
-  switch (code)
-  {
-    case CODE_CONSTANT:
-    {
-      int constant = READ_SHORT();
-      printf("%-16s %5d '", "CONSTANT", constant);
-      wrenDumpValue(fn->constants.data[constant]);
-      printf("'\n");
-      break;
-    }
+  wrenPushRoot(vm, (Obj*)module);
 
-    case CODE_NULL:  printf("NULL\n"); break;
-    case CODE_FALSE: printf("FALSE\n"); break;
-    case CODE_TRUE:  printf("TRUE\n"); break;
+  wrenSymbolTableInit(&module->variableNames);
+  wrenValueBufferInit(&module->variables);
 
-    case CODE_LOAD_LOCAL_0: printf("LOAD_LOCAL_0\n"); break;
-    case CODE_LOAD_LOCAL_1: printf("LOAD_LOCAL_1\n"); break;
-    case CODE_LOAD_LOCAL_2: printf("LOAD_LOCAL_2\n"); break;
-    case CODE_LOAD_LOCAL_3: printf("LOAD_LOCAL_3\n"); break;
-    case CODE_LOAD_LOCAL_4: printf("LOAD_LOCAL_4\n"); break;
-    case CODE_LOAD_LOCAL_5: printf("LOAD_LOCAL_5\n"); break;
-    case CODE_LOAD_LOCAL_6: printf("LOAD_LOCAL_6\n"); break;
-    case CODE_LOAD_LOCAL_7: printf("LOAD_LOCAL_7\n"); break;
-    case CODE_LOAD_LOCAL_8: printf("LOAD_LOCAL_8\n"); break;
+  module->name = name;
 
-    case CODE_LOAD_LOCAL: BYTE_INSTRUCTION("LOAD_LOCAL");
-    case CODE_STORE_LOCAL: BYTE_INSTRUCTION("STORE_LOCAL");
-    case CODE_LOAD_UPVALUE: BYTE_INSTRUCTION("LOAD_UPVALUE");
-    case CODE_STORE_UPVALUE: BYTE_INSTRUCTION("STORE_UPVALUE");
+  wrenPopRoot(vm);
+  return module;
+}
 
-    case CODE_LOAD_MODULE_VAR:
-    {
-      int slot = READ_SHORT();
-      printf("%-16s %5d '%s'\n", "LOAD_MODULE_VAR", slot,
-             fn->module->variableNames.data[slot]->value);
-      break;
-    }
+Value wrenNewRange(WrenVM* vm, double from, double to, bool isInclusive)
+{
+  ObjRange* range = ALLOCATE(vm, ObjRange);
+  initObj(vm, &range->obj, OBJ_RANGE, vm->rangeClass);
+  range->from = from;
+  range->to = to;
+  range->isInclusive = isInclusive;
 
-    case CODE_STORE_MODULE_VAR:
-    {
-      int slot = READ_SHORT();
-      printf("%-16s %5d '%s'\n", "STORE_MODULE_VAR", slot,
-             fn->module->variableNames.data[slot]->value);
-      break;
-    }
+  return OBJ_VAL(range);
+}
 
-    case CODE_LOAD_FIELD_THIS: BYTE_INSTRUCTION("LOAD_FIELD_THIS");
-    case CODE_STORE_FIELD_THIS: BYTE_INSTRUCTION("STORE_FIELD_THIS");
-    case CODE_LOAD_FIELD: BYTE_INSTRUCTION("LOAD_FIELD");
-    case CODE_STORE_FIELD: BYTE_INSTRUCTION("STORE_FIELD");
+// Creates a new string object with a null-terminated buffer large enough to
+// hold a string of [length] but does not fill in the bytes.
+//
+// The caller is expected to fill in the buffer and then calculate the string's
+// hash.
+static ObjString* allocateString(WrenVM* vm, size_t length)
+{
+  ObjString* string = ALLOCATE_FLEX(vm, ObjString, char, length + 1);
+  initObj(vm, &string->obj, OBJ_STRING, vm->stringClass);
+  string->length = (int)length;
+  string->value[length] = '\0';
 
-    case CODE_POP: printf("POP\n"); break;
+  return string;
+}
 
-    case CODE_CALL_0:
-    case CODE_CALL_1:
-    case CODE_CALL_2:
-    case CODE_CALL_3:
-    case CODE_CALL_4:
-    case CODE_CALL_5:
-    case CODE_CALL_6:
-    case CODE_CALL_7:
-    case CODE_CALL_8:
-    case CODE_CALL_9:
-    case CODE_CALL_10:
-    case CODE_CALL_11:
-    case CODE_CALL_12:
-    case CODE_CALL_13:
-    case CODE_CALL_14:
-    case CODE_CALL_15:
-    case CODE_CALL_16:
-    {
-      int numArgs = bytecode[i - 1] - CODE_CALL_0;
-      int symbol = READ_SHORT();
-      printf("CALL_%-11d %5d '%s'\n", numArgs, symbol,
-             vm->methodNames.data[symbol]->value);
-      break;
-    }
+// Calculates and stores the hash code for [string].
+static void hashString(ObjString* string)
+{
+  // FNV-1a hash. See: http://www.isthe.com/chongo/tech/comp/fnv/
+  uint32_t hash = 2166136261u;
 
-    case CODE_SUPER_0:
-    case CODE_SUPER_1:
-    case CODE_SUPER_2:
-    case CODE_SUPER_3:
-    case CODE_SUPER_4:
-    case CODE_SUPER_5:
-    case CODE_SUPER_6:
-    case CODE_SUPER_7:
-    case CODE_SUPER_8:
-    case CODE_SUPER_9:
-    case CODE_SUPER_10:
-    case CODE_SUPER_11:
-    case CODE_SUPER_12:
-    case CODE_SUPER_13:
-    case CODE_SUPER_14:
-    case CODE_SUPER_15:
-    case CODE_SUPER_16:
-    {
-      int numArgs = bytecode[i - 1] - CODE_SUPER_0;
-      int symbol = READ_SHORT();
-      int superclass = READ_SHORT();
-      printf("SUPER_%-10d %5d '%s' %5d\n", numArgs, symbol,
-             vm->methodNames.data[symbol]->value, superclass);
-      break;
-    }
+  // This is O(n) on the length of the string, but we only call this when a new
+  // string is created. Since the creation is also O(n) (to copy/initialize all
+  // the bytes), we allow this here.
+  for (uint32_t i = 0; i < string->length; i++)
+  {
+    hash ^= string->value[i];
+    hash *= 16777619;
+  }
+
+  string->hash = hash;
+}
+
+Value wrenNewString(WrenVM* vm, const char* text)
+{
+  return wrenNewStringLength(vm, text, strlen(text));
+}
+
+Value wrenNewStringLength(WrenVM* vm, const char* text, size_t length)
+{
+  // Allow NULL if the string is empty since byte buffers don't allocate any
+  // characters for a zero-length string.
+  ASSERT(length == 0 || text != NULL, "Unexpected NULL string.");
+  
+  ObjString* string = allocateString(vm, length);
+  
+  // Copy the string (if given one).
+  if (length > 0 && text != NULL) memcpy(string->value, text, length);
+  
+  hashString(string);
+  return OBJ_VAL(string);
+}
+
+
+Value wrenNewStringFromRange(WrenVM* vm, ObjString* source, int start,
+                             uint32_t count, int step)
+{
+  uint8_t* from = (uint8_t*)source->value;
+  int length = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    length += wrenUtf8DecodeNumBytes(from[start + i * step]);
+  }
 
-    case CODE_JUMP:
-    {
-      int offset = READ_SHORT();
-      printf("%-16s %5d to %d\n", "JUMP", offset, i + offset);
-      break;
-    }
+  ObjString* result = allocateString(vm, length);
+  result->value[length] = '\0';
 
-    case CODE_LOOP:
+  uint8_t* to = (uint8_t*)result->value;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    int index = start + i * step;
+    int codePoint = wrenUtf8Decode(from + index, source->length - index);
+
+    if (codePoint != -1)
     {
-      int offset = READ_SHORT();
-      printf("%-16s %5d to %d\n", "LOOP", offset, i - offset);
-      break;
+      to += wrenUtf8Encode(codePoint, to);
     }
+  }
 
-    case CODE_JUMP_IF:
+  hashString(result);
+  return OBJ_VAL(result);
+}
+
+Value wrenNumToString(WrenVM* vm, double value)
+{
+  // Edge case: If the value is NaN or infinity, different versions of libc
+  // produce different outputs (some will format it signed and some won't). To
+  // get reliable output, handle it ourselves.
+  if (isnan(value)) return CONST_STRING(vm, "nan");
+  if (isinf(value))
+  {
+    if (value > 0.0)
     {
-      int offset = READ_SHORT();
-      printf("%-16s %5d to %d\n", "JUMP_IF", offset, i + offset);
-      break;
+      return CONST_STRING(vm, "infinity");
     }
-
-    case CODE_AND:
+    else
     {
-      int offset = READ_SHORT();
-      printf("%-16s %5d to %d\n", "AND", offset, i + offset);
-      break;
+      return CONST_STRING(vm, "-infinity");
     }
+  }
 
-    case CODE_OR:
+  // This is large enough to hold any double converted to a string using
+  // "%.14g". Example:
+  //
+  //     -1.12345678901234e-1022
+  //
+  // So we have:
+  //
+  // + 1 char for sign
+  // + 1 char for digit
+  // + 1 char for "."
+  // + 14 chars for decimal digits
+  // + 1 char for "e"
+  // + 1 char for "-" or "+"
+  // + 4 chars for exponent
+  // + 1 char for "\0"
+  // = 24
+  char buffer[24];
+  int length = sprintf(buffer, "%.14g", value);
+  return wrenNewStringLength(vm, buffer, length);
+}
+
+Value wrenStringFromCodePoint(WrenVM* vm, int value)
+{
+  int length = wrenUtf8EncodeNumBytes(value);
+  ASSERT(length != 0, "Value out of range.");
+
+  ObjString* string = allocateString(vm, length);
+
+  wrenUtf8Encode(value, (uint8_t*)string->value);
+  hashString(string);
+
+  return OBJ_VAL(string);
+}
+
+Value wrenStringFromByte(WrenVM *vm, uint8_t value)
+{
+  int length = 1;
+  ObjString* string = allocateString(vm, length);
+  string->value[0] = value;
+  hashString(string);
+  return OBJ_VAL(string);
+}
+
+Value wrenStringFormat(WrenVM* vm, const char* format, ...)
+{
+  va_list argList;
+
+  // Calculate the length of the result string. Do this up front so we can
+  // create the final string with a single allocation.
+  va_start(argList, format);
+  size_t totalLength = 0;
+  for (const char* c = format; *c != '\0'; c++)
+  {
+    switch (*c)
     {
-      int offset = READ_SHORT();
-      printf("%-16s %5d to %d\n", "OR", offset, i + offset);
-      break;
+      case '$':
+        totalLength += strlen(va_arg(argList, const char*));
+        break;
+
+      case '@':
+        totalLength += AS_STRING(va_arg(argList, Value))->length;
+        break;
+
+      default:
+        // Any other character is interpreted literally.
+        totalLength++;
     }
+  }
+  va_end(argList);
 
-    case CODE_CLOSE_UPVALUE: printf("CLOSE_UPVALUE\n"); break;
-    case CODE_RETURN:        printf("RETURN\n"); break;
+  // Concatenate the string.
+  ObjString* result = allocateString(vm, totalLength);
 
-    case CODE_CLOSURE:
+  va_start(argList, format);
+  char* start = result->value;
+  for (const char* c = format; *c != '\0'; c++)
+  {
+    switch (*c)
     {
-      int constant = READ_SHORT();
-      printf("%-16s %5d ", "CLOSURE", constant);
-      wrenDumpValue(fn->constants.data[constant]);
-      printf(" ");
-      ObjFn* loadedFn = AS_FN(fn->constants.data[constant]);
-      for (int j = 0; j < loadedFn->numUpvalues; j++)
+      case '$':
       {
-        int isLocal = READ_BYTE();
-        int index = READ_BYTE();
-        if (j > 0) printf(", ");
-        printf("%s %d", isLocal ? "local" : "upvalue", index);
+        const char* string = va_arg(argList, const char*);
+        size_t length = strlen(string);
+        memcpy(start, string, length);
+        start += length;
+        break;
       }
-      printf("\n");
-      break;
-    }
 
-    case CODE_CONSTRUCT:         printf("CONSTRUCT\n"); break;
-    case CODE_FOREIGN_CONSTRUCT: printf("FOREIGN_CONSTRUCT\n"); break;
-      
-    case CODE_CLASS:
-    {
-      int numFields = READ_BYTE();
-      printf("%-16s %5d fields\n", "CLASS", numFields);
-      break;
+      case '@':
+      {
+        ObjString* string = AS_STRING(va_arg(argList, Value));
+        memcpy(start, string->value, string->length);
+        start += string->length;
+        break;
+      }
+
+      default:
+        // Any other character is interpreted literally.
+        *start++ = *c;
     }
+  }
+  va_end(argList);
 
-    case CODE_FOREIGN_CLASS: printf("FOREIGN_CLASS\n"); break;
-    case CODE_END_CLASS: printf("END_CLASS\n"); break;
+  hashString(result);
 
-    case CODE_METHOD_INSTANCE:
-    {
-      int symbol = READ_SHORT();
-      printf("%-16s %5d '%s'\n", "METHOD_INSTANCE", symbol,
-             vm->methodNames.data[symbol]->value);
-      break;
-    }
+  return OBJ_VAL(result);
+}
 
-    case CODE_METHOD_STATIC:
-    {
-      int symbol = READ_SHORT();
-      printf("%-16s %5d '%s'\n", "METHOD_STATIC", symbol,
-             vm->methodNames.data[symbol]->value);
-      break;
-    }
-      
-    case CODE_END_MODULE:
-      printf("END_MODULE\n");
-      break;
-      
-    case CODE_IMPORT_MODULE:
-    {
-      int name = READ_SHORT();
-      printf("%-16s %5d '", "IMPORT_MODULE", name);
-      wrenDumpValue(fn->constants.data[name]);
-      printf("'\n");
-      break;
-    }
-      
-    case CODE_IMPORT_VARIABLE:
+Value wrenStringCodePointAt(WrenVM* vm, ObjString* string, uint32_t index)
+{
+  ASSERT(index < string->length, "Index out of bounds.");
+
+  int codePoint = wrenUtf8Decode((uint8_t*)string->value + index,
+                                 string->length - index);
+  if (codePoint == -1)
+  {
+    // If it isn't a valid UTF-8 sequence, treat it as a single raw byte.
+    char bytes[2];
+    bytes[0] = string->value[index];
+    bytes[1] = '\0';
+    return wrenNewStringLength(vm, bytes, 1);
+  }
+
+  return wrenStringFromCodePoint(vm, codePoint);
+}
+
+// Uses the Boyer-Moore-Horspool string matching algorithm.
+uint32_t wrenStringFind(ObjString* haystack, ObjString* needle, uint32_t start)
+{
+  // Edge case: An empty needle is always found.
+  if (needle->length == 0) return start;
+
+  // If the needle goes past the haystack it won't be found.
+  if (start + needle->length > haystack->length) return UINT32_MAX;
+
+  // If the startIndex is too far it also won't be found.
+  if (start >= haystack->length) return UINT32_MAX;
+
+  // Pre-calculate the shift table. For each character (8-bit value), we
+  // determine how far the search window can be advanced if that character is
+  // the last character in the haystack where we are searching for the needle
+  // and the needle doesn't match there.
+  uint32_t shift[UINT8_MAX];
+  uint32_t needleEnd = needle->length - 1;
+
+  // By default, we assume the character is not the needle at all. In that case
+  // case, if a match fails on that character, we can advance one whole needle
+  // width since.
+  for (uint32_t index = 0; index < UINT8_MAX; index++)
+  {
+    shift[index] = needle->length;
+  }
+
+  // Then, for every character in the needle, determine how far it is from the
+  // end. If a match fails on that character, we can advance the window such
+  // that it the last character in it lines up with the last place we could
+  // find it in the needle.
+  for (uint32_t index = 0; index < needleEnd; index++)
+  {
+    char c = needle->value[index];
+    shift[(uint8_t)c] = needleEnd - index;
+  }
+
+  // Slide the needle across the haystack, looking for the first match or
+  // stopping if the needle goes off the end.
+  char lastChar = needle->value[needleEnd];
+  uint32_t range = haystack->length - needle->length;
+
+  for (uint32_t index = start; index <= range; )
+  {
+    // Compare the last character in the haystack's window to the last character
+    // in the needle. If it matches, see if the whole needle matches.
+    char c = haystack->value[index + needleEnd];
+    if (lastChar == c &&
+        memcmp(haystack->value + index, needle->value, needleEnd) == 0)
     {
-      int variable = READ_SHORT();
-      printf("%-16s %5d '", "IMPORT_VARIABLE", variable);
-      wrenDumpValue(fn->constants.data[variable]);
-      printf("'\n");
-      break;
+      // Found a match.
+      return index;
     }
-      
-    case CODE_END:
-      printf("END\n");
-      break;
 
-    default:
-      printf("UKNOWN! [%d]\n", bytecode[i - 1]);
-      break;
+    // Otherwise, slide the needle forward.
+    index += shift[(uint8_t)c];
   }
 
-  // Return how many bytes this instruction takes, or -1 if it's an END.
-  if (code == CODE_END) return -1;
-  return i - start;
-
-  #undef READ_BYTE
-  #undef READ_SHORT
+  // Not found.
+  return UINT32_MAX;
 }
 
-int wrenDumpInstruction(WrenVM* vm, ObjFn* fn, int i)
+ObjUpvalue* wrenNewUpvalue(WrenVM* vm, Value* value)
 {
-  return dumpInstruction(vm, fn, i, NULL);
+  ObjUpvalue* upvalue = ALLOCATE(vm, ObjUpvalue);
+
+  // Upvalues are never used as first-class objects, so don't need a class.
+  initObj(vm, &upvalue->obj, OBJ_UPVALUE, NULL);
+
+  upvalue->value = value;
+  upvalue->closed = NULL_VAL;
+  upvalue->next = NULL;
+  return upvalue;
 }
 
-void wrenDumpCode(WrenVM* vm, ObjFn* fn)
-{
-  printf("%s: %s\n",
-         fn->module->name == NULL ? "<core>" : fn->module->name->value,
-         fn->debug->name);
+#if WREN_PARALLEL_MARK
 
-  int i = 0;
-  int lastLine = -1;
-  for (;;)
-  {
-    int offset = dumpInstruction(vm, fn, i, &lastLine);
-    if (offset == -1) break;
-    i += offset;
-  }
+// Mark threads pass gray objects to each other in fixed size packets. Each
+// thread blackens the objects in one packet while graying into another, and
+// hands that out once it's full. A thread that runs out of work takes a full
+// packet from the shared list, or waits for one while any thread is busy.
+#define GC_PACKET_SIZE 128
 
-  printf("\n");
-}
+typedef struct sGrayPacket
+{
+  struct sGrayPacket* next;
+  int count;
+  Obj* objects[GC_PACKET_SIZE];
+} GrayPacket;
 
-void wrenDumpStack(ObjFiber* fiber)
+typedef struct sParallelMark
 {
-  printf("(fiber %p) ", fiber);
-  for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
-  {
-    wrenDumpValue(*slot);
-    printf(" | ");
-  }
-  printf("\n");
-}
-// End file "wren_debug.c"
-// Begin file "wren_primitive.c"
+  // Packets of gray objects waiting for a thread, and unused ones. Only
+  // changed while holding [lock].
+  GrayPacket* full;
+  GrayPacket* empty;
+  int lock;
 
-#include <math.h>
+  // The threads that may still gray objects.
+  int busy;
 
-// Validates that [value] is an integer within `[0, count)`. Also allows
-// negative indices which map backwards from the end. Returns the valid positive
-// index value. If invalid, reports an error and returns `UINT32_MAX`.
-static uint32_t validateIndexValue(WrenVM* vm, uint32_t count, double value,
-                                   const char* argName)
+  size_t markedBytes;
+} ParallelMark;
+
+typedef struct
 {
-  if (!validateIntValue(vm, value, argName)) return UINT32_MAX;
-  
-  // Negative indices count from the end.
-  if (value < 0) value = count + value;
-  
-  // Check bounds.
-  if (value >= 0 && value < count) return (uint32_t)value;
-  
-  vm->fiber->error = wrenStringFormat(vm, "$ out of bounds.", argName);
-  return UINT32_MAX;
-}
+  ParallelMark* mark;
 
-bool validateFn(WrenVM* vm, Value arg, const char* argName)
+  // The packet being blackened and the one being grayed into.
+  GrayPacket* in;
+  GrayPacket* out;
+
+  size_t markedBytes;
+} Marker;
+
+static __thread Marker* currentMarker = NULL;
+
+static void lockMark(ParallelMark* mark)
 {
-  if (IS_CLOSURE(arg)) return true;
-  RETURN_ERROR_FMT("$ must be a function.", argName);
+  while (__atomic_exchange_n(&mark->lock, 1, __ATOMIC_ACQUIRE))
+  {
+    while (__atomic_load_n(&mark->lock, __ATOMIC_RELAXED)) {}
+  }
 }
 
-bool validateNum(WrenVM* vm, Value arg, const char* argName)
+static void unlockMark(ParallelMark* mark)
 {
-  if (IS_NUM(arg)) return true;
-  RETURN_ERROR_FMT("$ must be a number.", argName);
+  __atomic_store_n(&mark->lock, 0, __ATOMIC_RELEASE);
 }
 
-bool validateIntValue(WrenVM* vm, double value, const char* argName)
+// Adds the current thread's full gray packet to the shared list and starts a
+// new one.
+static void handOutPacket(Marker* marker)
 {
-  if (trunc(value) == value) return true;
-  RETURN_ERROR_FMT("$ must be an integer.", argName);
+  ParallelMark* mark = marker->mark;
+
+  lockMark(mark);
+  marker->out->next = mark->full;
+  __atomic_store_n(&mark->full, marker->out, __ATOMIC_RELAXED);
+
+  // There are enough packets for every object to be gray at once.
+  ASSERT(mark->empty != NULL, "Out of gray packets.");
+  marker->out = mark->empty;
+  mark->empty = marker->out->next;
+  unlockMark(mark);
+
+  marker->out->count = 0;
 }
 
-bool validateInt(WrenVM* vm, Value arg, const char* argName)
+static void grayInParallel(Obj* obj)
 {
-  // Make sure it's a number first.
-  if (!validateNum(vm, arg, argName)) return false;
-  return validateIntValue(vm, AS_NUM(arg), argName);
+  // Another thread may get to the object first, only one of them wins.
+  if (__atomic_load_n(&obj->isDark, __ATOMIC_RELAXED)) return;
+  if (__atomic_exchange_n(&obj->isDark, true, __ATOMIC_RELAXED)) return;
+
+  Marker* marker = currentMarker;
+  if (marker->out->count == GC_PACKET_SIZE) handOutPacket(marker);
+  marker->out->objects[marker->out->count++] = obj;
 }
 
-bool validateKey(WrenVM* vm, Value arg)
+#endif
+
+void wrenGrayObj(WrenVM* vm, Obj* obj)
 {
-  if (wrenMapIsValidKey(arg)) return true;
+  if (obj == NULL) return;
 
-  RETURN_ERROR("Key must be a value type.");
+#if WREN_PARALLEL_MARK
+  if (vm->parallelMark != NULL)
+  {
+    grayInParallel(obj);
+    return;
+  }
+#endif
+
+  // Stop if the object is already darkened so we don't get stuck in a cycle.
+  if (obj->isDark) return;
+
+  // It's been reached.
+  obj->isDark = true;
+
+  // Add it to the gray list so it can be recursively explored for
+  // more marks later.
+  if (vm->grayCount >= vm->grayCapacity)
+  {
+    vm->grayCapacity = vm->grayCount * 2;
+    vm->gray = (Obj**)vm->config.reallocateFn(vm->gray,
+                                              vm->grayCapacity * sizeof(Obj*),
+                                              vm->config.userData);
+  }
+
+  vm->gray[vm->grayCount++] = obj;
 }
 
-uint32_t validateIndex(WrenVM* vm, Value arg, uint32_t count,
-                       const char* argName)
+void wrenGrayValue(WrenVM* vm, Value value)
 {
-  if (!validateNum(vm, arg, argName)) return UINT32_MAX;
-  return validateIndexValue(vm, count, AS_NUM(arg), argName);
+  if (!IS_OBJ(value)) return;
+  wrenGrayObj(vm, AS_OBJ(value));
 }
 
-bool validateString(WrenVM* vm, Value arg, const char* argName)
+void wrenGrayBuffer(WrenVM* vm, ValueBuffer* buffer)
 {
-  if (IS_STRING(arg)) return true;
-  RETURN_ERROR_FMT("$ must be a string.", argName);
+  for (int i = 0; i < buffer->count; i++)
+  {
+    wrenGrayValue(vm, buffer->data[i]);
+  }
 }
 
-uint32_t calculateRange(WrenVM* vm, ObjRange* range, uint32_t* length,
-                        int* step)
+// The memory [obj] holds on to. Marking counts this for every object it
+// reaches, which is all that's known to be in use afterwards.
+static size_t objectSize(WrenVM* vm, Obj* obj, WrenForeignSizeFn foreignSize)
 {
-  *step = 0;
-
-  // Edge case: an empty range is allowed at the end of a sequence. This way,
-  // list[0..-1] and list[0...list.count] can be used to copy a list even when
-  // empty.
-  if (range->from == *length &&
-      range->to == (range->isInclusive ? -1.0 : (double)*length))
+  switch (obj->type)
   {
-    *length = 0;
-    return 0;
+    case OBJ_CLASS:
+      return sizeof(ObjClass) +
+             ((ObjClass*)obj)->methods.capacity * sizeof(MethodEntry);
+
+    case OBJ_CLOSURE:
+      return sizeof(ObjClosure) +
+             sizeof(ObjUpvalue*) * ((ObjClosure*)obj)->fn->numUpvalues;
+
+    case OBJ_FIBER:
+    {
+      ObjFiber* fiber = (ObjFiber*)obj;
+      return sizeof(ObjFiber) + fiber->frameCapacity * sizeof(CallFrame) +
+             fiber->stackCapacity * sizeof(Value);
+    }
+
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)obj;
+      return sizeof(ObjFn) + sizeof(uint8_t) * fn->code.capacity +
+             sizeof(Value) * fn->constants.capacity +
+             sizeof(int) * fn->code.capacity;
+    }
+
+    case OBJ_FOREIGN:
+    {
+      ObjForeign* foreign = (ObjForeign*)obj;
+      if (foreignSize == NULL)
+      {
+        return sizeof(ObjForeign) + foreign->externalSize;
+      }
+
+      int symbol = wrenSymbolTableFind(&vm->methodNames, "<allocate>", 10);
+      Method* allocate = wrenFindMethod(wrenGetObjClass(vm, obj), symbol);
+      if (allocate == NULL || allocate->type != METHOD_FOREIGN)
+      {
+        return sizeof(ObjForeign) + foreign->externalSize;
+      }
+
+      return sizeof(ObjForeign) +
+             foreignSize(vm, allocate->as.foreign, foreign->data);
+    }
+
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+             sizeof(Value) * wrenGetObjClass(vm, obj)->numFields;
+
+    case OBJ_LIST:
+      return sizeof(ObjList) +
+             sizeof(Value) * ((ObjList*)obj)->elements.capacity;
+
+    case OBJ_MAP:
+      return sizeof(ObjMap) + sizeof(MapEntry) * ((ObjMap*)obj)->capacity;
+
+    case OBJ_MODULE:
+      return sizeof(ObjModule) + ((ObjModule*)obj)->variableNames.capacity *
+                                 sizeof(*((ObjModule*)obj)->variableNames.data);
+
+    case OBJ_RANGE:   return sizeof(ObjRange);
+    case OBJ_STRING:  return sizeof(ObjString) + ((ObjString*)obj)->length + 1;
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
   }
 
-  uint32_t from = validateIndexValue(vm, *length, range->from, "Range start");
-  if (from == UINT32_MAX) return UINT32_MAX;
+  return 0;
+}
 
-  // Bounds check the end manually to handle exclusive ranges.
-  double value = range->to;
-  if (!validateIntValue(vm, value, "Range end")) return UINT32_MAX;
+static void blackenClass(WrenVM* vm, ObjClass* classObj)
+{
+  // The metaclass.
+  wrenGrayObj(vm, (Obj*)wrenGetObjClass(vm, &classObj->obj));
 
-  // Negative indices count from the end.
-  if (value < 0) value = *length + value;
+  // The superclass.
+  wrenGrayObj(vm, (Obj*)classObj->superclass);
 
-  // Convert the exclusive range to an inclusive one.
-  if (!range->isInclusive)
+  // Method function objects.
+  for (int i = 0; i < classObj->methods.capacity; i++)
   {
-    // An exclusive range with the same start and end points is empty.
-    if (value == from)
+    MethodEntry* entry = &classObj->methods.entries[i];
+    if (entry->symbol != -1 && wrenIsClosureMethod(&entry->method))
     {
-      *length = 0;
-      return from;
+      wrenGrayObj(vm, (Obj*)entry->method.as.closure);
     }
+  }
+
+  wrenGrayObj(vm, (Obj*)classObj->name);
+
+  if(!IS_NULL(classObj->attributes)) wrenGrayObj(vm, AS_OBJ(classObj->attributes));
+}
+
+static void blackenClosure(WrenVM* vm, ObjClosure* closure)
+{
+  // Mark the function.
+  wrenGrayObj(vm, (Obj*)closure->fn);
+
+  // Mark the upvalues.
+  for (int i = 0; i < closure->fn->numUpvalues; i++)
+  {
+    wrenGrayObj(vm, (Obj*)closure->upvalues[i]);
+  }
+}
+
+static void blackenFiber(WrenVM* vm, ObjFiber* fiber)
+{
+  // A fiber that ran during an incremental collection was scanned already.
+  if (vm->gcPhase == GC_MARK)
+  {
+    if (fiber->scanned == vm->gcCount + 1) return;
+    fiber->scanned = vm->gcCount + 1;
+  }
+
+  // Stack functions.
+  for (int i = 0; i < fiber->numFrames; i++)
+  {
+    wrenGrayObj(vm, (Obj*)fiber->frames[i].closure);
+  }
 
-    // Shift the endpoint to make it inclusive, handling both increasing and
-    // decreasing ranges.
-    value += value >= from ? -1 : 1;
+  // Stack variables.
+  for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
+  {
+    wrenGrayValue(vm, *slot);
   }
 
-  // Check bounds.
-  if (value < 0 || value >= *length)
+  // Open upvalues.
+  ObjUpvalue* upvalue = fiber->openUpvalues;
+  while (upvalue != NULL)
   {
-    vm->fiber->error = CONST_STRING(vm, "Range end out of bounds.");
-    return UINT32_MAX;
+    wrenGrayObj(vm, (Obj*)upvalue);
+    upvalue = upvalue->next;
   }
 
-  uint32_t to = (uint32_t)value;
-  *length = abs((int)(from - to)) + 1;
-  *step = from < to ? 1 : -1;
-  return from;
+  // The caller.
+  wrenGrayObj(vm, (Obj*)fiber->caller);
+  wrenGrayValue(vm, fiber->error);
 }
-// End file "wren_primitive.c"
-// Begin file "wren_utils.c"
-#include <string.h>
-
-
-DEFINE_BUFFER(Byte, uint8_t);
-DEFINE_BUFFER(Int, int);
-DEFINE_BUFFER(String, ObjString*);
 
-void wrenSymbolTableInit(SymbolTable* symbols)
+static void blackenFn(WrenVM* vm, ObjFn* fn)
 {
-  wrenStringBufferInit(symbols);
+  // Mark the constants.
+  wrenGrayBuffer(vm, &fn->constants);
 }
 
-void wrenSymbolTableClear(WrenVM* vm, SymbolTable* symbols)
+static void blackenInstance(WrenVM* vm, ObjInstance* instance)
 {
-  wrenStringBufferClear(vm, symbols);
-}
+  wrenGrayObj(vm, (Obj*)wrenGetObjClass(vm, &instance->obj));
 
-int wrenSymbolTableAdd(WrenVM* vm, SymbolTable* symbols,
-                       const char* name, size_t length)
-{
-  ObjString* symbol = AS_STRING(wrenNewStringLength(vm, name, length));
-  
-  wrenPushRoot(vm, &symbol->obj);
-  wrenStringBufferWrite(vm, symbols, symbol);
-  wrenPopRoot(vm);
-  
-  return symbols->count - 1;
+  // Mark the fields.
+  for (int i = 0; i < wrenGetObjClass(vm, &instance->obj)->numFields; i++)
+  {
+    wrenGrayValue(vm, instance->fields[i]);
+  }
 }
 
-int wrenSymbolTableEnsure(WrenVM* vm, SymbolTable* symbols,
-                          const char* name, size_t length)
+static void blackenList(WrenVM* vm, ObjList* list)
 {
-  // See if the symbol is already defined.
-  int existing = wrenSymbolTableFind(symbols, name, length);
-  if (existing != -1) return existing;
-
-  // New symbol, so add it.
-  return wrenSymbolTableAdd(vm, symbols, name, length);
+  // Mark the elements.
+  wrenGrayBuffer(vm, &list->elements);
 }
 
-int wrenSymbolTableFind(const SymbolTable* symbols,
-                        const char* name, size_t length)
+static void blackenMap(WrenVM* vm, ObjMap* map)
 {
-  // See if the symbol is already defined.
-  // TODO: O(n). Do something better.
-  for (int i = 0; i < symbols->count; i++)
+  // Mark the entries.
+  for (uint32_t i = 0; i < map->capacity; i++)
   {
-    if (wrenStringEqualsCString(symbols->data[i], name, length)) return i;
-  }
+    MapEntry* entry = &map->entries[i];
+    if (IS_UNDEFINED(entry->key)) continue;
 
-  return -1;
+    wrenGrayValue(vm, entry->key);
+    wrenGrayValue(vm, entry->value);
+  }
 }
 
-void wrenBlackenSymbolTable(WrenVM* vm, SymbolTable* symbolTable)
+static void blackenModule(WrenVM* vm, ObjModule* module)
 {
-  for (int i = 0; i < symbolTable->count; i++)
+  // Top-level variables.
+  for (int i = 0; i < module->variables.count; i++)
   {
-    wrenGrayObj(vm, &symbolTable->data[i]->obj);
+    wrenGrayValue(vm, module->variables.data[i]);
   }
-  
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += symbolTable->capacity * sizeof(*symbolTable->data);
+
+  wrenBlackenSymbolTable(vm, &module->variableNames);
+
+  wrenGrayObj(vm, (Obj*)module->name);
 }
 
-int wrenUtf8EncodeNumBytes(int value)
+static void blackenUpvalue(WrenVM* vm, ObjUpvalue* upvalue)
 {
-  ASSERT(value >= 0, "Cannot encode a negative value.");
-  
-  if (value <= 0x7f) return 1;
-  if (value <= 0x7ff) return 2;
-  if (value <= 0xffff) return 3;
-  if (value <= 0x10ffff) return 4;
-  return 0;
+  // Mark the closed-over object (in case it is closed).
+  wrenGrayValue(vm, upvalue->closed);
 }
 
-int wrenUtf8Encode(int value, uint8_t* bytes)
+static void blackenObject(WrenVM* vm, Obj* obj)
 {
-  if (value <= 0x7f)
+#if WREN_DEBUG_TRACE_MEMORY
+  printf("mark ");
+  wrenDumpValue(OBJ_VAL(obj));
+  printf(" @ %p\n", obj);
+#endif
+
+  // Traverse the object's fields.
+  switch (obj->type)
   {
-    // Single byte (i.e. fits in ASCII).
-    *bytes = value & 0x7f;
-    return 1;
+    case OBJ_CLASS:    blackenClass(   vm, (ObjClass*)   obj); break;
+    case OBJ_CLOSURE:  blackenClosure( vm, (ObjClosure*) obj); break;
+    case OBJ_FIBER:    blackenFiber(   vm, (ObjFiber*)   obj); break;
+    case OBJ_FN:       blackenFn(      vm, (ObjFn*)      obj); break;
+    case OBJ_INSTANCE: blackenInstance(vm, (ObjInstance*)obj); break;
+    case OBJ_LIST:     blackenList(    vm, (ObjList*)    obj); break;
+    case OBJ_MAP:      blackenMap(     vm, (ObjMap*)     obj); break;
+    case OBJ_MODULE:   blackenModule(  vm, (ObjModule*)  obj); break;
+    case OBJ_UPVALUE:  blackenUpvalue( vm, (ObjUpvalue*) obj); break;
+
+    // These don't reference other objects.
+    case OBJ_FOREIGN:
+    case OBJ_RANGE:
+    case OBJ_STRING:
+      break;
   }
-  else if (value <= 0x7ff)
+}
+
+void wrenBlackenObjects(WrenVM* vm)
+{
+  while (vm->grayCount > 0)
   {
-    // Two byte sequence: 110xxxxx 10xxxxxx.
-    *bytes = 0xc0 | ((value & 0x7c0) >> 6);
-    bytes++;
-    *bytes = 0x80 | (value & 0x3f);
-    return 2;
+    // Pop an item from the gray stack.
+    Obj* obj = vm->gray[--vm->grayCount];
+    vm->markedBytes += objectSize(vm, obj, NULL);
+    blackenObject(vm, obj);
   }
-  else if (value <= 0xffff)
+}
+
+#if WREN_PARALLEL_MARK
+
+// Heaps with fewer objects than this aren't worth starting threads for.
+#define GC_PARALLEL_MIN_OBJECTS 20000
+
+// Swaps [marker]'s drained packet for a full one. If there are none, waits
+// until another thread hands one out, or returns false once no thread is
+// busy anymore and so marking is done.
+static bool takePacket(Marker* marker)
+{
+  ParallelMark* mark = marker->mark;
+  bool busy = true;
+
+  for (;;)
   {
-    // Three byte sequence: 1110xxxx 10xxxxxx 10xxxxxx.
-    *bytes = 0xe0 | ((value & 0xf000) >> 12);
-    bytes++;
-    *bytes = 0x80 | ((value & 0xfc0) >> 6);
-    bytes++;
-    *bytes = 0x80 | (value & 0x3f);
-    return 3;
+    lockMark(mark);
+    if (mark->full != NULL)
+    {
+      marker->in->next = mark->empty;
+      mark->empty = marker->in;
+
+      marker->in = mark->full;
+      __atomic_store_n(&mark->full, marker->in->next, __ATOMIC_RELAXED);
+
+      if (!busy) __atomic_store_n(&mark->busy, mark->busy + 1, __ATOMIC_RELAXED);
+      unlockMark(mark);
+      return true;
+    }
+
+    if (busy)
+    {
+      busy = false;
+      __atomic_store_n(&mark->busy, mark->busy - 1, __ATOMIC_RELAXED);
+    }
+
+    bool done = mark->busy == 0;
+    unlockMark(mark);
+    if (done) return false;
+
+    while (__atomic_load_n(&mark->full, __ATOMIC_RELAXED) == NULL &&
+           __atomic_load_n(&mark->busy, __ATOMIC_RELAXED) > 0) {}
   }
-  else if (value <= 0x10ffff)
+}
+
+static void markWorker(WrenVM* vm, int index, void* data)
+{
+  Marker marker;
+  marker.mark = (ParallelMark*)data;
+  marker.markedBytes = 0;
+
+  lockMark(marker.mark);
+  __atomic_store_n(&marker.mark->busy, marker.mark->busy + 1, __ATOMIC_RELAXED);
+  marker.in = marker.mark->empty;
+  marker.out = marker.in->next;
+  marker.mark->empty = marker.out->next;
+  unlockMark(marker.mark);
+
+  marker.in->count = 0;
+  marker.out->count = 0;
+  currentMarker = &marker;
+
+  for (;;)
   {
-    // Four byte sequence: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx.
-    *bytes = 0xf0 | ((value & 0x1c0000) >> 18);
-    bytes++;
-    *bytes = 0x80 | ((value & 0x3f000) >> 12);
-    bytes++;
-    *bytes = 0x80 | ((value & 0xfc0) >> 6);
-    bytes++;
-    *bytes = 0x80 | (value & 0x3f);
-    return 4;
+    while (marker.in->count > 0)
+    {
+      Obj* obj = marker.in->objects[--marker.in->count];
+      marker.markedBytes += objectSize(vm, obj, NULL);
+      blackenObject(vm, obj);
+    }
+
+    // Share what this thread grayed if others are waiting for work, otherwise
+    // keep going with it.
+    if (marker.out->count >= GC_PACKET_SIZE / 2 &&
+        __atomic_load_n(&marker.mark->full, __ATOMIC_RELAXED) == NULL)
+    {
+      handOutPacket(&marker);
+    }
+    else if (marker.out->count > 0)
+    {
+      GrayPacket* packet = marker.in;
+      marker.in = marker.out;
+      marker.out = packet;
+      continue;
+    }
+
+    if (!takePacket(&marker)) break;
   }
 
-  // Invalid Unicode value. See: http://tools.ietf.org/html/rfc3629
-  UNREACHABLE();
-  return 0;
+  currentMarker = NULL;
+
+  lockMark(marker.mark);
+  marker.mark->markedBytes += marker.markedBytes;
+  unlockMark(marker.mark);
 }
 
-int wrenUtf8Decode(const uint8_t* bytes, uint32_t length)
-{
-  // Single byte (i.e. fits in ASCII).
-  if (*bytes <= 0x7f) return *bytes;
+#endif
 
-  int value;
-  uint32_t remainingBytes;
-  if ((*bytes & 0xe0) == 0xc0)
+bool wrenBlackenObjectsInParallel(WrenVM* vm)
+{
+#if WREN_PARALLEL_MARK
+  int threads = vm->config.markThreads;
+  if (vm->config.parallelFn == NULL || threads < 2 ||
+      vm->objectCount < GC_PARALLEL_MIN_OBJECTS)
   {
-    // Two byte sequence: 110xxxxx 10xxxxxx.
-    value = *bytes & 0x1f;
-    remainingBytes = 1;
+    return false;
   }
-  else if ((*bytes & 0xf0) == 0xe0)
+
+  // Packets handed out are at least half full and hold different objects,
+  // each thread has two of its own, and the roots take up one more.
+  size_t count = 2 * vm->objectCount / GC_PACKET_SIZE + 2 * threads + 1;
+  GrayPacket* packets = (GrayPacket*)vm->config.reallocateFn(NULL,
+      count * sizeof(GrayPacket), vm->config.userData);
+  if (packets == NULL) return false;
+
+  ParallelMark mark;
+  mark.full = NULL;
+  mark.empty = NULL;
+  mark.lock = 0;
+  mark.busy = 0;
+  mark.markedBytes = 0;
+
+  for (size_t i = 0; i < count; i++)
   {
-    // Three byte sequence: 1110xxxx	 10xxxxxx 10xxxxxx.
-    value = *bytes & 0x0f;
-    remainingBytes = 2;
+    packets[i].next = mark.empty;
+    mark.empty = &packets[i];
   }
-  else if ((*bytes & 0xf8) == 0xf0)
+
+  // Start with the roots.
+  while (vm->grayCount > 0)
   {
-    // Four byte sequence: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx.
-    value = *bytes & 0x07;
-    remainingBytes = 3;
+    GrayPacket* packet = mark.empty;
+    mark.empty = packet->next;
+
+    packet->count = 0;
+    while (vm->grayCount > 0 && packet->count < GC_PACKET_SIZE)
+    {
+      packet->objects[packet->count++] = vm->gray[--vm->grayCount];
+    }
+
+    packet->next = mark.full;
+    mark.full = packet;
   }
-  else
+
+  vm->parallelMark = &mark;
+  vm->config.parallelFn(vm, threads, markWorker, &mark);
+  vm->parallelMark = NULL;
+
+  vm->markedBytes += mark.markedBytes;
+  vm->config.reallocateFn(packets, 0, vm->config.userData);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void wrenFreeObj(WrenVM* vm, Obj* obj)
+{
+#if WREN_DEBUG_TRACE_MEMORY
+  printf("free ");
+  wrenDumpValue(OBJ_VAL(obj));
+  printf(" @ %p\n", obj);
+#endif
+
+  vm->objectCount--;
+
+  switch (obj->type)
   {
-    // Invalid UTF-8 sequence.
-    return -1;
-  }
+    case OBJ_CLASS:
+    {
+      ObjClass* classObj = (ObjClass*)obj;
+      DEALLOCATE(vm, classObj->methods.entries);
+      vm->classes[classObj->id] = NULL;
+      vm->freeClassIds[vm->freeClassCount++] = classObj->id;
+      break;
+    }
 
-  // Don't read past the end of the buffer on truncated UTF-8.
-  if (remainingBytes > length - 1) return -1;
+    case OBJ_FIBER:
+    {
+      ObjFiber* fiber = (ObjFiber*)obj;
+      DEALLOCATE(vm, fiber->frames);
+      DEALLOCATE(vm, fiber->stack);
+      break;
+    }
+      
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)obj;
+      wrenValueBufferClear(vm, &fn->constants);
+      wrenByteBufferClear(vm, &fn->code);
+      wrenIntBufferClear(vm, &fn->debug->sourceLines);
+      DEALLOCATE(vm, fn->debug->name);
+      DEALLOCATE(vm, fn->debug);
+      break;
+    }
 
-  while (remainingBytes > 0)
-  {
-    bytes++;
-    remainingBytes--;
+    case OBJ_FOREIGN:
+      vm->externalBytes -= ((ObjForeign*)obj)->externalSize;
+      wrenFinalizeForeign(vm, (ObjForeign*)obj);
+      break;
 
-    // Remaining bytes must be of form 10xxxxxx.
-    if ((*bytes & 0xc0) != 0x80) return -1;
+    case OBJ_LIST:
+      wrenValueBufferClear(vm, &((ObjList*)obj)->elements);
+      break;
 
-    value = value << 6 | (*bytes & 0x3f);
+    case OBJ_MAP:
+      DEALLOCATE(vm, ((ObjMap*)obj)->entries);
+      break;
+
+    case OBJ_MODULE:
+      wrenSymbolTableClear(vm, &((ObjModule*)obj)->variableNames);
+      wrenValueBufferClear(vm, &((ObjModule*)obj)->variables);
+      break;
+
+    case OBJ_CLOSURE:
+    case OBJ_INSTANCE:
+    case OBJ_RANGE:
+    case OBJ_STRING:
+    case OBJ_UPVALUE:
+      break;
   }
 
-  return value;
+  DEALLOCATE(vm, obj);
 }
 
-int wrenUtf8DecodeNumBytes(uint8_t byte)
+ObjClass* wrenGetClass(WrenVM* vm, Value value)
 {
-  // If the byte starts with 10xxxxx, it's the middle of a UTF-8 sequence, so
-  // don't count it at all.
-  if ((byte & 0xc0) == 0x80) return 0;
-  
-  // The first byte's high bits tell us how many bytes are in the UTF-8
-  // sequence.
-  if ((byte & 0xf8) == 0xf0) return 4;
-  if ((byte & 0xf0) == 0xe0) return 3;
-  if ((byte & 0xe0) == 0xc0) return 2;
-  return 1;
+  return wrenGetClassInline(vm, value);
 }
 
-// From: http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2Float
-int wrenPowerOf2Ceil(int n)
+bool wrenValuesEqual(Value a, Value b)
 {
-  n--;
-  n |= n >> 1;
-  n |= n >> 2;
-  n |= n >> 4;
-  n |= n >> 8;
-  n |= n >> 16;
-  n++;
-  
-  return n;
-}
+  if (wrenValuesSame(a, b)) return true;
 
-uint32_t wrenValidateIndex(uint32_t count, int64_t value)
-{
-  // Negative indices count from the end.
-  if (value < 0) value = count + value;
+  // If we get here, it's only possible for two heap-allocated immutable objects
+  // to be equal.
+  if (!IS_OBJ(a) || !IS_OBJ(b)) return false;
 
-  // Check bounds.
-  if (value >= 0 && value < count) return (uint32_t)value;
+  Obj* aObj = AS_OBJ(a);
+  Obj* bObj = AS_OBJ(b);
 
-  return UINT32_MAX;
+  // Must be the same type.
+  if (aObj->type != bObj->type) return false;
+
+  switch (aObj->type)
+  {
+    case OBJ_RANGE:
+    {
+      ObjRange* aRange = (ObjRange*)aObj;
+      ObjRange* bRange = (ObjRange*)bObj;
+      return aRange->from == bRange->from &&
+             aRange->to == bRange->to &&
+             aRange->isInclusive == bRange->isInclusive;
+    }
+
+    case OBJ_STRING:
+    {
+      ObjString* aString = (ObjString*)aObj;
+      ObjString* bString = (ObjString*)bObj;
+      return aString->hash == bString->hash &&
+      wrenStringEqualsCString(aString, bString->value, bString->length);
+    }
+
+    default:
+      // All other types are only equal if they are same, which they aren't if
+      // we get here.
+      return false;
+  }
 }
-// End file "wren_utils.c"
-// Begin file "wren_value.c"
-#include <math.h>
+// End file "wren_value.c"
+// Begin file "wren_vm.c"
 #include <stdarg.h>
-#include <stdio.h>
 #include <string.h>
 
 
-#if WREN_DEBUG_TRACE_MEMORY
+#if WREN_OPT_META
+// Begin file "wren_opt_meta.h"
+#ifndef wren_opt_meta_h
+#define wren_opt_meta_h
+
+
+// This module defines the Meta class and its associated methods.
+#if WREN_OPT_META
+
+const char* wrenMetaSource();
+WrenForeignMethodFn wrenMetaBindForeignMethod(WrenVM* vm,
+                                              const char* className,
+                                              bool isStatic,
+                                              const char* signature);
+
 #endif
 
-// TODO: Tune these.
-// The initial (and minimum) capacity of a non-empty list or map object.
-#define MIN_CAPACITY 16
+#endif
+// End file "wren_opt_meta.h"
+#endif
+#if WREN_OPT_RANDOM
+// Begin file "wren_opt_random.h"
+#ifndef wren_opt_random_h
+#define wren_opt_random_h
 
-// The rate at which a collection's capacity grows when the size exceeds the
-// current capacity. The new capacity will be determined by *multiplying* the
-// old capacity by this. Growing geometrically is necessary to ensure that
-// adding to a collection has O(1) amortized complexity.
-#define GROW_FACTOR 2
 
-// The maximum percentage of map entries that can be filled before the map is
-// grown. A lower load takes more memory but reduces collisions which makes
-// lookup faster.
-#define MAP_LOAD_PERCENT 75
+#if WREN_OPT_RANDOM
 
-// The number of call frames initially allocated when a fiber is created. Making
-// this smaller makes fibers use less memory (at first) but spends more time
-// reallocating when the call stack grows.
-#define INITIAL_CALL_FRAMES 4
+const char* wrenRandomSource();
+WrenForeignClassMethods wrenRandomBindForeignClass(WrenVM* vm,
+                                                   const char* module,
+                                                   const char* className);
+WrenForeignMethodFn wrenRandomBindForeignMethod(WrenVM* vm,
+                                                const char* className,
+                                                bool isStatic,
+                                                const char* signature);
 
-DEFINE_BUFFER(Value, Value);
-DEFINE_BUFFER(Method, Method);
+#endif
 
-static void initObj(WrenVM* vm, Obj* obj, ObjType type, ObjClass* classObj)
-{
-  obj->type = type;
-  obj->isDark = false;
-  obj->classObj = classObj;
-  obj->next = vm->first;
-  vm->first = obj;
-}
+#endif
+// End file "wren_opt_random.h"
+#endif
 
-ObjClass* wrenNewSingleClass(WrenVM* vm, int numFields, ObjString* name)
+#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
+  #include <time.h>
+  #include <stdio.h>
+#endif
+
+// The behavior of realloc() when the size is 0 is implementation defined. It
+// may return a non-NULL pointer which must not be dereferenced but nevertheless
+// should be freed. To prevent that, we avoid calling realloc() with a zero
+// size.
+static void* defaultReallocate(void* ptr, size_t newSize, void* _)
 {
-  ObjClass* classObj = ALLOCATE(vm, ObjClass);
-  initObj(vm, &classObj->obj, OBJ_CLASS, NULL);
-  classObj->superclass = NULL;
-  classObj->numFields = numFields;
-  classObj->name = name;
-  classObj->attributes = NULL_VAL;
+  if (newSize == 0)
+  {
+    free(ptr);
+    return NULL;
+  }
 
-  wrenPushRoot(vm, (Obj*)classObj);
-  wrenMethodBufferInit(&classObj->methods);
-  wrenPopRoot(vm);
+  return realloc(ptr, newSize);
+}
 
-  return classObj;
+int wrenGetVersionNumber() 
+{ 
+  return WREN_VERSION_NUMBER;
 }
 
-void wrenBindSuperclass(WrenVM* vm, ObjClass* subclass, ObjClass* superclass)
+void wrenInitConfiguration(WrenConfiguration* config)
 {
-  ASSERT(superclass != NULL, "Must have superclass.");
+  config->reallocateFn = defaultReallocate;
+  config->resolveModuleFn = NULL;
+  config->loadModuleFn = NULL;
+  config->loadBytecodeFn = NULL;
+  config->saveBytecodeFn = NULL;
+  config->bindForeignMethodFn = NULL;
+  config->bindTypedForeignMethodFn = NULL;
+  config->bindForeignClassFn = NULL;
+  config->writeFn = NULL;
+  config->errorFn = NULL;
+  config->randomSeedFn = NULL;
+  config->sampleFn = NULL;
+  config->gcFn = NULL;
+  config->incrementalGC = false;
+  config->nurserySize = 0;
+  config->parallelFn = NULL;
+  config->markThreads = 1;
+  config->initialHeapSize = 1024 * 1024 * 10;
+  config->minHeapSize = 1024 * 1024;
+  config->heapGrowthPercent = 50;
+  config->userData = NULL;
+}
 
-  subclass->superclass = superclass;
+WrenVM* wrenNewVM(WrenConfiguration* config)
+{
+  WrenReallocateFn reallocate = defaultReallocate;
+  void* userData = NULL;
+  if (config != NULL) {
+    userData = config->userData;
+    reallocate = config->reallocateFn ? config->reallocateFn : defaultReallocate;
+  }
+  
+  WrenVM* vm = (WrenVM*)reallocate(NULL, sizeof(*vm), userData);
+  memset(vm, 0, sizeof(WrenVM));
 
-  // Include the superclass in the total number of fields.
-  if (subclass->numFields != -1)
+  // Copy the configuration if given one.
+  if (config != NULL)
   {
-    subclass->numFields += superclass->numFields;
+    memcpy(&vm->config, config, sizeof(WrenConfiguration));
+
+    // We choose to set this after copying, 
+    // rather than modifying the user config pointer
+    vm->config.reallocateFn = reallocate;
   }
   else
   {
-    ASSERT(superclass->numFields == 0,
-           "A foreign class cannot inherit from a class with fields.");
-  }
-
-  // Inherit methods from its superclass.
-  for (int i = 0; i < superclass->methods.count; i++)
-  {
-    wrenBindMethod(vm, subclass, i, superclass->methods.data[i]);
+    wrenInitConfiguration(&vm->config);
   }
+
+  // TODO: Should we allocate and free this during a GC?
+  vm->grayCount = 0;
+  // TODO: Tune this.
+  vm->grayCapacity = 4;
+  vm->gray = (Obj**)reallocate(NULL, vm->grayCapacity * sizeof(Obj*), userData);
+
+  vm->classCount = 1;
+  vm->classCapacity = 64;
+  vm->classes = (ObjClass**)reallocate(NULL,
+      vm->classCapacity * sizeof(ObjClass*), userData);
+  vm->freeClassIds = (uint32_t*)reallocate(NULL,
+      vm->classCapacity * sizeof(uint32_t), userData);
+  vm->classes[0] = NULL;
+  vm->nextGC = vm->config.initialHeapSize;
+  if (vm->config.incrementalGC) vm->config.nurserySize = 0;
+
+  wrenSymbolTableInit(&vm->methodNames);
+  wrenByteBufferInit(&vm->foreignTypes);
+
+  vm->modules = wrenNewMap(vm);
+  wrenInitializeCore(vm);
+  return vm;
 }
 
-ObjClass* wrenNewClass(WrenVM* vm, ObjClass* superclass, int numFields,
-                       ObjString* name)
+// Allocation tracking uses the host allocator directly, so it never shows up
+// in its own counts or triggers a collection.
+static void* trackingReallocate(WrenVM* vm, void* memory, size_t size)
 {
-  // Create the metaclass.
-  Value metaclassName = wrenStringFormat(vm, "@ metaclass", OBJ_VAL(name));
-  wrenPushRoot(vm, AS_OBJ(metaclassName));
+  return vm->config.reallocateFn(memory, size, vm->config.userData);
+}
 
-  ObjClass* metaclass = wrenNewSingleClass(vm, 0, AS_STRING(metaclassName));
-  metaclass->obj.classObj = vm->classClass;
+static uint32_t hashAllocationKey(const void* key, int line)
+{
+  uint64_t bits = (uint64_t)(uintptr_t)key ^ ((uint64_t)line << 32);
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
 
-  wrenPopRoot(vm);
+// Returns the index of the entry for [key] and [line] in [table], adding one
+// named by [format] if there isn't one yet.
+static int findAllocationCount(WrenVM* vm, AllocationTable* table,
+                               const void* key, int line, const char* format,
+                               const char* first, const char* second)
+{
+  if (table->count + 1 > table->capacity * 3 / 4)
+  {
+    int capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    AllocationCount* entries = (AllocationCount*)trackingReallocate(vm, NULL,
+        capacity * sizeof(AllocationCount));
+    memset(entries, 0, capacity * sizeof(AllocationCount));
 
-  // Make sure the metaclass isn't collected when we allocate the class.
-  wrenPushRoot(vm, (Obj*)metaclass);
+    for (int i = 0; i < table->capacity; i++)
+    {
+      AllocationCount* entry = &table->entries[i];
+      if (entry->key == NULL) continue;
 
-  // Metaclasses always inherit Class and do not parallel the non-metaclass
-  // hierarchy.
-  wrenBindSuperclass(vm, metaclass, vm->classClass);
+      uint32_t index = hashAllocationKey(entry->key, entry->line) & (capacity - 1);
+      while (entries[index].key != NULL) index = (index + 1) & (capacity - 1);
+      entries[index] = *entry;
+    }
 
-  ObjClass* classObj = wrenNewSingleClass(vm, numFields, name);
+    trackingReallocate(vm, table->entries, 0);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
 
-  // Make sure the class isn't collected while the inherited methods are being
-  // bound.
-  wrenPushRoot(vm, (Obj*)classObj);
+  uint32_t index = hashAllocationKey(key, line) & (table->capacity - 1);
+  while (table->entries[index].key != NULL)
+  {
+    AllocationCount* entry = &table->entries[index];
+    if (entry->key == key && entry->line == line) return (int)index;
+    index = (index + 1) & (table->capacity - 1);
+  }
 
-  classObj->obj.classObj = metaclass;
-  wrenBindSuperclass(vm, classObj, superclass);
+  char name[128];
+  snprintf(name, sizeof(name), format, first, second, line);
 
-  wrenPopRoot(vm);
-  wrenPopRoot(vm);
+  AllocationCount* entry = &table->entries[index];
+  entry->key = key;
+  entry->line = line;
+  entry->name = (char*)trackingReallocate(vm, NULL, strlen(name) + 1);
+  strcpy(entry->name, name);
+  table->count++;
 
-  return classObj;
+  return (int)index;
 }
 
-void wrenBindMethod(WrenVM* vm, ObjClass* classObj, int symbol, Method method)
+// Counts an allocation of [size] bytes against the innermost line of Wren
+// code outside the core module that's running.
+static void trackAllocation(WrenVM* vm, size_t size)
 {
-  // Make sure the buffer is big enough to contain the symbol's index.
-  if (symbol >= classObj->methods.count)
+  AllocationStats* stats = vm->allocationStats;
+  int site = -1;
+
+  if (vm->compiler != NULL)
   {
-    Method noMethod;
-    noMethod.type = METHOD_NONE;
-    wrenMethodBufferFill(vm, &classObj->methods, noMethod,
-                         symbol - classObj->methods.count + 1);
+    site = findAllocationCount(vm, &stats->sites, "compiler", 0, "%s%s",
+                               "(compiler)", "");
   }
 
-  classObj->methods.data[symbol] = method;
-}
+  for (ObjFiber* fiber = vm->fiber; fiber != NULL && site < 0;
+       fiber = fiber->caller)
+  {
+    for (int i = fiber->numFrames - 1; i >= 0; i--)
+    {
+      ObjFn* fn = fiber->frames[i].closure->fn;
+      if (fn->module == NULL || fn->module->name == NULL) continue;
 
-ObjClosure* wrenNewClosure(WrenVM* vm, ObjFn* fn)
-{
-  ObjClosure* closure = ALLOCATE_FLEX(vm, ObjClosure,
-                                      ObjUpvalue*, fn->numUpvalues);
-  initObj(vm, &closure->obj, OBJ_CLOSURE, vm->fnClass);
+      // Constructor stubs have no name, the object belongs to their caller.
+      if (fn->debug->name[0] == '\0') continue;
 
-  closure->fn = fn;
+      // The instruction that's running, see wrenGetStackFrames().
+      int offset = (int)(fiber->frames[i].ip - fn->code.data) - 1;
+      if (offset < 0) offset = 0;
 
-  // Clear the upvalue array. We need to do this in case a GC is triggered
-  // after the closure is created but before the upvalue array is populated.
-  for (int i = 0; i < fn->numUpvalues; i++) closure->upvalues[i] = NULL;
+      site = findAllocationCount(vm, &stats->sites, fn,
+                                 fn->debug->sourceLines.data[offset],
+                                 "%s (%s:%d)", fn->debug->name,
+                                 fn->module->name->value);
+      break;
+    }
+  }
 
-  return closure;
+  if (site < 0)
+  {
+    site = findAllocationCount(vm, &stats->sites, "host", 0, "%s%s",
+                               "(host)", "");
+  }
+
+  stats->sites.entries[site].allocations++;
+  stats->sites.entries[site].bytes += size;
+  stats->lastSite = site;
+  stats->lastSize = size;
 }
 
-ObjFiber* wrenNewFiber(WrenVM* vm, ObjClosure* closure)
+void wrenTrackObject(WrenVM* vm, Obj* obj)
 {
-  // Allocate the arrays before the fiber in case it triggers a GC.
-  CallFrame* frames = ALLOCATE_ARRAY(vm, CallFrame, INITIAL_CALL_FRAMES);
-  
-  // Add one slot for the unused implicit receiver slot that the compiler
-  // assumes all functions have.
-  int stackCapacity = closure == NULL
-      ? 1
-      : wrenPowerOf2Ceil(closure->fn->maxSlots + 1);
-  Value* stack = ALLOCATE_ARRAY(vm, Value, stackCapacity);
-  
-  ObjFiber* fiber = ALLOCATE(vm, ObjFiber);
-  initObj(vm, &fiber->obj, OBJ_FIBER, vm->fiberClass);
-
-  fiber->stack = stack;
-  fiber->stackTop = fiber->stack;
-  fiber->stackCapacity = stackCapacity;
+  // The names of the object types, in the order of ObjType.
+  static const char* typeNames[] = {
+    "Class", "Fn", "Fiber", "Fn (bytecode)", "Foreign", "Instance", "List",
+    "Map", "Module", "Range", "String", "Upvalue"
+  };
 
-  fiber->frames = frames;
-  fiber->frameCapacity = INITIAL_CALL_FRAMES;
-  fiber->numFrames = 0;
+  AllocationStats* stats = vm->allocationStats;
 
-  fiber->openUpvalues = NULL;
-  fiber->caller = NULL;
-  fiber->error = NULL_VAL;
-  fiber->state = FIBER_OTHER;
-  
-  if (closure != NULL)
+  // Instances and foreign objects are counted by class, everything else by
+  // what kind of object it is.
+  const void* key = &typeNames[obj->type];
+  const char* name = typeNames[obj->type];
+  ObjClass* classObj = wrenGetObjClass(vm, obj);
+  if ((obj->type == OBJ_INSTANCE || obj->type == OBJ_FOREIGN) &&
+      classObj != NULL)
   {
-    // Initialize the first call frame.
-    wrenAppendCallFrame(vm, fiber, closure, fiber->stack);
-
-    // The first slot always holds the closure.
-    fiber->stackTop[0] = OBJ_VAL(closure);
-    fiber->stackTop++;
+    key = classObj;
+    name = classObj->name->value;
   }
-  
-  return fiber;
+
+  int type = findAllocationCount(vm, &stats->types, key, 0, "%s%s", name, "");
+  stats->types.entries[type].allocations++;
+  stats->types.entries[type].objects++;
+  stats->types.entries[type].bytes += stats->lastSize;
+
+  if (stats->lastSite >= 0) stats->sites.entries[stats->lastSite].objects++;
+
+  stats->lastSite = -1;
+  stats->lastSize = 0;
 }
 
-void wrenEnsureStack(WrenVM* vm, ObjFiber* fiber, int needed)
+static void freeAllocationTable(WrenVM* vm, AllocationTable* table)
 {
-  if (fiber->stackCapacity >= needed) return;
-  
-  int capacity = wrenPowerOf2Ceil(needed);
-  
-  Value* oldStack = fiber->stack;
-  fiber->stack = (Value*)wrenReallocate(vm, fiber->stack,
-                                        sizeof(Value) * fiber->stackCapacity,
-                                        sizeof(Value) * capacity);
-  fiber->stackCapacity = capacity;
-  
-  // If the reallocation moves the stack, then we need to recalculate every
-  // pointer that points into the old stack to into the same relative distance
-  // in the new stack. We have to be a little careful about how these are
-  // calculated because pointer subtraction is only well-defined within a
-  // single array, hence the slightly redundant-looking arithmetic below.
-  if (fiber->stack != oldStack)
+  for (int i = 0; i < table->capacity; i++)
   {
-    // Top of the stack.
-    if (vm->apiStack >= oldStack && vm->apiStack <= fiber->stackTop)
-    {
-      vm->apiStack = fiber->stack + (vm->apiStack - oldStack);
-    }
-    
-    // Stack pointer for each call frame.
-    for (int i = 0; i < fiber->numFrames; i++)
+    if (table->entries[i].key != NULL)
     {
-      CallFrame* frame = &fiber->frames[i];
-      frame->stackStart = fiber->stack + (frame->stackStart - oldStack);
-    }
-    
-    // Open upvalues.
-    for (ObjUpvalue* upvalue = fiber->openUpvalues;
-         upvalue != NULL;
-         upvalue = upvalue->next)
-    {
-      upvalue->value = fiber->stack + (upvalue->value - oldStack);
+      trackingReallocate(vm, table->entries[i].name, 0);
     }
-    
-    fiber->stackTop = fiber->stack + (fiber->stackTop - oldStack);
   }
-}
-
-ObjForeign* wrenNewForeign(WrenVM* vm, ObjClass* classObj, size_t size)
-{
-  ObjForeign* object = ALLOCATE_FLEX(vm, ObjForeign, uint8_t, size);
-  initObj(vm, &object->obj, OBJ_FOREIGN, classObj);
 
-  // Zero out the bytes.
-  memset(object->data, 0, size);
-  return object;
+  trackingReallocate(vm, table->entries, 0);
 }
 
-ObjFn* wrenNewFunction(WrenVM* vm, ObjModule* module, int maxSlots)
+void wrenFreeVM(WrenVM* vm)
 {
-  FnDebug* debug = ALLOCATE(vm, FnDebug);
-  debug->name = NULL;
-  wrenIntBufferInit(&debug->sourceLines);
-
-  ObjFn* fn = ALLOCATE(vm, ObjFn);
-  initObj(vm, &fn->obj, OBJ_FN, vm->fnClass);
-  
-  wrenValueBufferInit(&fn->constants);
-  wrenByteBufferInit(&fn->code);
-  fn->module = module;
-  fn->maxSlots = maxSlots;
-  fn->numUpvalues = 0;
-  fn->arity = 0;
-  fn->debug = debug;
+  ASSERT(vm->methodNames.count > 0, "VM appears to have already been freed.");
   
-  return fn;
-}
+  // Free all of the GC objects.
+  Obj* obj = vm->first;
+  while (obj != NULL)
+  {
+    Obj* next = obj->next;
+    wrenFreeObj(vm, obj);
+    obj = next;
+  }
 
-void wrenFunctionBindName(WrenVM* vm, ObjFn* fn, const char* name, int length)
-{
-  fn->debug->name = ALLOCATE_ARRAY(vm, char, length + 1);
-  memcpy(fn->debug->name, name, length);
-  fn->debug->name[length] = '\0';
-}
+  // Free up the GC gray set.
+  vm->gray = (Obj**)vm->config.reallocateFn(vm->gray, 0, vm->config.userData);
 
-Value wrenNewInstance(WrenVM* vm, ObjClass* classObj)
-{
-  ObjInstance* instance = ALLOCATE_FLEX(vm, ObjInstance,
-                                        Value, classObj->numFields);
-  initObj(vm, &instance->obj, OBJ_INSTANCE, classObj);
+  vm->config.reallocateFn(vm->classes, 0, vm->config.userData);
+  vm->config.reallocateFn(vm->freeClassIds, 0, vm->config.userData);
 
-  // Initialize fields to null.
-  for (int i = 0; i < classObj->numFields; i++)
+  if (vm->remembered != NULL)
   {
-    instance->fields[i] = NULL_VAL;
+    vm->config.reallocateFn(vm->remembered, 0, vm->config.userData);
   }
 
-  return OBJ_VAL(instance);
-}
+  // Tell the user if they didn't free any handles. We don't want to just free
+  // them here because the host app may still have pointers to them that they
+  // may try to use. Better to tell them about the bug early.
+  ASSERT(vm->handles == NULL, "All handles have not been released.");
 
-ObjList* wrenNewList(WrenVM* vm, uint32_t numElements)
-{
-  // Allocate this before the list object in case it triggers a GC which would
-  // free the list.
-  Value* elements = NULL;
-  if (numElements > 0)
+  wrenSymbolTableClear(vm, &vm->methodNames);
+  wrenByteBufferClear(vm, &vm->foreignTypes);
+
+  if (vm->opcodeStats != NULL)
   {
-    elements = ALLOCATE_ARRAY(vm, Value, numElements);
+    vm->config.reallocateFn(vm->opcodeStats, 0, vm->config.userData);
   }
 
-  ObjList* list = ALLOCATE(vm, ObjList);
-  initObj(vm, &list->obj, OBJ_LIST, vm->listClass);
-  list->elements.capacity = numElements;
-  list->elements.count = numElements;
-  list->elements.data = elements;
-  return list;
+  if (vm->allocationStats != NULL)
+  {
+    freeAllocationTable(vm, &vm->allocationStats->sites);
+    freeAllocationTable(vm, &vm->allocationStats->types);
+    trackingReallocate(vm, vm->allocationStats, 0);
+  }
+
+  DEALLOCATE(vm, vm);
 }
 
-void wrenListInsert(WrenVM* vm, ObjList* list, Value value, uint32_t index)
-{
-  if (IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
+// While an incremental collection is in progress, a step runs every time this
+// many bytes have been allocated and marks or sweeps this many objects.
+#define GC_STEP_BYTES (16 * 1024)
+#define GC_STEP_WORK 1000
 
-  // Add a slot at the end of the list.
-  wrenValueBufferWrite(vm, &list->elements, NULL_VAL);
+// Lists and maps with more slots than this are marked this many at a time,
+// each slice counting as one object.
+#define GC_MARK_SLICE 64
 
-  if (IS_OBJ(value)) wrenPopRoot(vm);
+// Grays every root.
+static void grayRoots(WrenVM* vm)
+{
+  wrenGrayObj(vm, (Obj*)vm->modules);
 
-  // Shift the existing elements down.
-  for (uint32_t i = list->elements.count - 1; i > index; i--)
+  // Temporary roots.
+  for (int i = 0; i < vm->numTempRoots; i++)
   {
-    list->elements.data[i] = list->elements.data[i - 1];
+    wrenGrayObj(vm, vm->tempRoots[i]);
   }
 
-  // Store the new element.
-  list->elements.data[index] = value;
-}
+  // The current fiber.
+  wrenGrayObj(vm, (Obj*)vm->fiber);
 
-int wrenListIndexOf(WrenVM* vm, ObjList* list, Value value)
-{
-  int count = list->elements.count;
-  for (int i = 0; i < count; i++)
+  // The handles.
+  for (WrenHandle* handle = vm->handles;
+       handle != NULL;
+       handle = handle->next)
   {
-    Value item = list->elements.data[i];
-    if(wrenValuesEqual(item, value)) {
-      return i;
-    }
+    wrenGrayValue(vm, handle->value);
   }
-  return -1;
+
+  // Any object the compiler is using (if there is one).
+  if (vm->compiler != NULL) wrenMarkCompiler(vm, vm->compiler);
+
+  // Method names.
+  wrenBlackenSymbolTable(vm, &vm->methodNames);
+  vm->markedBytes += vm->methodNames.capacity * sizeof(*vm->methodNames.data);
 }
 
-Value wrenListRemoveAt(WrenVM* vm, ObjList* list, uint32_t index)
+// Called once every reachable object is marked.
+static void finishMarking(WrenVM* vm)
 {
-  Value removed = list->elements.data[index];
-
-  if (IS_OBJ(removed)) wrenPushRoot(vm, AS_OBJ(removed));
+  size_t before = vm->bytesAllocated;
 
-  // Shift items up.
-  for (int i = index; i < list->elements.count - 1; i++)
-  {
-    list->elements.data[i] = list->elements.data[i + 1];
-  }
+  // The marked objects are all that's known to be in use now. Counting them
+  // while marking means we never need the size of a *freed* object, which
+  // isn't always known. For example, when freeing an instance, we need to know
+  // its class to know how big it is, but its class may have already been
+  // freed.
+  vm->bytesAllocated = vm->markedBytes;
 
-  // If we have too much excess capacity, shrink it.
-  if (list->elements.capacity / GROW_FACTOR >= list->elements.count)
-  {
-    list->elements.data = (Value*)wrenReallocate(vm, list->elements.data,
-        sizeof(Value) * list->elements.capacity,
-        sizeof(Value) * (list->elements.capacity / GROW_FACTOR));
-    list->elements.capacity /= GROW_FACTOR;
-  }
+  // Calculate the next gc point, this is the current allocation plus
+  // a configured percentage of the current allocation.
+  vm->nextGC = vm->bytesAllocated + ((vm->bytesAllocated * vm->config.heapGrowthPercent) / 100);
+  if (vm->nextGC < vm->config.minHeapSize) vm->nextGC = vm->config.minHeapSize;
 
-  if (IS_OBJ(removed)) wrenPopRoot(vm);
+  vm->gcCount++;
+  vm->lastFreed = before > vm->bytesAllocated ? before - vm->bytesAllocated : 0;
+  vm->totalFreed += vm->lastFreed;
 
-  list->elements.count--;
-  return removed;
+  vm->gcPhase = GC_SWEEP;
+  vm->sweepLink = &vm->first;
 }
 
-ObjMap* wrenNewMap(WrenVM* vm)
+// Frees up to [work] unmarked objects, or all of them if [work] is negative.
+static void sweep(WrenVM* vm, int work)
 {
-  ObjMap* map = ALLOCATE(vm, ObjMap);
-  initObj(vm, &map->obj, OBJ_MAP, vm->mapClass);
-  map->capacity = 0;
-  map->count = 0;
-  map->entries = NULL;
-  return map;
-}
+  Obj** obj = vm->sweepLink;
+  while (*obj != NULL && work-- != 0)
+  {
+    if (!((*obj)->isDark))
+    {
+      // This object wasn't reached, so remove it from the list and free it.
+      Obj* unreached = *obj;
+      *obj = unreached->next;
+      wrenFreeObj(vm, unreached);
+    }
+    else
+    {
+      // This object was reached, so unmark it (for the next GC) and move on to
+      // the next. Generational collection keeps it marked as old instead.
+      (*obj)->isDark = vm->config.nurserySize > 0;
+      obj = &(*obj)->next;
+    }
+  }
 
-static inline uint32_t hashBits(uint64_t hash)
-{
-  // From v8's ComputeLongHash() which in turn cites:
-  // Thomas Wang, Integer Hash Functions.
-  // http://www.concentric.net/~Ttwang/tech/inthash.htm
-  hash = ~hash + (hash << 18);  // hash = (hash << 18) - hash - 1;
-  hash = hash ^ (hash >> 31);
-  hash = hash * 21;  // hash = (hash + (hash << 2)) + (hash << 4);
-  hash = hash ^ (hash >> 11);
-  hash = hash + (hash << 6);
-  hash = hash ^ (hash >> 22);
-  return (uint32_t)(hash & 0x3fffffff);
+  if (*obj == NULL)
+  {
+    vm->gcPhase = GC_IDLE;
+    vm->sweepLink = NULL;
+  }
+  else
+  {
+    vm->sweepLink = obj;
+  }
 }
 
-// Generates a hash code for [num].
-static inline uint32_t hashNumber(double num)
+// Marks the next slice of [vm->markingObj].
+static void markSlice(WrenVM* vm)
 {
-  // Hash the raw bits of the value.
-  return hashBits(wrenDoubleToBits(num));
-}
+  Obj* obj = vm->markingObj;
+  uint32_t start = vm->markingIndex;
+  uint32_t end = start + GC_MARK_SLICE;
 
-// Generates a hash code for [object].
-static uint32_t hashObject(Obj* object)
-{
-  switch (object->type)
+  if (obj->type == OBJ_LIST)
   {
-    case OBJ_CLASS:
-      // Classes just use their name.
-      return hashObject((Obj*)((ObjClass*)object)->name);
-      
-      // Allow bare (non-closure) functions so that we can use a map to find
-      // existing constants in a function's constant table. This is only used
-      // internally. Since user code never sees a non-closure function, they
-      // cannot use them as map keys.
-    case OBJ_FN:
+    ObjList* list = (ObjList*)obj;
+    if (end > (uint32_t)list->elements.count) end = list->elements.count;
+
+    for (uint32_t i = start; i < end; i++)
     {
-      ObjFn* fn = (ObjFn*)object;
-      return hashNumber(fn->arity) ^ hashNumber(fn->code.count);
+      wrenGrayValue(vm, list->elements.data[i]);
     }
 
-    case OBJ_RANGE:
+    if (end == (uint32_t)list->elements.count) vm->markingObj = NULL;
+  }
+  else
+  {
+    ObjMap* map = (ObjMap*)obj;
+    if (end > map->capacity) end = map->capacity;
+
+    for (uint32_t i = start; i < end; i++)
     {
-      ObjRange* range = (ObjRange*)object;
-      return hashNumber(range->from) ^ hashNumber(range->to);
-    }
+      MapEntry* entry = &map->entries[i];
+      if (IS_UNDEFINED(entry->key)) continue;
 
-    case OBJ_STRING:
-      return ((ObjString*)object)->hash;
+      wrenGrayValue(vm, entry->key);
+      wrenGrayValue(vm, entry->value);
+    }
 
-    default:
-      ASSERT(false, "Only immutable objects can be hashed.");
-      return 0;
+    if (end == map->capacity) vm->markingObj = NULL;
   }
+
+  vm->markingIndex = end;
 }
 
-// Generates a hash code for [value], which must be one of the built-in
-// immutable types: null, bool, class, num, range, or string.
-static uint32_t hashValue(Value value)
+// Marks [obj], unless it's a long list or map. Those are only counted and
+// then marked by [markSlice] so no single step has to go through all of them.
+static void markObject(WrenVM* vm, Obj* obj)
 {
-  // TODO: We'll probably want to randomize this at some point.
-
-#if WREN_NAN_TAGGING
-  if (IS_OBJ(value)) return hashObject(AS_OBJ(value));
+  vm->markedBytes += objectSize(vm, obj, NULL);
 
-  // Hash the raw bits of the unboxed value.
-  return hashBits(value);
-#else
-  switch (value.type)
+  if ((obj->type == OBJ_LIST &&
+       ((ObjList*)obj)->elements.count > GC_MARK_SLICE) ||
+      (obj->type == OBJ_MAP && ((ObjMap*)obj)->capacity > GC_MARK_SLICE))
   {
-    case VAL_FALSE: return 0;
-    case VAL_NULL:  return 1;
-    case VAL_NUM:   return hashNumber(AS_NUM(value));
-    case VAL_TRUE:  return 2;
-    case VAL_OBJ:   return hashObject(AS_OBJ(value));
-    default:        UNREACHABLE();
+    vm->markingObj = obj;
+    vm->markingIndex = 0;
+    return;
   }
-  
-  return 0;
-#endif
+
+  blackenObject(vm, obj);
 }
 
-// Looks for an entry with [key] in an array of [capacity] [entries].
-//
-// If found, sets [result] to point to it and returns `true`. Otherwise,
-// returns `false` and points [result] to the entry where the key/value pair
-// should be inserted.
-static bool findEntry(MapEntry* entries, uint32_t capacity, Value key,
-                      MapEntry** result)
+void wrenFinishMarkingObj(WrenVM* vm, Obj* obj)
 {
-  // If there is no entry array (an empty map), we definitely won't find it.
-  if (capacity == 0) return false;
-  
-  // Figure out where to insert it in the table. Use open addressing and
-  // basic linear probing.
-  uint32_t startIndex = hashValue(key) % capacity;
-  uint32_t index = startIndex;
-  
-  // If we pass a tombstone and don't end up finding the key, its entry will
-  // be re-used for the insert.
-  MapEntry* tombstone = NULL;
-  
-  // Walk the probe sequence until we've tried every slot.
-  do
+  while (vm->markingObj == obj && obj != NULL) markSlice(vm);
+}
+
+// Does up to [work] units of the current incremental collection, starting one
+// if there is none, or all that's left of it if [work] is negative.
+static void advanceCollection(WrenVM* vm, int work)
+{
+  if (vm->gcPhase == GC_IDLE)
   {
-    MapEntry* entry = &entries[index];
-    
-    if (IS_UNDEFINED(entry->key))
+    vm->gcPhase = GC_MARK;
+    vm->markedBytes = 0;
+    grayRoots(vm);
+
+    // Everything else that changes while marking goes through a barrier, but
+    // the running fiber's stack doesn't.
+    if (vm->fiber != NULL) wrenScanFiber(vm, vm->fiber);
+  }
+
+  if (vm->gcPhase == GC_MARK)
+  {
+    while ((vm->markingObj != NULL || vm->grayCount > 0) && work != 0)
     {
-      // If we found an empty slot, the key is not in the table. If we found a
-      // slot that contains a deleted key, we have to keep looking.
-      if (IS_FALSE(entry->value))
+      if (vm->markingObj != NULL)
       {
-        // We found an empty slot, so we've reached the end of the probe
-        // sequence without finding the key. If we passed a tombstone, then
-        // that's where we should insert the item, otherwise, put it here at
-        // the end of the sequence.
-        *result = tombstone != NULL ? tombstone : entry;
-        return false;
+        markSlice(vm);
       }
       else
       {
-        // We found a tombstone. We need to keep looking in case the key is
-        // after it, but we'll use this entry as the insertion point if the
-        // key ends up not being found.
-        if (tombstone == NULL) tombstone = entry;
+        markObject(vm, vm->gray[--vm->grayCount]);
       }
+
+      work--;
     }
-    else if (wrenValuesEqual(entry->key, key))
-    {
-      // We found the key.
-      *result = entry;
-      return true;
-    }
-    
-    // Try the next slot.
-    index = (index + 1) % capacity;
+
+    if (vm->markingObj == NULL && vm->grayCount == 0) finishMarking(vm);
   }
-  while (index != startIndex);
-  
-  // If we get here, the table is full of tombstones. Return the first one we
-  // found.
-  ASSERT(tombstone != NULL, "Map should have tombstones or empty entries.");
-  *result = tombstone;
-  return false;
+
+  if (vm->gcPhase == GC_SWEEP) sweep(vm, work);
 }
 
-// Inserts [key] and [value] in the array of [entries] with the given
-// [capacity].
-//
-// Returns `true` if this is the first time [key] was added to the map.
-static bool insertEntry(MapEntry* entries, uint32_t capacity,
-                        Value key, Value value)
+void wrenRemember(WrenVM* vm, Obj* obj)
 {
-  ASSERT(entries != NULL, "Should ensure capacity before inserting.");
-  
-  MapEntry* entry;
-  if (findEntry(entries, capacity, key, &entry))
-  {
-    // Already present, so just replace the value.
-    entry->value = value;
-    return false;
-  }
-  else
+  if (vm->config.nurserySize == 0 || !obj->isDark || obj->isRemembered) return;
+
+  if (vm->rememberedCount >= vm->rememberedCapacity)
   {
-    entry->key = key;
-    entry->value = value;
-    return true;
+    vm->rememberedCapacity = vm->rememberedCapacity == 0
+        ? 64 : vm->rememberedCapacity * 2;
+    vm->remembered = (Obj**)vm->config.reallocateFn(vm->remembered,
+        vm->rememberedCapacity * sizeof(Obj*), vm->config.userData);
   }
+
+  obj->isRemembered = true;
+  vm->remembered[vm->rememberedCount++] = obj;
 }
 
-// Updates [map]'s entry array to [capacity].
-static void resizeMap(WrenVM* vm, ObjMap* map, uint32_t capacity)
+// Empties the remembered set. The running fiber stays in it, its stack keeps
+// changing until the next collection.
+static void resetRemembered(WrenVM* vm)
 {
-  // Create the new empty hash table.
-  MapEntry* entries = ALLOCATE_ARRAY(vm, MapEntry, capacity);
-  for (uint32_t i = 0; i < capacity; i++)
+  for (int i = 0; i < vm->rememberedCount; i++)
   {
-    entries[i].key = UNDEFINED_VAL;
-    entries[i].value = FALSE_VAL;
+    vm->remembered[i]->isRemembered = false;
   }
 
-  // Re-add the existing entries.
-  if (map->capacity > 0)
+  vm->rememberedCount = 0;
+  if (vm->fiber != NULL) wrenRemember(vm, &vm->fiber->obj);
+}
+
+// Collects the objects allocated since the last collection.
+//
+// Old objects are still marked, so marking stops at them and only reaches
+// young objects, starting from the roots and what the remembered set points
+// at. Only the young part of the object list is swept, and the survivors are
+// left marked, which makes them old.
+static void collectNursery(WrenVM* vm)
+{
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, false);
+
+  if (vm->fiber != NULL) wrenRemember(vm, &vm->fiber->obj);
+
+  for (int i = 0; i < vm->rememberedCount; i++)
   {
-    for (uint32_t i = 0; i < map->capacity; i++)
-    {
-      MapEntry* entry = &map->entries[i];
-      
-      // Don't copy empty entries or tombstones.
-      if (IS_UNDEFINED(entry->key)) continue;
+    Obj* obj = vm->remembered[i];
 
-      insertEntry(entries, capacity, entry->key, entry->value);
+    // Stores through an open upvalue go to the stack of a fiber that may not
+    // be remembered itself.
+    if (obj->type == OBJ_UPVALUE)
+    {
+      wrenGrayValue(vm, *((ObjUpvalue*)obj)->value);
     }
+
+    blackenObject(vm, obj);
   }
 
-  // Replace the array.
-  DEALLOCATE(vm, map->entries);
-  map->entries = entries;
-  map->capacity = capacity;
-}
+  grayRoots(vm);
+  wrenBlackenObjects(vm);
 
-Value wrenMapGet(ObjMap* map, Value key)
-{
-  MapEntry* entry;
-  if (findEntry(map->entries, map->capacity, key, &entry)) return entry->value;
+  // Dead objects are measured before they're freed. An object is always newer
+  // than its class or function, so those are still around at that point.
+  size_t freed = 0;
+  Obj** obj = &vm->first;
+  while (*obj != vm->firstOld)
+  {
+    if (!((*obj)->isDark))
+    {
+      Obj* unreached = *obj;
+      *obj = unreached->next;
+      freed += objectSize(vm, unreached, NULL);
+      wrenFreeObj(vm, unreached);
+    }
+    else
+    {
+      obj = &(*obj)->next;
+    }
+  }
 
-  return UNDEFINED_VAL;
+  vm->firstOld = vm->first;
+  resetRemembered(vm);
+
+  if (freed > vm->bytesAllocated) freed = vm->bytesAllocated;
+  vm->bytesAllocated -= freed;
+  vm->minorCount++;
+  vm->lastFreed = freed;
+  vm->totalFreed += freed;
+  vm->gcDebt = 0;
+
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, true);
 }
 
-void wrenMapSet(WrenVM* vm, ObjMap* map, Value key, Value value)
+void wrenScanFiber(WrenVM* vm, ObjFiber* fiber)
 {
-  // If the map is getting too full, make room first.
-  if (map->count + 1 > map->capacity * MAP_LOAD_PERCENT / 100)
+  if (vm->gcPhase == GC_IDLE)
   {
-    // Figure out the new hash table size.
-    uint32_t capacity = map->capacity * GROW_FACTOR;
-    if (capacity < MIN_CAPACITY) capacity = MIN_CAPACITY;
-
-    resizeMap(vm, map, capacity);
+    wrenRemember(vm, &fiber->obj);
+    return;
   }
 
-  if (insertEntry(map->entries, map->capacity, key, value))
-  {
-    // A new key was added.
-    map->count++;
-  }
-}
+  if (vm->gcPhase != GC_MARK || fiber->scanned == vm->gcCount + 1) return;
 
-void wrenMapClear(WrenVM* vm, ObjMap* map)
-{
-  DEALLOCATE(vm, map->entries);
-  map->entries = NULL;
-  map->capacity = 0;
-  map->count = 0;
+  // A fiber that's still gray is counted when it's taken off the gray stack.
+  if (!fiber->obj.isDark) vm->markedBytes += objectSize(vm, &fiber->obj, NULL);
+  fiber->obj.isDark = true;
+  blackenFiber(vm, fiber);
 }
 
-Value wrenMapRemoveKey(WrenVM* vm, ObjMap* map, Value key)
+void wrenCollectGarbage(WrenVM* vm)
 {
-  MapEntry* entry;
-  if (!findEntry(map->entries, map->capacity, key, &entry)) return NULL_VAL;
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, false);
 
-  // Remove the entry from the map. Set this value to true, which marks it as a
-  // deleted slot. When searching for a key, we will stop on empty slots, but
-  // continue past deleted slots.
-  Value value = entry->value;
-  entry->key = UNDEFINED_VAL;
-  entry->value = TRUE_VAL;
+  // Objects marked by an unfinished incremental collection would look live,
+  // so that one has to be finished first.
+  if (vm->gcPhase != GC_IDLE) advanceCollection(vm, -1);
 
-  if (IS_OBJ(value)) wrenPushRoot(vm, AS_OBJ(value));
+#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
+  printf("-- gc --\n");
 
-  map->count--;
+  size_t before = vm->bytesAllocated;
+  double startTime = (double)clock() / CLOCKS_PER_SEC;
+#endif
 
-  if (map->count == 0)
+  // Old objects are left marked by generational collection, so a full one
+  // starts by clearing them.
+  if (vm->config.nurserySize > 0)
   {
-    // Removed the last item, so free the array.
-    wrenMapClear(vm, map);
+    for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
+    {
+      obj->isDark = false;
+      obj->isRemembered = false;
+    }
+
+    vm->rememberedCount = 0;
   }
-  else if (map->capacity > MIN_CAPACITY &&
-           map->count < map->capacity / GROW_FACTOR * MAP_LOAD_PERCENT / 100)
-  {
-    uint32_t capacity = map->capacity / GROW_FACTOR;
-    if (capacity < MIN_CAPACITY) capacity = MIN_CAPACITY;
 
-    // The map is getting empty, so shrink the entry array back down.
-    // TODO: Should we do this less aggressively than we grow?
-    resizeMap(vm, map, capacity);
+  // Mark all reachable objects.
+  vm->markedBytes = 0;
+  grayRoots(vm);
+
+  // Now that we have grayed the roots, do a depth-first search over all of the
+  // reachable objects.
+  if (!wrenBlackenObjectsInParallel(vm)) wrenBlackenObjects(vm);
+  finishMarking(vm);
+
+  // Collect the white objects.
+  sweep(vm, -1);
+
+  if (vm->config.nurserySize > 0)
+  {
+    vm->firstOld = vm->first;
+    resetRemembered(vm);
+    vm->gcDebt = 0;
   }
 
-  if (IS_OBJ(value)) wrenPopRoot(vm);
-  return value;
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, true);
+
+#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
+  double elapsed = ((double)clock() / CLOCKS_PER_SEC) - startTime;
+  // Explicit cast because size_t has different sizes on 32-bit and 64-bit and
+  // we need a consistent type for the format string.
+  printf("GC %lu before, %lu after (%lu collected), next at %lu. Took %.3fms.\n",
+         (unsigned long)before,
+         (unsigned long)vm->bytesAllocated,
+         (unsigned long)(before - vm->bytesAllocated),
+         (unsigned long)vm->nextGC,
+         elapsed*1000.0);
+#endif
 }
 
-ObjModule* wrenNewModule(WrenVM* vm, ObjString* name)
+bool wrenCollectGarbageStep(WrenVM* vm, int work)
 {
-  ObjModule* module = ALLOCATE(vm, ObjModule);
-
-  // Modules are never used as first-class objects, so don't need a class.
-  initObj(vm, (Obj*)module, OBJ_MODULE, NULL);
-
-  wrenPushRoot(vm, (Obj*)module);
+  if (vm->config.nurserySize > 0)
+  {
+    if (vm->gcDebt >= vm->config.nurserySize / 2) collectNursery(vm);
+    return false;
+  }
 
-  wrenSymbolTableInit(&module->variableNames);
-  wrenValueBufferInit(&module->variables);
+  if (vm->gcPhase == GC_IDLE && vm->bytesAllocated < vm->nextGC / 2)
+  {
+    return false;
+  }
 
-  module->name = name;
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, false);
+  vm->gcDebt = 0;
+  advanceCollection(vm, work);
+  if (vm->config.gcFn != NULL) vm->config.gcFn(vm, true);
 
-  wrenPopRoot(vm);
-  return module;
+  return vm->gcPhase != GC_IDLE;
 }
 
-Value wrenNewRange(WrenVM* vm, double from, double to, bool isInclusive)
+void wrenGetGCStats(WrenVM* vm, WrenGCStats* stats)
 {
-  ObjRange* range = ALLOCATE(vm, ObjRange);
-  initObj(vm, &range->obj, OBJ_RANGE, vm->rangeClass);
-  range->from = from;
-  range->to = to;
-  range->isInclusive = isInclusive;
-
-  return OBJ_VAL(range);
+  stats->collections = vm->gcCount;
+  stats->bytesAllocated = vm->bytesAllocated;
+  stats->nextGC = vm->nextGC;
+  stats->lastFreed = vm->lastFreed;
+  stats->totalFreed = vm->totalFreed;
+  stats->externalBytes = vm->externalBytes;
+  stats->methodTableBytes = 0;
+  for (uint32_t i = 1; i < vm->classCount; i++)
+  {
+    if (vm->classes[i] == NULL) continue;
+    stats->methodTableBytes +=
+        vm->classes[i]->methods.capacity * sizeof(MethodEntry);
+  }
+  stats->classIds = vm->classCount - 1;
+  stats->incremental = vm->config.incrementalGC;
+  stats->minorCollections = vm->minorCount;
+  stats->nurserySize = vm->config.nurserySize;
+  stats->markThreads = WREN_PARALLEL_MARK && vm->config.parallelFn != NULL &&
+                       vm->config.markThreads > 1
+                       ? vm->config.markThreads : 1;
 }
 
-// Creates a new string object with a null-terminated buffer large enough to
-// hold a string of [length] but does not fill in the bytes.
-//
-// The caller is expected to fill in the buffer and then calculate the string's
-// hash.
-static ObjString* allocateString(WrenVM* vm, size_t length)
+typedef struct
 {
-  ObjString* string = ALLOCATE_FLEX(vm, ObjString, char, length + 1);
-  initObj(vm, &string->obj, OBJ_STRING, vm->stringClass);
-  string->length = (int)length;
-  string->value[length] = '\0';
+  WrenVM* vm;
+  WrenSnapshotFn write;
+  void* userData;
 
-  return string;
-}
+  // The references of the object being written.
+  bool firstReference;
+} Snapshot;
 
-// Calculates and stores the hash code for [string].
-static void hashString(ObjString* string)
+static void snapshotPrintf(Snapshot* snapshot, const char* format, ...)
 {
-  // FNV-1a hash. See: http://www.isthe.com/chongo/tech/comp/fnv/
-  uint32_t hash = 2166136261u;
+  char text[256];
 
-  // This is O(n) on the length of the string, but we only call this when a new
-  // string is created. Since the creation is also O(n) (to copy/initialize all
-  // the bytes), we allow this here.
-  for (uint32_t i = 0; i < string->length; i++)
-  {
-    hash ^= string->value[i];
-    hash *= 16777619;
-  }
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
 
-  string->hash = hash;
+  if (length >= (int)sizeof(text)) length = (int)sizeof(text) - 1;
+  if (length > 0) snapshot->write(snapshot->userData, text, (size_t)length);
 }
 
-Value wrenNewString(WrenVM* vm, const char* text)
+static void snapshotReference(Snapshot* snapshot, Obj* obj)
 {
-  return wrenNewStringLength(vm, text, strlen(text));
+  if (obj == NULL) return;
+
+  snapshotPrintf(snapshot, snapshot->firstReference ? "%p" : ",%p", (void*)obj);
+  snapshot->firstReference = false;
 }
 
-Value wrenNewStringLength(WrenVM* vm, const char* text, size_t length)
+static void snapshotValue(Snapshot* snapshot, Value value)
 {
-  // Allow NULL if the string is empty since byte buffers don't allocate any
-  // characters for a zero-length string.
-  ASSERT(length == 0 || text != NULL, "Unexpected NULL string.");
-  
-  ObjString* string = allocateString(vm, length);
-  
-  // Copy the string (if given one).
-  if (length > 0 && text != NULL) memcpy(string->value, text, length);
-  
-  hashString(string);
-  return OBJ_VAL(string);
+  if (IS_OBJ(value)) snapshotReference(snapshot, AS_OBJ(value));
 }
 
-
-Value wrenNewStringFromRange(WrenVM* vm, ObjString* source, int start,
-                             uint32_t count, int step)
+// Writes the references of [obj], mirroring what blackenObject() marks.
+static void snapshotReferences(Snapshot* snapshot, Obj* obj)
 {
-  uint8_t* from = (uint8_t*)source->value;
-  int length = 0;
-  for (uint32_t i = 0; i < count; i++)
-  {
-    length += wrenUtf8DecodeNumBytes(from[start + i * step]);
-  }
+  snapshot->firstReference = true;
 
-  ObjString* result = allocateString(vm, length);
-  result->value[length] = '\0';
+  snapshotReference(snapshot, (Obj*)wrenGetObjClass(snapshot->vm, obj));
 
-  uint8_t* to = (uint8_t*)result->value;
-  for (uint32_t i = 0; i < count; i++)
+  switch (obj->type)
   {
-    int index = start + i * step;
-    int codePoint = wrenUtf8Decode(from + index, source->length - index);
-
-    if (codePoint != -1)
+    case OBJ_CLASS:
     {
-      to += wrenUtf8Encode(codePoint, to);
+      ObjClass* classObj = (ObjClass*)obj;
+      snapshotReference(snapshot, (Obj*)classObj->superclass);
+      for (int i = 0; i < classObj->methods.capacity; i++)
+      {
+        MethodEntry* entry = &classObj->methods.entries[i];
+        if (entry->symbol != -1 && wrenIsClosureMethod(&entry->method))
+        {
+          snapshotReference(snapshot, (Obj*)entry->method.as.closure);
+        }
+      }
+      snapshotReference(snapshot, (Obj*)classObj->name);
+      snapshotValue(snapshot, classObj->attributes);
+      break;
     }
-  }
-
-  hashString(result);
-  return OBJ_VAL(result);
-}
 
-Value wrenNumToString(WrenVM* vm, double value)
-{
-  // Edge case: If the value is NaN or infinity, different versions of libc
-  // produce different outputs (some will format it signed and some won't). To
-  // get reliable output, handle it ourselves.
-  if (isnan(value)) return CONST_STRING(vm, "nan");
-  if (isinf(value))
-  {
-    if (value > 0.0)
+    case OBJ_CLOSURE:
     {
-      return CONST_STRING(vm, "infinity");
+      ObjClosure* closure = (ObjClosure*)obj;
+      snapshotReference(snapshot, (Obj*)closure->fn);
+      for (int i = 0; i < closure->fn->numUpvalues; i++)
+      {
+        snapshotReference(snapshot, (Obj*)closure->upvalues[i]);
+      }
+      break;
     }
-    else
+
+    case OBJ_FIBER:
     {
-      return CONST_STRING(vm, "-infinity");
+      ObjFiber* fiber = (ObjFiber*)obj;
+      for (int i = 0; i < fiber->numFrames; i++)
+      {
+        snapshotReference(snapshot, (Obj*)fiber->frames[i].closure);
+      }
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
+      {
+        snapshotValue(snapshot, *slot);
+      }
+      for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+           upvalue = upvalue->next)
+      {
+        snapshotReference(snapshot, (Obj*)upvalue);
+      }
+      snapshotReference(snapshot, (Obj*)fiber->caller);
+      snapshotValue(snapshot, fiber->error);
+      break;
     }
-  }
-
-  // This is large enough to hold any double converted to a string using
-  // "%.14g". Example:
-  //
-  //     -1.12345678901234e-1022
-  //
-  // So we have:
-  //
-  // + 1 char for sign
-  // + 1 char for digit
-  // + 1 char for "."
-  // + 14 chars for decimal digits
-  // + 1 char for "e"
-  // + 1 char for "-" or "+"
-  // + 4 chars for exponent
-  // + 1 char for "\0"
-  // = 24
-  char buffer[24];
-  int length = sprintf(buffer, "%.14g", value);
-  return wrenNewStringLength(vm, buffer, length);
-}
-
-Value wrenStringFromCodePoint(WrenVM* vm, int value)
-{
-  int length = wrenUtf8EncodeNumBytes(value);
-  ASSERT(length != 0, "Value out of range.");
-
-  ObjString* string = allocateString(vm, length);
-
-  wrenUtf8Encode(value, (uint8_t*)string->value);
-  hashString(string);
 
-  return OBJ_VAL(string);
-}
-
-Value wrenStringFromByte(WrenVM *vm, uint8_t value)
-{
-  int length = 1;
-  ObjString* string = allocateString(vm, length);
-  string->value[0] = value;
-  hashString(string);
-  return OBJ_VAL(string);
-}
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)obj;
+      for (int i = 0; i < fn->constants.count; i++)
+      {
+        snapshotValue(snapshot, fn->constants.data[i]);
+      }
+      break;
+    }
 
-Value wrenStringFormat(WrenVM* vm, const char* format, ...)
-{
-  va_list argList;
+    case OBJ_INSTANCE:
+    {
+      ObjInstance* instance = (ObjInstance*)obj;
+      for (int i = 0; i < wrenGetObjClass(snapshot->vm, obj)->numFields; i++)
+      {
+        snapshotValue(snapshot, instance->fields[i]);
+      }
+      break;
+    }
 
-  // Calculate the length of the result string. Do this up front so we can
-  // create the final string with a single allocation.
-  va_start(argList, format);
-  size_t totalLength = 0;
-  for (const char* c = format; *c != '\0'; c++)
-  {
-    switch (*c)
+    case OBJ_LIST:
     {
-      case '$':
-        totalLength += strlen(va_arg(argList, const char*));
-        break;
+      ObjList* list = (ObjList*)obj;
+      for (int i = 0; i < list->elements.count; i++)
+      {
+        snapshotValue(snapshot, list->elements.data[i]);
+      }
+      break;
+    }
 
-      case '@':
-        totalLength += AS_STRING(va_arg(argList, Value))->length;
-        break;
+    case OBJ_MAP:
+    {
+      ObjMap* map = (ObjMap*)obj;
+      for (uint32_t i = 0; i < map->capacity; i++)
+      {
+        MapEntry* entry = &map->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
 
-      default:
-        // Any other character is interpreted literally.
-        totalLength++;
+        snapshotValue(snapshot, entry->key);
+        snapshotValue(snapshot, entry->value);
+      }
+      break;
     }
-  }
-  va_end(argList);
-
-  // Concatenate the string.
-  ObjString* result = allocateString(vm, totalLength);
 
-  va_start(argList, format);
-  char* start = result->value;
-  for (const char* c = format; *c != '\0'; c++)
-  {
-    switch (*c)
+    case OBJ_MODULE:
     {
-      case '$':
+      ObjModule* module = (ObjModule*)obj;
+      for (int i = 0; i < module->variables.count; i++)
       {
-        const char* string = va_arg(argList, const char*);
-        size_t length = strlen(string);
-        memcpy(start, string, length);
-        start += length;
-        break;
+        snapshotValue(snapshot, module->variables.data[i]);
       }
-
-      case '@':
+      for (int i = 0; i < module->variableNames.count; i++)
       {
-        ObjString* string = AS_STRING(va_arg(argList, Value));
-        memcpy(start, string->value, string->length);
-        start += string->length;
-        break;
+        snapshotReference(snapshot, (Obj*)module->variableNames.data[i]);
       }
-
-      default:
-        // Any other character is interpreted literally.
-        *start++ = *c;
+      snapshotReference(snapshot, (Obj*)module->name);
+      break;
     }
-  }
-  va_end(argList);
 
-  hashString(result);
+    case OBJ_UPVALUE:
+      snapshotValue(snapshot, ((ObjUpvalue*)obj)->closed);
+      break;
 
-  return OBJ_VAL(result);
+    case OBJ_FOREIGN:
+    case OBJ_RANGE:
+    case OBJ_STRING:
+      break;
+  }
 }
 
-Value wrenStringCodePointAt(WrenVM* vm, ObjString* string, uint32_t index)
+// Writes [text] as a label, cut short and without the characters that
+// separate fields and records.
+static void snapshotLabel(Snapshot* snapshot, const char* text, int length)
 {
-  ASSERT(index < string->length, "Index out of bounds.");
+  char label[64];
+  int count = 0;
 
-  int codePoint = wrenUtf8Decode((uint8_t*)string->value + index,
-                                 string->length - index);
-  if (codePoint == -1)
+  for (int i = 0; i < length && count < (int)sizeof(label) - 1; i++)
   {
-    // If it isn't a valid UTF-8 sequence, treat it as a single raw byte.
-    char bytes[2];
-    bytes[0] = string->value[index];
-    bytes[1] = '\0';
-    return wrenNewStringLength(vm, bytes, 1);
+    label[count++] = (unsigned char)text[i] < 0x20 ? ' ' : text[i];
   }
 
-  return wrenStringFromCodePoint(vm, codePoint);
+  snapshot->write(snapshot->userData, label, (size_t)count);
 }
 
-// Uses the Boyer-Moore-Horspool string matching algorithm.
-uint32_t wrenStringFind(ObjString* haystack, ObjString* needle, uint32_t start)
+void wrenWriteHeapSnapshot(WrenVM* vm, WrenSnapshotFn write, void* userData,
+                           WrenForeignSizeFn foreignSize)
 {
-  // Edge case: An empty needle is always found.
-  if (needle->length == 0) return start;
-
-  // If the needle goes past the haystack it won't be found.
-  if (start + needle->length > haystack->length) return UINT32_MAX;
-
-  // If the startIndex is too far it also won't be found.
-  if (start >= haystack->length) return UINT32_MAX;
+  // Only what's still reachable is interesting.
+  wrenCollectGarbage(vm);
 
-  // Pre-calculate the shift table. For each character (8-bit value), we
-  // determine how far the search window can be advanced if that character is
-  // the last character in the haystack where we are searching for the needle
-  // and the needle doesn't match there.
-  uint32_t shift[UINT8_MAX];
-  uint32_t needleEnd = needle->length - 1;
+  // The names of the object types, in the order of ObjType.
+  static const char* typeNames[] = {
+    "class", "closure", "fiber", "fn", "foreign", "instance", "list", "map",
+    "module", "range", "string", "upvalue"
+  };
 
-  // By default, we assume the character is not the needle at all. In that case
-  // case, if a match fails on that character, we can advance one whole needle
-  // width since.
-  for (uint32_t index = 0; index < UINT8_MAX; index++)
-  {
-    shift[index] = needle->length;
-  }
+  Snapshot snapshot;
+  snapshot.vm = vm;
+  snapshot.write = write;
+  snapshot.userData = userData;
 
-  // Then, for every character in the needle, determine how far it is from the
-  // end. If a match fails on that character, we can advance the window such
-  // that it the last character in it lines up with the last place we could
-  // find it in the needle.
-  for (uint32_t index = 0; index < needleEnd; index++)
+  for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
   {
-    char c = needle->value[index];
-    shift[(uint8_t)c] = needleEnd - index;
-  }
+    ObjClass* classObj = wrenGetObjClass(vm, obj);
+    snapshotPrintf(&snapshot, "o\t%p\t%s\t%s\t%lu\t", (void*)obj,
+                   typeNames[obj->type],
+                   classObj != NULL ? classObj->name->value : "-",
+                   (unsigned long)objectSize(vm, obj, foreignSize));
 
-  // Slide the needle across the haystack, looking for the first match or
-  // stopping if the needle goes off the end.
-  char lastChar = needle->value[needleEnd];
-  uint32_t range = haystack->length - needle->length;
+    snapshotReferences(&snapshot, obj);
+    write(userData, "\t", 1);
 
-  for (uint32_t index = start; index <= range; )
-  {
-    // Compare the last character in the haystack's window to the last character
-    // in the needle. If it matches, see if the whole needle matches.
-    char c = haystack->value[index + needleEnd];
-    if (lastChar == c &&
-        memcmp(haystack->value + index, needle->value, needleEnd) == 0)
+    switch (obj->type)
     {
-      // Found a match.
-      return index;
-    }
-
-    // Otherwise, slide the needle forward.
-    index += shift[(uint8_t)c];
-  }
+      case OBJ_CLASS:
+      {
+        ObjString* name = ((ObjClass*)obj)->name;
+        snapshotLabel(&snapshot, name->value, name->length);
+        break;
+      }
 
-  // Not found.
-  return UINT32_MAX;
-}
+      case OBJ_CLOSURE:
+      case OBJ_FN:
+      {
+        ObjFn* fn = obj->type == OBJ_FN ? (ObjFn*)obj : ((ObjClosure*)obj)->fn;
+        const char* name = fn->debug->name;
+        if (name != NULL) snapshotLabel(&snapshot, name, (int)strlen(name));
+        break;
+      }
 
-ObjUpvalue* wrenNewUpvalue(WrenVM* vm, Value* value)
-{
-  ObjUpvalue* upvalue = ALLOCATE(vm, ObjUpvalue);
+      case OBJ_MODULE:
+      {
+        ObjString* name = ((ObjModule*)obj)->name;
+        if (name != NULL) snapshotLabel(&snapshot, name->value, name->length);
+        break;
+      }
 
-  // Upvalues are never used as first-class objects, so don't need a class.
-  initObj(vm, &upvalue->obj, OBJ_UPVALUE, NULL);
+      case OBJ_STRING:
+      {
+        ObjString* string = (ObjString*)obj;
+        snapshotLabel(&snapshot, string->value, string->length);
+        break;
+      }
 
-  upvalue->value = value;
-  upvalue->closed = NULL_VAL;
-  upvalue->next = NULL;
-  return upvalue;
-}
+      default:
+        break;
+    }
 
-void wrenGrayObj(WrenVM* vm, Obj* obj)
-{
-  if (obj == NULL) return;
+    write(userData, "\n", 1);
 
-  // Stop if the object is already darkened so we don't get stuck in a cycle.
-  if (obj->isDark) return;
+    if (obj->type == OBJ_CLASS)
+    {
+      MethodTable* methods = &((ObjClass*)obj)->methods;
+      snapshotPrintf(&snapshot, "m\t%p\t%d\t%lu\n", (void*)obj,
+                     methods->count,
+                     (unsigned long)(methods->capacity * sizeof(MethodEntry)));
+    }
+  }
 
-  // It's been reached.
-  obj->isDark = true;
+  // The roots, as marked by wrenCollectGarbage().
+  snapshotPrintf(&snapshot, "r\tmodules\t%p\n", (void*)vm->modules);
 
-  // Add it to the gray list so it can be recursively explored for
-  // more marks later.
-  if (vm->grayCount >= vm->grayCapacity)
+  for (int i = 0; i < vm->numTempRoots; i++)
   {
-    vm->grayCapacity = vm->grayCount * 2;
-    vm->gray = (Obj**)vm->config.reallocateFn(vm->gray,
-                                              vm->grayCapacity * sizeof(Obj*),
-                                              vm->config.userData);
+    snapshotPrintf(&snapshot, "r\ttemp\t%p\n", (void*)vm->tempRoots[i]);
   }
 
-  vm->gray[vm->grayCount++] = obj;
-}
-
-void wrenGrayValue(WrenVM* vm, Value value)
-{
-  if (!IS_OBJ(value)) return;
-  wrenGrayObj(vm, AS_OBJ(value));
-}
-
-void wrenGrayBuffer(WrenVM* vm, ValueBuffer* buffer)
-{
-  for (int i = 0; i < buffer->count; i++)
+  if (vm->fiber != NULL)
   {
-    wrenGrayValue(vm, buffer->data[i]);
+    snapshotPrintf(&snapshot, "r\tfiber\t%p\n", (void*)vm->fiber);
   }
-}
 
-static void blackenClass(WrenVM* vm, ObjClass* classObj)
-{
-  // The metaclass.
-  wrenGrayObj(vm, (Obj*)classObj->obj.classObj);
-
-  // The superclass.
-  wrenGrayObj(vm, (Obj*)classObj->superclass);
-
-  // Method function objects.
-  for (int i = 0; i < classObj->methods.count; i++)
+  for (WrenHandle* handle = vm->handles; handle != NULL; handle = handle->next)
   {
-    if (classObj->methods.data[i].type == METHOD_BLOCK)
+    if (IS_OBJ(handle->value))
     {
-      wrenGrayObj(vm, (Obj*)classObj->methods.data[i].as.closure);
+      snapshotPrintf(&snapshot, "r\thandle\t%p\n", (void*)AS_OBJ(handle->value));
     }
   }
 
-  wrenGrayObj(vm, (Obj*)classObj->name);
-
-  if(!IS_NULL(classObj->attributes)) wrenGrayObj(vm, AS_OBJ(classObj->attributes));
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjClass);
-  vm->bytesAllocated += classObj->methods.capacity * sizeof(Method);
+  for (int i = 0; i < vm->methodNames.count; i++)
+  {
+    snapshotPrintf(&snapshot, "r\tmethod name\t%p\n",
+                   (void*)vm->methodNames.data[i]);
+  }
 }
 
-static void blackenClosure(WrenVM* vm, ObjClosure* closure)
+void* wrenReallocate(WrenVM* vm, void* memory, size_t oldSize, size_t newSize)
 {
-  // Mark the function.
-  wrenGrayObj(vm, (Obj*)closure->fn);
+#if WREN_DEBUG_TRACE_MEMORY
+  // Explicit cast because size_t has different sizes on 32-bit and 64-bit and
+  // we need a consistent type for the format string.
+  printf("reallocate %p %lu -> %lu\n",
+         memory, (unsigned long)oldSize, (unsigned long)newSize);
+#endif
 
-  // Mark the upvalues.
-  for (int i = 0; i < closure->fn->numUpvalues; i++)
+  // If new bytes are being allocated, add them to the total count. If objects
+  // are being completely deallocated, we don't track that (since we don't
+  // track the original size). Instead, that will be handled while marking
+  // during the next GC.
+  vm->bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize)
   {
-    wrenGrayObj(vm, (Obj*)closure->upvalues[i]);
-  }
+    // Anything allocated while marking survives the collection.
+    if (vm->gcPhase == GC_MARK) vm->markedBytes += newSize - oldSize;
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjClosure);
-  vm->bytesAllocated += sizeof(ObjUpvalue*) * closure->fn->numUpvalues;
-}
+    vm->gcDebt += newSize - oldSize;
+  }
 
-static void blackenFiber(WrenVM* vm, ObjFiber* fiber)
-{
-  // Stack functions.
-  for (int i = 0; i < fiber->numFrames; i++)
+  if (vm->trackAllocations && newSize > oldSize)
   {
-    wrenGrayObj(vm, (Obj*)fiber->frames[i].closure);
+    trackAllocation(vm, newSize - oldSize);
   }
 
-  // Stack variables.
-  for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
+#if WREN_DEBUG_GC_STRESS
+  // Since collecting calls this function to free things, make sure we don't
+  // recurse.
+  if (newSize > 0) wrenCollectGarbage(vm);
+#else
+  if (newSize > 0 && vm->gcPhase != GC_IDLE)
   {
-    wrenGrayValue(vm, *slot);
+    // If the program allocates faster than the steps keep up with, finish the
+    // collection now rather than let the heap grow without bound.
+    if (vm->bytesAllocated > vm->nextGC * 2)
+    {
+      wrenCollectGarbageStep(vm, -1);
+    }
+    else if (vm->gcDebt >= GC_STEP_BYTES)
+    {
+      wrenCollectGarbageStep(vm, GC_STEP_WORK);
+    }
+  }
+  else if (newSize > 0 && vm->bytesAllocated > vm->nextGC)
+  {
+    if (vm->config.incrementalGC)
+    {
+      wrenCollectGarbageStep(vm, GC_STEP_WORK);
+    }
+    else
+    {
+      wrenCollectGarbage(vm);
+    }
   }
-
-  // Open upvalues.
-  ObjUpvalue* upvalue = fiber->openUpvalues;
-  while (upvalue != NULL)
+  else if (newSize > 0 && vm->config.nurserySize > 0 &&
+           vm->gcDebt > vm->config.nurserySize)
   {
-    wrenGrayObj(vm, (Obj*)upvalue);
-    upvalue = upvalue->next;
+    collectNursery(vm);
   }
+#endif
 
-  // The caller.
-  wrenGrayObj(vm, (Obj*)fiber->caller);
-  wrenGrayValue(vm, fiber->error);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjFiber);
-  vm->bytesAllocated += fiber->frameCapacity * sizeof(CallFrame);
-  vm->bytesAllocated += fiber->stackCapacity * sizeof(Value);
-}
-
-static void blackenFn(WrenVM* vm, ObjFn* fn)
-{
-  // Mark the constants.
-  wrenGrayBuffer(vm, &fn->constants);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjFn);
-  vm->bytesAllocated += sizeof(uint8_t) * fn->code.capacity;
-  vm->bytesAllocated += sizeof(Value) * fn->constants.capacity;
-  
-  // The debug line number buffer.
-  vm->bytesAllocated += sizeof(int) * fn->code.capacity;
-  // TODO: What about the function name?
+  return vm->config.reallocateFn(memory, newSize, vm->config.userData);
 }
 
-static void blackenForeign(WrenVM* vm, ObjForeign* foreign)
+// Captures the local variable [local] into an [Upvalue]. If that local is
+// already in an upvalue, the existing one will be used. (This is important to
+// ensure that multiple closures closing over the same variable actually see
+// the same variable.) Otherwise, it will create a new open upvalue and add it
+// the fiber's list of upvalues.
+static ObjUpvalue* captureUpvalue(WrenVM* vm, ObjFiber* fiber, Value* local)
 {
-  // TODO: Keep track of how much memory the foreign object uses. We can store
-  // this in each foreign object, but it will balloon the size. We may not want
-  // that much overhead. One option would be to let the foreign class register
-  // a C function that returns a size for the object. That way the VM doesn't
-  // always have to explicitly store it.
-}
+  // If there are no open upvalues at all, we must need a new one.
+  if (fiber->openUpvalues == NULL)
+  {
+    fiber->openUpvalues = wrenNewUpvalue(vm, local);
+    return fiber->openUpvalues;
+  }
 
-static void blackenInstance(WrenVM* vm, ObjInstance* instance)
-{
-  wrenGrayObj(vm, (Obj*)instance->obj.classObj);
+  ObjUpvalue* prevUpvalue = NULL;
+  ObjUpvalue* upvalue = fiber->openUpvalues;
 
-  // Mark the fields.
-  for (int i = 0; i < instance->obj.classObj->numFields; i++)
+  // Walk towards the bottom of the stack until we find a previously existing
+  // upvalue or pass where it should be.
+  while (upvalue != NULL && upvalue->value > local)
   {
-    wrenGrayValue(vm, instance->fields[i]);
+    prevUpvalue = upvalue;
+    upvalue = upvalue->next;
   }
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjInstance);
-  vm->bytesAllocated += sizeof(Value) * instance->obj.classObj->numFields;
-}
+  // Found an existing upvalue for this local.
+  if (upvalue != NULL && upvalue->value == local) return upvalue;
 
-static void blackenList(WrenVM* vm, ObjList* list)
-{
-  // Mark the elements.
-  wrenGrayBuffer(vm, &list->elements);
+  // We've walked past this local on the stack, so there must not be an
+  // upvalue for it already. Make a new one and link it in in the right
+  // place to keep the list sorted.
+  ObjUpvalue* createdUpvalue = wrenNewUpvalue(vm, local);
+  if (prevUpvalue == NULL)
+  {
+    // The new one is the first one in the list.
+    fiber->openUpvalues = createdUpvalue;
+  }
+  else
+  {
+    prevUpvalue->next = createdUpvalue;
+  }
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjList);
-  vm->bytesAllocated += sizeof(Value) * list->elements.capacity;
+  createdUpvalue->next = upvalue;
+  return createdUpvalue;
 }
 
-static void blackenMap(WrenVM* vm, ObjMap* map)
+// Closes any open upvalues that have been created for stack slots at [last]
+// and above.
+static void closeUpvalues(WrenVM* vm, ObjFiber* fiber, Value* last)
 {
-  // Mark the entries.
-  for (uint32_t i = 0; i < map->capacity; i++)
+  while (fiber->openUpvalues != NULL &&
+         fiber->openUpvalues->value >= last)
   {
-    MapEntry* entry = &map->entries[i];
-    if (IS_UNDEFINED(entry->key)) continue;
+    ObjUpvalue* upvalue = fiber->openUpvalues;
 
-    wrenGrayValue(vm, entry->key);
-    wrenGrayValue(vm, entry->value);
-  }
+    // Move the value into the upvalue itself and point the upvalue to it.
+    upvalue->closed = *upvalue->value;
+    upvalue->value = &upvalue->closed;
+    wrenRememberStore(vm, &upvalue->obj, upvalue->closed);
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjMap);
-  vm->bytesAllocated += sizeof(MapEntry) * map->capacity;
+    // Remove it from the open upvalue list.
+    fiber->openUpvalues = upvalue->next;
+  }
 }
 
-static void blackenModule(WrenVM* vm, ObjModule* module)
+// Returns the number of parameters the method with [signature] takes.
+static int signatureArity(const char* signature, int length)
 {
-  // Top-level variables.
-  for (int i = 0; i < module->variables.count; i++)
+  int numParams = 0;
+  if (signature[length - 1] == ')')
   {
-    wrenGrayValue(vm, module->variables.data[i]);
+    for (int i = length - 1; i > 0 && signature[i] != '('; i--)
+    {
+      if (signature[i] == '_') numParams++;
+    }
   }
 
-  wrenBlackenSymbolTable(vm, &module->variableNames);
-
-  wrenGrayObj(vm, (Obj*)module->name);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjModule);
-}
+  // Count subscript arguments.
+  if (signature[0] == '[')
+  {
+    for (int i = 0; i < length && signature[i] != ']'; i++)
+    {
+      if (signature[i] == '_') numParams++;
+    }
+  }
 
-static void blackenRange(WrenVM* vm, ObjRange* range)
-{
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjRange);
+  return numParams;
 }
 
-static void blackenString(WrenVM* vm, ObjString* string)
+// Looks up a typed foreign method in [moduleName] on [className] with
+// [signature] and binds [method] to it.
+//
+// Returns false if the host doesn't have one. Aborts the current fiber if its
+// types don't match the signature.
+static bool findTypedForeignMethod(WrenVM* vm, Method* method,
+                                   const char* moduleName,
+                                   const char* className, bool isStatic,
+                                   const char* signature)
 {
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjString) + string->length + 1;
-}
+  if (vm->config.bindTypedForeignMethodFn == NULL) return false;
 
-static void blackenUpvalue(WrenVM* vm, ObjUpvalue* upvalue)
-{
-  // Mark the closed-over object (in case it is closed).
-  wrenGrayValue(vm, upvalue->closed);
+  WrenTypedForeignMethod typed = vm->config.bindTypedForeignMethodFn(vm,
+      moduleName, className, isStatic, signature);
+  if (typed.fn == NULL) return false;
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjUpvalue);
-}
+  int start = vm->foreignTypes.count;
+  bool isValid = true;
+  for (const char* type = typed.types; *type != '\0'; type++)
+  {
+    if (*type == ' ') continue;
 
-static void blackenObject(WrenVM* vm, Obj* obj)
-{
-#if WREN_DEBUG_TRACE_MEMORY
-  printf("mark ");
-  wrenDumpValue(OBJ_VAL(obj));
-  printf(" @ %p\n", obj);
-#endif
+    isValid = isValid && strchr("NIBSF_", *type) != NULL;
+    wrenByteBufferWrite(vm, &vm->foreignTypes, (uint8_t)*type);
+  }
 
-  // Traverse the object's fields.
-  switch (obj->type)
+  int numArgs = signatureArity(signature, (int)strlen(signature)) + 1;
+  if (!isValid || vm->foreignTypes.count - start != numArgs)
   {
-    case OBJ_CLASS:    blackenClass(   vm, (ObjClass*)   obj); break;
-    case OBJ_CLOSURE:  blackenClosure( vm, (ObjClosure*) obj); break;
-    case OBJ_FIBER:    blackenFiber(   vm, (ObjFiber*)   obj); break;
-    case OBJ_FN:       blackenFn(      vm, (ObjFn*)      obj); break;
-    case OBJ_FOREIGN:  blackenForeign( vm, (ObjForeign*) obj); break;
-    case OBJ_INSTANCE: blackenInstance(vm, (ObjInstance*)obj); break;
-    case OBJ_LIST:     blackenList(    vm, (ObjList*)    obj); break;
-    case OBJ_MAP:      blackenMap(     vm, (ObjMap*)     obj); break;
-    case OBJ_MODULE:   blackenModule(  vm, (ObjModule*)  obj); break;
-    case OBJ_RANGE:    blackenRange(   vm, (ObjRange*)   obj); break;
-    case OBJ_STRING:   blackenString(  vm, (ObjString*)  obj); break;
-    case OBJ_UPVALUE:  blackenUpvalue( vm, (ObjUpvalue*) obj); break;
+    vm->foreignTypes.count = start;
+    vm->fiber->error = wrenStringFormat(vm,
+        "Types '$' of foreign method '$' for class $ don't match its "
+        "arguments.", typed.types, signature, className);
+    return true;
   }
+
+  method->type = METHOD_FOREIGN_TYPED;
+  method->field = start;
+  method->as.typedForeign = typed.fn;
+  return true;
 }
 
-void wrenBlackenObjects(WrenVM* vm)
+// Looks up a foreign method in [moduleName] on [className] with [signature].
+//
+// This will try the host's foreign method binder first. If that fails, it
+// falls back to handling the built-in modules.
+static WrenForeignMethodFn findForeignMethod(WrenVM* vm,
+                                             const char* moduleName,
+                                             const char* className,
+                                             bool isStatic,
+                                             const char* signature)
 {
-  while (vm->grayCount > 0)
+  WrenForeignMethodFn method = NULL;
+  
+  if (vm->config.bindForeignMethodFn != NULL)
   {
-    // Pop an item from the gray stack.
-    Obj* obj = vm->gray[--vm->grayCount];
-    blackenObject(vm, obj);
+    method = vm->config.bindForeignMethodFn(vm, moduleName, className, isStatic,
+                                            signature);
   }
-}
-
-void wrenFreeObj(WrenVM* vm, Obj* obj)
-{
-#if WREN_DEBUG_TRACE_MEMORY
-  printf("free ");
-  wrenDumpValue(OBJ_VAL(obj));
-  printf(" @ %p\n", obj);
-#endif
-
-  switch (obj->type)
+  
+  // If the host didn't provide it, see if it's an optional one.
+  if (method == NULL)
   {
-    case OBJ_CLASS:
-      wrenMethodBufferClear(vm, &((ObjClass*)obj)->methods);
-      break;
-
-    case OBJ_FIBER:
+#if WREN_OPT_META
+    if (strcmp(moduleName, "meta") == 0)
     {
-      ObjFiber* fiber = (ObjFiber*)obj;
-      DEALLOCATE(vm, fiber->frames);
-      DEALLOCATE(vm, fiber->stack);
-      break;
+      method = wrenMetaBindForeignMethod(vm, className, isStatic, signature);
     }
-      
-    case OBJ_FN:
+#endif
+#if WREN_OPT_RANDOM
+    if (strcmp(moduleName, "random") == 0)
     {
-      ObjFn* fn = (ObjFn*)obj;
-      wrenValueBufferClear(vm, &fn->constants);
-      wrenByteBufferClear(vm, &fn->code);
-      wrenIntBufferClear(vm, &fn->debug->sourceLines);
-      DEALLOCATE(vm, fn->debug->name);
-      DEALLOCATE(vm, fn->debug);
-      break;
+      method = wrenRandomBindForeignMethod(vm, className, isStatic, signature);
     }
-
-    case OBJ_FOREIGN:
-      wrenFinalizeForeign(vm, (ObjForeign*)obj);
-      break;
-
-    case OBJ_LIST:
-      wrenValueBufferClear(vm, &((ObjList*)obj)->elements);
-      break;
-
-    case OBJ_MAP:
-      DEALLOCATE(vm, ((ObjMap*)obj)->entries);
-      break;
-
-    case OBJ_MODULE:
-      wrenSymbolTableClear(vm, &((ObjModule*)obj)->variableNames);
-      wrenValueBufferClear(vm, &((ObjModule*)obj)->variables);
-      break;
-
-    case OBJ_CLOSURE:
-    case OBJ_INSTANCE:
-    case OBJ_RANGE:
-    case OBJ_STRING:
-    case OBJ_UPVALUE:
-      break;
+#endif
   }
 
-  DEALLOCATE(vm, obj);
+  return method;
 }
 
-ObjClass* wrenGetClass(WrenVM* vm, Value value)
+// Turns [method] into a METHOD_FIELD_GETTER or METHOD_FIELD_SETTER if its
+// body is nothing but `_field` or `_field = firstArgument`.
+static void findFieldAccessor(Method* method)
 {
-  return wrenGetClassInline(vm, value);
+  ObjFn* fn = method->as.closure->fn;
+  uint8_t* code = fn->code.data;
+
+  if (fn->code.count == 4 &&
+      code[0] == CODE_LOAD_FIELD_THIS &&
+      code[2] == CODE_RETURN)
+  {
+    method->type = METHOD_FIELD_GETTER;
+    method->field = code[1];
+  }
+  else if (fn->code.count == 5 &&
+           code[0] == CODE_LOAD_LOCAL_1 &&
+           code[1] == CODE_STORE_FIELD_THIS &&
+           code[3] == CODE_RETURN)
+  {
+    method->type = METHOD_FIELD_SETTER;
+    method->field = code[2];
+  }
 }
 
-bool wrenValuesEqual(Value a, Value b)
+// Defines [methodValue] as a method on [classObj].
+//
+// Handles both foreign methods where [methodValue] is a string containing the
+// method's signature and Wren methods where [methodValue] is a function.
+//
+// Aborts the current fiber if the method is a foreign method that could not be
+// found.
+static void bindMethod(WrenVM* vm, int methodType, int symbol,
+                       ObjModule* module, ObjClass* classObj, Value methodValue)
 {
-  if (wrenValuesSame(a, b)) return true;
-
-  // If we get here, it's only possible for two heap-allocated immutable objects
-  // to be equal.
-  if (!IS_OBJ(a) || !IS_OBJ(b)) return false;
-
-  Obj* aObj = AS_OBJ(a);
-  Obj* bObj = AS_OBJ(b);
-
-  // Must be the same type.
-  if (aObj->type != bObj->type) return false;
+  const char* className = classObj->name->value;
+  if (methodType == CODE_METHOD_STATIC)
+  {
+    classObj = wrenGetObjClass(vm, &classObj->obj);
+  }
 
-  switch (aObj->type)
+  Method method;
+  if (IS_STRING(methodValue) &&
+      findTypedForeignMethod(vm, &method, module->name->value, className,
+                             methodType == CODE_METHOD_STATIC,
+                             AS_CSTRING(methodValue)))
   {
-    case OBJ_RANGE:
-    {
-      ObjRange* aRange = (ObjRange*)aObj;
-      ObjRange* bRange = (ObjRange*)bObj;
-      return aRange->from == bRange->from &&
-             aRange->to == bRange->to &&
-             aRange->isInclusive == bRange->isInclusive;
-    }
+    if (wrenHasError(vm->fiber)) return;
+  }
+  else if (IS_STRING(methodValue))
+  {
+    const char* name = AS_CSTRING(methodValue);
+    method.type = METHOD_FOREIGN;
+    method.as.foreign = findForeignMethod(vm, module->name->value,
+                                          className,
+                                          methodType == CODE_METHOD_STATIC,
+                                          name);
 
-    case OBJ_STRING:
+    if (method.as.foreign == NULL)
     {
-      ObjString* aString = (ObjString*)aObj;
-      ObjString* bString = (ObjString*)bObj;
-      return aString->hash == bString->hash &&
-      wrenStringEqualsCString(aString, bString->value, bString->length);
+      vm->fiber->error = wrenStringFormat(vm,
+          "Could not find foreign method '@' for class $ in module '$'.",
+          methodValue, classObj->name->value, module->name->value);
+      return;
     }
+  }
+  else
+  {
+    method.as.closure = AS_CLOSURE(methodValue);
+    method.type = METHOD_BLOCK;
 
-    default:
-      // All other types are only equal if they are same, which they aren't if
-      // we get here.
-      return false;
+    // Patch up the bytecode now that we know the superclass.
+    wrenBindMethodCode(classObj, method.as.closure->fn);
+    findFieldAccessor(&method);
   }
+
+  wrenBindMethod(vm, classObj, symbol, method);
 }
-// End file "wren_value.c"
-// Begin file "wren_vm.c"
-#include <stdarg.h>
-#include <string.h>
 
+static void callForeign(WrenVM* vm, ObjFiber* fiber,
+                        WrenForeignMethodFn foreign, int numArgs)
+{
+  ASSERT(vm->apiStack == NULL, "Cannot already be in foreign call.");
+  vm->apiStack = fiber->stackTop - numArgs;
 
-#if WREN_OPT_META
-// Begin file "wren_opt_meta.h"
-#ifndef wren_opt_meta_h
-#define wren_opt_meta_h
+  foreign(vm);
 
+  // Discard the stack slots for the arguments and temporaries but leave one
+  // for the result.
+  fiber->stackTop = vm->apiStack + 1;
 
-// This module defines the Meta class and its associated methods.
-#if WREN_OPT_META
+  vm->apiStack = NULL;
+}
 
-const char* wrenMetaSource();
-WrenForeignMethodFn wrenMetaBindForeignMethod(WrenVM* vm,
-                                              const char* className,
-                                              bool isStatic,
-                                              const char* signature);
+static const char* foreignTypeName(uint8_t type)
+{
+  switch (type)
+  {
+    case 'B': return "a bool";
+    case 'F': return "a foreign object";
+    case 'S': return "a string";
+    default:  return "a number";
+  }
+}
 
-#endif
+// Checks the receiver and arguments of a call to [method], a
+// METHOD_FOREIGN_TYPED, against its types and calls it with them unpacked.
+// Aborts [fiber] instead if one has the wrong type.
+static void callTypedForeign(WrenVM* vm, ObjFiber* fiber, const Method* method,
+                             int symbol, int numArgs)
+{
+  ASSERT(vm->apiStack == NULL, "Cannot already be in foreign call.");
 
-#endif
-// End file "wren_opt_meta.h"
-#endif
-#if WREN_OPT_RANDOM
-// Begin file "wren_opt_random.h"
-#ifndef wren_opt_random_h
-#define wren_opt_random_h
+  Value* args = fiber->stackTop - numArgs;
+  const uint8_t* types = &vm->foreignTypes.data[method->field];
+  WrenForeignArg unpacked[MAX_PARAMETERS + 1];
 
+  for (int i = 0; i < numArgs; i++)
+  {
+    bool isValid = true;
+    switch (types[i])
+    {
+      case 'N':
+        isValid = IS_NUM(args[i]);
+        if (isValid) unpacked[i].num = AS_NUM(args[i]);
+        break;
 
-#if WREN_OPT_RANDOM
+      case 'I':
+        isValid = IS_NUM(args[i]);
+        if (isValid) unpacked[i].integer = (int)AS_NUM(args[i]);
+        break;
 
-const char* wrenRandomSource();
-WrenForeignClassMethods wrenRandomBindForeignClass(WrenVM* vm,
-                                                   const char* module,
-                                                   const char* className);
-WrenForeignMethodFn wrenRandomBindForeignMethod(WrenVM* vm,
-                                                const char* className,
-                                                bool isStatic,
-                                                const char* signature);
+      case 'B':
+        isValid = IS_BOOL(args[i]);
+        if (isValid) unpacked[i].boolean = AS_BOOL(args[i]);
+        break;
 
-#endif
+      case 'S':
+        isValid = IS_STRING(args[i]);
+        if (isValid) unpacked[i].string = AS_CSTRING(args[i]);
+        break;
 
-#endif
-// End file "wren_opt_random.h"
-#endif
+      case 'F':
+        isValid = IS_FOREIGN(args[i]);
+        if (isValid) unpacked[i].foreign = AS_FOREIGN(args[i])->data;
+        break;
+    }
 
-#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
-  #include <time.h>
-  #include <stdio.h>
-#endif
+    if (isValid) continue;
 
-// The behavior of realloc() when the size is 0 is implementation defined. It
-// may return a non-NULL pointer which must not be dereferenced but nevertheless
-// should be freed. To prevent that, we avoid calling realloc() with a zero
-// size.
-static void* defaultReallocate(void* ptr, size_t newSize, void* _)
-{
-  if (newSize == 0)
-  {
-    free(ptr);
-    return NULL;
+    const char* name = vm->methodNames.data[symbol]->value;
+    if (i == 0)
+    {
+      fiber->error = wrenStringFormat(vm, "Receiver of '$' must be $.", name,
+                                      foreignTypeName(types[i]));
+    }
+    else
+    {
+      char argument[16];
+      snprintf(argument, sizeof(argument), "%d", i);
+      fiber->error = wrenStringFormat(vm, "Argument $ of '$' must be $.",
+                                      argument, name,
+                                      foreignTypeName(types[i]));
+    }
+    return;
   }
 
-  return realloc(ptr, newSize);
-}
+  vm->apiStack = args;
 
-int wrenGetVersionNumber() 
-{ 
-  return WREN_VERSION_NUMBER;
+  method->as.typedForeign(vm, unpacked);
+
+  // Discard the stack slots for the arguments and temporaries but leave one
+  // for the result.
+  fiber->stackTop = vm->apiStack + 1;
+
+  vm->apiStack = NULL;
 }
 
-void wrenInitConfiguration(WrenConfiguration* config)
+void wrenRequestSample(WrenVM* vm)
 {
-  config->reallocateFn = defaultReallocate;
-  config->resolveModuleFn = NULL;
-  config->loadModuleFn = NULL;
-  config->bindForeignMethodFn = NULL;
-  config->bindForeignClassFn = NULL;
-  config->writeFn = NULL;
-  config->errorFn = NULL;
-  config->initialHeapSize = 1024 * 1024 * 10;
-  config->minHeapSize = 1024 * 1024;
-  config->heapGrowthPercent = 50;
-  config->userData = NULL;
+  __atomic_store_n(&vm->sampleRequested, true, __ATOMIC_RELAXED);
 }
 
-WrenVM* wrenNewVM(WrenConfiguration* config)
+int wrenGetStackFrames(WrenVM* vm, WrenStackFrame* frames, int maxFrames)
 {
-  WrenReallocateFn reallocate = defaultReallocate;
-  void* userData = NULL;
-  if (config != NULL) {
-    userData = config->userData;
-    reallocate = config->reallocateFn ? config->reallocateFn : defaultReallocate;
-  }
-  
-  WrenVM* vm = (WrenVM*)reallocate(NULL, sizeof(*vm), userData);
-  memset(vm, 0, sizeof(WrenVM));
+  int count = 0;
 
-  // Copy the configuration if given one.
-  if (config != NULL)
+  for (ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller)
   {
-    memcpy(&vm->config, config, sizeof(WrenConfiguration));
+    for (int i = fiber->numFrames - 1; i >= 0 && count < maxFrames; i--)
+    {
+      CallFrame* frame = &fiber->frames[i];
+      ObjFn* fn = frame->closure->fn;
 
-    // We choose to set this after copying, 
-    // rather than modifying the user config pointer
-    vm->config.reallocateFn = reallocate;
-  }
-  else
-  {
-    wrenInitConfiguration(&vm->config);
-  }
+      // Skip stub functions and the core module, like stack traces do.
+      if (fn->module == NULL || fn->module->name == NULL) continue;
 
-  // TODO: Should we allocate and free this during a GC?
-  vm->grayCount = 0;
-  // TODO: Tune this.
-  vm->grayCapacity = 4;
-  vm->gray = (Obj**)reallocate(NULL, vm->grayCapacity * sizeof(Obj*), userData);
-  vm->nextGC = vm->config.initialHeapSize;
+      // -1 because IP has advanced past the instruction that it just executed,
+      // unless the function was only just entered.
+      int offset = (int)(frame->ip - fn->code.data) - 1;
+      if (offset < 0) offset = 0;
 
-  wrenSymbolTableInit(&vm->methodNames);
+      frames[count].module = fn->module->name->value;
+      frames[count].function = fn->debug->name;
+      frames[count].line = fn->debug->sourceLines.data[offset];
+      count++;
+    }
+  }
 
-  vm->modules = wrenNewMap(vm);
-  wrenInitializeCore(vm);
-  return vm;
-}
+  return count;
+}
+
+// The names of the opcodes, in the order of wren_opcodes.h.
+static const char* opcodeNames[] = {
+  "CONSTANT", "NULL", "FALSE", "TRUE", "LOAD_LOCAL_0", "LOAD_LOCAL_1",
+  "LOAD_LOCAL_2", "LOAD_LOCAL_3", "LOAD_LOCAL_4", "LOAD_LOCAL_5",
+  "LOAD_LOCAL_6", "LOAD_LOCAL_7", "LOAD_LOCAL_8", "LOAD_LOCAL", "STORE_LOCAL",
+  "LOAD_UPVALUE", "STORE_UPVALUE", "LOAD_MODULE_VAR", "STORE_MODULE_VAR",
+  "LOAD_FIELD_THIS", "STORE_FIELD_THIS", "LOAD_FIELD", "STORE_FIELD", "POP",
+  "CALL_0", "CALL_1", "CALL_2", "CALL_3", "CALL_4", "CALL_5", "CALL_6",
+  "CALL_7", "CALL_8", "CALL_9", "CALL_10", "CALL_11", "CALL_12", "CALL_13",
+  "CALL_14", "CALL_15", "CALL_16", "SUPER_0", "SUPER_1", "SUPER_2", "SUPER_3",
+  "SUPER_4", "SUPER_5", "SUPER_6", "SUPER_7", "SUPER_8", "SUPER_9", "SUPER_10",
+  "SUPER_11", "SUPER_12", "SUPER_13", "SUPER_14", "SUPER_15", "SUPER_16",
+  "JUMP", "LOOP", "JUMP_IF", "JUMP_IF_NUMS", "ITERATE", "AND", "OR",
+  "CLOSE_UPVALUE", "RETURN", "CLOSURE", "CONSTRUCT", "FOREIGN_CONSTRUCT",
+  "CLASS", "END_CLASS", "FOREIGN_CLASS", "METHOD_INSTANCE", "METHOD_STATIC",
+  "END_MODULE", "IMPORT_MODULE", "IMPORT_VARIABLE", "LOAD_LOCAL_CALL_0",
+  "LOAD_LOCAL_CALL_1", "LOAD_MODULE_VAR_CALL_0", "CONSTANT_CALL_1",
+  "STORE_LOCAL_POP", "STORE_MODULE_VAR_POP", "STORE_FIELD_THIS_POP",
+  "POP_LOOP", "END"
+};
 
-void wrenFreeVM(WrenVM* vm)
+// Fails to compile if [opcodeNames] gets out of sync with the opcodes.
+typedef char OpcodeNamesMatch[
+    sizeof(opcodeNames) / sizeof(opcodeNames[0]) == CODE_END + 1 ? 1 : -1];
+
+void wrenSetOpcodeCounting(WrenVM* vm, bool enabled)
 {
-  ASSERT(vm->methodNames.count > 0, "VM appears to have already been freed.");
-  
-  // Free all of the GC objects.
-  Obj* obj = vm->first;
-  while (obj != NULL)
+  if (enabled && vm->opcodeStats == NULL)
   {
-    Obj* next = obj->next;
-    wrenFreeObj(vm, obj);
-    obj = next;
+    // Not allocated through wrenReallocate() so turning counting on never
+    // triggers a collection.
+    vm->opcodeStats = (OpcodeStats*)vm->config.reallocateFn(
+        NULL, sizeof(OpcodeStats), vm->config.userData);
+    memset(vm->opcodeStats, 0, sizeof(OpcodeStats));
+    vm->opcodeStats->previous = CODE_END;
   }
 
-  // Free up the GC gray set.
-  vm->gray = (Obj**)vm->config.reallocateFn(vm->gray, 0, vm->config.userData);
-
-  // Tell the user if they didn't free any handles. We don't want to just free
-  // them here because the host app may still have pointers to them that they
-  // may try to use. Better to tell them about the bug early.
-  ASSERT(vm->handles == NULL, "All handles have not been released.");
+  vm->countOpcodes = enabled;
+}
 
-  wrenSymbolTableClear(vm, &vm->methodNames);
+typedef struct
+{
+  uint64_t count;
+  int first;
+  int second;
+} OpcodeCount;
 
-  DEALLOCATE(vm, vm);
+static int compareOpcodeCounts(const void* a, const void* b)
+{
+  uint64_t x = ((const OpcodeCount*)a)->count;
+  uint64_t y = ((const OpcodeCount*)b)->count;
+  return (x < y) - (x > y);
 }
 
-void wrenCollectGarbage(WrenVM* vm)
+static int compareFnCounts(const void* a, const void* b)
 {
-#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
-  printf("-- gc --\n");
+  uint64_t x = (*(ObjFn* const*)a)->debug->executed;
+  uint64_t y = (*(ObjFn* const*)b)->debug->executed;
+  return (x < y) - (x > y);
+}
 
-  size_t before = vm->bytesAllocated;
-  double startTime = (double)clock() / CLOCKS_PER_SEC;
-#endif
+void wrenDumpOpcodeStats(WrenVM* vm, WrenWriteFn write)
+{
+  if (write == NULL) write = vm->config.writeFn;
+  if (write == NULL) return;
 
-  // Mark all reachable objects.
+  if (vm->opcodeStats == NULL)
+  {
+    write(vm, "No opcode counts, counting was never turned on.\n");
+    return;
+  }
 
-  // Reset this. As we mark objects, their size will be counted again so that
-  // we can track how much memory is in use without needing to know the size
-  // of each *freed* object.
-  //
-  // This is important because when freeing an unmarked object, we don't always
-  // know how much memory it is using. For example, when freeing an instance,
-  // we need to know its class to know how big it is, but its class may have
-  // already been freed.
-  vm->bytesAllocated = 0;
+  OpcodeStats* stats = vm->opcodeStats;
+  char line[256];
 
-  wrenGrayObj(vm, (Obj*)vm->modules);
+  uint64_t total = 0;
+  for (int i = 0; i <= CODE_END; i++) total += stats->opcodes[i];
+  if (total == 0) total = 1;
 
-  // Temporary roots.
-  for (int i = 0; i < vm->numTempRoots; i++)
+  // Opcodes, most executed first.
+  OpcodeCount counts[CODE_END + 1];
+  for (int i = 0; i <= CODE_END; i++)
   {
-    wrenGrayObj(vm, vm->tempRoots[i]);
+    counts[i].count = stats->opcodes[i];
+    counts[i].first = i;
+    counts[i].second = -1;
   }
 
-  // The current fiber.
-  wrenGrayObj(vm, (Obj*)vm->fiber);
+  qsort(counts, CODE_END + 1, sizeof(OpcodeCount), compareOpcodeCounts);
 
-  // The handles.
-  for (WrenHandle* handle = vm->handles;
-       handle != NULL;
-       handle = handle->next)
+  write(vm, "Opcodes:\n");
+  for (int i = 0; i <= CODE_END && counts[i].count > 0; i++)
   {
-    wrenGrayValue(vm, handle->value);
+    snprintf(line, sizeof(line), "  %-36s %14llu %6.2f%%\n",
+             opcodeNames[counts[i].first], (unsigned long long)counts[i].count,
+             counts[i].count * 100.0 / total);
+    write(vm, line);
   }
 
-  // Any object the compiler is using (if there is one).
-  if (vm->compiler != NULL) wrenMarkCompiler(vm, vm->compiler);
-
-  // Method names.
-  wrenBlackenSymbolTable(vm, &vm->methodNames);
-
-  // Now that we have grayed the roots, do a depth-first search over all of the
-  // reachable objects.
-  wrenBlackenObjects(vm);
+  // The most frequent pairs of consecutive opcodes.
+  #define MAX_PAIRS 40
+  OpcodeCount pairs[MAX_PAIRS];
+  int numPairs = 0;
 
-  // Collect the white objects.
-  Obj** obj = &vm->first;
-  while (*obj != NULL)
+  for (int i = 0; i <= CODE_END; i++)
   {
-    if (!((*obj)->isDark))
+    for (int j = 0; j <= CODE_END; j++)
     {
-      // This object wasn't reached, so remove it from the list and free it.
-      Obj* unreached = *obj;
-      *obj = unreached->next;
-      wrenFreeObj(vm, unreached);
+      uint64_t count = stats->pairs[i][j];
+      if (count == 0) continue;
+      if (numPairs == MAX_PAIRS && count <= pairs[MAX_PAIRS - 1].count) continue;
+
+      // Insert in order, dropping the smallest pair if full.
+      int k = numPairs < MAX_PAIRS ? numPairs++ : MAX_PAIRS - 1;
+      while (k > 0 && pairs[k - 1].count < count)
+      {
+        pairs[k] = pairs[k - 1];
+        k--;
+      }
+
+      pairs[k].count = count;
+      pairs[k].first = i;
+      pairs[k].second = j;
     }
-    else
+  }
+
+  write(vm, "Pairs:\n");
+  for (int i = 0; i < numPairs; i++)
+  {
+    char pair[64];
+    snprintf(pair, sizeof(pair), "%s %s",
+             opcodeNames[pairs[i].first], opcodeNames[pairs[i].second]);
+    snprintf(line, sizeof(line), "  %-36s %14llu %6.2f%%\n", pair,
+             (unsigned long long)pairs[i].count, pairs[i].count * 100.0 / total);
+    write(vm, line);
+  }
+  #undef MAX_PAIRS
+
+  // Functions, most executed first. Only functions that are still alive are
+  // reported.
+  int numFns = 0;
+  for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
+  {
+    if (obj->type == OBJ_FN && ((ObjFn*)obj)->debug->executed > 0) numFns++;
+  }
+
+  ObjFn** fns = (ObjFn**)vm->config.reallocateFn(NULL,
+      (numFns > 0 ? numFns : 1) * sizeof(ObjFn*), vm->config.userData);
+  numFns = 0;
+  for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
+  {
+    if (obj->type == OBJ_FN && ((ObjFn*)obj)->debug->executed > 0)
     {
-      // This object was reached, so unmark it (for the next GC) and move on to
-      // the next.
-      (*obj)->isDark = false;
-      obj = &(*obj)->next;
+      fns[numFns++] = (ObjFn*)obj;
     }
   }
 
-  // Calculate the next gc point, this is the current allocation plus
-  // a configured percentage of the current allocation.
-  vm->nextGC = vm->bytesAllocated + ((vm->bytesAllocated * vm->config.heapGrowthPercent) / 100);
-  if (vm->nextGC < vm->config.minHeapSize) vm->nextGC = vm->config.minHeapSize;
+  qsort(fns, numFns, sizeof(ObjFn*), compareFnCounts);
 
-#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
-  double elapsed = ((double)clock() / CLOCKS_PER_SEC) - startTime;
-  // Explicit cast because size_t has different sizes on 32-bit and 64-bit and
-  // we need a consistent type for the format string.
-  printf("GC %lu before, %lu after (%lu collected), next at %lu. Took %.3fms.\n",
-         (unsigned long)before,
-         (unsigned long)vm->bytesAllocated,
-         (unsigned long)(before - vm->bytesAllocated),
-         (unsigned long)vm->nextGC,
-         elapsed*1000.0);
-#endif
+  write(vm, "Functions:\n");
+  for (int i = 0; i < numFns && i < 40; i++)
+  {
+    ObjFn* fn = fns[i];
+    char name[128];
+    snprintf(name, sizeof(name), "%s (%s:%d)",
+             fn->debug->name != NULL ? fn->debug->name : "?",
+             fn->module != NULL && fn->module->name != NULL
+                 ? fn->module->name->value : "core",
+             fn->debug->sourceLines.count > 0 ? fn->debug->sourceLines.data[0] : 0);
+    snprintf(line, sizeof(line), "  %-36s %14llu %6.2f%%\n", name,
+             (unsigned long long)fn->debug->executed,
+             fn->debug->executed * 100.0 / total);
+    write(vm, line);
+  }
+
+  vm->config.reallocateFn(fns, 0, vm->config.userData);
 }
 
-void* wrenReallocate(WrenVM* vm, void* memory, size_t oldSize, size_t newSize)
+void wrenSetAllocationTracking(WrenVM* vm, bool enabled)
 {
-#if WREN_DEBUG_TRACE_MEMORY
-  // Explicit cast because size_t has different sizes on 32-bit and 64-bit and
-  // we need a consistent type for the format string.
-  printf("reallocate %p %lu -> %lu\n",
-         memory, (unsigned long)oldSize, (unsigned long)newSize);
-#endif
-
-  // If new bytes are being allocated, add them to the total count. If objects
-  // are being completely deallocated, we don't track that (since we don't
-  // track the original size). Instead, that will be handled while marking
-  // during the next GC.
-  vm->bytesAllocated += newSize - oldSize;
+  if (enabled && vm->allocationStats == NULL)
+  {
+    vm->allocationStats = (AllocationStats*)trackingReallocate(vm, NULL,
+        sizeof(AllocationStats));
+    memset(vm->allocationStats, 0, sizeof(AllocationStats));
+    vm->allocationStats->lastSite = -1;
+  }
 
-#if WREN_DEBUG_GC_STRESS
-  // Since collecting calls this function to free things, make sure we don't
-  // recurse.
-  if (newSize > 0) wrenCollectGarbage(vm);
-#else
-  if (newSize > 0 && vm->bytesAllocated > vm->nextGC) wrenCollectGarbage(vm);
-#endif
+  vm->trackAllocations = enabled;
+}
 
-  return vm->config.reallocateFn(memory, newSize, vm->config.userData);
+static int compareAllocationBytes(const void* a, const void* b)
+{
+  uint64_t x = (*(AllocationCount* const*)a)->bytes;
+  uint64_t y = (*(AllocationCount* const*)b)->bytes;
+  return (x < y) - (x > y);
 }
 
-// Captures the local variable [local] into an [Upvalue]. If that local is
-// already in an upvalue, the existing one will be used. (This is important to
-// ensure that multiple closures closing over the same variable actually see
-// the same variable.) Otherwise, it will create a new open upvalue and add it
-// the fiber's list of upvalues.
-static ObjUpvalue* captureUpvalue(WrenVM* vm, ObjFiber* fiber, Value* local)
+// Writes up to [max] entries of [table], most bytes first.
+static void dumpAllocationTable(WrenVM* vm, WrenWriteFn write,
+                                AllocationTable* table, int max,
+                                uint64_t totalBytes)
 {
-  // If there are no open upvalues at all, we must need a new one.
-  if (fiber->openUpvalues == NULL)
+  AllocationCount** sorted = (AllocationCount**)trackingReallocate(vm, NULL,
+      (table->count > 0 ? table->count : 1) * sizeof(AllocationCount*));
+
+  int count = 0;
+  for (int i = 0; i < table->capacity; i++)
   {
-    fiber->openUpvalues = wrenNewUpvalue(vm, local);
-    return fiber->openUpvalues;
+    if (table->entries[i].key != NULL) sorted[count++] = &table->entries[i];
   }
 
-  ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = fiber->openUpvalues;
+  qsort(sorted, count, sizeof(AllocationCount*), compareAllocationBytes);
 
-  // Walk towards the bottom of the stack until we find a previously existing
-  // upvalue or pass where it should be.
-  while (upvalue != NULL && upvalue->value > local)
+  char line[256];
+  for (int i = 0; i < count && i < max; i++)
   {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
+    AllocationCount* entry = sorted[i];
+    snprintf(line, sizeof(line), "  %-44s %10llu %10llu %14llu %6.2f%%\n",
+             entry->name, (unsigned long long)entry->allocations,
+             (unsigned long long)entry->objects,
+             (unsigned long long)entry->bytes,
+             entry->bytes * 100.0 / totalBytes);
+    write(vm, line);
   }
 
-  // Found an existing upvalue for this local.
-  if (upvalue != NULL && upvalue->value == local) return upvalue;
+  trackingReallocate(vm, sorted, 0);
+}
 
-  // We've walked past this local on the stack, so there must not be an
-  // upvalue for it already. Make a new one and link it in in the right
-  // place to keep the list sorted.
-  ObjUpvalue* createdUpvalue = wrenNewUpvalue(vm, local);
-  if (prevUpvalue == NULL)
+void wrenDumpAllocationStats(WrenVM* vm, WrenWriteFn write, int maxSites)
+{
+  if (write == NULL) write = vm->config.writeFn;
+  if (write == NULL) return;
+
+  if (vm->allocationStats == NULL)
   {
-    // The new one is the first one in the list.
-    fiber->openUpvalues = createdUpvalue;
+    write(vm, "No allocation counts, tracking was never turned on.\n");
+    return;
   }
-  else
+
+  AllocationStats* stats = vm->allocationStats;
+
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < stats->sites.capacity; i++)
   {
-    prevUpvalue->next = createdUpvalue;
+    allocations += stats->sites.entries[i].allocations;
+    bytes += stats->sites.entries[i].bytes;
   }
 
-  createdUpvalue->next = upvalue;
-  return createdUpvalue;
+  char line[256];
+  snprintf(line, sizeof(line), "%llu allocations, %llu bytes\n",
+           (unsigned long long)allocations, (unsigned long long)bytes);
+  write(vm, line);
+  if (bytes == 0) bytes = 1;
+
+  snprintf(line, sizeof(line), "%-46s %10s %10s %14s\n",
+           "Sites:", "allocs", "objects", "bytes");
+  write(vm, line);
+  dumpAllocationTable(vm, write, &stats->sites, maxSites, bytes);
+
+  // Types only count the memory of the objects themselves, buffers they grow
+  // later are counted at their site alone.
+  snprintf(line, sizeof(line), "%-46s %10s %10s %14s\n",
+           "Types:", "allocs", "objects", "bytes");
+  write(vm, line);
+  dumpAllocationTable(vm, write, &stats->types, stats->types.count, bytes);
 }
 
-// Closes any open upvalues that have been created for stack slots at [last]
-// and above.
-static void closeUpvalues(ObjFiber* fiber, Value* last)
+// Hands a requested sample to the host. [classObj] and [symbol] identify the
+// foreign method that just returned, if any.
+static void takeSample(WrenVM* vm, ObjClass* classObj, int symbol)
 {
-  while (fiber->openUpvalues != NULL &&
-         fiber->openUpvalues->value >= last)
-  {
-    ObjUpvalue* upvalue = fiber->openUpvalues;
-
-    // Move the value into the upvalue itself and point the upvalue to it.
-    upvalue->closed = *upvalue->value;
-    upvalue->value = &upvalue->closed;
+  __atomic_store_n(&vm->sampleRequested, false, __ATOMIC_RELAXED);
+  if (vm->config.sampleFn == NULL) return;
 
-    // Remove it from the open upvalue list.
-    fiber->openUpvalues = upvalue->next;
+  if (classObj == NULL)
+  {
+    vm->config.sampleFn(vm, NULL, NULL);
+    return;
   }
+
+  vm->config.sampleFn(vm, classObj->name->value,
+                      vm->methodNames.data[symbol]->value);
 }
 
-// Looks up a foreign method in [moduleName] on [className] with [signature].
+// Handles the current fiber having aborted because of an error.
 //
-// This will try the host's foreign method binder first. If that fails, it
-// falls back to handling the built-in modules.
-static WrenForeignMethodFn findForeignMethod(WrenVM* vm,
-                                             const char* moduleName,
-                                             const char* className,
-                                             bool isStatic,
-                                             const char* signature)
+// Walks the call chain of fibers, aborting each one until it hits a fiber that
+// handles the error. If none do, tells the VM to stop.
+static void runtimeError(WrenVM* vm)
 {
-  WrenForeignMethodFn method = NULL;
-  
-  if (vm->config.bindForeignMethodFn != NULL)
-  {
-    method = vm->config.bindForeignMethodFn(vm, moduleName, className, isStatic,
-                                            signature);
-  }
+  ASSERT(wrenHasError(vm->fiber), "Should only call this after an error.");
+
+  ObjFiber* current = vm->fiber;
+  Value error = current->error;
   
-  // If the host didn't provide it, see if it's an optional one.
-  if (method == NULL)
+  while (current != NULL)
   {
-#if WREN_OPT_META
-    if (strcmp(moduleName, "meta") == 0)
-    {
-      method = wrenMetaBindForeignMethod(vm, className, isStatic, signature);
-    }
-#endif
-#if WREN_OPT_RANDOM
-    if (strcmp(moduleName, "random") == 0)
+    // Every fiber along the call chain gets aborted with the same error.
+    current->error = error;
+    wrenRememberStore(vm, &current->obj, error);
+
+    // If the caller ran this fiber using "try", give it the error and stop.
+    if (current->state == FIBER_TRY)
     {
-      method = wrenRandomBindForeignMethod(vm, className, isStatic, signature);
+      // Make the caller's try method return the error message.
+      wrenScanFiber(vm, current->caller);
+      current->caller->stackTop[-1] = vm->fiber->error;
+      vm->fiber = current->caller;
+      return;
     }
-#endif
+    
+    // Otherwise, unhook the caller since we will never resume and return to it.
+    ObjFiber* caller = current->caller;
+    current->caller = NULL;
+    current = caller;
   }
 
-  return method;
+  // If we got here, nothing caught the error, so show the stack trace.
+  wrenDebugPrintStackTrace(vm);
+  vm->fiber = NULL;
+  vm->apiStack = NULL;
 }
 
-// Defines [methodValue] as a method on [classObj].
-//
-// Handles both foreign methods where [methodValue] is a string containing the
-// method's signature and Wren methods where [methodValue] is a function.
+// Aborts the current fiber with an appropriate method not found error for a
+// method with [symbol] on [classObj].
+static void methodNotFound(WrenVM* vm, ObjClass* classObj, int symbol)
+{
+  vm->fiber->error = wrenStringFormat(vm, "@ does not implement '$'.",
+      OBJ_VAL(classObj->name), vm->methodNames.data[symbol]->value);
+}
+
+// Looks up the previously loaded module with [name].
 //
-// Aborts the current fiber if the method is a foreign method that could not be
-// found.
-static void bindMethod(WrenVM* vm, int methodType, int symbol,
-                       ObjModule* module, ObjClass* classObj, Value methodValue)
+// Returns `NULL` if no module with that name has been loaded.
+static ObjModule* getModule(WrenVM* vm, Value name)
 {
-  const char* className = classObj->name->value;
-  if (methodType == CODE_METHOD_STATIC) classObj = classObj->obj.classObj;
+  Value moduleValue = wrenMapGet(vm->modules, name);
+  return !IS_UNDEFINED(moduleValue) ? AS_MODULE(moduleValue) : NULL;
+}
 
-  Method method;
-  if (IS_STRING(methodValue))
+// Steps a [CODE_ITERATE] loop through [sequence], the value in the loop's
+// sequence slot, without calling its iteration methods. Returns the next
+// iterator and stores the element in [value], or returns false when the loop
+// is done. Returns undefined for sequences that need the iteration protocol.
+static inline Value iterateSequence(Value* sequence, Value iterator,
+                                    IterateKind kind, Value* value)
+{
+  if (kind != ITERATE_SEQUENCE && IS_NUM(*sequence))
   {
-    const char* name = AS_CSTRING(methodValue);
-    method.type = METHOD_FOREIGN;
-    method.as.foreign = findForeignMethod(vm, module->name->value,
-                                          className,
-                                          methodType == CODE_METHOD_STATIC,
-                                          name);
+    *value = wrenIterateRange(AS_NUM(sequence[0]), AS_NUM(sequence[1]),
+                              kind == ITERATE_INCLUSIVE_RANGE, iterator);
+    return *value;
+  }
 
-    if (method.as.foreign == NULL)
-    {
-      vm->fiber->error = wrenStringFormat(vm,
-          "Could not find foreign method '@' for class $ in module '$'.",
-          methodValue, classObj->name->value, module->name->value);
-      return;
-    }
+  if (IS_RANGE(*sequence))
+  {
+    ObjRange* range = AS_RANGE(*sequence);
+    *value = wrenIterateRange(range->from, range->to, range->isInclusive,
+                              iterator);
+    return *value;
   }
-  else
+
+  if (IS_LIST(*sequence))
   {
-    method.as.closure = AS_CLOSURE(methodValue);
-    method.type = METHOD_BLOCK;
+    ObjList* list = AS_LIST(*sequence);
+    double index = IS_NULL(iterator) ? 0 : AS_NUM(iterator) + 1;
+    if (index >= list->elements.count) return FALSE_VAL;
 
-    // Patch up the bytecode now that we know the superclass.
-    wrenBindMethodCode(classObj, method.as.closure->fn);
+    *value = list->elements.data[(uint32_t)index];
+    return NUM_VAL(index);
   }
 
-  wrenBindMethod(vm, classObj, symbol, method);
+  return UNDEFINED_VAL;
 }
 
-static void callForeign(WrenVM* vm, ObjFiber* fiber,
-                        WrenForeignMethodFn foreign, int numArgs)
+#ifdef WREN_NATIVE_MODULES
+
+// The code [wrenWriteNativeCode] wrote for one function of a module, and the
+// length of the bytecode it was written from. [fn] is NULL for functions with
+// nothing worth running natively.
+typedef struct
 {
-  ASSERT(vm->apiStack == NULL, "Cannot already be in foreign call.");
-  vm->apiStack = fiber->stackTop - numArgs;
+  NativeFn fn;
+  int codeLength;
+} NativeFnEntry;
 
-  foreign(vm);
+typedef struct
+{
+  // The hash of the module's source.
+  uint64_t hash;
+
+  const NativeFnEntry* fns;
+  int numFns;
+} NativeModule;
+
+// The macros generated code is written in terms of. Each native function
+// works on the top call frame of [fiber] and keeps its own stack pointer,
+// which is stored back when it returns to the interpreter at [ip].
+#define NATIVE_FRAME()                                                         \
+    CallFrame* frame = &fiber->frames[fiber->numFrames - 1];                   \
+    Value* stackStart = frame->stackStart;                                     \
+    ObjFn* fn = frame->closure->fn;                                            \
+    uint8_t* code = fn->code.data;                                             \
+    Value* stackTop = fiber->stackTop;                                         \
+    (void)vm; (void)stackStart; (void)fn
+
+#define NATIVE_EXIT(ip)                                                        \
+    do                                                                         \
+    {                                                                          \
+      fiber->stackTop = stackTop;                                              \
+      return code + (ip);                                                      \
+    } while (false)
 
-  // Discard the stack slots for the arguments and temporaries but leave one
-  // for the result.
-  fiber->stackTop = vm->apiStack + 1;
+#define NATIVE_MODULE_VAR(ip)                                                  \
+    fn->module->variables.data[(code[(ip) + 1] << 8) | code[(ip) + 2]]
+
+#define NATIVE_FIELD(ip)                                                       \
+    AS_INSTANCE(stackStart[0])->fields[code[(ip) + 1]]
+
+#define NATIVE_STORE(obj, slot, value)                                         \
+    do                                                                         \
+    {                                                                          \
+      wrenWriteBarrier(vm, slot);                                              \
+      wrenRememberStore(vm, obj, value);                                       \
+      slot = value;                                                            \
+    } while (false)
+
+// Leaves the loop instruction at [ip] to the interpreter when it has a
+// profiler sample to take.
+#define NATIVE_LOOP(ip, numPopped, label)                                      \
+    do                                                                         \
+    {                                                                          \
+      if (__atomic_load_n(&vm->sampleRequested, __ATOMIC_RELAXED))             \
+        NATIVE_EXIT(ip);                                                       \
+      stackTop -= (numPopped);                                                 \
+      goto label;                                                              \
+    } while (false)
+
+// Falls through to the iteration protocol calls like the interpreter does.
+#define NATIVE_ITERATE(sequenceSlot, iteratorSlot, kind, exit, body)           \
+    do                                                                         \
+    {                                                                          \
+      Value value;                                                             \
+      Value next = iterateSequence(&stackStart[sequenceSlot],                  \
+                                   stackStart[iteratorSlot],                   \
+                                   (IterateKind)(kind), &value);               \
+      if (IS_FALSE(next)) { *stackTop++ = FALSE_VAL; goto exit; }              \
+      if (!IS_UNDEFINED(next))                                                 \
+      {                                                                        \
+        stackStart[iteratorSlot] = next;                                       \
+        *stackTop++ = value;                                                   \
+        goto body;                                                             \
+      }                                                                        \
+    } while (false)
+
+#include WREN_NATIVE_MODULES
+
+static const NativeModule nativeModules[] = {
+  #define NATIVE_MODULE(hash, fns) { hash, fns, sizeof(fns) / sizeof(fns[0]) },
+  #include WREN_NATIVE_MODULES
+  #undef NATIVE_MODULE
+  { 0, NULL, 0 }
+};
+
+static void attachNativeFns(ObjFn* fn, const NativeModule* module, int* index)
+{
+  fn->native = module->fns[(*index)++].fn;
+
+  for (int i = 0; i < fn->constants.count; i++)
+  {
+    if (IS_FN(fn->constants.data[i]))
+    {
+      attachNativeFns(AS_FN(fn->constants.data[i]), module, index);
+    }
+  }
+}
+
+static bool matchesNativeFns(ObjFn* fn, const NativeModule* module, int* index)
+{
+  if (*index >= module->numFns ||
+      module->fns[(*index)++].codeLength != fn->code.count)
+  {
+    return false;
+  }
+
+  for (int i = 0; i < fn->constants.count; i++)
+  {
+    if (IS_FN(fn->constants.data[i]) &&
+        !matchesNativeFns(AS_FN(fn->constants.data[i]), module, index))
+    {
+      return false;
+    }
+  }
 
-  vm->apiStack = NULL;
+  return true;
 }
 
-// Handles the current fiber having aborted because of an error.
-//
-// Walks the call chain of fibers, aborting each one until it hits a fiber that
-// handles the error. If none do, tells the VM to stop.
-static void runtimeError(WrenVM* vm)
+// Gives [fn], compiled from [source], and the functions it creates the native
+// code this build was made with for them, if any.
+static void attachNativeCode(ObjFn* fn, const char* source)
 {
-  ASSERT(wrenHasError(vm->fiber), "Should only call this after an error.");
+  uint64_t hash = hashSource(source);
 
-  ObjFiber* current = vm->fiber;
-  Value error = current->error;
-  
-  while (current != NULL)
+  for (const NativeModule* module = nativeModules; module->fns != NULL;
+       module++)
   {
-    // Every fiber along the call chain gets aborted with the same error.
-    current->error = error;
+    if (module->hash != hash) continue;
 
-    // If the caller ran this fiber using "try", give it the error and stop.
-    if (current->state == FIBER_TRY)
+    // Code compiled with different options doesn't match.
+    int index = 0;
+    if (!matchesNativeFns(fn, module, &index) || index != module->numFns)
     {
-      // Make the caller's try method return the error message.
-      current->caller->stackTop[-1] = vm->fiber->error;
-      vm->fiber = current->caller;
       return;
     }
-    
-    // Otherwise, unhook the caller since we will never resume and return to it.
-    ObjFiber* caller = current->caller;
-    current->caller = NULL;
-    current = caller;
-  }
 
-  // If we got here, nothing caught the error, so show the stack trace.
-  wrenDebugPrintStackTrace(vm);
-  vm->fiber = NULL;
-  vm->apiStack = NULL;
+    index = 0;
+    attachNativeFns(fn, module, &index);
+    return;
+  }
 }
 
-// Aborts the current fiber with an appropriate method not found error for a
-// method with [symbol] on [classObj].
-static void methodNotFound(WrenVM* vm, ObjClass* classObj, int symbol)
-{
-  vm->fiber->error = wrenStringFormat(vm, "@ does not implement '$'.",
-      OBJ_VAL(classObj->name), vm->methodNames.data[symbol]->value);
-}
+#else
 
-// Looks up the previously loaded module with [name].
-//
-// Returns `NULL` if no module with that name has been loaded.
-static ObjModule* getModule(WrenVM* vm, Value name)
+static void attachNativeCode(ObjFn* fn, const char* source) {}
+
+#endif
+
+// Serializes [fn], just compiled from [source], and hands it to the host.
+static void saveBytecode(WrenVM* vm, Value name, ObjFn* fn, const char* source)
 {
-  Value moduleValue = wrenMapGet(vm->modules, name);
-  return !IS_UNDEFINED(moduleValue) ? AS_MODULE(moduleValue) : NULL;
+  ByteBuffer bytes;
+  wrenByteBufferInit(&bytes);
+
+  wrenPushRoot(vm, (Obj*)fn);
+  if (wrenSerializeModule(vm, fn, source, &bytes))
+  {
+    vm->config.saveBytecodeFn(vm, IS_NULL(name) ? NULL : AS_CSTRING(name),
+                              source, bytes.data, bytes.count);
+  }
+  wrenPopRoot(vm);
+
+  wrenByteBufferClear(vm, &bytes);
 }
 
+// Compiles [source] into the module [name], creating it if needed.
+//
+// If [useBytecode] is true, the host gets a chance to provide the compiled
+// module instead, and is given the result if it doesn't.
 static ObjClosure* compileInModule(WrenVM* vm, Value name, const char* source,
-                                   bool isExpression, bool printErrors)
+                                   bool isExpression, bool printErrors,
+                                   bool useBytecode)
 {
   // See if the module has already been loaded.
   ObjModule* module = getModule(vm, name);
@@ -11391,13 +16060,39 @@ static ObjClosure* compileInModule(WrenVM* vm, Value name, const char* source,
     }
   }
 
-  ObjFn* fn = wrenCompile(vm, module, source, isExpression, printErrors);
+  ObjFn* fn = NULL;
+  if (useBytecode && vm->config.loadBytecodeFn != NULL)
+  {
+    const char* moduleName = IS_NULL(name) ? NULL : AS_CSTRING(name);
+    WrenLoadBytecodeResult result = vm->config.loadBytecodeFn(vm, moduleName,
+                                                              source);
+    if (result.bytecode != NULL)
+    {
+      fn = wrenDeserializeModule(vm, module, source,
+                                 (const uint8_t*)result.bytecode,
+                                 result.length);
+    }
+
+    if (result.onComplete) result.onComplete(vm, moduleName, result);
+  }
+
   if (fn == NULL)
   {
-    // TODO: Should we still store the module even if it didn't compile?
-    return NULL;
+    fn = wrenCompile(vm, module, source, isExpression, printErrors);
+    if (fn == NULL)
+    {
+      // TODO: Should we still store the module even if it didn't compile?
+      return NULL;
+    }
+
+    if (useBytecode && vm->config.saveBytecodeFn != NULL)
+    {
+      saveBytecode(vm, name, fn, source);
+    }
   }
 
+  attachNativeCode(fn, source);
+
   // Functions are always wrapped in closures.
   wrenPushRoot(vm, (Obj*)fn);
   ObjClosure* closure = wrenNewClosure(vm, fn);
@@ -11536,6 +16231,7 @@ static void endClass(WrenVM* vm)
 
   ObjClass* classObj = AS_CLASS(classValue);
     classObj->attributes = attributes;
+    wrenRememberStore(vm, &classObj->obj, attributes);
 }
 
 // Creates a new class.
@@ -11574,8 +16270,8 @@ static void createForeign(WrenVM* vm, ObjFiber* fiber, Value* stack)
   int symbol = wrenSymbolTableFind(&vm->methodNames, "<allocate>", 10);
   ASSERT(symbol != -1, "Should have defined <allocate> symbol.");
 
-  ASSERT(classObj->methods.count > symbol, "Class should have allocator.");
-  Method* method = &classObj->methods.data[symbol];
+  Method* method = wrenFindMethod(classObj, symbol);
+  ASSERT(method != NULL, "Class should have allocator.");
   ASSERT(method->type == METHOD_FOREIGN, "Allocator should be foreign.");
 
   // Pass the constructor arguments to the allocator as well.
@@ -11597,11 +16293,9 @@ void wrenFinalizeForeign(WrenVM* vm, ObjForeign* foreign)
   if (symbol == -1) return;
 
   // If the class doesn't have a finalizer, bail out.
-  ObjClass* classObj = foreign->obj.classObj;
-  if (symbol >= classObj->methods.count) return;
-
-  Method* method = &classObj->methods.data[symbol];
-  if (method->type == METHOD_NONE) return;
+  ObjClass* classObj = wrenGetObjClass(vm, &foreign->obj);
+  Method* method = wrenFindMethod(classObj, symbol);
+  if (method == NULL) return;
 
   ASSERT(method->type == METHOD_FOREIGN, "Finalizer should be foreign.");
 
@@ -11677,7 +16371,8 @@ static Value importModule(WrenVM* vm, Value name)
     return NULL_VAL;
   }
   
-  ObjClosure* moduleClosure = compileInModule(vm, name, result.source, false, true);
+  ObjClosure* moduleClosure = compileInModule(vm, name, result.source, false,
+                                              true, true);
   
   // Now that we're done, give the result back in case there's cleanup to do.
   if(result.onComplete) result.onComplete(vm, AS_CSTRING(name), result);
@@ -11738,6 +16433,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
   // Remember the current fiber so we can find it if a GC happens.
   vm->fiber = fiber;
   fiber->state = FIBER_ROOT;
+  wrenScanFiber(vm, fiber);
 
   // Hoist these into local variables. They are accessed frequently in the loop
   // but assigned less frequently. Keeping them in locals and updating them when
@@ -11785,6 +16481,34 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
         DISPATCH();                                                            \
       } while (false)
 
+  // Takes a profiler sample if one was requested. Only checked where control
+  // flow changes so straight line code doesn't pay for it.
+  #define CHECK_SAMPLE(classObj, symbol)                                       \
+      do                                                                       \
+      {                                                                        \
+        if (__atomic_load_n(&vm->sampleRequested, __ATOMIC_RELAXED))           \
+        {                                                                      \
+          STORE_FRAME();                                                       \
+          takeSample(vm, classObj, symbol);                                    \
+        }                                                                      \
+      } while (false)
+
+  // Hands the current function over to its native code, if it has any, from
+  // the start or a loop header. It returns at the first instruction it can't
+  // run. Counting needs every instruction to go through the interpreter.
+  #ifdef WREN_NATIVE_MODULES
+    #define RUN_NATIVE()                                                       \
+        do                                                                     \
+        {                                                                      \
+          if (fn->native != NULL && !counting)                                 \
+          {                                                                    \
+            ip = fn->native(vm, fiber, ip);                                    \
+          }                                                                    \
+        } while (false)
+  #else
+    #define RUN_NATIVE() do { } while (false)
+  #endif
+
   #if WREN_DEBUG_TRACE_INSTRUCTIONS
     // Prints the stack and instruction before each instruction is executed.
     #define DEBUG_TRACE_INSTRUCTIONS()                                         \
@@ -11930,6 +16654,19 @@ OPCODE(LOOP, 0)
 // Pop and if not truthy then jump the instruction pointer [arg] forward.
 OPCODE(JUMP_IF, -1)
 
+// Jump [arg] forward if the top two values on the stack are both numbers.
+// Leaves the stack unchanged.
+OPCODE(JUMP_IF_NUMS, 0)
+
+// Advances a for loop over a List or Range without going through the
+// iteration protocol. Reads the slots of the sequence and iterator, an
+// [IterateKind], and then two forward jump offsets, both relative to the end
+// of the instruction. When the loop is done, pushes false and jumps by the
+// first one to the exit test. Otherwise, stores the new iterator, pushes its
+// value and jumps by the second one to the loop body. For any other sequence
+// it does nothing, and the protocol calls that follow run instead.
+OPCODE(ITERATE, 0)
+
 // If the top of the stack is false, jump [arg] forward. Otherwise, pop and
 // continue.
 OPCODE(AND, -1)
@@ -12016,6 +16753,31 @@ OPCODE(IMPORT_MODULE, 1)
 // variable's value.
 OPCODE(IMPORT_VARIABLE, 1)
 
+// Superinstructions, which each run a pair of instructions that often follow
+// one another with a single dispatch. The compiler never emits them directly,
+// it rewrites pairs into them once a function is finished. Each one takes up
+// the same bytes as its pair. The second opcode byte holds the slot of a
+// LOAD_LOCAL_<n> and is unused otherwise.
+
+// LOAD_LOCAL_<n> followed by CALL_0 or CALL_1. Byte [arg] is the local slot
+// and the next two are the method symbol.
+OPCODE(LOAD_LOCAL_CALL_0, 1)
+OPCODE(LOAD_LOCAL_CALL_1, 0)
+
+// LOAD_MODULE_VAR followed by CALL_0.
+OPCODE(LOAD_MODULE_VAR_CALL_0, 1)
+
+// CONSTANT followed by CALL_1.
+OPCODE(CONSTANT_CALL_1, 0)
+
+// STORE_LOCAL, STORE_MODULE_VAR or STORE_FIELD_THIS followed by POP.
+OPCODE(STORE_LOCAL_POP, -1)
+OPCODE(STORE_MODULE_VAR_POP, -1)
+OPCODE(STORE_FIELD_THIS_POP, -1)
+
+// POP followed by LOOP.
+OPCODE(POP_LOOP, -1)
+
 // This pseudo-instruction indicates the end of the bytecode. It should
 // always be preceded by a `CODE_RETURN`, so is never actually executed.
 OPCODE(END, 0)
@@ -12023,6 +16785,33 @@ OPCODE(END, 0)
     #undef OPCODE
   };
 
+  // While counting or tracking allocations, every opcode first goes through
+  // countInstruction, which then jumps to the real implementation. Switching
+  // tables keeps the normal dispatch free of any counting checks. The table
+  // covers every byte so it can be initialized statically, like the dispatch
+  // table, and shared by VMs on any thread.
+  #define COUNT_2   &&countInstruction, &&countInstruction
+  #define COUNT_8   COUNT_2, COUNT_2, COUNT_2, COUNT_2
+  #define COUNT_32  COUNT_8, COUNT_8, COUNT_8, COUNT_8
+  #define COUNT_128 COUNT_32, COUNT_32, COUNT_32, COUNT_32
+
+  static void* countingTable[] = { COUNT_128, COUNT_128 };
+
+  #undef COUNT_2
+  #undef COUNT_8
+  #undef COUNT_32
+  #undef COUNT_128
+
+  void** dispatch;
+
+  #define REFRESH_COUNTING()                                                   \
+      do                                                                       \
+      {                                                                        \
+        stats = vm->countOpcodes ? vm->opcodeStats : NULL;                     \
+        counting = stats != NULL || vm->trackAllocations;                      \
+        dispatch = counting ? countingTable : dispatchTable;                   \
+      } while (false)
+
   #define INTERPRET_LOOP    DISPATCH();
   #define CASE_CODE(name)   code_##name
 
@@ -12030,22 +16819,49 @@ OPCODE(END, 0)
       do                                                                       \
       {                                                                        \
         DEBUG_TRACE_INSTRUCTIONS();                                            \
-        goto *dispatchTable[instruction = (Code)READ_BYTE()];                  \
+        goto *dispatch[instruction = (Code)READ_BYTE()];                       \
       } while (false)
 
   #else
 
+  #define REFRESH_COUNTING()                                                   \
+      do                                                                       \
+      {                                                                        \
+        stats = vm->countOpcodes ? vm->opcodeStats : NULL;                     \
+        counting = stats != NULL || vm->trackAllocations;                      \
+      } while (false)
+
   #define INTERPRET_LOOP                                                       \
       loop:                                                                    \
         DEBUG_TRACE_INSTRUCTIONS();                                            \
-        switch (instruction = (Code)READ_BYTE())
+        instruction = (Code)READ_BYTE();                                       \
+        if (counting) COUNT_INSTRUCTION();                                     \
+        switch (instruction)
 
   #define CASE_CODE(name)  case CODE_##name
   #define DISPATCH()       goto loop
 
   #endif
 
+  // Storing the IP lets allocation tracking see the line that's running.
+  #define COUNT_INSTRUCTION()                                                  \
+      do                                                                       \
+      {                                                                        \
+        frame->ip = ip;                                                        \
+        if (stats == NULL) break;                                              \
+        stats->opcodes[instruction]++;                                         \
+        stats->pairs[stats->previous][instruction]++;                          \
+        stats->previous = instruction;                                         \
+        fn->debug->executed++;                                                 \
+      } while (false)
+
+  // The instruction counts, NULL unless counting is on.
+  OpcodeStats* stats;
+  bool counting;
+  REFRESH_COUNTING();
+
   LOAD_FRAME();
+  RUN_NATIVE();
 
   Code instruction;
   INTERPRET_LOOP
@@ -12072,7 +16888,8 @@ OPCODE(END, 0)
       Value receiver = stackStart[0];
       ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
       ObjInstance* instance = AS_INSTANCE(receiver);
-      ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
+      ASSERT(field < wrenGetObjClass(vm, &instance->obj)->numFields,
+             "Out of bounds field.");
       PUSH(instance->fields[field]);
       DISPATCH();
     }
@@ -12086,6 +16903,11 @@ OPCODE(END, 0)
       stackStart[READ_BYTE()] = PEEK();
       DISPATCH();
 
+    CASE_CODE(STORE_LOCAL_POP):
+      stackStart[READ_BYTE()] = POP();
+      ip++;
+      DISPATCH();
+
     CASE_CODE(CONSTANT):
       PUSH(fn->constants.data[READ_SHORT()]);
       DISPATCH();
@@ -12133,6 +16955,33 @@ OPCODE(END, 0)
       classObj = wrenGetClassInline(vm, args[0]);
       goto completeCall;
 
+    CASE_CODE(LOAD_LOCAL_CALL_0):
+    CASE_CODE(LOAD_LOCAL_CALL_1):
+      PUSH(stackStart[READ_BYTE()]);
+      numArgs = instruction - CODE_LOAD_LOCAL_CALL_0 + 1;
+      symbol = READ_SHORT();
+      args = fiber->stackTop - numArgs;
+      classObj = wrenGetClassInline(vm, args[0]);
+      goto completeCall;
+
+    CASE_CODE(LOAD_MODULE_VAR_CALL_0):
+      PUSH(fn->module->variables.data[READ_SHORT()]);
+      ip++;
+      numArgs = 1;
+      symbol = READ_SHORT();
+      args = fiber->stackTop - numArgs;
+      classObj = wrenGetClassInline(vm, args[0]);
+      goto completeCall;
+
+    CASE_CODE(CONSTANT_CALL_1):
+      PUSH(fn->constants.data[READ_SHORT()]);
+      ip++;
+      numArgs = 2;
+      symbol = READ_SHORT();
+      args = fiber->stackTop - numArgs;
+      classObj = wrenGetClassInline(vm, args[0]);
+      goto completeCall;
+
     CASE_CODE(SUPER_0):
     CASE_CODE(SUPER_1):
     CASE_CODE(SUPER_2):
@@ -12163,8 +17012,8 @@ OPCODE(END, 0)
 
     completeCall:
       // If the class's method table doesn't include the symbol, bail.
-      if (symbol >= classObj->methods.count ||
-          (method = &classObj->methods.data[symbol])->type == METHOD_NONE)
+      method = wrenFindMethod(classObj, symbol);
+      if (method == NULL)
       {
         methodNotFound(vm, classObj, symbol);
         RUNTIME_ERROR();
@@ -12199,18 +17048,64 @@ OPCODE(END, 0)
           STORE_FRAME();
           method->as.primitive(vm, args);
           LOAD_FRAME();
+          RUN_NATIVE();
           break;
 
         case METHOD_FOREIGN:
+        {
+          // The result replaces the receiver, so the sample is named first.
+          ObjClass* receiverClass = IS_CLASS(args[0]) ? AS_CLASS(args[0])
+                                                      : classObj;
+
           callForeign(vm, fiber, method->as.foreign, numArgs);
           if (wrenHasError(fiber)) RUNTIME_ERROR();
+          CHECK_SAMPLE(receiverClass, symbol);
+
+          // The foreign method may have turned counting or tracking on or off.
+          REFRESH_COUNTING();
+          break;
+        }
+
+        case METHOD_FOREIGN_TYPED:
+        {
+          ObjClass* receiverClass = IS_CLASS(args[0]) ? AS_CLASS(args[0])
+                                                      : classObj;
+
+          callTypedForeign(vm, fiber, method, symbol, numArgs);
+          if (wrenHasError(fiber)) RUNTIME_ERROR();
+          CHECK_SAMPLE(receiverClass, symbol);
+          REFRESH_COUNTING();
           break;
+        }
 
         case METHOD_BLOCK:
           STORE_FRAME();
           wrenCallFunction(vm, fiber, (ObjClosure*)method->as.closure, numArgs);
           LOAD_FRAME();
+          CHECK_SAMPLE(NULL, -1);
+          RUN_NATIVE();
+          break;
+
+        case METHOD_FIELD_GETTER:
+        {
+          ObjInstance* instance = AS_INSTANCE(args[0]);
+          args[0] = instance->fields[method->field];
+          fiber->stackTop -= numArgs - 1;
+          break;
+        }
+
+        case METHOD_FIELD_SETTER:
+        {
+          ObjInstance* instance = AS_INSTANCE(args[0]);
+          wrenWriteBarrier(vm, instance->fields[method->field]);
+          wrenRememberStore(vm, &instance->obj, args[1]);
+          instance->fields[method->field] = args[1];
+
+          // Like the method it replaces, this returns the stored value.
+          args[0] = args[1];
+          fiber->stackTop -= numArgs - 1;
           break;
+        }
 
         case METHOD_NONE:
           UNREACHABLE();
@@ -12228,8 +17123,10 @@ OPCODE(END, 0)
 
     CASE_CODE(STORE_UPVALUE):
     {
-      ObjUpvalue** upvalues = frame->closure->upvalues;
-      *upvalues[READ_BYTE()]->value = PEEK();
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      wrenWriteBarrier(vm, *upvalue->value);
+      wrenRememberStore(vm, &upvalue->obj, PEEK());
+      *upvalue->value = PEEK();
       DISPATCH();
     }
 
@@ -12238,8 +17135,23 @@ OPCODE(END, 0)
       DISPATCH();
 
     CASE_CODE(STORE_MODULE_VAR):
-      fn->module->variables.data[READ_SHORT()] = PEEK();
+    {
+      Value* variable = &fn->module->variables.data[READ_SHORT()];
+      wrenWriteBarrier(vm, *variable);
+      wrenRememberStore(vm, &fn->module->obj, PEEK());
+      *variable = PEEK();
+      DISPATCH();
+    }
+
+    CASE_CODE(STORE_MODULE_VAR_POP):
+    {
+      Value* variable = &fn->module->variables.data[READ_SHORT()];
+      wrenWriteBarrier(vm, *variable);
+      wrenRememberStore(vm, &fn->module->obj, PEEK());
+      *variable = POP();
+      ip++;
       DISPATCH();
+    }
 
     CASE_CODE(STORE_FIELD_THIS):
     {
@@ -12247,7 +17159,10 @@ OPCODE(END, 0)
       Value receiver = stackStart[0];
       ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
       ObjInstance* instance = AS_INSTANCE(receiver);
-      ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
+      ASSERT(field < wrenGetObjClass(vm, &instance->obj)->numFields,
+             "Out of bounds field.");
+      wrenWriteBarrier(vm, instance->fields[field]);
+      wrenRememberStore(vm, &instance->obj, PEEK());
       instance->fields[field] = PEEK();
       DISPATCH();
     }
@@ -12258,7 +17173,8 @@ OPCODE(END, 0)
       Value receiver = POP();
       ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
       ObjInstance* instance = AS_INSTANCE(receiver);
-      ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
+      ASSERT(field < wrenGetObjClass(vm, &instance->obj)->numFields,
+             "Out of bounds field.");
       PUSH(instance->fields[field]);
       DISPATCH();
     }
@@ -12269,11 +17185,29 @@ OPCODE(END, 0)
       Value receiver = POP();
       ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
       ObjInstance* instance = AS_INSTANCE(receiver);
-      ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
+      ASSERT(field < wrenGetObjClass(vm, &instance->obj)->numFields,
+             "Out of bounds field.");
+      wrenWriteBarrier(vm, instance->fields[field]);
+      wrenRememberStore(vm, &instance->obj, PEEK());
       instance->fields[field] = PEEK();
       DISPATCH();
     }
 
+    CASE_CODE(STORE_FIELD_THIS_POP):
+    {
+      uint8_t field = READ_BYTE();
+      Value receiver = stackStart[0];
+      ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
+      ObjInstance* instance = AS_INSTANCE(receiver);
+      ASSERT(field < wrenGetObjClass(vm, &instance->obj)->numFields,
+             "Out of bounds field.");
+      wrenWriteBarrier(vm, instance->fields[field]);
+      wrenRememberStore(vm, &instance->obj, PEEK());
+      instance->fields[field] = POP();
+      ip++;
+      DISPATCH();
+    }
+
     CASE_CODE(JUMP):
     {
       uint16_t offset = READ_SHORT();
@@ -12286,6 +17220,19 @@ OPCODE(END, 0)
       // Jump back to the top of the loop.
       uint16_t offset = READ_SHORT();
       ip -= offset;
+      CHECK_SAMPLE(NULL, -1);
+      RUN_NATIVE();
+      DISPATCH();
+    }
+
+    CASE_CODE(POP_LOOP):
+    {
+      DROP();
+      ip++;
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      CHECK_SAMPLE(NULL, -1);
+      RUN_NATIVE();
       DISPATCH();
     }
 
@@ -12298,6 +17245,38 @@ OPCODE(END, 0)
       DISPATCH();
     }
 
+    CASE_CODE(JUMP_IF_NUMS):
+    {
+      uint16_t offset = READ_SHORT();
+      if (IS_NUM(PEEK()) && IS_NUM(PEEK2())) ip += offset;
+      DISPATCH();
+    }
+
+    CASE_CODE(ITERATE):
+    {
+      Value* sequence = &stackStart[READ_BYTE()];
+      Value* iterator = &stackStart[READ_BYTE()];
+      IterateKind kind = (IterateKind)READ_BYTE();
+      uint16_t exitOffset = READ_SHORT();
+      uint16_t bodyOffset = READ_SHORT();
+
+      Value value;
+      Value next = iterateSequence(sequence, *iterator, kind, &value);
+      if (IS_UNDEFINED(next)) DISPATCH();
+
+      if (IS_FALSE(next))
+      {
+        PUSH(FALSE_VAL);
+        ip += exitOffset;
+        DISPATCH();
+      }
+
+      *iterator = next;
+      PUSH(value);
+      ip += bodyOffset;
+      DISPATCH();
+    }
+
     CASE_CODE(AND):
     {
       uint16_t offset = READ_SHORT();
@@ -12336,7 +17315,7 @@ OPCODE(END, 0)
 
     CASE_CODE(CLOSE_UPVALUE):
       // Close the upvalue for the local if we have one.
-      closeUpvalues(fiber, fiber->stackTop - 1);
+      closeUpvalues(vm, fiber, fiber->stackTop - 1);
       DROP();
       DISPATCH();
 
@@ -12346,7 +17325,7 @@ OPCODE(END, 0)
       fiber->numFrames--;
 
       // Close any upvalues still in scope.
-      closeUpvalues(fiber, stackStart);
+      closeUpvalues(vm, fiber, stackStart);
 
       // If the fiber is complete, end it.
       if (fiber->numFrames == 0)
@@ -12365,6 +17344,7 @@ OPCODE(END, 0)
         fiber->caller = NULL;
         fiber = resumingFiber;
         vm->fiber = resumingFiber;
+        wrenScanFiber(vm, fiber);
         
         // Store the result in the resuming fiber.
         fiber->stackTop[-1] = result;
@@ -12381,6 +17361,7 @@ OPCODE(END, 0)
       }
       
       LOAD_FRAME();
+      CHECK_SAMPLE(NULL, -1);
       DISPATCH();
     }
 
@@ -12419,6 +17400,9 @@ OPCODE(END, 0)
           // Use the same upvalue as the current call frame.
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
+
+        // Capturing can collect, so the closure may not be young anymore.
+        wrenRememberStore(vm, &closure->obj, OBJ_VAL(closure->upvalues[i]));
       }
       DISPATCH();
     }
@@ -12508,6 +17492,12 @@ OPCODE(END, 0)
       UNREACHABLE();
   }
 
+  #if WREN_COMPUTED_GOTO
+  countInstruction:
+    COUNT_INSTRUCTION();
+    goto *dispatchTable[instruction];
+  #endif
+
   // We should only exit this function from an explicit return from CODE_RETURN
   // or a runtime error.
   UNREACHABLE();
@@ -12525,23 +17515,7 @@ WrenHandle* wrenMakeCallHandle(WrenVM* vm, const char* signature)
   ASSERT(signatureLength > 0, "Signature cannot be empty.");
   
   // Count the number parameters the method expects.
-  int numParams = 0;
-  if (signature[signatureLength - 1] == ')')
-  {
-    for (int i = signatureLength - 1; i > 0 && signature[i] != '('; i--)
-    {
-      if (signature[i] == '_') numParams++;
-    }
-  }
-  
-  // Count subscript arguments.
-  if (signature[0] == '[')
-  {
-    for (int i = 0; i < signatureLength && signature[i] != ']'; i++)
-    {
-      if (signature[i] == '_') numParams++;
-    }
-  }
+  int numParams = signatureArity(signature, signatureLength);
   
   // Add the signatue to the method table.
   int method =  wrenSymbolTableEnsure(vm, &vm->methodNames,
@@ -12641,7 +17615,8 @@ void wrenReleaseHandle(WrenVM* vm, WrenHandle* handle)
 WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
                                   const char* source)
 {
-  ObjClosure* closure = wrenCompileSource(vm, module, source, false, true);
+  ObjClosure* closure = wrenCompileSource(vm, module, source, false, true,
+                                          true);
   if (closure == NULL) return WREN_RESULT_COMPILE_ERROR;
   
   wrenPushRoot(vm, (Obj*)closure);
@@ -12653,7 +17628,8 @@ WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
 }
 
 ObjClosure* wrenCompileSource(WrenVM* vm, const char* module, const char* source,
-                            bool isExpression, bool printErrors)
+                            bool isExpression, bool printErrors,
+                            bool useBytecode)
 {
   Value nameValue = NULL_VAL;
   if (module != NULL)
@@ -12663,12 +17639,50 @@ ObjClosure* wrenCompileSource(WrenVM* vm, const char* module, const char* source
   }
   
   ObjClosure* closure = compileInModule(vm, nameValue, source,
-                                        isExpression, printErrors);
+                                        isExpression, printErrors, useBytecode);
 
   if (module != NULL) wrenPopRoot(vm); // nameValue.
   return closure;
 }
 
+WrenInterpretResult wrenCompileModule(WrenVM* vm, const char* module,
+                                      const char* source)
+{
+  Value nameValue = wrenNewString(vm, module);
+  wrenPushRoot(vm, AS_OBJ(nameValue));
+
+  ObjClosure* closure = compileInModule(vm, nameValue, source, false, true,
+                                        false);
+  if (closure != NULL && vm->config.saveBytecodeFn != NULL)
+  {
+    saveBytecode(vm, nameValue, closure->fn, source);
+  }
+
+  wrenPopRoot(vm); // nameValue.
+  return closure == NULL ? WREN_RESULT_COMPILE_ERROR : WREN_RESULT_SUCCESS;
+}
+
+WrenInterpretResult wrenWriteNativeCode(WrenVM* vm, const char* module,
+                                        const char* source, WrenWriteFn write)
+{
+  if (write == NULL) write = vm->config.writeFn;
+
+  Value nameValue = wrenNewString(vm, module);
+  wrenPushRoot(vm, AS_OBJ(nameValue));
+
+  ObjClosure* closure = compileInModule(vm, nameValue, source, false, true,
+                                        false);
+  if (closure != NULL && write != NULL)
+  {
+    wrenPushRoot(vm, (Obj*)closure);
+    wrenWriteNativeModule(vm, closure->fn, source, write);
+    wrenPopRoot(vm); // closure.
+  }
+
+  wrenPopRoot(vm); // nameValue.
+  return closure == NULL ? WREN_RESULT_COMPILE_ERROR : WREN_RESULT_SUCCESS;
+}
+
 Value wrenGetModuleVariable(WrenVM* vm, Value moduleName, Value variableName)
 {
   ObjModule* module = getModule(vm, moduleName);
@@ -12697,7 +17711,9 @@ int wrenDeclareVariable(WrenVM* vm, ObjModule* module, const char* name,
   // variable is first used. We'll use that later to report an error on the
   // right line.
   wrenValueBufferWrite(vm, &module->variables, NUM_VAL(line));
-  return wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+  int symbol = wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+  wrenRemember(vm, &module->obj);
+  return symbol;
 }
 
 int wrenDefineVariable(WrenVM* vm, ObjModule* module, const char* name,
@@ -12714,13 +17730,17 @@ int wrenDefineVariable(WrenVM* vm, ObjModule* module, const char* name,
   {
     // Brand new variable.
     symbol = wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+    wrenRemember(vm, &module->obj);
     wrenValueBufferWrite(vm, &module->variables, value);
+    wrenRememberStore(vm, &module->obj, value);
   }
   else if (IS_NUM(module->variables.data[symbol]))
   {
     // An implicitly declared variable's value will always be a number.
     // Now we have a real definition.
     if(line) *line = (int)AS_NUM(module->variables.data[symbol]);
+    wrenWriteBarrier(vm, module->variables.data[symbol]);
+    wrenRememberStore(vm, &module->obj, value);
     module->variables.data[symbol] = value;
 
 	// If this was a localname we want to error if it was 
@@ -12836,6 +17856,24 @@ void* wrenGetSlotForeign(WrenVM* vm, int slot)
   return AS_FOREIGN(vm->apiStack[slot])->data;
 }
 
+void wrenSetSlotExternalSize(WrenVM* vm, int slot, size_t size)
+{
+  validateApiSlot(vm, slot);
+  ASSERT(IS_FOREIGN(vm->apiStack[slot]),
+         "Slot must hold a foreign instance.");
+
+  ObjForeign* foreign = AS_FOREIGN(vm->apiStack[slot]);
+
+  // The next allocation collects if this pushed the heap over the limit.
+  vm->bytesAllocated += size - foreign->externalSize;
+  if (vm->gcPhase == GC_MARK && foreign->obj.isDark && size > foreign->externalSize)
+  {
+    vm->markedBytes += size - foreign->externalSize;
+  }
+  vm->externalBytes += size - foreign->externalSize;
+  foreign->externalSize = size;
+}
+
 const char* wrenGetSlotString(WrenVM* vm, int slot)
 {
   validateApiSlot(vm, slot);
@@ -12951,6 +17989,8 @@ void wrenSetListElement(WrenVM* vm, int listSlot, int index, int elementSlot)
   uint32_t usedIndex = wrenValidateIndex(list->elements.count, index);
   ASSERT(usedIndex != UINT32_MAX, "Index out of bounds.");
   
+  wrenWriteBarrier(vm, list->elements.data[usedIndex]);
+  wrenRememberStore(vm, &list->obj, vm->apiStack[elementSlot]);
   list->elements.data[usedIndex] = vm->apiStack[elementSlot];
 }
 
@@ -13104,6 +18144,26 @@ bool wrenHasModule(WrenVM* vm, const char* module)
   return moduleObj != NULL;
 }
 
+void wrenUnloadModule(WrenVM* vm, const char* module)
+{
+  ASSERT(module != NULL, "Module cannot be NULL.");
+
+  Value moduleName = wrenStringFormat(vm, "$", module);
+  wrenPushRoot(vm, AS_OBJ(moduleName));
+
+  ObjModule* moduleObj = getModule(vm, moduleName);
+  if (moduleObj != NULL)
+  {
+    // The last imported module is not a GC root, so don't leave it pointing at
+    // a module that may be collected.
+    if (vm->lastModule == moduleObj) vm->lastModule = NULL;
+
+    wrenMapRemoveKey(vm, vm->modules, moduleName);
+  }
+
+  wrenPopRoot(vm); // moduleName.
+}
+
 void wrenAbortFiber(WrenVM* vm, int slot)
 {
   validateApiSlot(vm, slot);
@@ -13179,7 +18239,7 @@ void metaCompile(WrenVM* vm)
   ObjString* module = fn->module->name;
 
   ObjClosure* closure = wrenCompileSource(vm, module->value, source,
-                                          isExpression, printErrors);
+                                          isExpression, printErrors, false);
   
   // Return the result. We can't use the public API for this since we have a
   // bare ObjClosure*.
@@ -13392,26 +18452,40 @@ static void randomAllocate(WrenVM* vm)
   well->index = 0;
 }
 
-static void randomSeed0(WrenVM* vm)
+// Fills the state of [well] from a single 32-bit [seed].
+//
+// This does not use srand() and rand() since their state is shared by the
+// whole process, which makes seeded generators racy and non-reproducible when
+// several VMs run on different threads.
+static void seedState(Well512* well, uint32_t seed)
 {
-  Well512* well = (Well512*)wrenGetSlotForeign(vm, 0);
-
-  srand((uint32_t)time(NULL));
+  // SplitMix32 spreads the seed across all 16 words.
   for (int i = 0; i < 16; i++)
   {
-    well->state[i] = rand();
+    uint32_t z = (seed += 0x9e3779b9U);
+    z = (z ^ (z >> 16)) * 0x85ebca6bU;
+    z = (z ^ (z >> 13)) * 0xc2b2ae35U;
+    well->state[i] = z ^ (z >> 16);
   }
 }
 
-static void randomSeed1(WrenVM* vm)
+static void randomSeed0(WrenVM* vm)
 {
   Well512* well = (Well512*)wrenGetSlotForeign(vm, 0);
-
-  srand((uint32_t)wrenGetSlotDouble(vm, 1));
-  for (int i = 0; i < 16; i++)
+  if (vm->config.randomSeedFn != NULL)
   {
-    well->state[i] = rand();
+    seedState(well, vm->config.randomSeedFn(vm));
   }
+  else
+  {
+    seedState(well, (uint32_t)time(NULL));
+  }
+}
+
+static void randomSeed1(WrenVM* vm)
+{
+  Well512* well = (Well512*)wrenGetSlotForeign(vm, 0);
+  seedState(well, (uint32_t)wrenGetSlotDouble(vm, 1));
 }
 
 static void randomSeed16(WrenVM* vm)
@@ -4,6 +4,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // The Wren semantic version number components.
 #define WREN_VERSION_MAJOR 0
@@ -60,6 +61,42 @@ typedef void* (*WrenReallocateFn)(void* memory, size_t newSize, void* userData);
 // A function callable from Wren code, but implemented in C.
 typedef void (*WrenForeignMethodFn)(WrenVM* vm);
 
+// The receiver or an argument of a typed foreign method, unpacked according to
+// the type it was declared with.
+typedef union
+{
+  double num;
+  int integer;
+  bool boolean;
+  const char* string;
+  void* foreign;
+} WrenForeignArg;
+
+// A foreign method whose receiver and arguments Wren checks against its
+// declared types and unpacks into [args] before calling it, [args][0] being
+// the receiver. The slots are set up as for a [WrenForeignMethodFn], for
+// returning a result and reading arguments declared as any value.
+typedef void (*WrenTypedForeignMethodFn)(WrenVM* vm,
+                                         const WrenForeignArg* args);
+
+// A typed foreign method and the types of its receiver and arguments, one
+// letter each, optionally separated by spaces:
+//
+// - `N` a number, unpacked as [num].
+// - `I` a number, truncated to [integer].
+// - `B` a boolean, unpacked as [boolean].
+// - `S` a string, unpacked as [string].
+// - `F` a foreign object, its data unpacked as [foreign].
+// - `_` any value, left in its slot.
+//
+// A call with an argument of the wrong type is a runtime error, and never
+// reaches [fn].
+typedef struct
+{
+  WrenTypedForeignMethodFn fn;
+  const char* types;
+} WrenTypedForeignMethod;
+
 // A finalizer function for freeing resources owned by an instance of a foreign
 // class. Unlike most foreign methods, finalizers do not have access to the VM
 // and should not interact with it since it's in the middle of a garbage
@@ -93,12 +130,48 @@ typedef struct WrenLoadModuleResult
 // Loads and returns the source code for the module [name].
 typedef WrenLoadModuleResult (*WrenLoadModuleFn)(WrenVM* vm, const char* name);
 
+// Forward declare
+struct WrenLoadBytecodeResult;
+
+// Called once Wren is done with the result of a loadBytecodeFn call, so that
+// you can free memory if appropriate.
+typedef void (*WrenLoadBytecodeCompleteFn)(WrenVM* vm, const char* module,
+    struct WrenLoadBytecodeResult result);
+
+// The result of a loadBytecodeFn call.
+// [bytecode] is the module as it was handed to saveBytecodeFn, [length] bytes
+// long, or NULL to compile the source.
+// [onComplete] an optional callback that will be called once Wren is done with the result.
+typedef struct WrenLoadBytecodeResult
+{
+  const void* bytecode;
+  size_t length;
+  WrenLoadBytecodeCompleteFn onComplete;
+  void* userData;
+} WrenLoadBytecodeResult;
+
+// Returns the compiled form of [module], whose source is [source]. [module] is
+// `NULL` for the core module.
+typedef WrenLoadBytecodeResult (*WrenLoadBytecodeFn)(WrenVM* vm,
+    const char* module, const char* source);
+
+// Receives [module], just compiled from [source], serialized to [length] bytes
+// of [bytecode]. The bytes are only valid during the call.
+typedef void (*WrenSaveBytecodeFn)(WrenVM* vm, const char* module,
+    const char* source, const void* bytecode, size_t length);
+
 // Returns a pointer to a foreign method on [className] in [module] with
 // [signature].
 typedef WrenForeignMethodFn (*WrenBindForeignMethodFn)(WrenVM* vm,
     const char* module, const char* className, bool isStatic,
     const char* signature);
 
+// Returns a typed foreign method on [className] in [module] with [signature],
+// or one whose [fn] is `NULL` to bind it with [WrenBindForeignMethodFn].
+typedef WrenTypedForeignMethod (*WrenBindTypedForeignMethodFn)(WrenVM* vm,
+    const char* module, const char* className, bool isStatic,
+    const char* signature);
+
 // Displays a string of text to the user.
 typedef void (*WrenWriteFn)(WrenVM* vm, const char* text);
 
@@ -130,6 +203,87 @@ typedef void (*WrenErrorFn)(
     WrenVM* vm, WrenErrorType type, const char* module, int line,
     const char* message);
 
+// Returns a seed for a `Random` instance created without an explicit seed.
+typedef uint32_t (*WrenRandomSeedFn)(WrenVM* vm);
+
+// Called at a safe point after [wrenRequestSample] was called. When the sample
+// was taken right after a foreign method returned, [className] and [signature]
+// name that method, otherwise they are `NULL`.
+typedef void (*WrenSampleFn)(WrenVM* vm, const char* className,
+                             const char* signature);
+
+// A frame of the running fiber's call stack, as seen by [wrenGetStackFrames].
+typedef struct
+{
+  const char* module;
+  const char* function;
+  int line;
+} WrenStackFrame;
+
+// Receives a heap snapshot written by [wrenWriteHeapSnapshot], a piece of
+// [length] bytes at a time.
+typedef void (*WrenSnapshotFn)(void* userData, const char* text, size_t length);
+
+// Returns the bytes owned by the foreign object [data], including its own data
+// and any memory it points to. Its class is identified by the [allocate]
+// function it was bound with, since class names aren't unique across modules.
+typedef size_t (*WrenForeignSizeFn)(WrenVM* vm, WrenForeignMethodFn allocate,
+                                    void* data);
+
+// Called right before a garbage collection or an incremental step of one
+// starts, with [finished] set to false, and again when it's done, with
+// [finished] set to true.
+typedef void (*WrenGCFn)(WrenVM* vm, bool finished);
+
+// A function run on several threads at once by a [WrenParallelFn], each
+// passing a different [index] starting from 0.
+typedef void (*WrenWorkerFn)(WrenVM* vm, int index, void* data);
+
+// Runs [worker] on [count] threads at once, the calling one included, and
+// returns once all of them have finished.
+typedef void (*WrenParallelFn)(WrenVM* vm, int count, WrenWorkerFn worker,
+                               void* data);
+
+// The state of the garbage collector, as reported by [wrenGetGCStats].
+typedef struct
+{
+  // The number of collections so far.
+  unsigned long collections;
+
+  // The bytes known to be in use, live after the last collection plus
+  // whatever was allocated since.
+  size_t bytesAllocated;
+
+  // The value of [bytesAllocated] that triggers the next collection.
+  size_t nextGC;
+
+  // The bytes freed by the last collection and by all of them.
+  size_t lastFreed;
+  size_t totalFreed;
+
+  // The part of [bytesAllocated] owned by foreign objects outside the VM, as
+  // recorded by [wrenSetSlotExternalSize].
+  size_t externalBytes;
+
+  // The part of [bytesAllocated] taken by the method tables of classes.
+  size_t methodTableBytes;
+
+  // The class ids handed out so far. Ids of freed classes are reused, so this
+  // follows the most classes alive at once.
+  size_t classIds;
+
+  // Whether collections triggered by allocation run incrementally.
+  bool incremental;
+
+  // The number of minor collections, and the bytes allocated between them, or
+  // zero if collection isn't generational.
+  unsigned long minorCollections;
+  size_t nurserySize;
+
+  // The number of threads full collections mark on.
+  int markThreads;
+} WrenGCStats;
+
 typedef struct
 {
   // The callback invoked when the foreign object is created.
@@ -200,6 +354,23 @@ typedef struct
   // should return NULL and Wren will report that as a runtime error.
   WrenLoadModuleFn loadModuleFn;
 
+  // The callback Wren uses to skip compiling a module it has compiled before.
+  //
+  // Before the source of a module is compiled, whether it comes from
+  // [loadModuleFn] or [wrenInterpret], this is called with the module's name
+  // and source. If it returns bytecode that [saveBytecodeFn] was given for the
+  // same source by the same version of Wren, the module is loaded from it.
+  // Anything else is ignored and the source is compiled as usual.
+  //
+  // If this is `NULL`, modules are always compiled from source.
+  WrenLoadBytecodeFn loadBytecodeFn;
+
+  // The callback that receives every module compiled from source, serialized
+  // so that [loadBytecodeFn] can hand it back to a later VM.
+  //
+  // If this is `NULL`, compiled modules aren't serialized.
+  WrenSaveBytecodeFn saveBytecodeFn;
+
   // The callback Wren uses to find a foreign method and bind it to a class.
   //
   // When a foreign method is declared in a class, this will be called with the
@@ -211,6 +382,13 @@ typedef struct
   // Wren will report it as runtime error.
   WrenBindForeignMethodFn bindForeignMethodFn;
 
+  // The callback Wren tries before [bindForeignMethodFn], for foreign methods
+  // that take their arguments already checked and unpacked. That saves a slot
+  // API call per argument, for methods called often enough for it to matter.
+  //
+  // If this is `NULL`, every foreign method is bound by [bindForeignMethodFn].
+  WrenBindTypedForeignMethodFn bindTypedForeignMethodFn;
+
   // The callback Wren uses to find a foreign class and get its foreign methods.
   //
   // When a foreign class is declared, this will be called with the class's
@@ -232,6 +410,56 @@ typedef struct
   // errors.
   WrenErrorFn errorFn;
 
+  // The callback the optional random module uses to seed generators created
+  // with `Random.new()`.
+  //
+  // If this is `NULL`, generators are seeded from the current time. Hosts that
+  // need reproducible runs can return a fixed sequence of seeds instead.
+  WrenRandomSeedFn randomSeedFn;
+
+  // The callback used to record a profiler sample.
+  //
+  // Samples are only taken when requested through [wrenRequestSample], if
+  // this is `NULL` requests are ignored.
+  WrenSampleFn sampleFn;
+
+  // The callback invoked around every garbage collection.
+  //
+  // If this is `NULL`, collections aren't reported.
+  WrenGCFn gcFn;
+
+  // Whether collections triggered by allocation run incrementally.
+  //
+  // If true, a collection marks and sweeps a bounded part of the heap every
+  // time another slice of memory is allocated, instead of pausing the program
+  // for the whole heap at once. Steps can also be taken explicitly with
+  // [wrenCollectGarbageStep] in either mode.
+  //
+  // Defaults to false.
+  bool incrementalGC;
+
+  // The number of bytes allocated between minor collections.
+  //
+  // If non-zero, collection is generational. Objects that survive a collection
+  // are old and only looked at again by a full one, while a minor collection
+  // runs every time this many bytes have been allocated and only visits the
+  // objects allocated since the last one and the old objects changed to point
+  // at them. Ignored if [incrementalGC] is set.
+  //
+  // Defaults to 0.
+  size_t nurserySize;
+
+  // The callback used to run work on several threads.
+  //
+  // If this is `NULL`, the VM only ever uses the thread it's called on.
+  WrenParallelFn parallelFn;
+
+  // The number of threads full collections mark the heap on, through
+  // [parallelFn]. The result is the same as marking on one.
+  //
+  // Defaults to 1.
+  int markThreads;
+
   // The number of bytes Wren will allocate before triggering the first garbage
   // collection.
   //
@@ -319,11 +547,98 @@ WREN_API void wrenFreeVM(WrenVM* vm);
 // Immediately run the garbage collector to free unused memory.
 WREN_API void wrenCollectGarbage(WrenVM* vm);
 
+// Does up to [work] units of incremental garbage collection, a unit being one
+// object marked or swept. A new collection is only started once the heap is
+// at least halfway to the next automatic one.
+//
+// If collection is generational, runs a minor collection instead once the
+// nursery is at least half full.
+//
+// Returns whether a collection is still in progress.
+WREN_API bool wrenCollectGarbageStep(WrenVM* vm, int work);
+
+// Stores the current state of the garbage collector in [stats].
+WREN_API void wrenGetGCStats(WrenVM* vm, WrenGCStats* stats);
+
+// Collects garbage, then writes every object on the heap with its size and
+// the objects it references, followed by the roots, using [write].
+//
+// The snapshot is text, one record per line with tab separated fields:
+//
+//     o <address> <type> <class> <size> <references> <label>
+//     m <address> <methods> <bytes>
+//     r <kind> <address>
+//
+// where <references> is a comma separated list of addresses and <label> is a
+// name or the start of a string's contents, if the object has one. The sizes
+// of foreign objects come from [foreignSize] if it isn't `NULL`. Every class
+// has an "m" record with the number of methods it has and the bytes its method
+// table takes, which are also part of the class's size.
+WREN_API void wrenWriteHeapSnapshot(WrenVM* vm, WrenSnapshotFn write,
+                                    void* userData,
+                                    WrenForeignSizeFn foreignSize);
+
+// Asks [vm] to call its sampleFn at the next call, return or loop back edge.
+//
+// Unlike the rest of the API this may be called from any thread, typically
+// from a profiler's timer.
+WREN_API void wrenRequestSample(WrenVM* vm);
+
+// Stores up to [maxFrames] frames of the running fiber's call stack in
+// [frames], innermost first, and returns how many were stored. Frames of the
+// core module are skipped. The strings are owned by the VM and only valid
+// until it resumes running.
+WREN_API int wrenGetStackFrames(WrenVM* vm, WrenStackFrame* frames,
+                                int maxFrames);
+
+// Turns counting of executed instructions on or off. While on, the
+// interpreter counts every opcode, every pair of consecutive opcodes and the
+// instructions executed by each function. Counts are kept when counting is
+// turned off again.
+WREN_API void wrenSetOpcodeCounting(WrenVM* vm, bool enabled);
+
+// Writes a report of the instruction counts gathered so far using [write], or
+// the VM's writeFn if [write] is `NULL`.
+WREN_API void wrenDumpOpcodeStats(WrenVM* vm, WrenWriteFn write);
+
+// Turns allocation tracking on or off. While on, every allocation is counted
+// against the line of Wren code that caused it, skipping the core module, and
+// every new object against its class. Counts are kept when tracking is turned
+// off again.
+WREN_API void wrenSetAllocationTracking(WrenVM* vm, bool enabled);
+
+// Writes the [maxSites] allocation sites that allocated the most bytes, and
+// the allocations by class, using [write] or the VM's writeFn if [write] is
+// `NULL`.
+WREN_API void wrenDumpAllocationStats(WrenVM* vm, WrenWriteFn write,
+                                      int maxSites);
+
 // Runs [source], a string of Wren source code in a new fiber in [vm] in the
 // context of resolved [module].
 WREN_API WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
                                   const char* source);
 
+// Compiles [source] as the module [module] without running it, and hands the
+// result to the VM's saveBytecodeFn.
+//
+// Returns [WREN_RESULT_COMPILE_ERROR] if the source has errors.
+WREN_API WrenInterpretResult wrenCompileModule(WrenVM* vm, const char* module,
+                                               const char* source);
+
+// Compiles [source] as the module [module] without running it, and writes C
+// code that runs its functions natively using [write], or the VM's writeFn if
+// [write] is `NULL`. Code written for several modules can go in one file.
+//
+// Building Wren with `WREN_NATIVE_MODULES` defined as the name of that file
+// makes those modules run the native code when their source is unchanged.
+// Anything the code doesn't handle, such as most calls, falls back to the
+// interpreter.
+//
+// Returns [WREN_RESULT_COMPILE_ERROR] if the source has errors.
+WREN_API WrenInterpretResult wrenWriteNativeCode(WrenVM* vm, const char* module,
+                                                 const char* source,
+                                                 WrenWriteFn write);
+
 // Creates a handle that can be used to invoke a method with [signature] on
 // using a receiver and arguments that are set up on the stack.
 //
@@ -430,6 +745,14 @@ WREN_API double wrenGetSlotDouble(WrenVM* vm, int slot);
 // foreign class.
 WREN_API void* wrenGetSlotForeign(WrenVM* vm, int slot);
 
+// Records that the foreign object in [slot] owns [size] bytes of memory
+// allocated outside of the VM, replacing whatever was recorded before.
+//
+// The bytes count towards the heap size like the VM's own allocations, so
+// objects holding on to large buffers cause collections sooner. Set it back
+// to zero when the object releases its memory early.
+WREN_API void wrenSetSlotExternalSize(WrenVM* vm, int slot, size_t size);
+
 // Reads a string from [slot].
 //
 // The memory for the returned string is owned by Wren. You can inspect it
@@ -541,6 +864,11 @@ WREN_API bool wrenHasVariable(WrenVM* vm, const char* module, const char* name);
 // Returns true if [module] has been imported/resolved before, false if not.
 WREN_API bool wrenHasModule(WrenVM* vm, const char* module);
 
+// Removes [module] from the set of loaded modules, if it has been loaded, so
+// that importing it again will load and run it from scratch. Anything that
+// was only reachable through the module is garbage after this.
+WREN_API void wrenUnloadModule(WrenVM* vm, const char* module);
+
 // Sets the current fiber to be aborted, and uses the value in [slot] as the
 // runtime error object.
 WREN_API void wrenAbortFiber(WrenVM* vm, int slot);
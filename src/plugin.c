@@ -0,0 +1,146 @@
+#include "plugin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "util.h"
+
+#if defined(_WIN32)
+#define PLUGIN_EXTENSION ".dll"
+#elif defined(__APPLE__)
+#define PLUGIN_EXTENSION ".dylib"
+#else
+#define PLUGIN_EXTENSION ".so"
+#endif
+
+typedef struct
+{
+    char path[MAX_PATH_LENGTH];
+    void* object;
+    const Plugin* plugin;
+} LoadedPlugin;
+
+// Shared by every VM, batch jobs load and bind plugins from several threads.
+static SDL_mutex* pluginLock = NULL;
+static LoadedPlugin* plugins = NULL;
+static int pluginCount = 0;
+
+void initPlugins()
+{
+    pluginLock = SDL_CreateMutex();
+}
+
+// Must be called with pluginLock held.
+static const Plugin* findLoadedPlugin(const char* path)
+{
+    for (int i = 0; i < pluginCount; i++) {
+        if (strcmp(plugins[i].path, path) == 0)
+            return plugins[i].plugin;
+    }
+
+    return NULL;
+}
+
+// The same name imported by scripts in different directories is a different
+// plugin, so they're told apart by the file they're loaded from.
+static bool getPluginPath(char path[MAX_PATH_LENGTH], const char* basePath, const char* module)
+{
+    return joinPath(path, basePath, module + strlen(PLUGIN_PREFIX), PLUGIN_EXTENSION);
+}
+
+bool isPluginModule(const char* module)
+{
+    return strncmp(module, PLUGIN_PREFIX, strlen(PLUGIN_PREFIX)) == 0;
+}
+
+// Loading holds the lock throughout, so that two jobs importing the same
+// plugin at once don't both load it.
+static const Plugin* loadPluginLocked(const char* path, TextBuffer* log)
+{
+    const Plugin* plugin = findLoadedPlugin(path);
+    if (plugin != NULL)
+        return plugin;
+
+    void* object = SDL_LoadObject(path);
+    if (object == NULL) {
+        printText(log, "Error loading plugin: %s (%s).\n", path, SDL_GetError());
+        return NULL;
+    }
+
+    PluginFn pluginFn = (PluginFn)SDL_LoadFunction(object, PLUGIN_ENTRY);
+    plugin = pluginFn != NULL ? pluginFn() : NULL;
+
+    if (plugin == NULL || plugin->version != PLUGIN_VERSION) {
+        printText(log, "Error loading plugin: %s (no %s version %d).\n", path, PLUGIN_ENTRY, PLUGIN_VERSION);
+        SDL_UnloadObject(object);
+        return NULL;
+    }
+
+    LoadedPlugin* loaded = (LoadedPlugin*)realloc(plugins, (pluginCount + 1) * sizeof(LoadedPlugin));
+    if (loaded == NULL) {
+        SDL_UnloadObject(object);
+        return NULL;
+    }
+
+    plugins = loaded;
+    snprintf(plugins[pluginCount].path, MAX_PATH_LENGTH, "%s", path);
+    plugins[pluginCount].object = object;
+    plugins[pluginCount].plugin = plugin;
+    pluginCount++;
+
+    return plugin;
+}
+
+const Plugin* loadPlugin(const char* basePath, const char* module, TextBuffer* log)
+{
+    char path[MAX_PATH_LENGTH];
+    if (!getPluginPath(path, basePath, module)) {
+        printText(log, "Plugin path is too long: %s.\n", module);
+        return NULL;
+    }
+
+    SDL_LockMutex(pluginLock);
+    const Plugin* plugin = loadPluginLocked(path, log);
+    SDL_UnlockMutex(pluginLock);
+
+    return plugin;
+}
+
+const Plugin* findPlugin(const char* basePath, const char* module)
+{
+    char path[MAX_PATH_LENGTH];
+    if (module == NULL || !isPluginModule(module) || !getPluginPath(path, basePath, module))
+        return NULL;
+
+    SDL_LockMutex(pluginLock);
+    const Plugin* plugin = findLoadedPlugin(path);
+    SDL_UnlockMutex(pluginLock);
+
+    return plugin;
+}
+
+// Only called when a class is defined, the bound functions are called
+// directly after that.
+const ForeignMethodBinding* findPluginMethod(const Plugin* plugin, const char* className, bool isStatic, const char* signature)
+{
+    for (int i = 0; i < plugin->methodCount; i++) {
+        const ForeignMethodBinding* binding = &plugin->methods[i];
+        if (binding->isStatic == isStatic && strcmp(binding->signature, signature) == 0 && strcmp(binding->className, className) == 0)
+            return binding;
+    }
+
+    return NULL;
+}
+
+const ForeignClassBinding* findPluginClass(const Plugin* plugin, const char* className)
+{
+    for (int i = 0; i < plugin->classCount; i++) {
+        if (strcmp(plugin->classes[i].className, className) == 0)
+            return &plugin->classes[i];
+    }
+
+    return NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stdbool.h>
+
+#include "lib/wren/wren.h"
+#include "util.h"
+
+// Native plugins are shared objects imported as "native:name". A plugin
+// exports a function named basilPlugin returning its Plugin, which lists the
+// foreign methods and classes of the module it implements. The tables can be
+// generated from #bind attributes by scripts/wren_to_bindings.py.
+//
+// Plugins call back into the Wren API of the executable that loads them, so
+// basil has to export its symbols (-rdynamic).
+
+#define PLUGIN_VERSION 1
+#define PLUGIN_ENTRY "basilPlugin"
+#define PLUGIN_PREFIX "native:"
+
+typedef struct
+{
+    const char* className;
+    bool isStatic;
+    const char* signature;
+    int arity;
+
+    // The argument types of typedFn, NULL for methods bound with fn.
+    const char* types;
+    WrenForeignMethodFn fn;
+    WrenTypedForeignMethodFn typedFn;
+} ForeignMethodBinding;
+
+typedef struct
+{
+    const char* className;
+    WrenForeignMethodFn allocate;
+    WrenFinalizerFn finalize;
+} ForeignClassBinding;
+
+typedef struct
+{
+    // Must be PLUGIN_VERSION.
+    int version;
+
+    // The Wren source of the module. When NULL, it's read from name.wren next
+    // to the plugin instead.
+    const char* source;
+
+    const ForeignMethodBinding* methods;
+    int methodCount;
+    const ForeignClassBinding* classes;
+    int classCount;
+} Plugin;
+
+typedef const Plugin* (*PluginFn)(void);
+
+// Must be called before any VM imports a plugin.
+void initPlugins();
+
+bool isPluginModule(const char* module);
+
+// Loads the plugin for "native:name" from [basePath]/name with the platform's
+// extension, once per process for each file. Plugins stay loaded until exit,
+// since their finalizers can run as late as the last VM being freed. Errors go
+// to [log], or stdout when it's NULL.
+const Plugin* loadPlugin(const char* basePath, const char* module, TextBuffer* log);
+
+// NULL unless [module] is a plugin that's already loaded from [basePath].
+const Plugin* findPlugin(const char* basePath, const char* module);
+
+const ForeignMethodBinding* findPluginMethod(const Plugin* plugin, const char* className, bool isStatic, const char* signature);
+const ForeignClassBinding* findPluginClass(const Plugin* plugin, const char* className);
+
+#endif
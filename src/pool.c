@@ -0,0 +1,232 @@
+#include "pool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+// Small blocks come from per-thread slabs, one free list per size class. A VM
+// only ever runs on one thread at a time, so the lists need no locking.
+#define POOL_CLASSES 16
+#define MAX_SMALL_BLOCK 512
+#define SLAB_SIZE (64 * 1024)
+#define LARGE_BLOCK 0xffffffffu
+
+// Every block starts with its class and the size that was asked for, the VM
+// doesn't pass the old size when freeing.
+typedef struct
+{
+    uint32_t sizeClass;
+    uint32_t size;
+} BlockHeader;
+
+typedef struct FreeBlock
+{
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct Slab
+{
+    struct Slab* next;
+
+    // Keeps the blocks after it 16 byte aligned.
+    void* padding;
+} Slab;
+
+typedef struct
+{
+    FreeBlock* freeBlocks[POOL_CLASSES];
+    Slab* slabs;
+    PoolStats stats;
+} Pool;
+
+static const uint32_t classSizes[POOL_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+// The class of each block size, in steps of 16 bytes.
+static uint8_t classIndex[MAX_SMALL_BLOCK / 16 + 1];
+
+static SDL_TLSID poolKey = 0;
+
+void initPool()
+{
+    int sizeClass = 0;
+
+    for (int i = 0; i <= MAX_SMALL_BLOCK / 16; i++) {
+        while (classSizes[sizeClass] < i * 16)
+            sizeClass++;
+
+        classIndex[i] = sizeClass;
+    }
+
+    poolKey = SDL_TLSCreate();
+}
+
+bool poolActive()
+{
+    return poolKey != 0;
+}
+
+static Pool* getPool()
+{
+    Pool* pool = (Pool*)SDL_TLSGet(poolKey);
+
+    if (pool == NULL) {
+        pool = (Pool*)calloc(1, sizeof(Pool));
+        SDL_TLSSet(poolKey, pool, NULL);
+    }
+
+    return pool;
+}
+
+static bool refill(Pool* pool, int sizeClass)
+{
+    Slab* slab = (Slab*)malloc(SLAB_SIZE);
+    if (slab == NULL)
+        return false;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->stats.slabBytes += SLAB_SIZE;
+
+    uint32_t blockSize = classSizes[sizeClass];
+    char* block = (char*)(slab + 1);
+    char* end = (char*)slab + SLAB_SIZE;
+
+    for (; block + blockSize <= end; block += blockSize) {
+        FreeBlock* free = (FreeBlock*)block;
+        free->next = pool->freeBlocks[sizeClass];
+        pool->freeBlocks[sizeClass] = free;
+    }
+
+    return true;
+}
+
+static void* allocate(Pool* pool, size_t size)
+{
+    size_t total = size + sizeof(BlockHeader);
+    BlockHeader* header;
+
+    if (total > MAX_SMALL_BLOCK) {
+        header = (BlockHeader*)malloc(total);
+        if (header == NULL)
+            return NULL;
+
+        header->sizeClass = LARGE_BLOCK;
+        pool->stats.largeBytes += size;
+        pool->stats.largeBlocks++;
+    } else {
+        int sizeClass = classIndex[(total + 15) / 16];
+
+        if (pool->freeBlocks[sizeClass] == NULL && !refill(pool, sizeClass))
+            return NULL;
+
+        header = (BlockHeader*)pool->freeBlocks[sizeClass];
+        pool->freeBlocks[sizeClass] = pool->freeBlocks[sizeClass]->next;
+
+        header->sizeClass = sizeClass;
+        pool->stats.usedBytes += classSizes[sizeClass];
+        pool->stats.requestedBytes += size;
+    }
+
+    header->size = (uint32_t)size;
+    return header + 1;
+}
+
+static void release(Pool* pool, void* memory)
+{
+    BlockHeader* header = (BlockHeader*)memory - 1;
+
+    if (header->sizeClass == LARGE_BLOCK) {
+        pool->stats.largeBytes -= header->size;
+        pool->stats.largeBlocks--;
+        free(header);
+        return;
+    }
+
+    int sizeClass = header->sizeClass;
+    pool->stats.usedBytes -= classSizes[sizeClass];
+    pool->stats.requestedBytes -= header->size;
+
+    FreeBlock* free = (FreeBlock*)header;
+    free->next = pool->freeBlocks[sizeClass];
+    pool->freeBlocks[sizeClass] = free;
+}
+
+void* poolReallocate(void* memory, size_t newSize, void* userData)
+{
+    Pool* pool = getPool();
+
+    if (newSize == 0) {
+        if (memory != NULL)
+            release(pool, memory);
+
+        return NULL;
+    }
+
+    if (memory == NULL)
+        return allocate(pool, newSize);
+
+    BlockHeader* header = (BlockHeader*)memory - 1;
+    size_t total = newSize + sizeof(BlockHeader);
+
+    // Large blocks that stay large can be resized in place by malloc.
+    if (header->sizeClass == LARGE_BLOCK && total > MAX_SMALL_BLOCK) {
+        size_t oldSize = header->size;
+
+        header = (BlockHeader*)realloc(header, total);
+        if (header == NULL)
+            return NULL;
+
+        header->size = (uint32_t)newSize;
+        pool->stats.largeBytes += newSize - oldSize;
+        return header + 1;
+    }
+
+    // Small blocks keep their class while the new size still fits.
+    if (header->sizeClass != LARGE_BLOCK && total <= classSizes[header->sizeClass]) {
+        pool->stats.requestedBytes += newSize - header->size;
+        header->size = (uint32_t)newSize;
+        return memory;
+    }
+
+    void* moved = allocate(pool, newSize);
+    if (moved == NULL)
+        return NULL;
+
+    memcpy(moved, memory, header->size < newSize ? header->size : newSize);
+    release(pool, memory);
+
+    return moved;
+}
+
+void freeThreadPool()
+{
+    if (poolKey == 0)
+        return;
+
+    Pool* pool = (Pool*)SDL_TLSGet(poolKey);
+    if (pool == NULL)
+        return;
+
+    Slab* slab = pool->slabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    free(pool);
+    SDL_TLSSet(poolKey, NULL, NULL);
+}
+
+bool getPoolStats(PoolStats* stats)
+{
+    if (poolKey == 0)
+        return false;
+
+    *stats = getPool()->stats;
+    return true;
+}
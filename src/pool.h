@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    size_t slabBytes;
+    size_t usedBytes;
+    size_t requestedBytes;
+    size_t largeBytes;
+    int largeBlocks;
+} PoolStats;
+
+void initPool();
+bool poolActive();
+
+void* poolReallocate(void* memory, size_t newSize, void* userData);
+void freeThreadPool();
+
+bool getPoolStats(PoolStats* stats);
+
+#endif
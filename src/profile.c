@@ -0,0 +1,245 @@
+#include "profile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#define MAX_STACK_FRAMES 128
+#define MAX_STACK_LENGTH 4096
+#define MAX_ALLOCATION_SITES 40
+
+typedef struct
+{
+    char* stack;
+    uint32_t hash;
+    int count;
+} Stack;
+
+static const char* profilePath = NULL;
+static int profileInterval = 1;
+
+static const char* opcodePath = NULL;
+static const char* allocationPath = NULL;
+static FILE* reportFile = NULL;
+
+static SDL_Thread* watchdog = NULL;
+static SDL_atomic_t stopping;
+static WrenVM* profiledVM = NULL;
+
+static Stack* stacks = NULL;
+static int stackCount, stackCapacity;
+static int sampleCount;
+
+void initProfile(const char* path, int interval)
+{
+    profilePath = path;
+    profileInterval = interval > 0 ? interval : 1;
+}
+
+void initOpcodeProfile(const char* path)
+{
+    opcodePath = path;
+}
+
+void initAllocationProfile(const char* path)
+{
+    allocationPath = path;
+}
+
+static void writeReport(WrenVM* vm, const char* text)
+{
+    fputs(text, reportFile);
+}
+
+static bool openReport(const char* path)
+{
+    reportFile = fopen(path, "w");
+
+    if (reportFile == NULL) {
+        printf("Error opening file: %s.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void closeReport()
+{
+    fclose(reportFile);
+    reportFile = NULL;
+}
+
+static int runWatchdog(void* data)
+{
+    // The watchdog only raises a flag, the VM takes the sample itself at its
+    // next safe point so the stack is never read while it changes.
+    while (!SDL_AtomicGet(&stopping)) {
+        SDL_Delay(profileInterval);
+        wrenRequestSample(profiledVM);
+    }
+
+    return 0;
+}
+
+void startProfile(WrenVM* vm)
+{
+    if (opcodePath != NULL)
+        wrenSetOpcodeCounting(vm, true);
+
+    if (allocationPath != NULL)
+        wrenSetAllocationTracking(vm, true);
+
+    if (profilePath == NULL || watchdog != NULL)
+        return;
+
+    profiledVM = vm;
+    SDL_AtomicSet(&stopping, 0);
+    watchdog = SDL_CreateThread(runWatchdog, "basil profiler", NULL);
+}
+
+void stopProfile(WrenVM* vm)
+{
+    if (watchdog != NULL) {
+        SDL_AtomicSet(&stopping, 1);
+        SDL_WaitThread(watchdog, NULL);
+
+        watchdog = NULL;
+        profiledVM = NULL;
+    }
+
+    // Opcode and allocation counts live in the VM, so they're written before
+    // it goes away.
+    if (opcodePath != NULL) {
+        if (openReport(opcodePath)) {
+            wrenDumpOpcodeStats(vm, writeReport);
+            closeReport();
+        }
+
+        opcodePath = NULL;
+    }
+
+    if (allocationPath != NULL) {
+        if (openReport(allocationPath)) {
+            wrenDumpAllocationStats(vm, writeReport, MAX_ALLOCATION_SITES);
+            closeReport();
+        }
+
+        allocationPath = NULL;
+    }
+}
+
+static uint32_t hashString(const char* text)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char* c = text; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void growStacks()
+{
+    int capacity = stackCapacity == 0 ? 256 : stackCapacity * 2;
+    Stack* grown = (Stack*)calloc(capacity, sizeof(Stack));
+
+    for (int i = 0; i < stackCapacity; i++) {
+        if (stacks[i].stack == NULL)
+            continue;
+
+        uint32_t index = stacks[i].hash & (capacity - 1);
+        while (grown[index].stack != NULL)
+            index = (index + 1) & (capacity - 1);
+
+        grown[index] = stacks[i];
+    }
+
+    free(stacks);
+    stacks = grown;
+    stackCapacity = capacity;
+}
+
+static void countStack(const char* stack)
+{
+    if (stackCount * 4 >= stackCapacity * 3)
+        growStacks();
+
+    uint32_t hash = hashString(stack);
+    uint32_t index = hash & (stackCapacity - 1);
+
+    while (stacks[index].stack != NULL) {
+        if (stacks[index].hash == hash && strcmp(stacks[index].stack, stack) == 0) {
+            stacks[index].count++;
+            return;
+        }
+
+        index = (index + 1) & (stackCapacity - 1);
+    }
+
+    stacks[index].stack = (char*)malloc(strlen(stack) + 1);
+    strcpy(stacks[index].stack, stack);
+    stacks[index].hash = hash;
+    stacks[index].count = 1;
+    stackCount++;
+}
+
+void profileSample(WrenVM* vm, const char* className, const char* signature)
+{
+    WrenStackFrame frames[MAX_STACK_FRAMES];
+    int frameCount = wrenGetStackFrames(vm, frames, MAX_STACK_FRAMES);
+
+    char stack[MAX_STACK_LENGTH];
+    int length = 0;
+
+    // Collapsed stacks go from the root to the leaf, separated by semicolons.
+    for (int i = frameCount - 1; i >= 0 && length < MAX_STACK_LENGTH; i--) {
+        length += snprintf(stack + length, MAX_STACK_LENGTH - length, "%s%s (%s:%d)",
+            length > 0 ? ";" : "", frames[i].function, frames[i].module, frames[i].line);
+    }
+
+    if (className != NULL && length < MAX_STACK_LENGTH)
+        length += snprintf(stack + length, MAX_STACK_LENGTH - length, "%s%s.%s", length > 0 ? ";" : "", className, signature);
+
+    if (length == 0)
+        return;
+
+    countStack(stack);
+    sampleCount++;
+}
+
+bool closeProfile()
+{
+    if (profilePath == NULL)
+        return true;
+
+    FILE* file = fopen(profilePath, "w");
+    if (file == NULL) {
+        printf("Error opening file: %s.\n", profilePath);
+        return false;
+    }
+
+    for (int i = 0; i < stackCapacity; i++)
+        if (stacks[i].stack != NULL)
+            fprintf(file, "%s %d\n", stacks[i].stack, stacks[i].count);
+
+    fclose(file);
+
+    printf("%d samples in %d stacks written to %s\n", sampleCount, stackCount, profilePath);
+
+    for (int i = 0; i < stackCapacity; i++)
+        free(stacks[i].stack);
+
+    free(stacks);
+
+    stacks = NULL;
+    stackCount = stackCapacity = 0;
+    sampleCount = 0;
+    profilePath = NULL;
+
+    return true;
+}
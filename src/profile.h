@@ -0,0 +1,18 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+#include "lib/wren/wren.h"
+
+void initProfile(const char* path, int interval);
+void initOpcodeProfile(const char* path);
+void initAllocationProfile(const char* path);
+bool closeProfile();
+
+void startProfile(WrenVM* vm);
+void stopProfile(WrenVM* vm);
+
+void profileSample(WrenVM* vm, const char* className, const char* signature);
+
+#endif
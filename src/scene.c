@@ -0,0 +1,400 @@
+#include "scene.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "pool.h"
+#include "profile.h"
+#include "trace.h"
+#include "util.h"
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_SEED 1
+
+static double seconds(uint64_t ticks)
+{
+    return ticks / (double)SDL_GetPerformanceFrequency();
+}
+
+static uint32_t sceneRandomSeed(WrenVM* vm)
+{
+    Scene* scene = ((Context*)wrenGetUserData(vm))->scene;
+
+    // The first generator gets the seed itself, later ones are spread apart so
+    // their streams don't overlap.
+    return scene->seed + scene->seedCount++ * 0x632be5abU;
+}
+
+static void applyEvents(Scene* scene, Window* window)
+{
+    while (scene->nextEvent < scene->eventCount && scene->events[scene->nextEvent].frame <= scene->frame) {
+        SceneEvent* event = &scene->events[scene->nextEvent++];
+
+        switch (event->type) {
+        case SCENE_MOUSE_MOVE:
+            window->mouseX = event->x;
+            window->mouseY = event->y;
+            break;
+        case SCENE_MOUSE_DOWN:
+            window->mouseHeld[event->button] = true;
+            window->mousePressed[event->button] = true;
+            break;
+        case SCENE_MOUSE_UP:
+            window->mouseHeld[event->button] = false;
+            break;
+        case SCENE_KEY_DOWN:
+            window->keysHeld[event->key] = true;
+            window->keysPressed[event->key] = true;
+            break;
+        case SCENE_KEY_UP:
+            window->keysHeld[event->key] = false;
+            break;
+        case SCENE_QUIT:
+            window->closed = true;
+            break;
+        }
+    }
+
+    if (scene->frame >= scene->frameCount)
+        window->closed = true;
+}
+
+void beginScene(Scene* scene, Window* window)
+{
+    scene->frame = 0;
+    scene->rasterTime = 0;
+
+    applyEvents(scene, window);
+
+    scene->frameStart = SDL_GetPerformanceCounter();
+}
+
+void presentScene(Scene* scene, Image* image)
+{
+    if (image->width != scene->screenWidth || image->height != scene->screenHeight) {
+        scene->screen = (Color*)realloc(scene->screen, image->width * image->height * sizeof(Color));
+        scene->screenWidth = image->width;
+        scene->screenHeight = image->height;
+    }
+
+    memcpy(scene->screen, image->data, image->width * image->height * sizeof(Color));
+}
+
+void endSceneFrame(Scene* scene, Window* window, uint64_t presentTime)
+{
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    if (scene->frame < scene->frameCount) {
+        SceneFrame* frame = &scene->frames[scene->frame];
+
+        frame->total = seconds(now - scene->frameStart);
+        frame->raster = seconds(scene->rasterTime);
+        frame->present = seconds(presentTime);
+        frame->script = frame->total - frame->raster - frame->present;
+    }
+
+    scene->frame++;
+    scene->rasterTime = 0;
+
+    applyEvents(scene, window);
+
+    scene->frameStart = SDL_GetPerformanceCounter();
+}
+
+static bool parseEvents(Scene* scene, char* input, const char* path)
+{
+    int capacity = 0;
+    int lineNumber = 0;
+
+    for (char* line = strtok(input, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+        lineNumber++;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        SceneEvent event;
+        memset(&event, 0, sizeof(SceneEvent));
+
+        char type[32];
+        char key[32];
+        bool valid = false;
+
+        if (sscanf(line, "%d %31s", &event.frame, type) == 2) {
+            if (strcmp(type, "mousemove") == 0) {
+                event.type = SCENE_MOUSE_MOVE;
+                valid = sscanf(line, "%*d %*s %d %d", &event.x, &event.y) == 2;
+            } else if (strcmp(type, "mousedown") == 0 || strcmp(type, "mouseup") == 0) {
+                event.type = type[5] == 'd' ? SCENE_MOUSE_DOWN : SCENE_MOUSE_UP;
+                valid = sscanf(line, "%*d %*s %d", &event.button) == 1 && event.button >= 1 && event.button < 5;
+            } else if (strcmp(type, "keydown") == 0 || strcmp(type, "keyup") == 0) {
+                event.type = type[3] == 'd' ? SCENE_KEY_DOWN : SCENE_KEY_UP;
+                valid = sscanf(line, "%*d %*s %31s", key) == 1;
+                event.key = valid ? SDL_GetScancodeFromName(key) : SDL_SCANCODE_UNKNOWN;
+                valid = valid && event.key != SDL_SCANCODE_UNKNOWN;
+            } else if (strcmp(type, "quit") == 0) {
+                event.type = SCENE_QUIT;
+                valid = true;
+            }
+        }
+
+        if (!valid || event.frame < 0) {
+            printf("%s:%d: Invalid input event.\n", path, lineNumber);
+            return false;
+        }
+
+        if (scene->eventCount > 0 && event.frame < scene->events[scene->eventCount - 1].frame) {
+            printf("%s:%d: Input events must be in frame order.\n", path, lineNumber);
+            return false;
+        }
+
+        if (scene->eventCount == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            scene->events = (SceneEvent*)realloc(scene->events, capacity * sizeof(SceneEvent));
+        }
+
+        scene->events[scene->eventCount++] = event;
+    }
+
+    return true;
+}
+
+static int compareTimes(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* sorted, int count, double p)
+{
+    int index = (int)(p / 100.0 * count + 0.5) - 1;
+
+    if (index < 0)
+        index = 0;
+    else if (index >= count)
+        index = count - 1;
+
+    return sorted[index];
+}
+
+static uint64_t checksum(Scene* scene)
+{
+    // FNV-1a over the final framebuffer.
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t* bytes = (const uint8_t*)scene->screen;
+    size_t size = (size_t)scene->screenWidth * scene->screenHeight * sizeof(Color);
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void report(Scene* scene, GCPauses* gc, PoolStats* pool, const char* path, const char* jsonPath)
+{
+    int count = scene->frame < scene->frameCount ? scene->frame : scene->frameCount;
+
+    if (count == 0) {
+        printf("%s: no frames rendered\n", path);
+        return;
+    }
+
+    double* sorted = (double*)malloc(count * sizeof(double));
+    double total = 0, script = 0, raster = 0, present = 0;
+
+    for (int i = 0; i < count; i++) {
+        SceneFrame* frame = &scene->frames[i];
+
+        sorted[i] = frame->total;
+        total += frame->total;
+        script += frame->script;
+        raster += frame->raster;
+        present += frame->present;
+    }
+
+    qsort(sorted, count, sizeof(double), compareTimes);
+
+    double p50 = percentile(sorted, count, 50) * 1000;
+    double p95 = percentile(sorted, count, 95) * 1000;
+    double p99 = percentile(sorted, count, 99) * 1000;
+    double max = sorted[count - 1] * 1000;
+    uint64_t hash = checksum(scene);
+
+    printf("%s: %d frames in %.3f ms (seed %u)\n", path, count, total * 1000, scene->seed);
+    printf("frame    p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n", p50, p95, p99, max);
+    printf("mean     script %.3f ms, raster %.3f ms, present %.3f ms\n",
+        script * 1000 / count, raster * 1000 / count, present * 1000 / count);
+    printf("gc       %d pauses, total %.3f ms, max %.3f ms\n", gc->pauses, gc->totalPause, gc->maxPause);
+    if (pool != NULL) {
+        printf("pool     %zu KB in slabs, %.1f%% in use, %.1f%% lost to size classes, %d large blocks (%zu KB)\n",
+            pool->slabBytes / 1024,
+            pool->slabBytes > 0 ? pool->usedBytes * 100.0 / pool->slabBytes : 0.0,
+            pool->usedBytes > 0 ? (pool->usedBytes - pool->requestedBytes) * 100.0 / pool->usedBytes : 0.0,
+            pool->largeBlocks, pool->largeBytes / 1024);
+    }
+
+    printf("checksum %016llx (%dx%d)\n", (unsigned long long)hash, scene->screenWidth, scene->screenHeight);
+
+    if (jsonPath != NULL) {
+        FILE* file = fopen(jsonPath, "w");
+
+        if (file == NULL) {
+            printf("Error opening file: %s.\n", jsonPath);
+        } else {
+            fprintf(file, "{\n");
+            fprintf(file, "  \"basil\": \"%s\",\n", BASIL_VERSION);
+            fprintf(file, "  \"script\": \"%s\",\n", path);
+            fprintf(file, "  \"seed\": %u,\n", scene->seed);
+            fprintf(file, "  \"frames\": %d,\n", count);
+            fprintf(file, "  \"totalMs\": %.3f,\n", total * 1000);
+            fprintf(file, "  \"p50Ms\": %.3f,\n", p50);
+            fprintf(file, "  \"p95Ms\": %.3f,\n", p95);
+            fprintf(file, "  \"p99Ms\": %.3f,\n", p99);
+            fprintf(file, "  \"maxMs\": %.3f,\n", max);
+            fprintf(file, "  \"scriptMs\": %.3f,\n", script * 1000 / count);
+            fprintf(file, "  \"rasterMs\": %.3f,\n", raster * 1000 / count);
+            fprintf(file, "  \"presentMs\": %.3f,\n", present * 1000 / count);
+            fprintf(file, "  \"gcPauses\": %d,\n", gc->pauses);
+            fprintf(file, "  \"gcTotalMs\": %.3f,\n", gc->totalPause);
+            fprintf(file, "  \"gcMaxMs\": %.3f,\n", gc->maxPause);
+            if (pool != NULL) {
+                fprintf(file, "  \"poolSlabBytes\": %zu,\n", pool->slabBytes);
+                fprintf(file, "  \"poolUsedBytes\": %zu,\n", pool->usedBytes);
+                fprintf(file, "  \"poolRequestedBytes\": %zu,\n", pool->requestedBytes);
+                fprintf(file, "  \"poolLargeBytes\": %zu,\n", pool->largeBytes);
+            }
+            fprintf(file, "  \"width\": %d,\n", scene->screenWidth);
+            fprintf(file, "  \"height\": %d,\n", scene->screenHeight);
+            fprintf(file, "  \"checksum\": \"%016llx\",\n", (unsigned long long)hash);
+            fprintf(file, "  \"frameTimes\": [\n");
+
+            for (int i = 0; i < count; i++) {
+                SceneFrame* frame = &scene->frames[i];
+                fprintf(file, "    {\"script\": %.6f, \"raster\": %.6f, \"present\": %.6f, \"total\": %.6f}%s\n",
+                    frame->script * 1000, frame->raster * 1000, frame->present * 1000, frame->total * 1000,
+                    i + 1 < count ? "," : "");
+            }
+
+            fprintf(file, "  ]\n");
+            fprintf(file, "}\n");
+
+            fclose(file);
+        }
+    }
+
+    free(sorted);
+}
+
+int runScene(WrenConfiguration* config, int argc, char** argv)
+{
+    Scene scene;
+    memset(&scene, 0, sizeof(Scene));
+
+    scene.frameCount = DEFAULT_FRAMES;
+    scene.seed = DEFAULT_SEED;
+
+    const char* inputPath = NULL;
+    const char* jsonPath = NULL;
+    bool headless = false;
+
+    int i = 2;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            scene.frameCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            scene.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+            inputPath = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else
+            break;
+    }
+
+    if (i >= argc || strncmp(argv[i], "--", 2) == 0 || scene.frameCount <= 0) {
+        printf("Usage:\n");
+        printf("\tbasil scene [--frames n] [--seed n] [--input file] [--json file] [--headless] [file] [arguments...]\n");
+        return 1;
+    }
+
+    if (inputPath != NULL) {
+        char* input = readFile(inputPath, NULL);
+        if (input == NULL)
+            return 1;
+
+        bool parsed = parseEvents(&scene, input, inputPath);
+        free(input);
+
+        if (!parsed) {
+            free(scene.events);
+            return 1;
+        }
+    }
+
+    const char* sourcePath = argv[i];
+
+    char* source = readFile(sourcePath, NULL);
+    if (source == NULL) {
+        free(scene.events);
+        return 1;
+    }
+
+    // The script sees the same OS.args as when run directly.
+    int argCount = argc - i + 1;
+    char** args = (char**)malloc(argCount * sizeof(char*));
+    args[0] = argv[0];
+    memcpy(&args[1], &argv[i], (argCount - 1) * sizeof(char*));
+
+    scene.frames = (SceneFrame*)calloc(scene.frameCount, sizeof(SceneFrame));
+
+    Context context;
+    initContext(&context, argCount, args);
+    context.headless = headless;
+    context.scene = &scene;
+
+    config->userData = &context;
+    config->randomSeedFn = sceneRandomSeed;
+
+    TRACE_BEGIN("VM init");
+    WrenVM* vm = wrenNewVM(config);
+    TRACE_END();
+
+    startProfile(vm);
+
+    TRACE_BEGIN("interpret");
+    WrenInterpretResult result = wrenInterpret(vm, sourcePath, source);
+    TRACE_END();
+
+    stopProfile(vm);
+
+    // Taken while the VM is alive, afterwards the pool is empty.
+    PoolStats pool;
+    bool pooled = getPoolStats(&pool);
+
+    free(source);
+    wrenFreeVM(vm);
+    freeThreadPool();
+
+    report(&scene, &context.gc, pooled ? &pool : NULL, sourcePath, jsonPath);
+
+    free(scene.frames);
+    free(scene.events);
+    free(scene.screen);
+    free(args);
+
+    if (result != WREN_RESULT_SUCCESS)
+        return 1;
+
+    return context.exitCode;
+}
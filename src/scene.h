@@ -0,0 +1,12 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "api.h"
+
+int runScene(WrenConfiguration* config, int argc, char** argv);
+
+void beginScene(Scene* scene, Window* window);
+void presentScene(Scene* scene, Image* image);
+void endSceneFrame(Scene* scene, Window* window, uint64_t presentTime);
+
+#endif
@@ -0,0 +1,328 @@
+#include "trace.h"
+
+#ifdef BASIL_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#define MAX_ZONE_DEPTH 64
+
+typedef struct
+{
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    bool instant;
+} TraceEvent;
+
+typedef struct
+{
+    const char* name;
+    uint64_t start;
+} Zone;
+
+typedef struct
+{
+    WrenForeignMethodFn fn;
+    WrenTypedForeignMethodFn typedFn;
+    const char* name;
+} TracedMethod;
+
+bool traceActive = false;
+
+static const char* tracePath = NULL;
+static uint64_t traceStart;
+static int frame, firstFrame, lastFrame;
+
+static TraceEvent* events = NULL;
+static int eventCount, eventCapacity;
+
+static Zone zones[MAX_ZONE_DEPTH];
+static int zoneDepth;
+
+// Interned zone names, an open addressed hash set.
+static char** names = NULL;
+static size_t nameCount, nameCapacity;
+
+static bool recording()
+{
+    return frame >= firstFrame && (lastFrame < 0 || frame <= lastFrame);
+}
+
+static void addEvent(const char* name, uint64_t start, uint64_t duration, bool instant)
+{
+    if (eventCount == eventCapacity) {
+        eventCapacity = eventCapacity == 0 ? 4096 : eventCapacity * 2;
+        events = (TraceEvent*)realloc(events, eventCapacity * sizeof(TraceEvent));
+    }
+
+    TraceEvent* event = &events[eventCount++];
+    event->name = name;
+    event->start = start;
+    event->duration = duration;
+    event->instant = instant;
+}
+
+void initTrace(const char* path, int first, int last)
+{
+    tracePath = path;
+    firstFrame = first;
+    lastFrame = last;
+    frame = 0;
+    traceStart = SDL_GetPerformanceCounter();
+    traceActive = true;
+}
+
+void traceBegin(const char* name)
+{
+    if (zoneDepth < MAX_ZONE_DEPTH) {
+        zones[zoneDepth].name = name;
+        zones[zoneDepth].start = SDL_GetPerformanceCounter();
+    }
+
+    zoneDepth++;
+}
+
+void traceEnd()
+{
+    if (zoneDepth == 0)
+        return;
+
+    zoneDepth--;
+
+    if (zoneDepth < MAX_ZONE_DEPTH && recording()) {
+        Zone* zone = &zones[zoneDepth];
+        addEvent(zone->name, zone->start, SDL_GetPerformanceCounter() - zone->start, false);
+    }
+}
+
+void traceFrame()
+{
+    if (recording())
+        addEvent("frame", SDL_GetPerformanceCounter(), 0, true);
+
+    frame++;
+
+    // Nothing after the last frame is recorded, so stop paying for it.
+    if (lastFrame >= 0 && frame > lastFrame)
+        traceActive = false;
+}
+
+static uint32_t hashName(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* c = name; *c != '\0'; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+    return hash;
+}
+
+static char** findName(char** table, size_t capacity, const char* name)
+{
+    size_t index = hashName(name) & (capacity - 1);
+    while (table[index] != NULL && strcmp(table[index], name) != 0)
+        index = (index + 1) & (capacity - 1);
+
+    return &table[index];
+}
+
+const char* traceName(const char* name)
+{
+    if (nameCapacity > 0) {
+        char** slot = findName(names, nameCapacity, name);
+        if (*slot != NULL)
+            return *slot;
+    }
+
+    // Kept at most half full so probes stay short. Zones whose name can't be
+    // stored still show up, just without it.
+    if ((nameCount + 1) * 2 > nameCapacity) {
+        size_t capacity = nameCapacity == 0 ? 64 : nameCapacity * 2;
+        char** table = capacity > nameCapacity ? (char**)calloc(capacity, sizeof(char*)) : NULL;
+        if (table == NULL)
+            return "(out of memory)";
+
+        for (size_t i = 0; i < nameCapacity; i++)
+            if (names[i] != NULL)
+                *findName(table, capacity, names[i]) = names[i];
+
+        free(names);
+        names = table;
+        nameCapacity = capacity;
+    }
+
+    char* copy = (char*)malloc(strlen(name) + 1);
+    if (copy == NULL)
+        return "(out of memory)";
+
+    strcpy(copy, name);
+    *findName(names, nameCapacity, name) = copy;
+    nameCount++;
+
+    return copy;
+}
+
+// Foreign methods only receive the VM, so each traced method gets its own
+// trampoline that knows which method it stands for.
+#define TRAMPOLINES(X)                                                                                              \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)                           \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)                 \
+    X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47)                 \
+    X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)                 \
+    X(64) X(65) X(66) X(67) X(68) X(69) X(70) X(71) X(72) X(73) X(74) X(75) X(76) X(77) X(78) X(79)                 \
+    X(80) X(81) X(82) X(83) X(84) X(85) X(86) X(87) X(88) X(89) X(90) X(91) X(92) X(93) X(94) X(95)                 \
+    X(96) X(97) X(98) X(99) X(100) X(101) X(102) X(103) X(104) X(105) X(106) X(107) X(108) X(109) X(110) X(111)     \
+    X(112) X(113) X(114) X(115) X(116) X(117) X(118) X(119) X(120) X(121) X(122) X(123) X(124) X(125) X(126) X(127)
+
+#define MAX_TRACED_METHODS 128
+
+static TracedMethod methods[MAX_TRACED_METHODS];
+static int methodCount;
+
+static void callTraced(WrenVM* vm, int index)
+{
+    TracedMethod* method = &methods[index];
+
+    if (!traceActive) {
+        method->fn(vm);
+        return;
+    }
+
+    traceBegin(method->name);
+    method->fn(vm);
+    traceEnd();
+}
+
+static void callTracedTyped(WrenVM* vm, int index, const WrenForeignArg* args)
+{
+    TracedMethod* method = &methods[index];
+
+    if (!traceActive) {
+        method->typedFn(vm, args);
+        return;
+    }
+
+    traceBegin(method->name);
+    method->typedFn(vm, args);
+    traceEnd();
+}
+
+#define DEFINE_TRAMPOLINE(i)                                              \
+    static void traced##i(WrenVM* vm)                                     \
+    {                                                                     \
+        callTraced(vm, i);                                                \
+    }                                                                     \
+                                                                          \
+    static void tracedTyped##i(WrenVM* vm, const WrenForeignArg* args)    \
+    {                                                                     \
+        callTracedTyped(vm, i, args);                                     \
+    }
+
+TRAMPOLINES(DEFINE_TRAMPOLINE)
+
+#define TRAMPOLINE_ENTRY(i) traced##i,
+#define TYPED_TRAMPOLINE_ENTRY(i) tracedTyped##i,
+
+static WrenForeignMethodFn trampolines[MAX_TRACED_METHODS] = { TRAMPOLINES(TRAMPOLINE_ENTRY) };
+static WrenTypedForeignMethodFn typedTrampolines[MAX_TRACED_METHODS] = { TRAMPOLINES(TYPED_TRAMPOLINE_ENTRY) };
+
+// Returns the index of the trampoline for the method, or -1 once they've all
+// been used, and the method still works but isn't traced.
+static int findTrampoline(WrenForeignMethodFn fn, WrenTypedForeignMethodFn typedFn, const char* className, bool isStatic, const char* signature)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "%s%s%s", className, isStatic ? "." : "#", signature);
+
+    for (int i = 0; i < methodCount; i++)
+        if (methods[i].fn == fn && methods[i].typedFn == typedFn && strcmp(methods[i].name, name) == 0)
+            return i;
+
+    if (methodCount == MAX_TRACED_METHODS)
+        return -1;
+
+    methods[methodCount].fn = fn;
+    methods[methodCount].typedFn = typedFn;
+    methods[methodCount].name = traceName(name);
+
+    return methodCount++;
+}
+
+WrenForeignMethodFn traceForeignMethod(WrenForeignMethodFn fn, const char* className, bool isStatic, const char* signature)
+{
+    int index = findTrampoline(fn, NULL, className, isStatic, signature);
+    return index >= 0 ? trampolines[index] : fn;
+}
+
+WrenTypedForeignMethodFn traceTypedForeignMethod(WrenTypedForeignMethodFn fn, const char* className, bool isStatic, const char* signature)
+{
+    int index = findTrampoline(NULL, fn, className, isStatic, signature);
+    return index >= 0 ? typedTrampolines[index] : fn;
+}
+
+static void writeString(FILE* file, const char* text)
+{
+    fputc('"', file);
+
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+
+    fputc('"', file);
+}
+
+bool closeTrace()
+{
+    if (tracePath == NULL)
+        return true;
+
+    traceActive = false;
+
+    FILE* file = fopen(tracePath, "w");
+    if (file == NULL) {
+        printf("Error opening file: %s.\n", tracePath);
+        return false;
+    }
+
+    double frequency = SDL_GetPerformanceFrequency() / 1000000.0;
+
+    // Chrome trace event format, viewable in chrome://tracing or Perfetto.
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    for (int i = 0; i < eventCount; i++) {
+        TraceEvent* event = &events[i];
+
+        fprintf(file, "{\"name\": ");
+        writeString(file, event->name);
+
+        if (event->instant)
+            fprintf(file, ", \"ph\": \"i\", \"s\": \"g\"");
+        else
+            fprintf(file, ", \"ph\": \"X\", \"dur\": %.3f", event->duration / frequency);
+
+        fprintf(file, ", \"ts\": %.3f, \"pid\": 1, \"tid\": 1}%s\n",
+            (event->start - traceStart) / frequency, i + 1 < eventCount ? "," : "");
+    }
+
+    fprintf(file, "]}\n");
+    fclose(file);
+
+    // Names stay around, traced methods keep pointing at them.
+    free(events);
+
+    events = NULL;
+    eventCount = eventCapacity = 0;
+    tracePath = NULL;
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+#include "lib/wren/wren.h"
+
+// Tracing is only compiled in when BASIL_TRACE is defined, otherwise all the
+// macros below expand to nothing.
+#ifdef BASIL_TRACE
+
+extern bool traceActive;
+
+void initTrace(const char* path, int firstFrame, int lastFrame);
+bool closeTrace();
+
+void traceBegin(const char* name);
+void traceEnd();
+void traceFrame();
+
+const char* traceName(const char* name);
+WrenForeignMethodFn traceForeignMethod(WrenForeignMethodFn fn, const char* className, bool isStatic, const char* signature);
+WrenTypedForeignMethodFn traceTypedForeignMethod(WrenTypedForeignMethodFn fn, const char* className, bool isStatic, const char* signature);
+
+#define TRACE_BEGIN(name)     \
+    do {                      \
+        if (traceActive)      \
+            traceBegin(name); \
+    } while (false)
+
+#define TRACE_END()       \
+    do {                  \
+        if (traceActive)  \
+            traceEnd();   \
+    } while (false)
+
+#define TRACE_FRAME()     \
+    do {                  \
+        if (traceActive)  \
+            traceFrame(); \
+    } while (false)
+
+#else
+
+#define TRACE_BEGIN(name)
+#define TRACE_END()
+#define TRACE_FRAME()
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,11 +12,11 @@ static const char* strprbrk(const char* s, const char* charset)
     return latestMatch;
 }
 
-char* readFile(const char* path)
+char* readFile(const char* path, TextBuffer* log)
 {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
-        printf("Error opening file: %s.\n", path);
+        printText(log, "Error opening file: %s.\n", path);
         return NULL;
     }
 
@@ -25,14 +26,14 @@ char* readFile(const char* path)
 
     char* buffer = (char*)malloc(fileSize + 1);
     if (buffer == NULL) {
-        printf("Error allocating memory for file: %s.\n", path);
+        printText(log, "Error allocating memory for file: %s.\n", path);
         fclose(file);
         return NULL;
     }
 
     size_t bytesRead = fread(buffer, 1, fileSize, file);
     if (bytesRead < fileSize) {
-        printf("Error reading file: %s.\n", path);
+        printText(log, "Error reading file: %s.\n", path);
         fclose(file);
         free(buffer);
         return NULL;
@@ -72,3 +73,53 @@ const char* getDirectoryPath(const char* filePath)
 
     return dirPath;
 }
+
+void appendText(TextBuffer* buffer, const char* text)
+{
+    int length = (int)strlen(text);
+
+    if (buffer->length + length + 1 > buffer->capacity) {
+        int capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while (buffer->length + length + 1 > capacity)
+            capacity *= 2;
+
+        char* data = (char*)realloc(buffer->data, capacity);
+        if (data == NULL)
+            return;
+
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, text, length + 1);
+    buffer->length += length;
+}
+
+bool joinPath(char fullPath[MAX_PATH_LENGTH], const char* directory, const char* path, const char* extension)
+{
+    int length = snprintf(fullPath, MAX_PATH_LENGTH, "%s/%s%s", directory, path, extension);
+    return length >= 0 && length < MAX_PATH_LENGTH;
+}
+
+void printText(TextBuffer* buffer, const char* format, ...)
+{
+    char text[1024];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (buffer != NULL)
+        appendText(buffer, text);
+    else
+        printf("%s", text);
+}
+
+void freeText(TextBuffer* buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
@@ -1,10 +1,27 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdbool.h>
+
 #define BASIL_VERSION "0.1.0"
 #define MAX_PATH_LENGTH 256
 
-char* readFile(const char* path);
+typedef struct
+{
+    char* data;
+    int length;
+    int capacity;
+} TextBuffer;
+
+// Errors go to [log], or stdout without one.
+char* readFile(const char* path, TextBuffer* log);
 const char* getDirectoryPath(const char* filePath);
 
+// Writes [directory]/[path][extension] to [fullPath], false if it doesn't fit.
+bool joinPath(char fullPath[MAX_PATH_LENGTH], const char* directory, const char* path, const char* extension);
+
+void appendText(TextBuffer* buffer, const char* text);
+void printText(TextBuffer* buffer, const char* format, ...);
+void freeText(TextBuffer* buffer);
+
 #endif
@@ -0,0 +1,25 @@
+// The plugin tests/plugin/plugins.wren imports as "native:filelib". It has no
+// embedded source, so its module is read from filelib.wren instead.
+
+#include "plugin.h"
+
+static void greeterGreet(WrenVM* vm, const WrenForeignArg* args)
+{
+    wrenSetSlotString(vm, 0, args[1].string);
+}
+
+static const ForeignMethodBinding methods[] = {
+    { "Greeter", true, "greet(_)", 1, "_ S", NULL, greeterGreet },
+};
+
+static const Plugin plugin = {
+    PLUGIN_VERSION,
+    NULL,
+    methods, sizeof(methods) / sizeof(methods[0]),
+    NULL, 0,
+};
+
+const Plugin* basilPlugin(void)
+{
+    return &plugin;
+}
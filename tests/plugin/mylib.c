@@ -0,0 +1,70 @@
+// The plugin tests/plugin/plugins.wren imports as "native:mylib", with its
+// module source embedded. run_tests.py builds it next to this file.
+
+#include "plugin.h"
+
+static int finalized = 0;
+
+static void counterAllocate(WrenVM* vm)
+{
+    double* count = (double*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(double));
+    *count = 0;
+}
+
+static void counterFinalize(void* data)
+{
+    finalized++;
+}
+
+static void counterAdd(WrenVM* vm, const WrenForeignArg* args)
+{
+    double* count = (double*)args[0].foreign;
+    *count += args[1].num;
+    wrenSetSlotDouble(vm, 0, *count);
+}
+
+static void nativeSumTo(WrenVM* vm)
+{
+    int n = (int)wrenGetSlotDouble(vm, 1);
+
+    double sum = 0;
+    for (int i = 1; i <= n; i++)
+        sum += i;
+
+    wrenSetSlotDouble(vm, 0, sum);
+}
+
+static void nativeFinalized(WrenVM* vm)
+{
+    wrenSetSlotDouble(vm, 0, finalized);
+}
+
+static const ForeignMethodBinding methods[] = {
+    { "Counter", false, "add(_)", 1, "F N", NULL, counterAdd },
+    { "Native", true, "sumTo(_)", 1, NULL, nativeSumTo, NULL },
+    { "Native", true, "finalized", 0, NULL, nativeFinalized, NULL },
+};
+
+static const ForeignClassBinding classes[] = {
+    { "Counter", counterAllocate, counterFinalize },
+};
+
+static const Plugin plugin = {
+    PLUGIN_VERSION,
+    "foreign class Counter {\n"
+    "    construct new() {}\n"
+    "    foreign add(n)\n"
+    "}\n"
+    "\n"
+    "class Native {\n"
+    "    foreign static sumTo(n)\n"
+    "    foreign static finalized\n"
+    "}\n",
+    methods, sizeof(methods) / sizeof(methods[0]),
+    classes, sizeof(classes) / sizeof(classes[0]),
+};
+
+const Plugin* basilPlugin(void)
+{
+    return &plugin;
+}
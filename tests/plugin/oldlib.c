@@ -0,0 +1,16 @@
+// A plugin built for a version of the plugin interface basil doesn't support,
+// which tests/plugin/plugins.wren expects to fail to load.
+
+#include "plugin.h"
+
+static const Plugin plugin = {
+    PLUGIN_VERSION + 1,
+    "class Old {}\n",
+    NULL, 0,
+    NULL, 0,
+};
+
+const Plugin* basilPlugin(void)
+{
+    return &plugin;
+}